@@ -46,7 +46,9 @@
 #include <fcntl.h>
 #include <inttypes.h>
 #include <libgen.h>
+#include <limits.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <pthread.h>
 #include <regex.h>
 #include <stdarg.h>
@@ -56,10 +58,30 @@
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
+#if defined(HAVE_ZLIB)
+#include <zlib.h>
+#endif
+#if defined(HAVE_LIBZSTD)
+#include <zstd.h>
+#endif
+
+#if defined(__linux__)
+#include <sys/inotify.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
 #define KEY_FOUND 1
 #define KEY_NOT_FOUND -1
 #define LINE_BUFFER 4096 /* read at most this num of chars */
@@ -79,8 +101,18 @@
 #define ERR_SPEC_TOKN_INV 0x2
 #define ERR_SPEC_SFMT_MIS 0x3
 #define ERR_SPEC_LINE_INV 0x4
+/* line dropped by a log filter, see add_log_filter() */
+#define LINE_FILTERED -2
+/* line skipped by sampling, see is_line_sampled_out() */
+#define LINE_SAMPLED -3
 #define ERR_LOG_NOT_FOUND 0x5
 #define ERR_LOG_REALLOC_FAILURE 0x6
+#define ERR_MISS_HOST 0x7
+#define ERR_MISS_DATE 0x8
+#define ERR_MISS_REQ 0x9
+#define ERR_LOG_FMT_UNSUP 0xA
+/* size of per-error-code counters, 0 counting invalid lines without a code */
+#define LOG_ERR_CODES 0xB
 
 #define LOG_DEBUG(x, ...)                                                      \
   do {                                                                         \
@@ -109,21 +141,37 @@ static void dbg_fprintf(const char *fmt, ...) {
   va_end(args);
 }
 
+/* Compression of a log, told by its magic bytes, see get_log_codec() */
+typedef enum GLogCodec_ {
+  LOG_CODEC_NONE,
+  LOG_CODEC_GZIP,
+  LOG_CODEC_ZSTD,
+} GLogCodec;
+
 typedef struct GLogProp_ {
   char *filename; /* filename including path */
   char *fname;    /* basename(filename) */
   uint64_t inode; /* inode of the log */
   uint64_t size;  /* original size of log */
+  uint8_t codec;  /* GLogCodec of the log */
 } GLogProp;
 
+/* A parsing error, kept as is so the message is only built on demand, see
+ * log_err_str() */
+typedef struct GLogErr_ {
+  uint8_t code; /* ERR_SPEC_* / ERR_MISS_* value, 0 if none */
+  char spec;    /* failing specifier, if any */
+  uint32_t off; /* offset in the line of the failing token */
+} GLogErr;
+
 /* Log properties. Note: This is per line parsed */
 typedef struct GLogItem_ {
   char *agent;
   char *date;
   char *host;
   char *keyphrase;
-  char *method;
-  char *protocol;
+  const char *method;   /* points into http_methods */
+  const char *protocol; /* points into http_protocols */
   char *qstr;
   char *ref;
   char *req;
@@ -141,6 +189,13 @@ typedef struct GLogItem_ {
   uint32_t numdate;
   int ignorelevel;
   int type_ip;
+  uint8_t addr[16]; /* binary host address, see parse_ipaddr() */
+
+  /* IDs of interned fields, 0 if not interned, see intern_str() */
+  uint32_t agent_id;
+  uint32_t host_id;
+  uint32_t vhost_id;
+  uint32_t site_id;
 
   /* UMS */
   char *mime_type;
@@ -148,18 +203,72 @@ typedef struct GLogItem_ {
   char *tls_cypher;
   char *tls_type_cypher;
 
-  char *errstr;
+  GLogErr err;
+  char *errstr; /* error message, unless conf.compact_errors */
   struct tm dt;
 } GLogItem;
 
+/* A non-owning slice of a string. It is not NUL-terminated and a NULL ptr
+ * means the field was not set */
+typedef struct GStrView_ {
+  const char *ptr;
+  size_t len;
+} GStrView;
+
+/* Zero-copy log properties. Slices point into the parsed line, into static
+ * tables (method, protocol) or into `buf` when a field had to be rewritten
+ * (URL decoding, date/time formatting). Note: This is per line parsed */
+typedef struct GLogItemView_ {
+  GStrView agent;
+  GStrView date;
+  GStrView host;
+  GStrView keyphrase;
+  GStrView method;
+  GStrView protocol;
+  GStrView qstr;
+  GStrView ref;
+  GStrView req;
+  int status;
+  GStrView time;
+  GStrView vhost;
+  GStrView userid;
+  GStrView cache_status;
+  GStrView site;
+
+  uint64_t resp_size;
+  uint64_t serve_time;
+
+  uint32_t numdate;
+  int type_ip;
+  uint8_t addr[16]; /* binary host address, see parse_ipaddr() */
+
+  /* UMS */
+  GStrView mime_type;
+  GStrView tls_type;
+  GStrView tls_cypher;
+
+  GLogErr err;
+  char *errstr; /* error message, unless conf.compact_errors */
+  struct tm dt;
+
+  /* scratch buffer for rewritten fields, kept across lines */
+  char *buf;
+  size_t buflen;
+  size_t bufsize;
+} GLogItemView;
+
 typedef struct GLastParse_ {
   uint32_t line;
   int64_t ts;
   uint64_t size;
+  uint32_t pathhash; /* of the log path, 0 if unknown, see set_last_parse() */
   uint16_t snippetlen;
   char snippet[READ_BYTES + 1];
 } GLastParse;
 
+/* Compiled log format along with its date/time formats, see GLogParser_ */
+typedef struct GLogParser_ GLogParser;
+
 /* Overall parsed log properties */
 typedef struct GLog_ {
   uint8_t piping : 1;
@@ -169,6 +278,10 @@ typedef struct GLog_ {
   uint64_t length;    /* length read from the log so far */
   uint64_t invalid;   /* invalid lines for this log */
   uint64_t processed; /* lines proceeded for this log */
+  uint64_t filtered;  /* lines dropped by log filters */
+  uint64_t sampled;   /* lines skipped by sampling, counted only */
+  uint32_t sample_rate; /* 1 in this many lines of the current batch parsed */
+  uint64_t err_counts[LOG_ERR_CODES]; /* invalid lines per GLogErr code */
 
   /* file test for persisted/restored data */
   uint16_t snippetlen;
@@ -182,6 +295,7 @@ typedef struct GLog_ {
   char **errors;
 
   FILE *pipe;
+  GLogParser *parser; /* parser of the log's lines, NULL for conf's */
 } GLog;
 
 /* Container for all logs */
@@ -196,15 +310,314 @@ typedef struct Logs_ {
   GLog *glog;
 } Logs;
 
+/* A block of memory handed out by a GArena */
+typedef struct GArenaBlock_ {
+  struct GArenaBlock_ *next;
+  size_t size; /* usable bytes in data */
+  size_t used; /* bytes handed out so far */
+  char *data;
+} GArenaBlock;
+
+/* Bump allocator, everything allocated from it is released at once */
+typedef struct GArena_ {
+  GArenaBlock *head;   /* current block, older ones follow */
+  size_t block_size;   /* minimum size of a new block */
+  size_t total;        /* usable bytes across all blocks */
+} GArena;
+
+/* Per-thread aggregation of parsed items, see aggregate_job() */
+typedef struct GAggShard_ GAggShard;
+
 /* Pthread jobs for multi-thread */
 typedef struct GJob_ {
   uint32_t cnt;
-  int p, test, dry_run, running;
+  int p, test, dry_run;
   GLog *glog;
   GLogItem **logitems;
+  int *rets;       /* parse_line() return value of each line */
+  uint32_t cap;    /* capacity of logitems and rets */
   char **lines;
+  size_t *linecap; /* getline(3) capacity of each line buffer */
+  char *begin;     /* mmap'd byte range, see mmap_lines() */
+  char *end;
+  uint64_t err_counts[LOG_ERR_CODES]; /* invalid lines per GLogErr code */
+  GArena arena;    /* per-batch allocations, see parse_job_lines() */
+  GAggShard *shard; /* if conf.aggregate, see aggregate_job() */
+  uint32_t sample;  /* parse 1 in this many lines, see get_sample_rate() */
+  /* packed items, if conf.compact_items, see pack_job_items() */
+  char *recs;
+  size_t recs_len;
+  size_t recs_cap;
+  size_t *rec_offs; /* 1 + offset of each line's record in recs, 0 if none */
 } GJob;
 
+/* Parser threads of a pair of job banks, started once per read so their
+ * thread-local state (e.g., the date/time cache) outlives a batch. Banks
+ * are handed to them one at a time, see start_jobs(). */
+typedef struct GJobPool_ {
+  pthread_mutex_t mutex;
+  pthread_cond_t cond; /* a bank was started, or the pool is stopping */
+  pthread_cond_t done; /* every job of the bank was parsed */
+  pthread_t *threads;
+  int nthreads;
+  GJob *bank; /* bank being parsed, NULL if none */
+  int n;      /* jobs in the bank */
+  int next;   /* next job of the bank to take */
+  int busy;   /* jobs of the bank not parsed yet */
+  int stop;
+} GJobPool;
+
+/* String columns of a GLogColumns */
+typedef enum GLogStrCol_ {
+  LOG_COL_AGENT,
+  LOG_COL_DATE,
+  LOG_COL_HOST,
+  LOG_COL_KEYPHRASE,
+  LOG_COL_QSTR,
+  LOG_COL_REF,
+  LOG_COL_REQ,
+  LOG_COL_TIME,
+  LOG_COL_VHOST,
+  LOG_COL_USERID,
+  LOG_COL_SITE,
+  LOG_COL_TLS_CYPHER,
+  LOG_STR_COLS,
+} GLogStrCol;
+
+/* Low-cardinality columns of a GLogColumns, stored as dictionary IDs */
+typedef enum GLogDictCol_ {
+  LOG_COL_METHOD,
+  LOG_COL_PROTOCOL,
+  LOG_COL_CACHE_STATUS,
+  LOG_COL_MIME_TYPE,
+  LOG_COL_TLS_TYPE,
+  LOG_DICT_COLS,
+} GLogDictCol;
+
+/* Distinct values of a dictionary-encoded column. ID 0 means the field was
+ * not set, so values[0] is NULL */
+typedef struct GLogDict_ {
+  char **values;
+  uint32_t size;
+  uint32_t cap;
+} GLogDict;
+
+/* Parsed items laid out one column per field, see append_log_columns().
+ * Each string column holds, per row, an offset into `buf`, where strings
+ * are NUL-terminated, and a length. Offset 0 means the field was not set.
+ * Dictionaries are kept across batches, so IDs stay stable. */
+typedef struct GLogColumns_ {
+  uint32_t cnt; /* rows */
+  uint32_t cap; /* capacity of each column */
+
+  uint32_t *line; /* index of the row's line within the batch */
+  uint32_t *numdate;
+  int16_t *status;
+  uint8_t *type_ip;
+  uint8_t (*addr)[16]; /* binary host address, see parse_ipaddr() */
+  uint64_t *resp_size;
+  uint64_t *serve_time;
+  /* intern IDs, 0 if not interned, see intern_str() */
+  uint32_t *agent_id;
+  uint32_t *host_id;
+  uint32_t *vhost_id;
+  uint32_t *site_id;
+
+  uint32_t *off[LOG_STR_COLS];
+  uint32_t *len[LOG_STR_COLS];
+  uint16_t *id[LOG_DICT_COLS];
+  GLogDict dict[LOG_DICT_COLS];
+
+  char *buf;
+  size_t buflen;
+  size_t bufsize;
+} GLogColumns;
+
+/* Lines parsed out of a caller's buffer, see parse_lines() */
+typedef struct GLogBatch_ {
+  GLogItem **logitems; /* NULL for lines that were not parsed into an item */
+  int *rets;           /* parse_line() return value of each line */
+  GLogErr *errs;       /* error of each invalid line, see get_log_err() */
+  uint64_t err_counts[LOG_ERR_CODES]; /* invalid lines per GLogErr code */
+  uint32_t cap;        /* capacity of logitems, rets and errs */
+  uint32_t cnt;        /* lines parsed by the last parse_lines() call */
+  char *line;          /* copy of a last line, see parse_range() */
+  size_t linecap;
+  GArena arena;        /* items of the last parse_lines() call */
+  GLogColumns *cols;   /* optional columnar copy of the items */
+  GLogParser *parser;  /* parser of the lines, NULL for conf's */
+  uint32_t sample;     /* parse 1 in this many lines, 0 or 1 for all */
+} GLogBatch;
+
+/* Header of a cache of parsed items, see open_log_cache_writer(). It is
+ * followed by the format key, then by the blocks */
+typedef struct GLogCacheHeader_ {
+  char magic[4];    /* LOG_CACHE_MAGIC */
+  uint32_t version; /* LOG_CACHE_VERSION */
+  uint64_t inode;   /* GLogProp of the log the cache was built from */
+  uint64_t size;
+  uint64_t blocks;
+  uint64_t rows;
+  uint32_t keylen; /* bytes of the format key, NUL included */
+  uint32_t codec;
+} GLogCacheHeader;
+
+/* Header of a block of a cache, a GLogColumns laid out as is and followed
+ * by its columns, its dictionaries' values and its string buffer, each
+ * starting on an 8-byte boundary */
+typedef struct GLogCacheBlock_ {
+  uint64_t size; /* bytes of the block, header included */
+  uint32_t rows;
+  uint32_t sample; /* each row stands for this many lines, see agg_item() */
+  uint32_t min_numdate;
+  uint32_t max_numdate;
+  int16_t min_status;
+  int16_t max_status;
+  uint32_t dict_size[LOG_DICT_COLS]; /* values of each dictionary, NULL too */
+  uint64_t dict_len;                 /* bytes of all dictionary values */
+  uint64_t buflen;                   /* bytes of the string buffer */
+} GLogCacheBlock;
+
+/* Writer of a cache of parsed items, see add_log_cache_item() */
+typedef struct GLogCacheWriter_ {
+  FILE *fp;
+  char *path;          /* written as path.tmp until closed */
+  GLogCacheHeader hdr; /* rewritten once closed */
+  GLogColumns cols;    /* rows of the block being filled */
+  uint32_t sample;     /* sampling rate of those rows */
+  int err;
+} GLogCacheWriter;
+
+/* A cache of parsed items mapped for reading, see next_log_cache_block() */
+typedef struct GLogCache_ {
+  char *map;
+  size_t size;
+  const GLogCacheHeader *hdr;
+  size_t pos;       /* offset of the next block */
+  GLogColumns cols; /* the current block, pointing into the mapping */
+  uint32_t *zeros;  /* intern IDs of the current block, all 0 */
+  uint32_t zeros_cap;
+} GLogCache;
+
+/* Strings of a GLogRecord */
+typedef enum GLogRecStr_ {
+  LOG_REC_AGENT,
+  LOG_REC_DATE, /* unless LOG_REC_NUMDATE */
+  LOG_REC_HOST,
+  LOG_REC_KEYPHRASE,
+  LOG_REC_QSTR,
+  LOG_REC_REF,
+  LOG_REC_REQ,
+  LOG_REC_TIME, /* unless LOG_REC_EPOCH_TIME */
+  LOG_REC_VHOST,
+  LOG_REC_USERID,
+  LOG_REC_CACHE_STATUS, /* unless found in cache_statuses */
+  LOG_REC_SITE,
+  LOG_REC_MIME_TYPE,
+  LOG_REC_TLS_TYPE, /* unless found in tls_types */
+  LOG_REC_TLS_CYPHER,
+  LOG_REC_TLS_TYPE_CYPHER,
+  LOG_REC_ERRSTR,
+  LOG_REC_STRS,
+} GLogRecStr;
+
+/* Flags of a GLogRecord */
+#define LOG_REC_NUMDATE 0x01    /* date is numdate as a decimal string */
+#define LOG_REC_EPOCH_TIME 0x02 /* time is formatted out of epoch */
+
+/* A GLogItem packed into one allocation, see pack_log_item(). Its strings
+ * follow the record in a blob, NUL-terminated, each at an offset from the
+ * start of the record, 0 if not set. Interned strings keep their ID only,
+ * low-cardinality ones are IDs into static tables and the date and time are
+ * derived out of numdate and epoch whenever they can be. */
+typedef struct GLogRecord_ {
+  uint32_t size; /* record and blob, a multiple of 8 */
+  uint32_t numdate;
+  int64_t epoch; /* date and time of dt as if in UTC, see get_tm_epoch() */
+  uint64_t resp_size;
+  uint64_t serve_time;
+  /* intern IDs, 0 if not interned, see intern_str() */
+  uint32_t agent_id;
+  uint32_t host_id;
+  uint32_t vhost_id;
+  uint32_t site_id;
+  uint32_t off[LOG_REC_STRS];
+  uint32_t len[LOG_REC_STRS];
+  GLogErr err;
+  int16_t status;
+  uint8_t method;       /* 1 + index into http_methods, 0 if not set */
+  uint8_t protocol;     /* 1 + index into http_protocols, 0 if not set */
+  uint8_t cache_status; /* 1 + index into cache_statuses, 0 if not found */
+  uint8_t tls_type;     /* 1 + index into tls_types, 0 if not found */
+  uint8_t type_ip;
+  uint8_t ignorelevel;
+  uint8_t flags;        /* LOG_REC_* */
+  uint8_t addr[16];     /* binary host address, see parse_ipaddr() */
+} GLogRecord;
+
+/* Consumer of parsed log items, called in input order by read_lines() */
+typedef void (*GLogItemCb)(GLog *glog, GLogItem *logitem, void *data);
+
+/* Compiled log format operation types */
+typedef enum GLogFmtOpType_ {
+  LFMT_OP_LITERAL, /* skip `len` literal chars from the log string */
+  LFMT_OP_SPEC,    /* %x specifier, delimiter already resolved */
+  LFMT_OP_XFF,     /* ~h{...} X-Forwarded-For specifier */
+  LFMT_OP_NOP,     /* ~x with no special meaning */
+  LFMT_OP_FAIL,    /* ~h without a valid {} reject set */
+} GLogFmtOpType;
+
+/* A single compiled log format operation */
+typedef struct GLogFmtOp_ {
+  GLogFmtOpType type;
+  int len;          /* LFMT_OP_LITERAL: number of chars to skip */
+  char spec[2 + 1]; /* specifier followed by the next format char */
+  char end[2 + 1];  /* resolved delimiter, as returned by get_delim() */
+  char *skips;      /* LFMT_OP_XFF: reject set within the braces */
+} GLogFmtOp;
+
+/* A log format compiled into a flat array of operations */
+typedef struct GLogFmtProg_ {
+  GLogFmtOp *ops;
+  int size; /* num ops */
+} GLogFmtProg;
+
+/* Parser specialized for a preset log format, see preset_parsers[] */
+typedef int (*GLogFmtFn)(GLogItem *logitem, const char *str);
+
+#define JSON_KEY_LEN 512  /* maximum length of a dotted JSON key path */
+#define JSON_MAX_DEPTH 64 /* maximum nesting of a JSON log line */
+
+/* A JSON key path along with the compiled log format of its value */
+typedef struct GJsonKeyFmt_ {
+  char *key;         /* dotted key path, e.g., request.method */
+  size_t len;        /* key length */
+  uint32_t hash;     /* see fnv1a_hash() */
+  uint32_t fields;   /* GLogField values set by the format */
+  GLogFmtProg *prog; /* compiled log format, e.g., %m */
+} GJsonKeyFmt;
+
+/* A JSON log format compiled into an open-addressed table of key paths */
+typedef struct GJsonFmtProg_ {
+  GJsonKeyFmt *keys; /* key paths in insertion order */
+  int size;          /* num key paths */
+  int32_t *slots;    /* index into keys, -1 if the slot is empty */
+  uint32_t mask;     /* num slots - 1 */
+} GJsonFmtProg;
+
+/* Matches the values of a JSON log line against a compiled JSON log format
+ * as the line is read, keeping track of the dotted key path of each value */
+typedef struct GJsonWalk_ {
+  GLogItem *logitem;
+  const GJsonFmtProg *prog;
+  char key[JSON_KEY_LEN]; /* key path, may be truncated, see keylen */
+  size_t keylen;          /* full key path length */
+  /* key length before each pending member, and whether each open
+   * container is the value of a member */
+  size_t keylens[JSON_MAX_DEPTH], nkeys, depth;
+  uint8_t keyed[JSON_MAX_DEPTH], pending, in_object;
+} GJsonWalk;
+
 /* Raw data field type */
 typedef enum { U32, STR } datatype;
 
@@ -257,10 +670,40 @@ typedef struct GRawData_ {
     exit(EXIT_FAILURE);                                                        \
   } while (0)
 
+/* Default size of a GArena block */
+#define ARENA_BLOCK_SIZE (64 * 1024)
+/* Every arena allocation is prefixed by its size and kept aligned */
+#define ARENA_ALIGN 16
+#define ARENA_HDR_SIZE ARENA_ALIGN
+
+/* Arena the x*alloc() wrappers allocate from on the calling thread, if any */
+static __thread GArena *active_arena = NULL;
+/* Heap allocations made through the x*alloc() wrappers on the calling
+ * thread, see bench_corpus() */
+static __thread uint64_t heap_allocs = 0;
+
+#if defined(HAVE_PARSE_STATS)
+/* Calls of the x*alloc() wrappers, arena allocations included, and of
+ * xstrdup() on the calling thread, see GParseStat */
+static __thread uint64_t parse_stat_allocs = 0;
+static __thread uint64_t parse_stat_strdups = 0;
+#define PARSE_STAT_INC(counter) ((counter)++)
+#else
+#define PARSE_STAT_INC(counter) ((void)0)
+#endif
+
+static void *arena_alloc(GArena *arena, size_t size);
+static int arena_owns(const GArena *arena, const void *ptr);
+
 /* Self-checking wrapper to malloc() */
 static void *xmalloc(size_t size) {
   void *ptr;
 
+  PARSE_STAT_INC(parse_stat_allocs);
+  if (active_arena)
+    return arena_alloc(active_arena, size);
+
+  heap_allocs++;
   if ((ptr = malloc(size)) == NULL)
     FATAL("Unable to allocate memory - failed.");
 
@@ -271,6 +714,7 @@ static char *xstrdup(const char *s) {
   char *ptr;
   size_t len;
 
+  PARSE_STAT_INC(parse_stat_strdups);
   len = strlen(s) + 1;
   ptr = xmalloc(len);
 
@@ -282,6 +726,14 @@ static char *xstrdup(const char *s) {
 static void *xcalloc(size_t nmemb, size_t size) {
   void *ptr;
 
+  PARSE_STAT_INC(parse_stat_allocs);
+  if (active_arena) {
+    if (size && nmemb > SIZE_MAX / size)
+      FATAL("Unable to calloc memory - overflow.");
+    return memset(arena_alloc(active_arena, nmemb * size), 0, nmemb * size);
+  }
+
+  heap_allocs++;
   if ((ptr = calloc(nmemb, size)) == NULL)
     FATAL("Unable to calloc memory - failed.");
 
@@ -291,13 +743,299 @@ static void *xcalloc(size_t nmemb, size_t size) {
 /* Self-checking wrapper to realloc() */
 static void *xrealloc(void *oldptr, size_t size) {
   void *newptr;
+  size_t oldsize;
+
+  PARSE_STAT_INC(parse_stat_allocs);
+  /* arena memory never moves back to the heap, grow it within the arena */
+  if (active_arena && (oldptr == NULL || arena_owns(active_arena, oldptr))) {
+    newptr = arena_alloc(active_arena, size);
+    if (oldptr) {
+      memcpy(&oldsize, (char *)oldptr - ARENA_HDR_SIZE, sizeof(oldsize));
+      memcpy(newptr, oldptr, MIN(oldsize, size));
+    }
+    return newptr;
+  }
 
+  heap_allocs++;
   if ((newptr = realloc(oldptr, size)) == NULL)
     FATAL("Unable to reallocate memory - failed");
 
   return (newptr);
 }
 
+/* Counterpart of the x*alloc() wrappers. Memory owned by the active arena is
+ * left alone as it is released on arena_reset(). */
+static void xfree(void *ptr) {
+  if (ptr == NULL || (active_arena && arena_owns(active_arena, ptr)))
+    return;
+  free(ptr);
+}
+
+#if defined(HAVE_PARSE_STATS)
+/* Buckets of a GParseStat histogram: bucket i counts the calls that took
+ * [2^i, 2^(i+1)) ns, the last one also those that took longer */
+#define PARSE_STAT_BUCKETS 24
+
+/* Parser functions timed by the parse stats, see end_parse_stat() */
+typedef enum GParseStatFn_ {
+  PARSE_STAT_SPECIFIER, /* also kept per specifier */
+  PARSE_STAT_SPECIAL,   /* also kept per specifier */
+  PARSE_STAT_STR_TO_TIME,
+  PARSE_STAT_PARSE_REQ,
+  PARSE_STAT_DECODE_URL,
+  PARSE_STAT_JSON_LINE, /* parse_json_index() or parse_json_format() */
+  PARSE_STAT_FNS,
+} GParseStatFn;
+
+static const char *parse_stat_fns[PARSE_STAT_FNS] = {
+    "parse_specifier", "special_specifier", "str_to_time",
+    "parse_req",       "decode_url",        "parse_json_line",
+};
+
+/* Counters of the calls of a parser function, or of one of its specifiers.
+ * Times, bytes and allocations include those of nested timed calls */
+typedef struct GParseStat_ {
+  uint64_t calls;
+  uint64_t ns;
+  uint64_t bytes;   /* bytes of input consumed */
+  uint64_t allocs;  /* x*alloc() calls, see parse_stat_allocs */
+  uint64_t strdups; /* xstrdup() calls */
+  uint64_t hist[PARSE_STAT_BUCKETS];
+} GParseStat;
+
+/* Parse stats of a thread, see get_parse_stats() */
+typedef struct GParseStats_ {
+  GParseStat fns[PARSE_STAT_FNS];
+  /* per specifier character of parse_specifier() and special_specifier() */
+  GParseStat specs[PARSE_STAT_SPECIAL + 1][128];
+  struct GParseStats_ *next;
+} GParseStats;
+
+/* Start of a timed call, see begin_parse_stat() */
+typedef struct GParseStatMark_ {
+  uint64_t ns;
+  uint64_t allocs;
+  uint64_t strdups;
+} GParseStatMark;
+
+/* Stats of the running threads that parsed, and those of the threads that
+ * exited since, folded together, see retire_parse_stats() */
+static GParseStats *parse_stats_list = NULL;
+static GParseStats parse_stats_retired;
+static pthread_mutex_t parse_stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t parse_stats_key;
+static pthread_once_t parse_stats_once = PTHREAD_ONCE_INIT;
+static __thread GParseStats *parse_stats = NULL;
+
+static void sum_parse_stat(GParseStat *dst, const GParseStat *src) {
+  int b;
+
+  dst->calls += __atomic_load_n(&src->calls, __ATOMIC_RELAXED);
+  dst->ns += __atomic_load_n(&src->ns, __ATOMIC_RELAXED);
+  dst->bytes += __atomic_load_n(&src->bytes, __ATOMIC_RELAXED);
+  dst->allocs += __atomic_load_n(&src->allocs, __ATOMIC_RELAXED);
+  dst->strdups += __atomic_load_n(&src->strdups, __ATOMIC_RELAXED);
+  for (b = 0; b < PARSE_STAT_BUCKETS; b++)
+    dst->hist[b] += __atomic_load_n(&src->hist[b], __ATOMIC_RELAXED);
+}
+
+/* Fold the parse stats of an exiting thread into parse_stats_retired and
+ * release them. */
+static void retire_parse_stats(void *ptr) {
+  GParseStats *stats = ptr, **link = NULL;
+  int f, c;
+
+  pthread_mutex_lock(&parse_stats_mutex);
+  for (link = &parse_stats_list; *link != stats; link = &(*link)->next)
+    ;
+  *link = stats->next;
+  for (f = 0; f < PARSE_STAT_FNS; f++)
+    sum_parse_stat(&parse_stats_retired.fns[f], &stats->fns[f]);
+  for (f = 0; f <= PARSE_STAT_SPECIAL; f++)
+    for (c = 0; c < 128; c++)
+      sum_parse_stat(&parse_stats_retired.specs[f][c], &stats->specs[f][c]);
+  pthread_mutex_unlock(&parse_stats_mutex);
+
+  if (parse_stats == stats)
+    parse_stats = NULL;
+  free(stats);
+}
+
+static void init_parse_stats_key(void) {
+  if (pthread_key_create(&parse_stats_key, retire_parse_stats) != 0)
+    FATAL("Unable to create the parse stats key.");
+}
+
+/* Get the parse stats of the calling thread, registering them on first use.
+ * They are allocated off any arena, as they outlive it, and retired once
+ * the thread exits, see retire_parse_stats().
+ *
+ * On error, the program exits. */
+static GParseStats *get_thread_parse_stats(void) {
+  if (parse_stats)
+    return parse_stats;
+
+  pthread_once(&parse_stats_once, init_parse_stats_key);
+  if ((parse_stats = calloc(1, sizeof(GParseStats))) == NULL)
+    FATAL("Unable to calloc memory - failed.");
+  pthread_mutex_lock(&parse_stats_mutex);
+  parse_stats->next = parse_stats_list;
+  parse_stats_list = parse_stats;
+  pthread_mutex_unlock(&parse_stats_mutex);
+  pthread_setspecific(parse_stats_key, parse_stats);
+
+  return parse_stats;
+}
+
+/* Monotonic clock in nanoseconds */
+static uint64_t get_parse_stat_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void begin_parse_stat(GParseStatMark *mark) {
+  mark->allocs = parse_stat_allocs;
+  mark->strdups = parse_stat_strdups;
+  mark->ns = get_parse_stat_ns();
+}
+
+/* Add to a counter other threads may read, see get_parse_stats(). Only the
+ * owning thread writes to it, so no locked instruction is needed. */
+static void add_parse_stat(uint64_t *counter, uint64_t n) {
+  __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n,
+                   __ATOMIC_RELAXED);
+}
+
+static void add_parse_stat_call(GParseStat *st, const GParseStatMark *mark,
+                                uint64_t ns, size_t bytes) {
+  int b = ns ? 63 - __builtin_clzll(ns) : 0;
+
+  add_parse_stat(&st->calls, 1);
+  add_parse_stat(&st->ns, ns);
+  add_parse_stat(&st->bytes, bytes);
+  add_parse_stat(&st->allocs, parse_stat_allocs - mark->allocs);
+  add_parse_stat(&st->strdups, parse_stat_strdups - mark->strdups);
+  add_parse_stat(&st->hist[MIN(b, PARSE_STAT_BUCKETS - 1)], 1);
+}
+
+/* Count a call of `fn` started at `mark` that consumed `bytes` of input,
+ * also under its specifier `spec`, if any. */
+static void end_parse_stat(const GParseStatMark *mark, GParseStatFn fn,
+                           int spec, size_t bytes) {
+  GParseStats *stats = get_thread_parse_stats();
+  uint64_t ns = get_parse_stat_ns() - mark->ns;
+
+  add_parse_stat_call(&stats->fns[fn], mark, ns, bytes);
+  if (fn <= PARSE_STAT_SPECIAL)
+    add_parse_stat_call(&stats->specs[fn][spec & 0x7f], mark, ns, bytes);
+}
+#endif
+
+/* Prepend a new block of at least `size` usable bytes to the arena. */
+static GArenaBlock *arena_new_block(GArena *arena, size_t size) {
+  GArenaBlock *block = NULL;
+
+  size = MAX(size, arena->block_size);
+  /* grow geometrically so a large batch only needs a few blocks */
+  size = MAX(size, arena->total);
+
+  if ((block = malloc(sizeof(*block))) == NULL ||
+      (block->data = malloc(size)) == NULL)
+    FATAL("Unable to allocate arena block - failed.");
+
+  block->size = size;
+  block->used = 0;
+  block->next = arena->head;
+  arena->head = block;
+  arena->total += size;
+
+  return block;
+}
+
+/* Initialize the given arena. Blocks are allocated lazily. */
+void init_arena(GArena *arena, size_t block_size) {
+  memset(arena, 0, sizeof *arena);
+  arena->block_size = block_size ? block_size : ARENA_BLOCK_SIZE;
+}
+
+/* Release all blocks owned by the given arena. */
+void free_arena(GArena *arena) {
+  GArenaBlock *block = arena->head, *next = NULL;
+
+  while (block) {
+    next = block->next;
+    free(block->data);
+    free(block);
+    block = next;
+  }
+  arena->head = NULL;
+  arena->total = 0;
+}
+
+/* Release everything allocated from the arena at once. If the previous batch
+ * spilled into several blocks, they are coalesced into a single one sized for
+ * it, so a steady stream of batches ends up bumping through one block. */
+void arena_reset(GArena *arena) {
+  size_t total = arena->total;
+
+  if (arena->head && arena->head->next) {
+    free_arena(arena);
+    arena_new_block(arena, total);
+  } else if (arena->head) {
+    arena->head->used = 0;
+  }
+}
+
+/* Allocate `size` bytes from the given arena.
+ *
+ * On success, a pointer aligned to ARENA_ALIGN is returned. */
+static void *arena_alloc(GArena *arena, size_t size) {
+  GArenaBlock *block = arena->head;
+  size_t need;
+  char *ptr = NULL;
+
+  if (size > SIZE_MAX - ARENA_HDR_SIZE - ARENA_ALIGN)
+    FATAL("Unable to allocate memory - overflow.");
+  need = (ARENA_HDR_SIZE + size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+  if (block == NULL || block->size - block->used < need)
+    block = arena_new_block(arena, need);
+
+  ptr = block->data + block->used;
+  block->used += need;
+
+  /* keep the size around for xrealloc() */
+  memcpy(ptr, &size, sizeof(size));
+  return ptr + ARENA_HDR_SIZE;
+}
+
+/* Determine if the given pointer was handed out by the arena.
+ *
+ * If not, 0 is returned.
+ * On success, 1 is returned. */
+static int arena_owns(const GArena *arena, const void *ptr) {
+  const GArenaBlock *block = NULL;
+  const char *p = ptr;
+
+  for (block = arena->head; block; block = block->next) {
+    if (p >= block->data && p < block->data + block->used)
+      return 1;
+  }
+  return 0;
+}
+
+/* Make the given arena the one the x*alloc() wrappers allocate from on the
+ * calling thread. NULL restores plain heap allocations.
+ *
+ * On success, the previously active arena is returned. */
+GArena *set_active_arena(GArena *arena) {
+  GArena *prev = active_arena;
+  active_arena = arena;
+  return prev;
+}
+
 /* Allocate memory for a new GRawData instance.
  *
  * On success, the newly allocated GRawData is returned . */
@@ -485,16 +1223,72 @@ typedef struct GAgents_ {
 #define FOREACH_MODULE(item, array)                                            \
   for (; (item < ARRAY_SIZE(array)) && array[item] != -1; ++item)
 
+/* A UTC offset in effect from a given instant onwards */
+typedef struct GTzTrans_ {
+  int64_t at;     /* first second (UTC) this offset applies to */
+  int32_t gmtoff; /* seconds east of UTC */
+  int isdst;
+  char zone[16]; /* abbreviation, e.g., CDT */
+} GTzTrans;
+
+/* A timezone resolved to its offset transitions, see new_tz_table() */
+typedef struct GTzTable_ {
+  char *name;
+  GTzTrans *trans; /* sorted by `at`, first one covers everything before */
+  int size;        /* num transitions */
+} GTzTable;
+
+/* Log item fields a consumer may ask for, see conf.field_mask */
+typedef enum GLogField_ {
+  LOG_FIELD_HOST = 1 << 0,         /* %h ~h */
+  LOG_FIELD_DATE = 1 << 1,         /* %d %x */
+  LOG_FIELD_TIME = 1 << 2,         /* %t */
+  LOG_FIELD_REQ = 1 << 3,          /* %r %U */
+  LOG_FIELD_METHOD = 1 << 4,       /* %m */
+  LOG_FIELD_PROTOCOL = 1 << 5,     /* %H */
+  LOG_FIELD_QSTR = 1 << 6,         /* %q */
+  LOG_FIELD_STATUS = 1 << 7,       /* %s */
+  LOG_FIELD_RESP_SIZE = 1 << 8,    /* %b */
+  LOG_FIELD_REFERER = 1 << 9,      /* %R */
+  LOG_FIELD_AGENT = 1 << 10,       /* %u */
+  LOG_FIELD_SERVE_TIME = 1 << 11,  /* %L %T %D %n */
+  LOG_FIELD_VHOST = 1 << 12,       /* %v */
+  LOG_FIELD_USERID = 1 << 13,      /* %e */
+  LOG_FIELD_CACHE_STATUS = 1 << 14, /* %C */
+  LOG_FIELD_TLS_CYPHER = 1 << 15,  /* %k */
+  LOG_FIELD_TLS_TYPE = 1 << 16,    /* %K */
+  LOG_FIELD_MIME_TYPE = 1 << 17,   /* %M */
+} GLogField;
+
+#define LOG_FIELD_ALL ((1u << 18) - 1)
+/* fields enforced by verify_missing_fields(), always parsed */
+#define LOG_FIELD_REQUIRED (LOG_FIELD_HOST | LOG_FIELD_DATE | LOG_FIELD_REQ)
+
+/* Log filter predicate types, see add_log_filter() */
+typedef enum GLogFilterType_ {
+  LOG_FILTER_STATUS,     /* status code within [min, max] */
+  LOG_FILTER_VHOST,      /* virtual host within a set */
+  LOG_FILTER_METHOD,     /* request method within a set */
+  LOG_FILTER_REQ_PREFIX, /* request starting with any prefix of a set */
+} GLogFilterType;
+
+/* A predicate on a parsed field, evaluated as soon as the field is set */
+typedef struct GLogFilter_ {
+  GLogFilterType type;
+  int drop;     /* drop matching lines, otherwise keep only matching lines */
+  int min, max; /* LOG_FILTER_STATUS range */
+  char **values;
+  size_t *lens;
+  int size; /* num values */
+} GLogFilter;
+
 typedef struct GConf_ {
   /* Log/date/time formats */
   const char *tz_name;         /* Canonical TZ name, e.g., America/Chicago */
   char *date_time_format;      /* date & time format */
   char *date_format;           /* date format */
-  char *date_num_format;       /* numeric date format %Y%m%d */
   char *time_format;           /* time format as given by the user */
-  char *spec_date_time_format; /* date format w/ specificity */
-  char *spec_date_time_num_format; /* numeric date format w/ specificity */
-  char *log_format;                /* log format */
+  char *log_format;            /* log format */
 
   /* User flags */
   int append_method;              /* append method to the req key */
@@ -511,21 +1305,63 @@ typedef struct GConf_ {
   int no_strict_status;           /* don't enforce 100-599 status codes */
   int no_ip_validation;           /* don't validate client IP addresses */
   int is_json_log_format;         /* is a json log format */
+  int jobs;                       /* number of parser threads */
+  uint32_t field_mask;            /* GLogField values to parse */
+  GLogFilter **filters;           /* predicates on parsed fields */
+  int filters_len;                /* num filters */
+  uint32_t filter_fields;         /* GLogField values having filters */
+  const char *resume_file;        /* GLastParse state, see resume_lines() */
+  int compact_errors;             /* keep a GLogErr only, no errstr */
+  int aggregate;                  /* aggregate items, see aggregate_job() */
+  uint32_t agg_merge_lines;       /* items a shard holds before a merge */
+  int compact_items;              /* keep batches packed, see GLogRecord */
+  uint32_t sample_rate;           /* parse 1 in N lines, if above 1 */
+  uint64_t sample_backlog;        /* sample above these pending bytes only */
 
   /* Internal flags */
-  int bandwidth;    /* is there bandwidth within the req line */
-  int date_spec_hr; /* date specificity - hour */
-  int hour_spec_min;   /* hour specificity - min */
-  int serve_usecs;     /* is there time served within req line */
+  int date_spec_hr;  /* date specificity - hour */
+  int hour_spec_min; /* hour specificity - min */
 } GConf;
 
 GConf conf = {
     .append_method = 1,
     .append_protocol = 1,
     .chunk_size = 1024,
+    .jobs = 1,
+    .field_mask = LOG_FIELD_ALL,
 };
 
+/* A log format compiled along with its date/time formats and timezone.
+ * Parsing only reads the parser it's given, so lines of different formats
+ * can be parsed at once from different threads, see new_log_parser(). */
+struct GLogParser_ {
+  char *tz_name;                   /* NULL for the process timezone */
+  char *date_format;               /* date format */
+  char *date_num_format;           /* numeric date format %Y%m%d */
+  char *time_format;               /* time format */
+  char *spec_date_time_format;     /* date format w/ specificity */
+  char *spec_date_time_num_format; /* numeric date format w/ specificity */
+  char *log_format;                /* log format */
+  int is_json_log_format;          /* is a json log format */
+  GLogFmtProg *log_format_prog;    /* compiled log format */
+  GLogFmtFn log_format_fn;         /* parser of a preset log format */
+  GJsonFmtProg *json_format_prog;  /* compiled JSON log format */
+  void *json_logfmt;               /* khash_t(ss32), JSON key => format */
+  GTzTable *tz_table;              /* tz_name resolved, see new_tz_table() */
+  int bandwidth;                   /* is there bandwidth within the req line */
+  int serve_usecs;                 /* is there time served within req line */
+};
+
+/* Parser of the formats set in conf, see set_spec_date_format() */
+static GLogParser log_parser;
+/* Parser lines are parsed with on the calling thread, see
+ * set_active_parser() */
+static __thread GLogParser *active_parser = &log_parser;
+
 pthread_mutex_t tz_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* Odd while a thread has the process TZ switched under tz_mutex, bumped on
+ * every switch, see process_localtime() */
+static unsigned tz_switches = 0;
 
 #define STATUS_CODE_0XX ("0xx Unofficial Codes")
 #define STATUS_CODE_1XX ("1xx Informational")
@@ -778,43 +1614,371 @@ static int count_matches(const char *s1, char c) {
 #define DAY 86400000000ULL
 #define TZ_NAME_LEN 48
 
-static void set_tz(void) {
-  /* this will persist for the duration of the program but also assumes that all
-   * threads have the same conf.tz_name values */
-  static char tz[TZ_NAME_LEN] = {0};
-
-  if (!conf.tz_name)
-    return;
+/* Mark the start or the end of a process TZ switch, see tz_switches.
+ * Callers hold tz_mutex. */
+static void bump_tz_switches(void) {
+  __atomic_add_fetch(&tz_switches, 1, __ATOMIC_SEQ_CST);
+}
 
-  if (pthread_mutex_lock(&tz_mutex) != 0) {
-    LOG_DEBUG(("Failed to acquire tz_mutex"));
-    return;
+/* Convert through localtime_r(3) in the process timezone. Another thread
+ * may have it switched meanwhile, see tz_localtime_libc(), in which case
+ * the conversion is done again once the switch is over.
+ *
+ * On error, 1 is returned.
+ * On success, 0 is returned. */
+static int process_localtime(time_t t, struct tm *tm) {
+  unsigned gen = __atomic_load_n(&tz_switches, __ATOMIC_ACQUIRE);
+  struct tm *ret = NULL;
+
+  if ((gen & 1) == 0) {
+    ret = localtime_r(&t, tm);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&tz_switches, __ATOMIC_RELAXED) == gen)
+      return ret == NULL;
   }
 
-  snprintf(tz, TZ_NAME_LEN, "TZ=%s", conf.tz_name);
-  if ((putenv(tz)) != 0) {
+  if (pthread_mutex_lock(&tz_mutex) != 0)
+    FATAL("Failed to acquire tz_mutex");
+  ret = localtime_r(&t, tm);
+  pthread_mutex_unlock(&tz_mutex);
+
+  return ret == NULL;
+}
+
+/* Set the process TZ to the given timezone, or unset it if NULL. Callers
+ * hold tz_mutex. */
+static void set_tz(const char *tz_name) {
+  int ret = tz_name ? setenv("TZ", tz_name, 1) : unsetenv("TZ");
+
+  if (ret != 0) {
     int old_errno = errno;
-    LOG_DEBUG(("Can't set TZ env variable %s: %s: %d\n", tz,
-               strerror(old_errno), old_errno));
-    goto release;
+    LOG_DEBUG(("Can't set TZ env variable %s: %s: %d\n",
+               tz_name ? tz_name : "", strerror(old_errno), old_errno));
   }
 
   tzset();
+}
+
+/* Range and resolution used to resolve a timezone into transitions */
+#define TZ_TABLE_START (-2208988800LL) /* 1900-01-01T00:00:00Z */
+#define TZ_TABLE_END (4102444800LL)    /* 2100-01-01T00:00:00Z */
+#define TZ_TABLE_STEP (86400LL)
+
+/* Number of days since 1970-01-01 of the given proleptic Gregorian date.
+ * Months are 1-based. */
+static int64_t days_from_civil(int64_t y, int64_t m, int64_t d) {
+  int64_t era, yoe, doy, doe;
+
+  y -= m <= 2;
+  era = (y >= 0 ? y : y - 399) / 400;
+  yoe = y - era * 400;
+  doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+  doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+
+  return era * 146097 + doe - 719468;
+}
+
+/* Inverse of days_from_civil(). */
+static void civil_from_days(int64_t z, int64_t *y, int *m, int *d) {
+  int64_t era, doe, yoe, doy, mp;
+
+  z += 719468;
+  era = (z >= 0 ? z : z - 146096) / 146097;
+  doe = z - era * 146097;
+  yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+  doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+  mp = (5 * doy + 2) / 153;
+
+  *d = (int)(doy - (153 * mp + 2) / 5 + 1);
+  *m = (int)(mp < 10 ? mp + 3 : mp - 9);
+  *y = yoe + era * 400 + (*m <= 2);
+}
+
+/* Convert a broken-down time into seconds since the Epoch, honoring its
+ * tm_gmtoff, without going through timegm(3), which takes the libc timezone
+ * lock. Out-of-range fields are normalized the same way. */
+static time_t tm2time_utc(const struct tm *src) {
+  int64_t y = src->tm_year + 1900LL, m = src->tm_mon, days;
+
+  y += m / 12, m %= 12;
+  if (m < 0)
+    y--, m += 12;
+
+  days = days_from_civil(y, m + 1, 1) + src->tm_mday - 1;
+  return (time_t)(days * 86400 + src->tm_hour * 3600LL + src->tm_min * 60LL +
+                  src->tm_sec - src->tm_gmtoff);
+}
+
+/* Find the transition in effect at the given instant.
+ *
+ * On success, the transition is returned. */
+static const GTzTrans *find_tz_trans(const GTzTable *table, int64_t t) {
+  int lo = 0, hi = table->size - 1, mid;
+
+  while (lo < hi) {
+    mid = lo + (hi - lo + 1) / 2;
+    if (table->trans[mid].at <= t)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  return &table->trans[lo];
+}
+
+/* Convert the given instant through localtime_r(3) in the timezone of the
+ * given table, switching the process TZ to it under tz_mutex. */
+static void tz_localtime_libc(const GTzTable *table, time_t t, struct tm *tm) {
+  char *saved = NULL, *env = NULL;
+
+  if (pthread_mutex_lock(&tz_mutex) != 0)
+    FATAL("Failed to acquire tz_mutex");
+
+  if ((env = getenv("TZ")))
+    saved = xstrdup(env);
+  bump_tz_switches();
+  set_tz(table->name);
+  localtime_r(&t, tm);
+  set_tz(saved);
+  bump_tz_switches();
+
+  pthread_mutex_unlock(&tz_mutex);
+  /* may have come off the active arena */
+  xfree(saved);
+}
+
+/* Lock-free localtime_r(3) counterpart for a resolved timezone. Instants
+ * the table doesn't cover, e.g., local mean time before 1900 or DST rules
+ * past 2100, go through tz_localtime_libc() instead. */
+static void tz_localtime(const GTzTable *table, time_t t, struct tm *tm) {
+  const GTzTrans *tr = NULL;
+  int64_t local, days, secs, y;
+  int m, d;
+
+  if ((int64_t)t < TZ_TABLE_START || (int64_t)t >= TZ_TABLE_END) {
+    tz_localtime_libc(table, t, tm);
+    return;
+  }
+
+  tr = find_tz_trans(table, t);
+  local = (int64_t)t + tr->gmtoff;
+
+  days = (local >= 0 ? local : local - 86399) / 86400;
+  secs = local - days * 86400;
+  civil_from_days(days, &y, &m, &d);
+
+  tm->tm_year = (int)(y - 1900);
+  tm->tm_mon = m - 1;
+  tm->tm_mday = d;
+  tm->tm_hour = (int)(secs / 3600);
+  tm->tm_min = (int)(secs % 3600 / 60);
+  tm->tm_sec = (int)(secs % 60);
+  tm->tm_wday = (int)(((days % 7) + 11) % 7); /* 1970-01-01 was a Thursday */
+  tm->tm_yday = (int)(days - days_from_civil(y, 1, 1));
+  tm->tm_isdst = tr->isdst;
+  tm->tm_gmtoff = tr->gmtoff;
+  tm->tm_zone = tr->zone;
+}
+
+static int same_tz_state(const struct tm *a, const struct tm *b) {
+  return a->tm_gmtoff == b->tm_gmtoff && a->tm_isdst == b->tm_isdst &&
+         strcmp(a->tm_zone ? a->tm_zone : "", b->tm_zone ? b->tm_zone : "") ==
+             0;
+}
+
+static void push_tz_trans(GTzTable *table, int64_t at, const struct tm *tm) {
+  GTzTrans *tr = NULL;
+
+  table->trans = xrealloc(table->trans, (table->size + 1) * sizeof(GTzTrans));
+  tr = &table->trans[table->size++];
+
+  memset(tr, 0, sizeof *tr);
+  tr->at = at;
+  tr->gmtoff = (int32_t)tm->tm_gmtoff;
+  tr->isdst = tm->tm_isdst;
+  snprintf(tr->zone, sizeof(tr->zone), "%s", tm->tm_zone ? tm->tm_zone : "");
+}
+
+/* Resolve the given timezone into its offset transitions between
+ * TZ_TABLE_START and TZ_TABLE_END. The process TZ is switched to it under
+ * tz_mutex, the rules are sampled through localtime_r(3) every
+ * TZ_TABLE_STEP, bisecting each change down to the second, and the previous
+ * TZ is restored, so each parser can have its own timezone.
+ *
+ * On success, the newly allocated GTzTable is returned. */
+static GTzTable *new_tz_table(const char *tz_name) {
+  GTzTable *table = xcalloc(1, sizeof(GTzTable));
+  struct tm prev, cur;
+  time_t t, lo, hi, mid;
+  char *saved = NULL, *env = NULL;
+
+  if (pthread_mutex_lock(&tz_mutex) != 0)
+    FATAL("Failed to acquire tz_mutex");
+
+  if ((env = getenv("TZ")))
+    saved = xstrdup(env);
+  bump_tz_switches();
+  set_tz(tz_name);
+  table->name = xstrdup(tz_name);
+
+  t = (time_t)TZ_TABLE_START;
+  localtime_r(&t, &prev);
+  push_tz_trans(table, INT64_MIN, &prev);
+
+  for (t += TZ_TABLE_STEP; t < (time_t)TZ_TABLE_END; t += TZ_TABLE_STEP) {
+    localtime_r(&t, &cur);
+    if (same_tz_state(&prev, &cur))
+      continue;
+
+    /* first second of the new state lies within (t - step, t] */
+    for (lo = t - TZ_TABLE_STEP, hi = t; hi - lo > 1;) {
+      mid = lo + (hi - lo) / 2;
+      localtime_r(&mid, &cur);
+      if (same_tz_state(&prev, &cur))
+        lo = mid;
+      else
+        hi = mid;
+    }
+    localtime_r(&hi, &cur);
+    push_tz_trans(table, hi, &cur);
+    prev = cur;
+    /* resume sampling from the transition */
+    t = hi;
+  }
+
+  set_tz(saved);
+  bump_tz_switches();
+  pthread_mutex_unlock(&tz_mutex);
+  free(saved);
+
+  return table;
+}
+
+static void free_tz_table(GTzTable *table) {
+  if (table == NULL)
+    return;
+  free(table->name);
+  free(table->trans);
+  free(table);
+}
+
+/* Parse exactly two digits.
+ *
+ * If not two digits, -1 is returned.
+ * On success, the value is returned. */
+static int parse_2digits(const char *s) {
+  if (!isdigit((unsigned char)s[0]) || !isdigit((unsigned char)s[1]))
+    return -1;
+  return (s[0] - '0') * 10 + (s[1] - '0');
+}
 
-release:
+/* Parse exactly four digits, see parse_2digits(). */
+static int parse_4digits(const char *s) {
+  int hi = parse_2digits(s), lo = 0;
 
-  if (pthread_mutex_unlock(&tz_mutex) != 0) {
-    LOG_DEBUG(("Failed to release tz_mutex"));
+  /* the last two digits aren't there to read if the first two aren't */
+  if (hi < 0 || (lo = parse_2digits(s + 2)) < 0)
+    return -1;
+  return hi * 100 + lo;
+}
+
+/* Parse an abbreviated month name, case insensitive as strptime(3).
+ *
+ * If not a month, -1 is returned.
+ * On success, the 0-based month is returned. */
+static int parse_month_abbr(const char *s) {
+  static const char months[] = "janfebmaraprmayjunjulaugsepoctnovdec";
+  char m[3];
+  int i;
+
+  for (i = 0; i < 3; i++) {
+    if (!isalpha((unsigned char)s[i]))
+      return -1;
+    m[i] = (char)tolower((unsigned char)s[i]);
+  }
+  for (i = 0; i < 12; i++) {
+    if (memcmp(months + i * 3, m, 3) == 0)
+      return i;
   }
+  return -1;
+}
 
-  return;
+/* Set the day of the week and of the year of a parsed date the same way
+ * strptime(3) does once it has a year, month and day. */
+static void set_tm_xday(struct tm *tm) {
+  int64_t y = tm->tm_year + 1900LL;
+  int64_t days = days_from_civil(y, tm->tm_mon + 1, tm->tm_mday);
+
+  tm->tm_wday = (int)(((days % 7) + 11) % 7);
+  tm->tm_yday = (int)(days - days_from_civil(y, 1, 1));
 }
 
-static time_t tm2time(const struct tm *src) {
-  struct tm tmp;
+/* Parse the given date/time string with the fixed layout of one of the
+ * predefined date/time formats (see dates and times) instead of going
+ * through strptime(3).
+ *
+ * If the format has no fixed layout or the string doesn't strictly follow
+ * it, 1 is returned and tm is untouched, so the caller can fall back to
+ * strptime(3).
+ * On success, tm is set the same way strptime(3) would and 0 is returned. */
+static int parse_fixed_date_time(const char *str, const char *fmt,
+                                 struct tm *tm) {
+  int y, m, d, hh, mm, ss, n;
+  time_t secs = 0;
+
+  /* Apache: 11/Jun/2023 */
+  if (strcmp(fmt, "%d/%b/%Y") == 0) {
+    if (str[0] == '\0' || str[1] == '\0' || str[2] != '/' ||
+        (m = parse_month_abbr(str + 3)) < 0 || str[6] != '/' ||
+        (d = parse_2digits(str)) < 1 || d > 31 ||
+        (y = parse_4digits(str + 7)) < 0 || str[11] != '\0')
+      return 1;
+    goto date;
+  }
+  /* W3C: 2023-06-11 */
+  if (strcmp(fmt, "%Y-%m-%d") == 0) {
+    if ((y = parse_4digits(str)) < 0 || str[4] != '-' ||
+        (m = parse_2digits(str + 5) - 1) < 0 || m > 11 || str[7] != '-' ||
+        (d = parse_2digits(str + 8)) < 1 || d > 31 || str[10] != '\0')
+      return 1;
+    goto date;
+  }
+  /* 01:23:45 */
+  if (strcmp(fmt, "%H:%M:%S") == 0 || strcmp(fmt, "%T") == 0) {
+    if ((hh = parse_2digits(str)) < 0 || hh > 23 || str[2] != ':' ||
+        (mm = parse_2digits(str + 3)) < 0 || mm > 59 || str[5] != ':' ||
+        (ss = parse_2digits(str + 6)) < 0 || ss > 61 || str[8] != '\0')
+      return 1;
+    tm->tm_hour = hh;
+    tm->tm_min = mm;
+    tm->tm_sec = ss;
+    return 0;
+  }
+  /* Squid: seconds since the Epoch, in local time as strptime(3) does */
+  if (strcmp(fmt, "%s") == 0) {
+    for (n = 0; isdigit((unsigned char)str[n]); n++)
+      secs = secs * 10 + (str[n] - '0');
+    if (n == 0 || n > 18 || str[n] != '\0')
+      return 1;
+    if (active_parser->tz_table)
+      tz_localtime(active_parser->tz_table, secs, tm);
+    else if (process_localtime(secs, tm) != 0)
+      return 1;
+    return 0;
+  }
+
+  return 1;
+
+date:
+  /* leave odd years to strptime(3) */
+  if (y < 1000)
+    return 1;
+
+  tm->tm_year = y - 1900;
+  tm->tm_mon = m;
+  tm->tm_mday = d;
+  set_tm_xday(tm);
 
-  tmp = *src;
-  return timegm(&tmp) - src->tm_gmtoff;
+  return 0;
 }
 
 /* Format the given date/time according the given format.
@@ -849,33 +2013,54 @@ static int str_to_time(const char *str, const char *fmt, struct tm *tm,
 
     seconds = (us) ? ts / SECS : ((ms) ? ts / MILS : ts);
 
-    if (conf.tz_name && tz)
-      set_tz();
+    if (tz && active_parser->tz_table) {
+      tz_localtime(active_parser->tz_table, seconds, tm);
+      return 0;
+    }
 
     /* if GMT needed, gmtime_r instead of localtime_r. */
-    localtime_r(&seconds, tm);
+    process_localtime(seconds, tm);
 
     return 0;
   }
 
-  end = strptime(str, fmt, tm);
-  if (end == NULL || *end != '\0')
-    return 1;
+  /* fixed layouts first, anything else goes through strptime(3) */
+  if (parse_fixed_date_time(str, fmt, tm) != 0) {
+    end = strptime(str, fmt, tm);
+    if (end == NULL || *end != '\0')
+      return 1;
+  }
 
-  if (!tz || !conf.tz_name)
+  /* resolved timezone, no environment changes nor locks */
+  if (!tz || !active_parser->tz_table)
     return 0;
 
-  if ((t = tm2time(tm)) == -1) {
-    LOG_DEBUG(("Can't set time via tm2time() %s: %s\n", str, strerror(errno)));
+  if ((t = tm2time_utc(tm)) == -1) {
+    LOG_DEBUG(("Can't set time via tm2time_utc() %s\n", str));
     return 0;
   }
-
-  set_tz();
-  localtime_r(&t, tm);
+  tz_localtime(active_parser->tz_table, t, tm);
 
   return 0;
 }
 
+#if defined(HAVE_PARSE_STATS)
+/* Timed str_to_time(), see end_parse_stat() */
+static int str_to_time_stat(const char *str, const char *fmt, struct tm *tm,
+                            int tz) {
+  GParseStatMark mark;
+  size_t len = str ? strlen(str) : 0;
+  int ret;
+
+  begin_parse_stat(&mark);
+  ret = str_to_time(str, fmt, tm, tz);
+  end_parse_stat(&mark, PARSE_STAT_STR_TO_TIME, 0, len);
+
+  return ret;
+}
+#define str_to_time str_to_time_stat
+#endif
+
 /* Determine if the given date format is a timestamp.
  *
  * If not a timestamp, 0 is returned.
@@ -886,42 +2071,149 @@ static int has_timestamp(const char *fmt) {
   return 0;
 }
 
-/* Determine if the given IP is a valid IPv4/IPv6 address.
+/* Parse a dotted-quad IPv4 address out of [s, end) into 4 bytes. As with
+ * inet_pton(3), octets with leading zeros are rejected.
  *
  * On error, 1 is returned.
  * On success, 0 is returned. */
-static int invalid_ipaddr(const char *str, int *ipvx) {
-  union {
-    struct sockaddr addr;
-    struct sockaddr_in6 addr6;
-    struct sockaddr_in addr4;
-  } a;
+static int parse_ipv4(const char *s, const char *end, uint8_t *out) {
+  uint8_t tmp[4] = {0}, *tp = tmp;
+  unsigned int val = 0;
+  int octets = 0, digits = 0;
+
+  for (; s < end; s++) {
+    if (*s >= '0' && *s <= '9') {
+      val = *tp * 10 + (*s - '0');
+      if ((digits && *tp == 0) || val > 255)
+        return 1;
+      *tp = val;
+      if (!digits && ++octets > 4)
+        return 1;
+      digits = 1;
+    } else if (*s == '.' && digits && octets < 4) {
+      *++tp = 0;
+      digits = 0;
+    } else {
+      return 1;
+    }
+  }
+  if (octets < 4)
+    return 1;
 
-  (*ipvx) = TYPE_IPINV;
-  if (str == NULL || *str == '\0')
+  memcpy(out, tmp, sizeof(tmp));
+  return 0;
+}
+
+/* Parse an IPv6 address out of [s, end) into 16 bytes, accepting the same
+ * forms as inet_pton(3): a single `::` and a trailing dotted quad.
+ *
+ * On error, 1 is returned.
+ * On success, 0 is returned. */
+static int parse_ipv6(const char *s, const char *end, uint8_t *out) {
+  uint8_t tmp[16] = {0}, *tp = tmp, *tend = tmp + 16, *colon = NULL;
+  const char *tok = s;
+  unsigned int val = 0;
+  int digits = 0, x;
+  size_t n;
+
+  if (s == end)
+    return 1;
+  /* a leading colon must be part of a leading :: */
+  if (*s == ':' && (++s == end || *s != ':'))
     return 1;
 
-  memset(&a, 0, sizeof(a));
-  if (1 == inet_pton(AF_INET, str, &a.addr4.sin_addr)) {
-    (*ipvx) = TYPE_IPV4;
-    return 0;
-  } else if (1 == inet_pton(AF_INET6, str, &a.addr6.sin6_addr)) {
-    (*ipvx) = TYPE_IPV6;
-    return 0;
+  for (tok = s; s < end; s++) {
+    x = *s | 0x20;
+    if ((*s >= '0' && *s <= '9') || (x >= 'a' && x <= 'f')) {
+      if (digits++ == 4)
+        return 1;
+      val = (val << 4) | (*s <= '9' ? *s - '0' : x - 'a' + 10);
+      continue;
+    }
+    if (*s == ':') {
+      tok = s + 1;
+      if (digits == 0) {
+        if (colon)
+          return 1;
+        colon = tp;
+        continue;
+      }
+      if (tok == end || tp + 2 > tend)
+        return 1;
+      *tp++ = val >> 8;
+      *tp++ = val & 0xff;
+      digits = 0;
+      val = 0;
+      continue;
+    }
+    if (*s == '.' && tp + 4 <= tend && parse_ipv4(tok, end, tp) == 0) {
+      tp += 4;
+      digits = 0;
+      break;
+    }
+    return 1;
   }
 
-  return 1;
-}
+  if (digits) {
+    if (tp + 2 > tend)
+      return 1;
+    *tp++ = val >> 8;
+    *tp++ = val & 0xff;
+  }
+  if (colon) {
+    /* :: must stand for at least one zero group */
+    if (tp == tend)
+      return 1;
+    n = tp - colon;
+    memmove(tend - n, colon, n);
+    memset(colon, 0, tend - n - colon);
+    tp = tend;
+  }
+  if (tp != tend)
+    return 1;
 
-static int is_valid_http_status(int code) {
-  return code >= 0 && code <= 599 && code_type[code / 100] != NULL &&
-         codes[code] != NULL;
+  memcpy(out, tmp, sizeof(tmp));
+  return 0;
 }
 
-/* Strip whitespace from the beginning of a string.
+/* Determine if the first `len` bytes of str are a valid IPv4/IPv6 address,
+ * without copying them. If `addr` is given, the binary address is stored in
+ * it, IPv4 addresses being mapped into IPv6 (::ffff:a.b.c.d), so hosts can
+ * be hashed as 16 bytes regardless of their type.
  *
- * On success, a string with whitespace stripped from the beginning of
- * the string is returned. */
+ * On error, 1 is returned.
+ * On success, 0 is returned. */
+static int parse_ipaddr(const char *str, size_t len, int *ipvx,
+                        uint8_t *addr) {
+  uint8_t tmp[16] = {0};
+
+  (*ipvx) = TYPE_IPINV;
+  if (str == NULL || len == 0)
+    return 1;
+
+  if (parse_ipv4(str, str + len, tmp + 12) == 0) {
+    tmp[10] = tmp[11] = 0xff;
+    (*ipvx) = TYPE_IPV4;
+  } else if (parse_ipv6(str, str + len, tmp) == 0) {
+    (*ipvx) = TYPE_IPV6;
+  } else {
+    return 1;
+  }
+
+  if (addr)
+    memcpy(addr, tmp, sizeof(tmp));
+  return 0;
+}
+
+static int is_valid_http_status(int code) {
+  return code >= 0 && code <= 599 && code_type[code / 100] != NULL &&
+         codes[code] != NULL;
+}
+
+/* Strip whitespace from the beginning of a string.
+ *
+ * On success, a string with whitespace stripped from the beginning of
+ * the string is returned. */
 static char *ltrim(char *s) {
   char *begin = s;
 
@@ -1075,6 +2367,10 @@ out:
   ("Unable to allocate memory for a log instance.")
 #define ERR_LOG_NOT_FOUND_MSG ("Unable to find the given log.")
 
+static const char *intern_str(const char *str, uint32_t *id);
+static char *intern_token(char *tkn, uint32_t *id);
+const char *get_intern_str(uint32_t id);
+
 /* Initialize a new GLogItem instance.
  *
  * On success, the new GLogItem instance is returned. */
@@ -1124,22 +2420,24 @@ GLogItem *init_log_item() {
   return logitem;
 }
 
-/* Free all members of a GLogItem */
+/* Free all members of a GLogItem. This is a no-op for items allocated from
+ * the active arena. */
 static void free_glog(GLogItem *logitem) {
-  if (logitem->agent != NULL)
+  /* members were allocated along, the arena releases them at once */
+  if (active_arena && arena_owns(active_arena, logitem))
+    return;
+
+  /* interned fields are shared, see intern_token() */
+  if (logitem->agent != NULL && !logitem->agent_id)
     free(logitem->agent);
   if (logitem->date != NULL)
     free(logitem->date);
   if (logitem->errstr != NULL)
     free(logitem->errstr);
-  if (logitem->host != NULL)
+  if (logitem->host != NULL && !logitem->host_id)
     free(logitem->host);
   if (logitem->keyphrase != NULL)
     free(logitem->keyphrase);
-  if (logitem->method != NULL)
-    free(logitem->method);
-  if (logitem->protocol != NULL)
-    free(logitem->protocol);
   if (logitem->qstr != NULL)
     free(logitem->qstr);
   if (logitem->ref != NULL)
@@ -1152,7 +2450,7 @@ static void free_glog(GLogItem *logitem) {
     free(logitem->userid);
   if (logitem->cache_status != NULL)
     free(logitem->cache_status);
-  if (logitem->vhost != NULL)
+  if (logitem->vhost != NULL && !logitem->vhost_id)
     free(logitem->vhost);
 
   if (logitem->mime_type != NULL)
@@ -1189,25 +2487,83 @@ static void decode_hex(char *url, char *out) {
   *ptr = 0;
 }
 
+/* Decode the first `len` bytes of the given URL-encoded buffer into `out`,
+ * stripping new lines and surrounding whitespace. Unless URLs are double
+ * decoded, this is done in a single pass. `out` may alias `url` as the
+ * decoded string is never longer.
+ *
+ * On success, the length of the decoded string is returned. */
+static size_t decode_url_into(const char *url, size_t len, char *out) {
+  const char *c, *end = url + len;
+  char *ptr = out, *last = out, ch;
+
+  for (c = url; c < end; c++) {
+    ch = *c;
+    if (ch == '%' && end - c > 2 && isxdigit((unsigned char)c[1]) &&
+        isxdigit((unsigned char)c[2])) {
+      ch = (char)((B16210(c[1]) * 16) + (B16210(c[2])));
+      c += 2;
+    }
+    /* a decoded NUL terminates the string */
+    if (ch == '\0')
+      break;
+
+    if (conf.double_decode)
+      *ptr++ = ch;
+    else if (ch == '\r' || ch == '\n')
+      continue;
+    else if (!isspace((unsigned char)ch))
+      *ptr++ = ch, last = ptr;
+    else if (ptr != out)
+      *ptr++ = ch;
+  }
+
+  if (!conf.double_decode) {
+    *last = '\0';
+    return last - out;
+  }
+
+  /* double encoded URL, new lines are stripped after both passes */
+  *ptr = '\0';
+  decode_hex(out, out);
+  strip_newlines(out);
+
+  return strlen(trim_str(out));
+}
+
 /* Entry point to decode the given URL-encoded string.
  *
  * On success, the decoded trimmed string is assigned to the output
  * buffer. */
 static char *decode_url(char *url) {
-  char *out, *decoded;
+  char *out;
+  size_t len;
 
   if ((url == NULL) || (*url == '\0'))
     return NULL;
 
-  out = decoded = xstrdup(url);
-  decode_hex(url, out);
-  /* double encoded URL? */
-  if (conf.double_decode)
-    decode_hex(decoded, out);
-  strip_newlines(out);
+  len = strlen(url);
+  out = xmalloc(len + 1);
+  decode_url_into(url, len, out);
+
+  return out;
+}
+
+#if defined(HAVE_PARSE_STATS)
+/* Timed decode_url(), see end_parse_stat() */
+static char *decode_url_stat(char *url) {
+  GParseStatMark mark;
+  size_t len = url ? strlen(url) : 0;
+  char *ret;
 
-  return trim_str(out);
+  begin_parse_stat(&mark);
+  ret = decode_url(url);
+  end_parse_stat(&mark, PARSE_STAT_DECODE_URL, 0, len);
+
+  return ret;
 }
+#define decode_url decode_url_stat
+#endif
 
 /* Process keyphrases from Google search, cache, and translate.
  * Note that the referer hasn't been decoded at the entry point
@@ -1255,7 +2611,7 @@ static int extract_keyphrase(char *ref, char **keyphrase) {
 
   referer = decode_url(r);
   if (referer == NULL || *referer == '\0') {
-    free(referer);
+    xfree(referer);
     return 1;
   }
 
@@ -1265,45 +2621,6 @@ static int extract_keyphrase(char *ref, char **keyphrase) {
   return 0;
 }
 
-/* Parse a URI and extracts the *host* part from it
- * i.e., //www.example.com/path?googleguy > www.example.com
- *
- * On error, 1 is returned.
- * On success, the extracted referer is set and 0 is returned. */
-static int extract_referer_site(const char *referer, char *host) {
-  char *url, *begin, *end;
-  int len = 0;
-
-  if ((referer == NULL) || (*referer == '\0'))
-    return 1;
-
-  url = strdup(referer);
-  if ((begin = strstr(url, "//")) == NULL)
-    goto clean;
-
-  begin += 2;
-  if ((len = strlen(begin)) == 0)
-    goto clean;
-
-  if ((end = strpbrk(begin, "/?")) != NULL)
-    len = end - begin;
-
-  if (len == 0)
-    goto clean;
-
-  if (len >= REF_SITE_LEN)
-    len = REF_SITE_LEN;
-
-  memcpy(host, begin, len);
-  host[len] = '\0';
-  free(url);
-  return 0;
-clean:
-  free(url);
-
-  return 1;
-}
-
 typedef struct httpmethods_ {
   const char *method;
   int len;
@@ -1346,7 +2663,6 @@ static const httpmethods http_methods[] = {
     {"MKACTIVITY", 10},
     {"ORDERPATCH", 10},
 };
-static const size_t http_methods_len = ARRAY_SIZE(http_methods);
 
 static const httpprotocols http_protocols[] = {
     {"HTTP/1.0", 8},
@@ -1354,101 +2670,89 @@ static const httpprotocols http_protocols[] = {
     {"HTTP/2", 6},
     {"HTTP/3", 6},
 };
-static const size_t http_protocols_len = ARRAY_SIZE(http_protocols);
 
-/* Extract the HTTP method.
+/* Indices into http_methods by the first letter of the method, -1
+ * terminated. No method is a prefix of another one. */
+static const int8_t *const http_methods_idx['Z' - 'A' + 1] = {
+    ['B' - 'A'] = (const int8_t[]){26, -1},
+    ['C' - 'A'] = (const int8_t[]){7, 13, 19, 20, -1},
+    ['D' - 'A'] = (const int8_t[]){5, -1},
+    ['G' - 'A'] = (const int8_t[]){1, -1},
+    ['H' - 'A'] = (const int8_t[]){2, -1},
+    ['L' - 'A'] = (const int8_t[]){15, 24, -1},
+    ['M' - 'A'] = (const int8_t[]){12, 14, 22, 25, 27, -1},
+    ['O' - 'A'] = (const int8_t[]){0, 28, -1},
+    ['P' - 'A'] = (const int8_t[]){3, 4, 8, 10, 11, -1},
+    ['R' - 'A'] = (const int8_t[]){18, -1},
+    ['S' - 'A'] = (const int8_t[]){9, -1},
+    ['T' - 'A'] = (const int8_t[]){6, -1},
+    ['U' - 'A'] = (const int8_t[]){16, 21, 23, -1},
+    ['V' - 'A'] = (const int8_t[]){17, -1},
+};
+
+/* Extract the HTTP method from the first `len` bytes of the token. The
+ * candidates are looked up by the first byte.
  *
  * On error, or if not found, NULL is returned.
  * On success, the HTTP method is returned. */
-static const char *extract_method(const char *token) {
-  size_t i;
-  for (i = 0; i < http_methods_len; i++) {
-    if (strncasecmp(token, http_methods[i].method, http_methods[i].len) == 0) {
-      return http_methods[i].method;
-    }
-  }
-  return NULL;
-}
+static const char *extract_method_len(const char *token, size_t len) {
+  const int8_t *idx = NULL;
+  int c = token[0] & ~0x20;
 
-static int is_cache_hit(const char *tkn) {
-  if (strcasecmp("MISS", tkn) == 0)
-    return 1;
-  else if (strcasecmp("BYPASS", tkn) == 0)
-    return 1;
-  else if (strcasecmp("EXPIRED", tkn) == 0)
-    return 1;
-  else if (strcasecmp("STALE", tkn) == 0)
-    return 1;
-  else if (strcasecmp("UPDATING", tkn) == 0)
-    return 1;
-  else if (strcasecmp("REVALIDATED", tkn) == 0)
-    return 1;
-  else if (strcasecmp("HIT", tkn) == 0)
-    return 1;
-  return 0;
-}
+  if (c < 'A' || c > 'Z' || !(idx = http_methods_idx[c - 'A']))
+    return NULL;
 
-/* Determine if the given token is a valid HTTP protocol.
- *
- * If not valid, 1 is returned.
- * If valid, 0 is returned. */
-static const char *extract_protocol(const char *token) {
-  size_t i;
-  for (i = 0; i < http_protocols_len; i++) {
-    if (strncasecmp(token, http_protocols[i].protocol, http_protocols[i].len) ==
-        0) {
-      return http_protocols[i].protocol;
-    }
+  for (; *idx >= 0; idx++) {
+    const httpmethods *m = &http_methods[*idx];
+    if (len >= (size_t)m->len && strncasecmp(token, m->method, m->len) == 0)
+      return m->method;
   }
   return NULL;
 }
 
-/* Parse a request containing the method and protocol.
- *
- * On error, or unable to parse, NULL is returned.
- * On success, the HTTP request is returned and the method and
- * protocol are assigned to the corresponding buffers. */
-static char *parse_req(char *line, char **method, char **protocol) {
-  char *req = NULL, *request = NULL, *dreq = NULL, *ptr = NULL;
-  const char *meth, *proto;
-  ptrdiff_t rlen;
-
-  meth = extract_method(line);
-
-  /* couldn't find a method, so use the whole request line */
-  if (meth == NULL) {
-    request = xstrdup(line);
-  }
-  /* method found, attempt to parse request */
-  else {
-    req = line + strlen(meth);
-    if (!(ptr = strrchr(req, ' ')) || !(proto = extract_protocol(++ptr)))
-      return alloc_string("-");
+/* Cache statuses %C takes, in any case */
+static const char *const cache_statuses[] = {
+    "MISS", "BYPASS", "EXPIRED", "STALE", "UPDATING", "REVALIDATED", "HIT",
+};
 
-    req++;
-    if ((rlen = ptr - req) <= 0)
-      return alloc_string("-");
+/* Usual %K values, see GLogRecord */
+static const char *const tls_types[] = {
+    "TLSv1.3", "TLSv1.2", "TLSv1.1", "TLSv1", "SSLv3",
+};
 
-    request = xmalloc(rlen + 1);
-    strncpy(request, req, rlen);
-    request[rlen] = 0;
+static int is_cache_hit(const char *tkn) {
+  size_t i;
 
-    if (conf.append_method)
-      (*method) = strtoupper(xstrdup(meth));
+  for (i = 0; i < ARRAY_SIZE(cache_statuses); i++)
+    if (strcasecmp(cache_statuses[i], tkn) == 0)
+      return 1;
+  return 0;
+}
 
-    if (conf.append_protocol)
-      (*protocol) = strtoupper(xstrdup(proto));
-  }
+/* Extract the HTTP protocol from the first `len` bytes of the token by
+ * comparing the fixed "HTTP/" prefix and then the version bytes.
+ *
+ * On error, or if not found, NULL is returned.
+ * On success, the HTTP protocol is returned. */
+static const char *extract_protocol_len(const char *token, size_t len) {
+  if (len < 6 || strncasecmp(token, "HTTP/", 5) != 0)
+    return NULL;
 
-  if (!(dreq = decode_url(request)))
-    return request;
-  else if (*dreq == '\0') {
-    free(dreq);
-    return request;
+  switch (token[5]) {
+  case '1':
+    if (len < 8 || token[6] != '.')
+      return NULL;
+    if (token[7] == '0')
+      return http_protocols[0].protocol;
+    if (token[7] == '1')
+      return http_protocols[1].protocol;
+    return NULL;
+  case '2':
+    return http_protocols[2].protocol;
+  case '3':
+    return http_protocols[3].protocol;
   }
-
-  free(request);
-  return dreq;
+  return NULL;
 }
 
 /* Extract the next delimiter given a log format and copy the delimiter to the
@@ -1482,32 +2786,207 @@ static char *parsed_string(const char *pch, const char **str, int move_ptr) {
   return trim_str(p);
 }
 
+/* Find the first char of s which is c, a backslash or the NUL terminator.
+ *
+ * The vectorized variants only issue aligned loads, and deliberately read
+ * the whole aligned block holding the terminator, and the bytes before s in
+ * the first one. An aligned block never crosses a page boundary, so those
+ * bytes are always mapped, and the result never depends on them: those
+ * before s are masked out and those past the terminator come after the
+ * first match. They may belong to a neighbouring allocation though, which
+ * ASan reports as an overflow and TSan as a race, hence both are disabled
+ * on the variants. */
+typedef const char *(*GScanDelimFn)(const char *s, char c);
+
+#define SCAN_NO_SANITIZE no_sanitize_address, no_sanitize_thread
+
+static const char *scan_delim_scalar(const char *s, char c) {
+  while (*s != '\0' && *s != c && *s != '\\')
+    s++;
+  return s;
+}
+
+#if defined(__SSE2__)
+__attribute__((SCAN_NO_SANITIZE)) static const char *
+scan_delim_sse2(const char *s, char c) {
+  const __m128i vc = _mm_set1_epi8(c), vb = _mm_set1_epi8('\\');
+  const __m128i vz = _mm_setzero_si128();
+  uintptr_t off = (uintptr_t)s & 15;
+  const char *p = s - off;
+  __m128i v = _mm_load_si128((const __m128i *)p);
+  unsigned mask;
+
+  mask = _mm_movemask_epi8(_mm_or_si128(
+      _mm_or_si128(_mm_cmpeq_epi8(v, vc), _mm_cmpeq_epi8(v, vb)),
+      _mm_cmpeq_epi8(v, vz)));
+  /* discard the bytes before s */
+  mask &= ~0u << off;
+
+  while (mask == 0) {
+    p += 16;
+    v = _mm_load_si128((const __m128i *)p);
+    mask = _mm_movemask_epi8(_mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(v, vc), _mm_cmpeq_epi8(v, vb)),
+        _mm_cmpeq_epi8(v, vz)));
+  }
+
+  return p + __builtin_ctz(mask);
+}
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2"), SCAN_NO_SANITIZE)) static const char *
+scan_delim_avx2(const char *s, char c) {
+  const __m256i vc = _mm256_set1_epi8(c), vb = _mm256_set1_epi8('\\');
+  const __m256i vz = _mm256_setzero_si256();
+  uintptr_t off = (uintptr_t)s & 31;
+  const char *p = s - off;
+  __m256i v = _mm256_load_si256((const __m256i *)p);
+  unsigned mask;
+
+  mask = (unsigned)_mm256_movemask_epi8(_mm256_or_si256(
+      _mm256_or_si256(_mm256_cmpeq_epi8(v, vc), _mm256_cmpeq_epi8(v, vb)),
+      _mm256_cmpeq_epi8(v, vz)));
+  /* discard the bytes before s */
+  mask &= ~0u << off;
+
+  while (mask == 0) {
+    p += 32;
+    v = _mm256_load_si256((const __m256i *)p);
+    mask = (unsigned)_mm256_movemask_epi8(_mm256_or_si256(
+        _mm256_or_si256(_mm256_cmpeq_epi8(v, vc), _mm256_cmpeq_epi8(v, vb)),
+        _mm256_cmpeq_epi8(v, vz)));
+  }
+
+  return p + __builtin_ctz(mask);
+}
+#endif
+
+#if defined(__ARM_NEON) || defined(__aarch64__)
+/* Narrow a byte compare result into a 64-bit mask, 4 bits per byte. */
+static inline uint64_t neon_mask(uint8x16_t cmp) {
+  uint8x8_t res = vshrn_n_u16(vreinterpretq_u16_u8(cmp), 4);
+  return vget_lane_u64(vreinterpret_u64_u8(res), 0);
+}
+
+__attribute__((SCAN_NO_SANITIZE)) static const char *
+scan_delim_neon(const char *s, char c) {
+  const uint8x16_t vc = vdupq_n_u8((uint8_t)c), vb = vdupq_n_u8('\\');
+  const uint8x16_t vz = vdupq_n_u8(0);
+  uintptr_t off = (uintptr_t)s & 15;
+  const char *p = s - off;
+  uint8x16_t v = vld1q_u8((const uint8_t *)p);
+  uint64_t mask;
+
+  mask = neon_mask(vorrq_u8(vorrq_u8(vceqq_u8(v, vc), vceqq_u8(v, vb)),
+                            vceqq_u8(v, vz)));
+  /* discard the bytes before s */
+  mask &= ~0ULL << (off * 4);
+
+  while (mask == 0) {
+    p += 16;
+    v = vld1q_u8((const uint8_t *)p);
+    mask = neon_mask(vorrq_u8(vorrq_u8(vceqq_u8(v, vc), vceqq_u8(v, vb)),
+                              vceqq_u8(v, vz)));
+  }
+
+  return p + (__builtin_ctzll(mask) >> 2);
+}
+#endif
+
+/* Pick the widest scanner the CPU supports. */
+static GScanDelimFn get_scan_delim_fn(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    return scan_delim_avx2;
+#endif
+#if defined(__SSE2__)
+  return scan_delim_sse2;
+#elif defined(__ARM_NEON) || defined(__aarch64__)
+  return scan_delim_neon;
+#endif
+  return scan_delim_scalar;
+}
+
+static GScanDelimFn scan_delim_fn = NULL;
+
+static const char *scan_delim(const char *s, char c) {
+  GScanDelimFn fn = __atomic_load_n(&scan_delim_fn, __ATOMIC_RELAXED);
+
+  if (fn == NULL) {
+    fn = get_scan_delim_fn();
+    __atomic_store_n(&scan_delim_fn, fn, __ATOMIC_RELAXED);
+  }
+
+  return fn(s, c);
+}
+
+/* Find the end of a token given a log format rule, i.e., the `cnt`-th
+ * unescaped occurrence of the delimiter or the end of the string. The
+ * delimiter has to be found at least once if one is given.
+ *
+ * On error, or unable to find it, NULL is returned.
+ * On success, a pointer to the end of the token is returned. */
+static const char *find_token_end(const char *s, const char *delims, int cnt) {
+  const char *p = NULL;
+  int idx = 0, seen = 0;
+  char end = *delims;
+
+  /* several delims, the first one found is the one */
+  if (end != '\0' && delims[1] != '\0') {
+    if ((p = strpbrk(s, delims)) == NULL)
+      return NULL;
+    end = *p;
+  }
+  /* no delim, up to the end of the string */
+  seen = end == '\0';
+
+  /* a backslash delim is also an escape, go one char at a time */
+  if (end == '\\') {
+    if (strchr(s, end) == NULL)
+      return NULL;
+    do {
+      if (*s == end && ++idx == cnt)
+        return s;
+      if (*s == '\0')
+        return s;
+      if (*s == '\\')
+        s++;
+    } while (*s++);
+    return NULL;
+  }
+
+  for (;;) {
+    s = scan_delim(s, end);
+    if (*s == '\0')
+      return seen ? s : NULL;
+    /* skip escaped chars */
+    if (*s == '\\') {
+      if (s[1] == '\0')
+        return NULL;
+      seen |= s[1] == end;
+      s += 2;
+      continue;
+    }
+    seen = 1;
+    if (++idx == cnt)
+      return s;
+    s++;
+  }
+}
+
 /* Find and extract a token given a log format rule.
  *
  * On error, or unable to parse it, NULL is returned.
  * On success, the malloc'd token is returned. */
 static char *parse_string(const char **str, const char *delims, int cnt) {
-  int idx = 0;
-  const char *pch = *str, *p = NULL;
-  char end;
+  const char *pch = NULL;
 
-  if ((*delims != 0x0) && (p = strpbrk(*str, delims)) == NULL)
+  if ((pch = find_token_end(*str, delims, cnt)) == NULL)
     return NULL;
 
-  end = !*delims ? 0x0 : *p;
-  do {
-    /* match number of delims */
-    if (*pch == end)
-      idx++;
-    /* delim found, parse string then */
-    if ((*pch == end && cnt == idx) || *pch == '\0')
-      return parsed_string(pch, str, 1);
-    /* advance to the first unescaped delim */
-    if (*pch == '\\')
-      pch++;
-  } while (*pch++);
-
-  return NULL;
+  return parsed_string(pch, str, 1);
 }
 
 /* Move forward through the log string until a non-space (!isspace)
@@ -1537,44 +3016,194 @@ static int find_alpha_count(const char *str) {
   return cnt;
 }
 
-/* Format the broken-down time tm to a numeric date format.
+static void set_numeric_date(uint32_t *numdate, const char *date) {
+  int res = 0;
+  if ((res = str2int(date)) == -1)
+    FATAL("Unable to parse date to integer %s", date);
+  *numdate = res;
+}
+
+/* Format the broken-down time tm to the numeric date format into buf and set
+ * its integer value. %Y%m%d, which all the predefined formats resolve to, is
+ * formatted by hand.
  *
- * On error, or unable to format the given tm, 1 is returned.
- * On success, a malloc'd format is returned. */
+ * On error, or unable to format the given tm, 0 is returned.
+ * On success, the length of the date is returned. */
 #pragma GCC diagnostic ignored "-Wformat-nonliteral"
-static int set_date(char **fdate, struct tm tm) {
-  char buf[DATE_LEN] = ""; /* Ymd */
+static size_t format_date_num(char *buf, size_t size, const struct tm *tm,
+                              uint32_t *numdate) {
+  int y = tm->tm_year + 1900, m = tm->tm_mon + 1, d = tm->tm_mday;
+  size_t len;
 
-  memset(buf, 0, sizeof(buf));
-  if (strftime(buf, DATE_LEN, conf.date_num_format, &tm) <= 0)
-    return 1;
-  *fdate = xstrdup(buf);
+  if (size > 8 && strcmp(active_parser->date_num_format, "%Y%m%d") == 0 &&
+      y >= 1000 && y <= 9999 && m >= 1 && m <= 12 && d >= 1 && d <= 31) {
+    buf[0] = '0' + y / 1000;
+    buf[1] = '0' + y / 100 % 10;
+    buf[2] = '0' + y / 10 % 10;
+    buf[3] = '0' + y % 10;
+    buf[4] = '0' + m / 10;
+    buf[5] = '0' + m % 10;
+    buf[6] = '0' + d / 10;
+    buf[7] = '0' + d % 10;
+    buf[8] = '\0';
+    *numdate = y * 10000 + m * 100 + d;
+    return 8;
+  }
 
-  return 0;
+  memset(buf, 0, size);
+  if ((len = strftime(buf, size, active_parser->date_num_format, tm)) <= 0)
+    return 0;
+
+  set_numeric_date(numdate, buf);
+
+  return len;
+}
+
+/* Format the broken-down time tm to %H:%M:%S into buf.
+ *
+ * On error, or unable to format the given tm, 0 is returned.
+ * On success, the length of the time is returned. */
+static size_t format_time(char *buf, size_t size, const struct tm *tm) {
+  int hh = tm->tm_hour, mm = tm->tm_min, ss = tm->tm_sec;
+
+  if (size > 8 && hh >= 0 && hh <= 23 && mm >= 0 && mm <= 59 && ss >= 0 &&
+      ss <= 61) {
+    buf[0] = '0' + hh / 10;
+    buf[1] = '0' + hh % 10;
+    buf[2] = ':';
+    buf[3] = '0' + mm / 10;
+    buf[4] = '0' + mm % 10;
+    buf[5] = ':';
+    buf[6] = '0' + ss / 10;
+    buf[7] = '0' + ss % 10;
+    buf[8] = '\0';
+    return 8;
+  }
+
+  memset(buf, 0, size);
+  return strftime(buf, size, "%H:%M:%S", tm);
+}
+
+/* Number of entries of the per-thread date/time cache */
+#define DT_CACHE_SIZE 16
+/* Longest date/time token worth caching */
+#define DT_CACHE_TKN_LEN 32
+
+/* A date/time token converted by str_to_time() and formatted */
+typedef struct GDateTime_ {
+  struct tm tm;
+  uint32_t numdate;     /* %d and %x only */
+  char date[DATE_LEN];  /* %d and %x only */
+  char time[TIME_LEN];  /* %t and %x only */
+  size_t datelen, timelen;
+} GDateTime;
+
+typedef struct GDateTimeCacheEntry_ {
+  uint32_t gen; /* 0 if empty, see dt_cache_gen */
+  char spec;
+  const GLogParser *parser; /* timezone and numeric date format */
+  const char *fmt;
+  size_t len;
+  char tkn[DT_CACHE_TKN_LEN];
+  struct tm in; /* broken-down time the token was applied to */
+  GDateTime dt;
+} GDateTimeCacheEntry;
+
+/* Memoized date/time conversions. Log lines are time-ordered, so the same
+ * date and time tokens repeat across lines. */
+typedef struct GDateTimeCache_ {
+  GDateTimeCacheEntry entries[DT_CACHE_SIZE];
+  uint64_t hits;
+  uint64_t misses;
+} GDateTimeCache;
+
+static __thread GDateTimeCache dt_cache;
+/* bumped whenever the date/time config changes, invalidating all caches */
+static uint32_t dt_cache_gen = 1;
+
+/* Invalidate the date/time caches of all threads. */
+static void reset_dt_cache(void) {
+  __sync_add_and_fetch(&dt_cache_gen, 1);
+}
+
+/* Get the hit/miss counters of the calling thread's date/time cache. */
+void get_dt_cache_stats(uint64_t *hits, uint64_t *misses) {
+  *hits = dt_cache.hits;
+  *misses = dt_cache.misses;
+}
+
+static int same_tm(const struct tm *a, const struct tm *b) {
+  return a->tm_sec == b->tm_sec && a->tm_min == b->tm_min &&
+         a->tm_hour == b->tm_hour && a->tm_mday == b->tm_mday &&
+         a->tm_mon == b->tm_mon && a->tm_year == b->tm_year &&
+         a->tm_wday == b->tm_wday && a->tm_yday == b->tm_yday &&
+         a->tm_isdst == b->tm_isdst && a->tm_gmtoff == b->tm_gmtoff;
 }
 
-/* Format the broken-down time tm to a numeric time format.
+/* Convert a date ('d'), time ('t') or timestamp ('x') token applied to the
+ * broken-down time `in`, and format the date and/or time out of it. Results
+ * are memoized per thread, keyed on the token, the format, the active parser
+ * and `in`.
  *
- * On error, or unable to format the given tm, 1 is returned.
- * On success, a malloc'd format is returned. */
-static int set_time(char **ftime, struct tm tm) {
-  char buf[TIME_LEN] = "";
+ * On error, 1 is returned.
+ * On success, dt is set and 0 is returned. */
+static int set_date_time(const char *tkn, char spec, const char *fmt,
+                         const struct tm *in, GDateTime *dt) {
+  GDateTimeCacheEntry *e = NULL;
+  uint32_t gen = __atomic_load_n(&dt_cache_gen, __ATOMIC_RELAXED);
+  uint32_t hash = 2166136261u;
+  size_t len;
+
+  for (len = 0; tkn[len] && len < DT_CACHE_TKN_LEN; len++)
+    hash = (hash ^ (unsigned char)tkn[len]) * 16777619u;
+
+  if (tkn[len] == '\0') {
+    e = &dt_cache.entries[(hash ^ (uint32_t)spec) % DT_CACHE_SIZE];
+    if (e->gen == gen && e->spec == spec && e->parser == active_parser &&
+        e->fmt == fmt && e->len == len && memcmp(e->tkn, tkn, len) == 0 &&
+        same_tm(&e->in, in)) {
+      dt_cache.hits++;
+      *dt = e->dt;
+      return 0;
+    }
+  }
+  dt_cache.misses++;
 
-  memset(buf, 0, sizeof(buf));
-  if (strftime(buf, TIME_LEN, "%H:%M:%S", &tm) <= 0)
+  memset(dt, 0, sizeof *dt);
+  dt->tm = *in;
+  if (str_to_time(tkn, fmt, &dt->tm, 1) != 0)
     return 1;
-  *ftime = xstrdup(buf);
+  if (spec != 't') {
+    dt->datelen = format_date_num(dt->date, DATE_LEN, &dt->tm, &dt->numdate);
+    if (dt->datelen == 0)
+      return 1;
+  }
+  if (spec != 'd') {
+    dt->timelen = format_time(dt->time, TIME_LEN, &dt->tm);
+    if (dt->timelen == 0)
+      return 1;
+  }
+
+  /* too long to be cached */
+  if (e == NULL)
+    return 0;
+
+  e->gen = gen;
+  e->spec = spec;
+  e->parser = active_parser;
+  e->fmt = fmt;
+  e->len = len;
+  memcpy(e->tkn, tkn, len);
+  e->in = *in;
+  e->dt = *dt;
 
   return 0;
 }
 
-/* Determine the parsing specifier error and construct a message out
- * of it.
+/* Construct an error message for the given parsing specifier error.
  *
- * On success, a malloc'd error message is assigned to the log
- * structure and 1 is returned. */
-static int spec_err(GLogItem *logitem, int code, const char spec,
-                    const char *tkn) {
+ * On success, a malloc'd error message is returned. */
+static char *spec_err_str(int code, const char spec, const char *tkn) {
   char *err = NULL;
   const char *fmt = NULL;
 
@@ -1600,7 +3229,54 @@ static int spec_err(GLogItem *logitem, int code, const char spec,
     sprintf(err, fmt, (tkn ? tkn : "-"));
     break;
   }
-  logitem->errstr = err;
+
+  return err;
+}
+
+/* Construct an error message for the given compact error, see
+ * conf.compact_errors. Tokens aren't kept along, so the offset in the line
+ * is reported instead.
+ *
+ * If there's no error, NULL is returned.
+ * On success, a malloc'd error message is returned. */
+char *log_err_str(const GLogErr *err) {
+  const char *fmt = "Token at offset %u doesn't match specifier '%%%c'";
+  char *msg = NULL;
+
+  switch (err->code) {
+  case ERR_SPEC_TOKN_NUL:
+  case ERR_SPEC_LINE_INV:
+    return spec_err_str(err->code, err->spec, NULL);
+  case ERR_SPEC_SFMT_MIS:
+    return spec_err_str(err->code, err->spec, "{}");
+  case ERR_SPEC_TOKN_INV:
+    msg = xmalloc(snprintf(NULL, 0, fmt, err->off, err->spec) + 1);
+    sprintf(msg, fmt, err->off, err->spec);
+    return msg;
+  case ERR_MISS_HOST:
+    return xstrdup("IPv4/6 is required.");
+  case ERR_MISS_DATE:
+    return xstrdup("A valid date is required.");
+  case ERR_MISS_REQ:
+    return xstrdup("A request is required.");
+  case ERR_LOG_FMT_UNSUP:
+    return xstrdup("Zero-copy parsing requires a non-JSON log format.");
+  }
+
+  return NULL;
+}
+
+/* Determine the parsing specifier error and construct a message out
+ * of it, unless conf.compact_errors is set.
+ *
+ * On success, the error is assigned to the log structure and its code is
+ * returned. */
+static int spec_err(GLogItem *logitem, int code, const char spec,
+                    const char *tkn) {
+  logitem->err.code = code;
+  logitem->err.spec = spec;
+  if (!conf.compact_errors)
+    logitem->errstr = spec_err_str(code, spec, tkn);
 
   return code;
 }
@@ -1617,13 +3293,6 @@ static void set_tm_tm_logitem(GLogItem *logitem, struct tm tm) {
   logitem->dt.tm_sec = tm.tm_sec;
 }
 
-static void set_numeric_date(uint32_t *numdate, const char *date) {
-  int res = 0;
-  if ((res = str2int(date)) == -1)
-    FATAL("Unable to parse date to integer %s", date);
-  *numdate = res;
-}
-
 static int handle_default_case_token(const char **str, const char *p) {
   char *pch = NULL;
   if ((pch = strchr(*str, p[1])) != NULL)
@@ -1631,33 +3300,660 @@ static int handle_default_case_token(const char **str, const char *p) {
   return 0;
 }
 
-#pragma GCC diagnostic warning "-Wformat-nonliteral"
+/* Parse a status code token.
+ *
+ * On error, or if the status code is not valid, 1 is returned.
+ * On success, the status code is set and 0 is returned. */
+static int parse_status_tkn(const char *tkn, int *status) {
+  char *sEnd = NULL;
+
+  *status = strtol(tkn, &sEnd, 10);
+  if (tkn == sEnd || *sEnd != '\0' || errno == ERANGE ||
+      (!conf.no_strict_status && !is_valid_http_status(*status)))
+    return 1;
+
+  return 0;
+}
 
-/* Parse the log string given log format rule.
+/* Parse a response size token.
  *
- * On error, or unable to parse it, 1 is returned.
- * On success, the malloc'd token is assigned to a GLogItem member. */
-static int parse_specifier(GLogItem *logitem, const char **str, const char *p,
-                           const char *end) {
-  struct tm tm;
-  const char *dfmt = conf.date_format;
-  const char *tfmt = conf.time_format;
+ * On error, 0 is returned.
+ * On success, the size of the response in bytes is returned. */
+static uint64_t parse_bandw_tkn(const char *tkn) {
+  char *bEnd = NULL;
+  uint64_t bandw = 0;
 
-  char *pch, *sEnd, *bEnd, *tkn = NULL;
-  double serve_secs = 0.0;
-  uint64_t bandw = 0, serve_time = 0;
-  int dspc = 0, fmtspcs = 0;
+  bandw = strtoull(tkn, &bEnd, 10);
+  if (tkn == bEnd || *bEnd != '\0' || errno == ERANGE)
+    bandw = 0;
+
+  return bandw;
+}
+
+/* Parse a time-served token for the given specifier (%L, %T, %D or %n).
+ *
+ * On error, 0 is returned.
+ * On success, the time taken to serve the request in microseconds is
+ * returned. */
+static uint64_t parse_serve_time_tkn(char spec, const char *tkn) {
+  char *bEnd = NULL;
+  double serve_secs = 0.0;
+  uint64_t serve_time = 0;
+
+  switch (spec) {
+    /* milliseconds as a decimal number */
+  case 'L':
+    serve_secs = strtoull(tkn, &bEnd, 10);
+    if (tkn == bEnd || *bEnd != '\0' || errno == ERANGE)
+      serve_secs = 0;
+    return (serve_secs > 0) ? serve_secs * MILS : 0;
+    /* seconds with a milliseconds resolution */
+  case 'T':
+    if (strchr(tkn, '.') != NULL)
+      serve_secs = strtod(tkn, &bEnd);
+    else
+      serve_secs = strtoull(tkn, &bEnd, 10);
+
+    if (tkn == bEnd || *bEnd != '\0' || errno == ERANGE)
+      serve_secs = 0;
+    return (serve_secs > 0) ? serve_secs * SECS : 0;
+    /* microseconds */
+  case 'D':
+    serve_time = strtoull(tkn, &bEnd, 10);
+    if (tkn == bEnd || *bEnd != '\0' || errno == ERANGE)
+      serve_time = 0;
+    return serve_time;
+    /* nanoseconds */
+  case 'n':
+    serve_time = strtoull(tkn, &bEnd, 10);
+    if (tkn == bEnd || *bEnd != '\0' || errno == ERANGE)
+      serve_time = 0;
+    return (serve_time > 0) ? serve_time / MILS : 0;
+  }
+
+  return 0;
+}
+
+#pragma GCC diagnostic warning "-Wformat-nonliteral"
+
+/* Get the log item field set by the given specifier.
+ *
+ * If the specifier doesn't set a field, 0 is returned.
+ * On success, the GLogField value is returned. */
+static uint32_t get_spec_field(char spec) {
+  switch (spec) {
+  case 'h':
+    return LOG_FIELD_HOST;
+  case 'd':
+  case 'x':
+    return LOG_FIELD_DATE;
+  case 't':
+    return LOG_FIELD_TIME;
+  case 'r':
+  case 'U':
+    return LOG_FIELD_REQ;
+  case 'm':
+    return LOG_FIELD_METHOD;
+  case 'H':
+    return LOG_FIELD_PROTOCOL;
+  case 'q':
+    return LOG_FIELD_QSTR;
+  case 's':
+    return LOG_FIELD_STATUS;
+  case 'b':
+    return LOG_FIELD_RESP_SIZE;
+  case 'R':
+    return LOG_FIELD_REFERER;
+  case 'u':
+    return LOG_FIELD_AGENT;
+  case 'L':
+  case 'T':
+  case 'D':
+  case 'n':
+    return LOG_FIELD_SERVE_TIME;
+  case 'v':
+    return LOG_FIELD_VHOST;
+  case 'e':
+    return LOG_FIELD_USERID;
+  case 'C':
+    return LOG_FIELD_CACHE_STATUS;
+  case 'k':
+    return LOG_FIELD_TLS_CYPHER;
+  case 'K':
+    return LOG_FIELD_TLS_TYPE;
+  case 'M':
+    return LOG_FIELD_MIME_TYPE;
+  }
+  return 0;
+}
+
+/* Determine if any of the given fields has to be parsed, that is, it's
+ * within conf.field_mask or required by verify_missing_fields().
+ *
+ * If none is wanted, 0 is returned.
+ * Otherwise, 1 is returned. */
+static int wants_fields(uint32_t fields) {
+  return (fields & (conf.field_mask | LOG_FIELD_REQUIRED |
+                    conf.filter_fields)) != 0;
+}
+
+/* Get the log item field the given filter type is evaluated on.
+ *
+ * On success, the GLogField value is returned. */
+static uint32_t get_filter_field(GLogFilterType type) {
+  switch (type) {
+  case LOG_FILTER_STATUS:
+    return LOG_FIELD_STATUS;
+  case LOG_FILTER_VHOST:
+    return LOG_FIELD_VHOST;
+  case LOG_FILTER_METHOD:
+    return LOG_FIELD_METHOD;
+  case LOG_FILTER_REQ_PREFIX:
+    return LOG_FIELD_REQ;
+  }
+  return 0;
+}
+
+/* Register a predicate on a parsed field. A line is dropped as soon as any
+ * of its filters rejects it, in which case parse_line() stops parsing it and
+ * returns LINE_FILTERED. A line lacking the field isn't filtered.
+ *
+ * On success, the new filter is returned so its range or values can be set
+ * through set_log_filter_range() and add_log_filter_value(). */
+GLogFilter *add_log_filter(GLogFilterType type, int drop) {
+  GLogFilter *filter = xcalloc(1, sizeof(GLogFilter));
+
+  filter->type = type;
+  filter->drop = drop;
+
+  conf.filters = xrealloc(conf.filters,
+                          (conf.filters_len + 1) * sizeof(GLogFilter *));
+  conf.filters[conf.filters_len++] = filter;
+  conf.filter_fields |= get_filter_field(type);
+
+  return filter;
+}
+
+/* Set the inclusive status code range of a LOG_FILTER_STATUS filter. */
+void set_log_filter_range(GLogFilter *filter, int min, int max) {
+  filter->min = min;
+  filter->max = max;
+}
+
+/* Add a vhost, method or request prefix to the set of the given filter. */
+void add_log_filter_value(GLogFilter *filter, const char *value) {
+  filter->values =
+      xrealloc(filter->values, (filter->size + 1) * sizeof(char *));
+  filter->lens = xrealloc(filter->lens, (filter->size + 1) * sizeof(size_t));
+  filter->values[filter->size] = xstrdup(value);
+  filter->lens[filter->size] = strlen(value);
+  filter->size++;
+}
+
+/* Free all registered log filters. */
+void free_log_filters(void) {
+  int i, j;
+
+  for (i = 0; i < conf.filters_len; i++) {
+    for (j = 0; j < conf.filters[i]->size; j++)
+      free(conf.filters[i]->values[j]);
+    free(conf.filters[i]->values);
+    free(conf.filters[i]->lens);
+    free(conf.filters[i]);
+  }
+  free(conf.filters);
+  conf.filters = NULL;
+  conf.filters_len = 0;
+  conf.filter_fields = 0;
+}
+
+/* Determine if the given field value matches the filter.
+ *
+ * If it doesn't match, 0 is returned.
+ * If it matches, 1 is returned. */
+static int log_filter_matches(const GLogFilter *filter, const char *s,
+                              size_t len, int num) {
+  int i;
+
+  if (filter->type == LOG_FILTER_STATUS)
+    return num >= filter->min && num <= filter->max;
+
+  for (i = 0; i < filter->size; i++) {
+    switch (filter->type) {
+    case LOG_FILTER_VHOST:
+    case LOG_FILTER_METHOD:
+      if (len == filter->lens[i] &&
+          strncasecmp(s, filter->values[i], len) == 0)
+        return 1;
+      break;
+    case LOG_FILTER_REQ_PREFIX:
+      if (len >= filter->lens[i] &&
+          memcmp(s, filter->values[i], filter->lens[i]) == 0)
+        return 1;
+      break;
+    default:
+      break;
+    }
+  }
+  return 0;
+}
+
+/* Evaluate the filters of the given type against a just parsed field,
+ * either the `len` bytes of `s` or the number `num` for status codes.
+ *
+ * If the line has to be dropped, LINE_FILTERED is returned.
+ * Otherwise, 0 is returned. */
+static int apply_log_filters(GLogFilterType type, const char *s, size_t len,
+                             int num) {
+  int i;
+
+  if (!(conf.filter_fields & get_filter_field(type)))
+    return 0;
+
+  for (i = 0; i < conf.filters_len; i++) {
+    if (conf.filters[i]->type != type)
+      continue;
+    if (log_filter_matches(conf.filters[i], s, len, num) ==
+        conf.filters[i]->drop)
+      return LINE_FILTERED;
+  }
+  return 0;
+}
+
+/* Strip whitespace from both ends of a slice by moving its offsets.
+ *
+ * On success, the trimmed slice is returned. */
+static GStrView trim_view(const char *ptr, size_t len) {
+  GStrView v;
+
+  while (len && isspace((unsigned char)*ptr))
+    ptr++, len--;
+  while (len && isspace((unsigned char)ptr[len - 1]))
+    len--;
+
+  v.ptr = ptr;
+  v.len = len;
+  return v;
+}
+
+/* Room for rewritten fields (date/time, decoded tokens) on top of the line
+ * length when reserving a GLogItemView scratch buffer. */
+#define VIEW_BUF_SLACK 256
+
+/* Locate the first occurrence of needle within the first `len` bytes of
+ * haystack.
+ *
+ * If not found, NULL is returned.
+ * On success, a pointer to the occurrence is returned. */
+static const char *find_in_view(const char *haystack, size_t len,
+                                const char *needle) {
+  size_t nlen = strlen(needle);
+  const char *p = haystack, *last = NULL;
+
+  if (nlen == 0 || nlen > len)
+    return NULL;
+
+  last = haystack + len - nlen;
+  while (p <= last && (p = memchr(p, *needle, last - p + 1))) {
+    if (memcmp(p, needle, nlen) == 0)
+      return p;
+    p++;
+  }
+
+  return NULL;
+}
+
+/* Wrap a NUL-terminated string into a slice. */
+static GStrView str_view(const char *str) {
+  GStrView v = {str, strlen(str)};
+  return v;
+}
+
+/* Copy a slice into a NUL-terminated string. The given buffer is used if it
+ * fits, otherwise it is malloc'd.
+ *
+ * On success, the string is returned and must be released using
+ * view_cstr_free(). */
+static char *view_cstr(GStrView v, char *buf, size_t size) {
+  char *s = (v.len < size) ? buf : xmalloc(v.len + 1);
+
+  memcpy(s, v.ptr, v.len);
+  s[v.len] = '\0';
+
+  return s;
+}
+
+static void view_cstr_free(char *s, const char *buf) {
+  if (s != buf)
+    xfree(s);
+}
+
+/* Take `len` bytes from the scratch buffer of the given view. The buffer is
+ * reserved per line by reset_log_item_view() so it never moves while slices
+ * point into it.
+ *
+ * On success, a pointer to the reserved bytes is returned. */
+static char *view_alloc(GLogItemView *view, size_t len) {
+  char *p = NULL;
+
+  if (view->buflen + len > view->bufsize)
+    FATAL("Unable to reserve %zu bytes on the view buffer.", len);
+
+  p = view->buf + view->buflen;
+  view->buflen += len;
+
+  return p;
+}
+
+/* Initialize a new GLogItemView instance. */
+void init_log_item_view(GLogItemView *view) {
+  memset(view, 0, sizeof *view);
+}
+
+/* Free the scratch buffer and error message of a GLogItemView. */
+void free_log_item_view(GLogItemView *view) {
+  xfree(view->buf);
+  xfree(view->errstr);
+  memset(view, 0, sizeof *view);
+}
+
+/* Clear all fields of the given view, keeping (and growing if needed) its
+ * scratch buffer so it can hold any rewritten field of a line of `len`
+ * bytes. */
+static void reset_log_item_view(GLogItemView *view, size_t len) {
+  char *buf = view->buf;
+  size_t bufsize = view->bufsize, need = 2 * len + VIEW_BUF_SLACK;
+
+  xfree(view->errstr);
+  if (bufsize < need) {
+    /* the buffer outlives any batch, keep it off the active arena */
+    GArena *arena = set_active_arena(NULL);
+    buf = xrealloc(buf, need);
+    bufsize = need;
+    set_active_arena(arena);
+  }
+
+  memset(view, 0, sizeof *view);
+  view->buf = buf;
+  view->bufsize = bufsize;
+  view->status = -1;
+
+  view->dt.tm_year = 2000;
+  view->dt.tm_mon = 1;
+  view->dt.tm_mday = 1;
+  view->dt.tm_isdst = -1;
+}
+
+/* Determine the parsing specifier error and construct a message out of it.
+ * The token is only copied out of the line on this path.
+ *
+ * On success, a malloc'd error message is assigned to the view and the
+ * error code is returned. */
+static int spec_err_view(GLogItemView *view, int code, const char spec,
+                         const GStrView *tkn) {
+  char *s = NULL;
+
+  view->err.code = code;
+  view->err.spec = spec;
+  if (conf.compact_errors)
+    return code;
+
+  s = tkn ? view_cstr(*tkn, NULL, 0) : NULL;
+  xfree(view->errstr);
+  view->errstr = spec_err_str(code, spec, s);
+  xfree(s);
+
+  return code;
+}
+
+/* Advance past the token of a specifier outside of the field mask without
+ * copying, decoding or validating it. As when parsing them, a missing
+ * referrer, user agent or query string isn't an error.
+ *
+ * On error, or unable to find the token, 1 is returned.
+ * On success, 0 is returned. */
+static int skip_specifier_view(GLogItemView *view, const char **str,
+                               const char *p, const char *end) {
+  const char *pch = NULL;
+
+  if ((pch = find_token_end(*str, end, 1)) != NULL)
+    *str = pch;
+  else if (*p != 'R' && *p != 'u' && *p != 'q')
+    return spec_err_view(view, ERR_SPEC_TOKN_NUL, *p, NULL);
+
+  return 0;
+}
+
+/* Find a token given a log format rule, same as parse_string() but without
+ * copying it.
+ *
+ * On error, or unable to parse it, 1 is returned.
+ * On success, the trimmed slice is set and 0 is returned. */
+static int parse_string_view(const char **str, const char *delims, int cnt,
+                             GStrView *tkn) {
+  const char *pch = NULL;
+
+  if ((pch = find_token_end(*str, delims, cnt)) == NULL)
+    return 1;
+
+  *tkn = trim_view(*str, pch - *str);
+  *str = pch;
+
+  return 0;
+}
+
+/* Decode the given URL-encoded slice, same as decode_url(). Bytes are only
+ * copied into the view buffer if something needs to be rewritten.
+ *
+ * If the slice is empty, 1 is returned.
+ * On success, the decoded trimmed slice is set and 0 is returned. */
+static int decode_url_view(GLogItemView *view, GStrView url, GStrView *out) {
+  char *s = NULL;
+
+  if (url.len == 0)
+    return 1;
+
+  if (!memchr(url.ptr, '%', url.len) && !memchr(url.ptr, '\n', url.len) &&
+      !memchr(url.ptr, '\r', url.len)) {
+    *out = trim_view(url.ptr, url.len);
+    return 0;
+  }
+
+  s = view_alloc(view, url.len + 1);
+  out->len = decode_url_into(url.ptr, url.len, s);
+  out->ptr = s;
+  return 0;
+}
+
+/* Parse a request slice containing the method and protocol. The request is
+ * only copied into the view buffer if decoding rewrites it, and an empty
+ * decoded request falls back to the raw request.
+ *
+ * On error, or unable to parse, a "-" slice is returned.
+ * On success, the HTTP request is returned, and the method and protocol
+ * point into the static tables. */
+static GStrView parse_req_view(GLogItemView *view, GStrView line) {
+  GStrView request = line, dreq;
+  const char *meth = NULL, *proto = NULL, *req = NULL, *ptr = NULL;
+  const char *end = line.ptr + line.len;
+  size_t rlen;
+
+  meth = extract_method_len(line.ptr, line.len);
+
+  /* method found, attempt to parse request */
+  if (meth != NULL) {
+    req = line.ptr + strlen(meth);
+    for (ptr = end; ptr > req && ptr[-1] != ' '; ptr--)
+      ;
+    if (ptr == req || !(proto = extract_protocol_len(ptr, end - ptr)))
+      return str_view("-");
+
+    req++;
+    if (ptr <= req)
+      return str_view("-");
+    rlen = ptr - req;
+
+    request.ptr = req;
+    request.len = rlen;
+
+    if (conf.append_method)
+      view->method = str_view(meth);
+
+    if (conf.append_protocol)
+      view->protocol = str_view(proto);
+  }
+
+  if (decode_url_view(view, request, &dreq) || dreq.len == 0)
+    return request;
+
+  return dreq;
+}
+
+#if defined(HAVE_PARSE_STATS)
+/* Timed parse_req_view(), see end_parse_stat() */
+static GStrView parse_req_view_stat(GLogItemView *view, GStrView line) {
+  GParseStatMark mark;
+  GStrView ret;
+
+  begin_parse_stat(&mark);
+  ret = parse_req_view(view, line);
+  end_parse_stat(&mark, PARSE_STAT_PARSE_REQ, 0, line.len);
+
+  return ret;
+}
+#define parse_req_view parse_req_view_stat
+
+/* Timed decode_url_view(), see end_parse_stat(). Defined past
+ * parse_req_view() so a request isn't timed twice. */
+static int decode_url_view_stat(GLogItemView *view, GStrView url,
+                                GStrView *out) {
+  GParseStatMark mark;
+  int ret;
+
+  begin_parse_stat(&mark);
+  ret = decode_url_view(view, url, out);
+  end_parse_stat(&mark, PARSE_STAT_DECODE_URL, 0, url.len);
+
+  return ret;
+}
+#define decode_url_view decode_url_view_stat
+#endif
+
+/* Determine if the given referrer may hold a keyphrase, see
+ * extract_keyphrase(). */
+static int has_keyphrase_ref(GStrView ref) {
+  static const char *const engines[] = {
+      "http://www.google.",
+      "http://webcache.googleusercontent.com/",
+      "http://translate.googleusercontent.com/",
+      "https://www.google.",
+      "https://webcache.googleusercontent.com/",
+      "https://translate.googleusercontent.com/",
+  };
+  size_t i;
+
+  for (i = 0; i < ARRAY_SIZE(engines); i++) {
+    if (find_in_view(ref.ptr, ref.len, engines[i]))
+      return 1;
+  }
+  return 0;
+}
+
+/* Process a referrer slice, see extract_keyphrase(), and extract the *host*
+ * part of it, i.e., //www.example.com/path?googleguy > www.example.com
+ * The keyphrase (rare) is the only part that gets copied. */
+static void set_referer_view(GLogItemView *view, GStrView ref) {
+  char buf[LINE_BUFFER], *tkn = NULL, *keyphrase = NULL, *dst = NULL;
+  const char *begin = NULL, *end = NULL;
+  size_t len;
+
+  /* extract_keyphrase() truncates the referrer at the end of the query */
+  if (has_keyphrase_ref(ref)) {
+    tkn = view_cstr(ref, buf, sizeof(buf));
+    if (extract_keyphrase(tkn, &keyphrase) == 0) {
+      dst = view_alloc(view, ref.len + 1);
+      len = strlen(keyphrase);
+      memcpy(dst, keyphrase, len + 1);
+      view->keyphrase.ptr = dst;
+      view->keyphrase.len = len;
+      xfree(keyphrase);
+    }
+    ref.len = strlen(tkn);
+    view_cstr_free(tkn, buf);
+  }
+  view->ref = ref;
+
+  /* referring site */
+  if (!(begin = find_in_view(ref.ptr, ref.len, "//")))
+    return;
+
+  begin += 2;
+  if ((len = ref.ptr + ref.len - begin) == 0)
+    return;
+
+  for (end = begin; end < begin + len && *end != '/' && *end != '?'; end++)
+    ;
+  if ((len = end - begin) == 0)
+    return;
+
+  view->site.ptr = begin;
+  view->site.len = MIN(len, (size_t)REF_SITE_LEN);
+}
+
+/* Copy the formatted date and/or time of dt into the view buffer.
+ *
+ * On success, the date/time slices and numeric date are set. */
+static void set_date_time_view(GLogItemView *view, char spec,
+                               const GDateTime *dt) {
+  char *buf = NULL;
+
+  if (spec != 't') {
+    buf = view_alloc(view, dt->datelen + 1);
+    memcpy(buf, dt->date, dt->datelen + 1);
+    view->date.ptr = buf;
+    view->date.len = dt->datelen;
+    view->numdate = dt->numdate;
+  }
+  if (spec != 'd') {
+    buf = view_alloc(view, dt->timelen + 1);
+    memcpy(buf, dt->time, dt->timelen + 1);
+    view->time.ptr = buf;
+    view->time.len = dt->timelen;
+  }
+}
+
+/* Parse the log string given log format rule, storing slices into the view
+ * instead of malloc'd strings. This is the single implementation of every
+ * specifier, see parse_specifier() and parse_specifier_view(). If `set` is
+ * nonzero, the field was already parsed and its token is skipped.
+ *
+ * On error, or unable to parse it, 1 is returned.
+ * On success, the slice is assigned to a GLogItemView member. */
+static int parse_specifier_slice(GLogItemView *view, const char **str,
+                                 const char *p, const char *end, int set) {
+  struct tm tm;
+  const char *dfmt = active_parser->date_format;
+  const char *tfmt = active_parser->time_format;
+  const char *meth = NULL, *proto = NULL;
+  char buf[LINE_LEN * 4], *s = NULL, *pch = NULL;
+  GStrView tkn;
+  GDateTime dt;
+  int dspc = 0, fmtspcs = 0, res = 0;
+  uint32_t field = get_spec_field(*p);
+
+  if (field && !wants_fields(field))
+    return skip_specifier_view(view, str, p, end);
+  if (set)
+    return handle_default_case_token(str, p);
 
   errno = 0;
   memset(&tm, 0, sizeof(tm));
   tm.tm_isdst = -1;
-  tm = logitem->dt;
+  tm = view->dt;
 
   switch (*p) {
     /* date */
   case 'd':
-    if (logitem->date)
-      return handle_default_case_token(str, p);
 
     /* Attempt to parse date format containing spaces,
      * i.e., syslog date format (Jul\s15, Nov\s\s2).
@@ -1668,376 +3964,218 @@ static int parse_specifier(GLogItem *logitem, const char **str, const char *p,
     if ((fmtspcs = count_matches(dfmt, ' ')) && (pch = strchr(*str, ' ')))
       dspc = find_alpha_count(pch);
 
-    if (!(tkn = parse_string(&(*str), end, MAX(dspc, fmtspcs) + 1)))
-      return spec_err(logitem, ERR_SPEC_TOKN_NUL, *p, NULL);
+    if (parse_string_view(&(*str), end, MAX(dspc, fmtspcs) + 1, &tkn))
+      return spec_err_view(view, ERR_SPEC_TOKN_NUL, *p, NULL);
 
-    if (str_to_time(tkn, dfmt, &tm, 1) != 0 ||
-        set_date(&logitem->date, tm) != 0) {
-      spec_err(logitem, ERR_SPEC_TOKN_INV, *p, tkn);
-      free(tkn);
+    s = view_cstr(tkn, buf, sizeof(buf));
+    res = set_date_time(s, *p, dfmt, &tm, &dt);
+    view_cstr_free(s, buf);
+    if (res) {
+      spec_err_view(view, ERR_SPEC_TOKN_INV, *p, &tkn);
       return 1;
     }
 
-    set_numeric_date(&logitem->numdate, logitem->date);
-    set_tm_dt_logitem(logitem, tm);
-    free(tkn);
+    set_date_time_view(view, *p, &dt);
+    view->dt.tm_year = dt.tm.tm_year;
+    view->dt.tm_mon = dt.tm.tm_mon;
+    view->dt.tm_mday = dt.tm.tm_mday;
     break;
     /* time */
   case 't':
-    if (logitem->time)
-      return handle_default_case_token(str, p);
-    if (!(tkn = parse_string(&(*str), end, 1)))
-      return spec_err(logitem, ERR_SPEC_TOKN_NUL, *p, NULL);
-
-    if (str_to_time(tkn, tfmt, &tm, 1) != 0 ||
-        set_time(&logitem->time, tm) != 0) {
-      spec_err(logitem, ERR_SPEC_TOKN_INV, *p, tkn);
-      free(tkn);
+    if (parse_string_view(&(*str), end, 1, &tkn))
+      return spec_err_view(view, ERR_SPEC_TOKN_NUL, *p, NULL);
+
+    s = view_cstr(tkn, buf, sizeof(buf));
+    res = set_date_time(s, *p, tfmt, &tm, &dt);
+    view_cstr_free(s, buf);
+    if (res) {
+      spec_err_view(view, ERR_SPEC_TOKN_INV, *p, &tkn);
       return 1;
     }
 
-    set_tm_tm_logitem(logitem, tm);
-    free(tkn);
+    set_date_time_view(view, *p, &dt);
+    view->dt.tm_hour = dt.tm.tm_hour;
+    view->dt.tm_min = dt.tm.tm_min;
+    view->dt.tm_sec = dt.tm.tm_sec;
     break;
     /* date/time as decimal, i.e., timestamps, ms/us  */
   case 'x':
-    if (logitem->time && logitem->date)
-      return handle_default_case_token(str, p);
-    if (!(tkn = parse_string(&(*str), end, 1)))
-      return spec_err(logitem, ERR_SPEC_TOKN_NUL, *p, NULL);
-
-    if (str_to_time(tkn, tfmt, &tm, 1) != 0 ||
-        set_date(&logitem->date, tm) != 0 ||
-        set_time(&logitem->time, tm) != 0) {
-      spec_err(logitem, ERR_SPEC_TOKN_INV, *p, tkn);
-      free(tkn);
+    if (parse_string_view(&(*str), end, 1, &tkn))
+      return spec_err_view(view, ERR_SPEC_TOKN_NUL, *p, NULL);
+
+    s = view_cstr(tkn, buf, sizeof(buf));
+    res = set_date_time(s, *p, tfmt, &tm, &dt);
+    view_cstr_free(s, buf);
+    if (res) {
+      spec_err_view(view, ERR_SPEC_TOKN_INV, *p, &tkn);
       return 1;
     }
-    set_numeric_date(&logitem->numdate, logitem->date);
-    set_tm_dt_logitem(logitem, tm);
-    set_tm_tm_logitem(logitem, tm);
-    free(tkn);
+
+    set_date_time_view(view, *p, &dt);
+    view->dt.tm_year = dt.tm.tm_year;
+    view->dt.tm_mon = dt.tm.tm_mon;
+    view->dt.tm_mday = dt.tm.tm_mday;
+    view->dt.tm_hour = dt.tm.tm_hour;
+    view->dt.tm_min = dt.tm.tm_min;
+    view->dt.tm_sec = dt.tm.tm_sec;
     break;
     /* Virtual Host */
   case 'v':
-    if (logitem->vhost)
-      return handle_default_case_token(str, p);
-    tkn = parse_string(&(*str), end, 1);
-    if (tkn == NULL)
-      return spec_err(logitem, ERR_SPEC_TOKN_NUL, *p, NULL);
-    logitem->vhost = tkn;
-    break;
+    if (parse_string_view(&(*str), end, 1, &view->vhost))
+      return spec_err_view(view, ERR_SPEC_TOKN_NUL, *p, NULL);
+    return apply_log_filters(LOG_FILTER_VHOST, view->vhost.ptr,
+                             view->vhost.len, 0);
     /* remote user */
   case 'e':
-    if (logitem->userid)
-      return handle_default_case_token(str, p);
-    tkn = parse_string(&(*str), end, 1);
-    if (tkn == NULL)
-      return spec_err(logitem, ERR_SPEC_TOKN_NUL, *p, NULL);
-    logitem->userid = tkn;
+    if (parse_string_view(&(*str), end, 1, &view->userid))
+      return spec_err_view(view, ERR_SPEC_TOKN_NUL, *p, NULL);
     break;
     /* cache status */
   case 'C':
-    if (logitem->cache_status)
-      return handle_default_case_token(str, p);
-    tkn = parse_string(&(*str), end, 1);
-    if (tkn == NULL)
-      return spec_err(logitem, ERR_SPEC_TOKN_NUL, *p, NULL);
-    if (is_cache_hit(tkn))
-      logitem->cache_status = tkn;
-    else
-      free(tkn);
+    if (parse_string_view(&(*str), end, 1, &tkn))
+      return spec_err_view(view, ERR_SPEC_TOKN_NUL, *p, NULL);
+
+    s = view_cstr(tkn, buf, sizeof(buf));
+    if (is_cache_hit(s))
+      view->cache_status = tkn;
+    view_cstr_free(s, buf);
     break;
     /* remote hostname (IP only) */
   case 'h':
-    if (logitem->host)
-      return handle_default_case_token(str, p);
     /* per https://datatracker.ietf.org/doc/html/rfc3986#section-3.2.2 */
     /* square brackets are possible */
     if (*str[0] == '[' && (*str += 1) && **str)
       end = "]";
-    if (!(tkn = parse_string(&(*str), end, 1)))
-      return spec_err(logitem, ERR_SPEC_TOKN_NUL, *p, NULL);
+    if (parse_string_view(&(*str), end, 1, &tkn))
+      return spec_err_view(view, ERR_SPEC_TOKN_NUL, *p, NULL);
 
-    if (!conf.no_ip_validation && invalid_ipaddr(tkn, &logitem->type_ip)) {
-      spec_err(logitem, ERR_SPEC_TOKN_INV, *p, tkn);
-      free(tkn);
+    if (!conf.no_ip_validation &&
+        parse_ipaddr(tkn.ptr, tkn.len, &view->type_ip, view->addr)) {
+      spec_err_view(view, ERR_SPEC_TOKN_INV, *p, &tkn);
       return 1;
     }
     /* require a valid host token (e.g., ord38s18-in-f14.1e100.net) even when
      * we're not validating the IP */
-    if (conf.no_ip_validation && *tkn == '\0') {
-      spec_err(logitem, ERR_SPEC_TOKN_INV, *p, tkn);
-      free(tkn);
+    if (conf.no_ip_validation && tkn.len == 0) {
+      spec_err_view(view, ERR_SPEC_TOKN_INV, *p, &tkn);
       return 1;
     }
-    logitem->host = tkn;
+    view->host = tkn;
     break;
     /* request method */
   case 'm':
-    if (logitem->method)
-      return handle_default_case_token(str, p);
-    if (!(tkn = parse_string(&(*str), end, 1)))
-      return spec_err(logitem, ERR_SPEC_TOKN_NUL, *p, NULL);
-    {
-      const char *meth = NULL;
-      if (!(meth = extract_method(tkn))) {
-        spec_err(logitem, ERR_SPEC_TOKN_INV, *p, tkn);
-        free(tkn);
-        return 1;
-      }
-      logitem->method = xstrdup(meth);
-      free(tkn);
+    if (parse_string_view(&(*str), end, 1, &tkn))
+      return spec_err_view(view, ERR_SPEC_TOKN_NUL, *p, NULL);
+    if (!(meth = extract_method_len(tkn.ptr, tkn.len))) {
+      spec_err_view(view, ERR_SPEC_TOKN_INV, *p, &tkn);
+      return 1;
     }
-    break;
+    view->method = str_view(meth);
+    return apply_log_filters(LOG_FILTER_METHOD, meth, view->method.len, 0);
     /* request not including method or protocol */
   case 'U':
-    if (logitem->req)
-      return handle_default_case_token(str, p);
-    tkn = parse_string(&(*str), end, 1);
-    if (tkn == NULL || *tkn == '\0') {
-      free(tkn);
-      return spec_err(logitem, ERR_SPEC_TOKN_NUL, *p, NULL);
-    }
-
-    if ((logitem->req = decode_url(tkn)) == NULL) {
-      spec_err(logitem, ERR_SPEC_TOKN_INV, *p, tkn);
-      free(tkn);
-      return 1;
-    }
-    free(tkn);
-    break;
+    if (parse_string_view(&(*str), end, 1, &tkn) || tkn.len == 0)
+      return spec_err_view(view, ERR_SPEC_TOKN_NUL, *p, NULL);
+    decode_url_view(view, tkn, &view->req);
+    return apply_log_filters(LOG_FILTER_REQ_PREFIX, view->req.ptr,
+                             view->req.len, 0);
     /* query string alone, e.g., ?param=goaccess&tbm=shop */
   case 'q':
-    if (logitem->qstr)
-      return handle_default_case_token(str, p);
-    tkn = parse_string(&(*str), end, 1);
-    if (tkn == NULL || *tkn == '\0') {
-      free(tkn);
+    if (parse_string_view(&(*str), end, 1, &tkn) || tkn.len == 0)
       return 0;
-    }
-
-    if ((logitem->qstr = decode_url(tkn)) == NULL) {
-      spec_err(logitem, ERR_SPEC_TOKN_INV, *p, tkn);
-      free(tkn);
-      return 1;
-    }
-    free(tkn);
+    decode_url_view(view, tkn, &view->qstr);
     break;
     /* request protocol */
   case 'H':
-    if (logitem->protocol)
-      return handle_default_case_token(str, p);
-    if (!(tkn = parse_string(&(*str), end, 1)))
-      return spec_err(logitem, ERR_SPEC_TOKN_NUL, *p, NULL);
-    {
-      const char *proto = NULL;
-      if (!(proto = extract_protocol(tkn))) {
-        spec_err(logitem, ERR_SPEC_TOKN_INV, *p, tkn);
-        free(tkn);
-        return 1;
-      }
-      logitem->protocol = xstrdup(proto);
-      free(tkn);
+    if (parse_string_view(&(*str), end, 1, &tkn))
+      return spec_err_view(view, ERR_SPEC_TOKN_NUL, *p, NULL);
+    if (!(proto = extract_protocol_len(tkn.ptr, tkn.len))) {
+      spec_err_view(view, ERR_SPEC_TOKN_INV, *p, &tkn);
+      return 1;
     }
+    view->protocol = str_view(proto);
     break;
     /* request, including method + protocol */
   case 'r':
-    if (logitem->req)
-      return handle_default_case_token(str, p);
-    if (!(tkn = parse_string(&(*str), end, 1)))
-      return spec_err(logitem, ERR_SPEC_TOKN_NUL, *p, NULL);
-
-    logitem->req = parse_req(tkn, &logitem->method, &logitem->protocol);
-    free(tkn);
-    break;
+    if (parse_string_view(&(*str), end, 1, &tkn))
+      return spec_err_view(view, ERR_SPEC_TOKN_NUL, *p, NULL);
+    view->req = parse_req_view(view, tkn);
+
+    if (view->method.ptr &&
+        (res = apply_log_filters(LOG_FILTER_METHOD, view->method.ptr,
+                                 view->method.len, 0)))
+      return res;
+    return apply_log_filters(LOG_FILTER_REQ_PREFIX, view->req.ptr,
+                             view->req.len, 0);
     /* Status Code */
   case 's':
-    if (logitem->status >= 0)
-      return handle_default_case_token(str, p);
-    if (!(tkn = parse_string(&(*str), end, 1)))
-      return spec_err(logitem, ERR_SPEC_TOKN_NUL, *p, NULL);
-
-    logitem->status = strtol(tkn, &sEnd, 10);
-    if (tkn == sEnd || *sEnd != '\0' || errno == ERANGE ||
-        (!conf.no_strict_status && !is_valid_http_status(logitem->status))) {
-      spec_err(logitem, ERR_SPEC_TOKN_INV, *p, tkn);
-      free(tkn);
+    if (parse_string_view(&(*str), end, 1, &tkn))
+      return spec_err_view(view, ERR_SPEC_TOKN_NUL, *p, NULL);
+
+    s = view_cstr(tkn, buf, sizeof(buf));
+    res = parse_status_tkn(s, &view->status);
+    view_cstr_free(s, buf);
+    if (res) {
+      spec_err_view(view, ERR_SPEC_TOKN_INV, *p, &tkn);
       return 1;
     }
-    free(tkn);
-    break;
+    return apply_log_filters(LOG_FILTER_STATUS, NULL, 0, view->status);
     /* size of response in bytes - excluding HTTP headers */
   case 'b':
-    if (logitem->resp_size)
-      return handle_default_case_token(str, p);
-    if (!(tkn = parse_string(&(*str), end, 1)))
-      return spec_err(logitem, ERR_SPEC_TOKN_NUL, *p, NULL);
-
-    bandw = strtoull(tkn, &bEnd, 10);
-    if (tkn == bEnd || *bEnd != '\0' || errno == ERANGE)
-      bandw = 0;
-    logitem->resp_size = bandw;
-    __sync_bool_compare_and_swap(&conf.bandwidth, 0, 1); /* set flag */
-    free(tkn);
+    if (parse_string_view(&(*str), end, 1, &tkn))
+      return spec_err_view(view, ERR_SPEC_TOKN_NUL, *p, NULL);
+
+    s = view_cstr(tkn, buf, sizeof(buf));
+    view->resp_size = parse_bandw_tkn(s);
+    view_cstr_free(s, buf);
+    /* set flag */
+    __sync_bool_compare_and_swap(&active_parser->bandwidth, 0, 1);
     break;
     /* referrer */
   case 'R':
-    if (logitem->ref)
-      return handle_default_case_token(str, p);
-
-    if (!(tkn = parse_string(&(*str), end, 1)))
-      tkn = alloc_string("-");
-    if (*tkn == '\0') {
-      free(tkn);
-      tkn = alloc_string("-");
-    }
-    if (strcmp(tkn, "-") != 0) {
-      extract_keyphrase(tkn, &logitem->keyphrase);
-      extract_referer_site(tkn, logitem->site);
-
-      /* hide referrers from report */
-      logitem->ref = tkn;
-      break;
-    }
-    logitem->ref = tkn;
-
+    if (parse_string_view(&(*str), end, 1, &tkn) || tkn.len == 0)
+      tkn = str_view("-");
+    if (tkn.len == 1 && *tkn.ptr == '-')
+      view->ref = tkn;
+    else
+      set_referer_view(view, tkn);
     break;
     /* user agent */
   case 'u':
-    if (logitem->agent)
-      return handle_default_case_token(str, p);
-
-    tkn = parse_string(&(*str), end, 1);
-    if (tkn != NULL && *tkn != '\0') {
-      /* Make sure the user agent is decoded (i.e.: CloudFront) */
-      logitem->agent = decode_url(tkn);
-
-      // set_browser_os (logitem);
-      // set_agent_hash(logitem);
-      free(tkn);
-      break;
-    } else if (tkn != NULL && *tkn == '\0') {
-      free(tkn);
-      tkn = alloc_string("-");
-    }
-    /* must be null */
-    else {
-      tkn = alloc_string("-");
-    }
-    logitem->agent = tkn;
-    // set_agent_hash(logitem);
+    /* make sure the user agent is decoded (i.e.: CloudFront) */
+    if (parse_string_view(&(*str), end, 1, &tkn) ||
+        decode_url_view(view, tkn, &view->agent))
+      view->agent = str_view("-");
     break;
-    /* time taken to serve the request, in milliseconds as a decimal number */
+    /* time taken to serve the request */
   case 'L':
-    /* ignore it if we already have served time */
-    if (logitem->serve_time)
-      return handle_default_case_token(str, p);
-    if (!(tkn = parse_string(&(*str), end, 1)))
-      return spec_err(logitem, ERR_SPEC_TOKN_NUL, *p, NULL);
-
-    serve_secs = strtoull(tkn, &bEnd, 10);
-    if (tkn == bEnd || *bEnd != '\0' || errno == ERANGE)
-      serve_secs = 0;
-    /* convert it to microseconds */
-    logitem->serve_time = (serve_secs > 0) ? serve_secs * MILS : 0;
-
-    /* Determine if time-served data was stored on-disk. */
-    __sync_bool_compare_and_swap(&conf.serve_usecs, 0, 1); /* set flag */
-    free(tkn);
-    break;
-    /* time taken to serve the request, in seconds with a milliseconds
-     * resolution */
   case 'T':
-    /* ignore it if we already have served time */
-    if (logitem->serve_time)
-      return handle_default_case_token(str, p);
-    if (!(tkn = parse_string(&(*str), end, 1)))
-      return spec_err(logitem, ERR_SPEC_TOKN_NUL, *p, NULL);
-
-    if (strchr(tkn, '.') != NULL)
-      serve_secs = strtod(tkn, &bEnd);
-    else
-      serve_secs = strtoull(tkn, &bEnd, 10);
-
-    if (tkn == bEnd || *bEnd != '\0' || errno == ERANGE)
-      serve_secs = 0;
-    /* convert it to microseconds */
-    logitem->serve_time = (serve_secs > 0) ? serve_secs * SECS : 0;
-
-    /* Determine if time-served data was stored on-disk. */
-    __sync_bool_compare_and_swap(&conf.serve_usecs, 0, 1); /* set flag */
-    free(tkn);
-    break;
-    /* time taken to serve the request, in microseconds */
   case 'D':
-    /* ignore it if we already have served time */
-    if (logitem->serve_time)
-      return handle_default_case_token(str, p);
-    if (!(tkn = parse_string(&(*str), end, 1)))
-      return spec_err(logitem, ERR_SPEC_TOKN_NUL, *p, NULL);
-
-    serve_time = strtoull(tkn, &bEnd, 10);
-    if (tkn == bEnd || *bEnd != '\0' || errno == ERANGE)
-      serve_time = 0;
-    logitem->serve_time = serve_time;
-
-    /* Determine if time-served data was stored on-disk. */
-    __sync_bool_compare_and_swap(&conf.serve_usecs, 0, 1); /* set flag */
-    free(tkn);
-    break;
-    /* time taken to serve the request, in nanoseconds */
   case 'n':
-    /* ignore it if we already have served time */
-    if (logitem->serve_time)
-      return handle_default_case_token(str, p);
-    if (!(tkn = parse_string(&(*str), end, 1)))
-      return spec_err(logitem, ERR_SPEC_TOKN_NUL, *p, NULL);
-
-    serve_time = strtoull(tkn, &bEnd, 10);
-    if (tkn == bEnd || *bEnd != '\0' || errno == ERANGE)
-      serve_time = 0;
-
-    /* convert it to microseconds */
-    logitem->serve_time = (serve_time > 0) ? serve_time / MILS : 0;
+    if (parse_string_view(&(*str), end, 1, &tkn))
+      return spec_err_view(view, ERR_SPEC_TOKN_NUL, *p, NULL);
 
+    s = view_cstr(tkn, buf, sizeof(buf));
+    view->serve_time = parse_serve_time_tkn(*p, s);
+    view_cstr_free(s, buf);
     /* Determine if time-served data was stored on-disk. */
-    __sync_bool_compare_and_swap(&conf.serve_usecs, 0, 1); /* set flag */
-    free(tkn);
+    /* set flag */
+    __sync_bool_compare_and_swap(&active_parser->serve_usecs, 0, 1);
     break;
     /* UMS: Krypto (TLS) "ECDHE-RSA-AES128-GCM-SHA256" */
   case 'k':
-    /* error to set this twice */
-    if (logitem->tls_cypher)
-      return handle_default_case_token(str, p);
-    if (!(tkn = parse_string(&(*str), end, 1)))
-      return spec_err(logitem, ERR_SPEC_TOKN_NUL, *p, NULL);
-
-    logitem->tls_cypher = tkn;
-
+    if (parse_string_view(&(*str), end, 1, &view->tls_cypher))
+      return spec_err_view(view, ERR_SPEC_TOKN_NUL, *p, NULL);
     break;
-
     /* UMS: Krypto (TLS) parameters like "TLSv1.2" */
   case 'K':
-    /* error to set this twice */
-    if (logitem->tls_type)
-      return handle_default_case_token(str, p);
-    if (!(tkn = parse_string(&(*str), end, 1)))
-      return spec_err(logitem, ERR_SPEC_TOKN_NUL, *p, NULL);
-
-    logitem->tls_type = tkn;
+    if (parse_string_view(&(*str), end, 1, &view->tls_type))
+      return spec_err_view(view, ERR_SPEC_TOKN_NUL, *p, NULL);
     break;
-
     /* UMS: Mime-Type like "text/html" */
   case 'M':
-    /* error to set this twice */
-    if (logitem->mime_type)
-      return handle_default_case_token(str, p);
-    if (!(tkn = parse_string(&(*str), end, 1)))
-      return spec_err(logitem, ERR_SPEC_TOKN_NUL, *p, NULL);
-
-    logitem->mime_type = tkn;
-
+    if (parse_string_view(&(*str), end, 1, &view->mime_type))
+      return spec_err_view(view, ERR_SPEC_TOKN_NUL, *p, NULL);
     break;
     /* move forward through str until not a space */
   case '~':
@@ -2051,6 +4189,280 @@ static int parse_specifier(GLogItem *logitem, const char **str, const char *p,
   return 0;
 }
 
+/* Determine if the field of the given specifier was already parsed into the
+ * view, see parse_specifier_slice(). */
+static int is_view_spec_set(const GLogItemView *view, char spec) {
+  switch (spec) {
+  case 'd':
+    return view->date.ptr != NULL;
+  case 't':
+    return view->time.ptr != NULL;
+  case 'x':
+    return view->date.ptr && view->time.ptr;
+  case 'v':
+    return view->vhost.ptr != NULL;
+  case 'e':
+    return view->userid.ptr != NULL;
+  case 'C':
+    return view->cache_status.ptr != NULL;
+  case 'h':
+    return view->host.ptr != NULL;
+  case 'm':
+    return view->method.ptr != NULL;
+  case 'U':
+  case 'r':
+    return view->req.ptr != NULL;
+  case 'q':
+    return view->qstr.ptr != NULL;
+  case 'H':
+    return view->protocol.ptr != NULL;
+  case 's':
+    return view->status >= 0;
+  case 'b':
+    return view->resp_size != 0;
+  case 'R':
+    return view->ref.ptr != NULL;
+  case 'u':
+    return view->agent.ptr != NULL;
+  case 'L':
+  case 'T':
+  case 'D':
+  case 'n':
+    return view->serve_time != 0;
+  case 'k':
+    return view->tls_cypher.ptr != NULL;
+  case 'K':
+    return view->tls_type.ptr != NULL;
+  case 'M':
+    return view->mime_type.ptr != NULL;
+  }
+  return 0;
+}
+
+/* Parse the log string given log format rule into a view, see
+ * parse_specifier_slice().
+ *
+ * On error, or unable to parse it, 1 is returned.
+ * On success, the slice is assigned to a GLogItemView member. */
+static int parse_specifier_view(GLogItemView *view, const char **str,
+                                const char *p, const char *end) {
+  return parse_specifier_slice(view, str, p, end, is_view_spec_set(view, *p));
+}
+
+/* Determine if the field of the given specifier was already parsed into the
+ * log item, same as is_view_spec_set(). */
+static int is_item_spec_set(const GLogItem *logitem, char spec) {
+  switch (spec) {
+  case 'd':
+    return logitem->date != NULL;
+  case 't':
+    return logitem->time != NULL;
+  case 'x':
+    return logitem->date && logitem->time;
+  case 'v':
+    return logitem->vhost != NULL;
+  case 'e':
+    return logitem->userid != NULL;
+  case 'C':
+    return logitem->cache_status != NULL;
+  case 'h':
+    return logitem->host != NULL;
+  case 'm':
+    return logitem->method != NULL;
+  case 'U':
+  case 'r':
+    return logitem->req != NULL;
+  case 'q':
+    return logitem->qstr != NULL;
+  case 'H':
+    return logitem->protocol != NULL;
+  case 's':
+    return logitem->status >= 0;
+  case 'b':
+    return logitem->resp_size != 0;
+  case 'R':
+    return logitem->ref != NULL;
+  case 'u':
+    return logitem->agent != NULL;
+  case 'L':
+  case 'T':
+  case 'D':
+  case 'n':
+    return logitem->serve_time != 0;
+  case 'k':
+    return logitem->tls_cypher != NULL;
+  case 'K':
+    return logitem->tls_type != NULL;
+  case 'M':
+    return logitem->mime_type != NULL;
+  }
+  return 0;
+}
+
+/* Copy the fields parse_specifier_slice() set on the view for the given
+ * specifier into malloc'd (or interned) log item members. */
+static void set_item_spec(GLogItem *logitem, const GLogItemView *view,
+                          char spec) {
+  switch (spec) {
+  case 'd':
+  case 't':
+  case 'x':
+    if (view->date.ptr) {
+      xfree(logitem->date);
+      logitem->date = view_cstr(view->date, NULL, 0);
+      logitem->numdate = view->numdate;
+      set_tm_dt_logitem(logitem, view->dt);
+    }
+    if (view->time.ptr) {
+      xfree(logitem->time);
+      logitem->time = view_cstr(view->time, NULL, 0);
+      set_tm_tm_logitem(logitem, view->dt);
+    }
+    break;
+  case 'v':
+    if (view->vhost.ptr)
+      logitem->vhost = intern_token(view_cstr(view->vhost, NULL, 0),
+                                    &logitem->vhost_id);
+    break;
+  case 'e':
+    if (view->userid.ptr)
+      logitem->userid = view_cstr(view->userid, NULL, 0);
+    break;
+  case 'C':
+    if (view->cache_status.ptr)
+      logitem->cache_status = view_cstr(view->cache_status, NULL, 0);
+    break;
+  case 'h':
+    if (view->host.ptr) {
+      logitem->host =
+          intern_token(view_cstr(view->host, NULL, 0), &logitem->host_id);
+      logitem->type_ip = view->type_ip;
+      memcpy(logitem->addr, view->addr, sizeof(logitem->addr));
+    }
+    break;
+  case 'U':
+  case 'r':
+    if (view->req.ptr)
+      logitem->req = view_cstr(view->req, NULL, 0);
+    /* fall through */
+  case 'm':
+  case 'H':
+    if (view->method.ptr)
+      logitem->method = view->method.ptr;
+    if (view->protocol.ptr)
+      logitem->protocol = view->protocol.ptr;
+    break;
+  case 'q':
+    if (view->qstr.ptr)
+      logitem->qstr = view_cstr(view->qstr, NULL, 0);
+    break;
+  case 's':
+    if (view->status >= 0)
+      logitem->status = view->status;
+    break;
+  case 'b':
+    if (view->resp_size)
+      logitem->resp_size = view->resp_size;
+    break;
+  case 'R':
+    if (!view->ref.ptr)
+      break;
+    logitem->ref = view_cstr(view->ref, NULL, 0);
+    if (view->keyphrase.ptr)
+      logitem->keyphrase = view_cstr(view->keyphrase, NULL, 0);
+    if (view->site.ptr) {
+      memcpy(logitem->site, view->site.ptr, view->site.len);
+      logitem->site[view->site.len] = '\0';
+      intern_str(logitem->site, &logitem->site_id);
+    }
+    break;
+  case 'u':
+    if (view->agent.ptr)
+      logitem->agent = intern_token(view_cstr(view->agent, NULL, 0),
+                                    &logitem->agent_id);
+    break;
+  case 'L':
+  case 'T':
+  case 'D':
+  case 'n':
+    if (view->serve_time)
+      logitem->serve_time = view->serve_time;
+    break;
+  case 'k':
+    if (view->tls_cypher.ptr)
+      logitem->tls_cypher = view_cstr(view->tls_cypher, NULL, 0);
+    break;
+  case 'K':
+    if (view->tls_type.ptr)
+      logitem->tls_type = view_cstr(view->tls_type, NULL, 0);
+    break;
+  case 'M':
+    if (view->mime_type.ptr)
+      logitem->mime_type = view_cstr(view->mime_type, NULL, 0);
+    break;
+  }
+}
+
+/* Parse the log string given log format rule into a log item. The token is
+ * parsed into a view over a scratch buffer by parse_specifier_slice() and
+ * copied out of it, so both parsers share a single implementation.
+ *
+ * On error, or unable to parse it, 1 is returned.
+ * On success, the malloc'd token is assigned to a GLogItem member. */
+static int parse_specifier(GLogItem *logitem, const char **str, const char *p,
+                           const char *end) {
+  GLogItemView view;
+  /* a single token (plus a date/time) is rewritten per specifier */
+  char buf[LINE_BUFFER + VIEW_BUF_SLACK];
+  int ret = 0;
+
+  memset(&view, 0, sizeof view);
+  view.buf = buf;
+  view.bufsize = sizeof(buf);
+  if (strnlen(*str, LINE_BUFFER + 1) > LINE_BUFFER) {
+    view.bufsize = strlen(*str) + VIEW_BUF_SLACK;
+    view.buf = xmalloc(view.bufsize);
+  }
+  view.status = -1;
+  view.type_ip = logitem->type_ip;
+  memcpy(view.addr, logitem->addr, sizeof(view.addr));
+  view.dt = logitem->dt;
+
+  ret = parse_specifier_slice(&view, str, p, end,
+                              is_item_spec_set(logitem, *p));
+  /* as with the view, fields parsed before an error are kept */
+  set_item_spec(logitem, &view, *p);
+  if (view.err.code) {
+    logitem->err = view.err;
+    if (view.errstr) {
+      xfree(logitem->errstr);
+      logitem->errstr = view.errstr;
+    }
+  }
+
+  if (view.buf != buf)
+    xfree(view.buf);
+
+  return ret;
+}
+
+#if defined(HAVE_PARSE_STATS)
+/* Timed parse_specifier(), see end_parse_stat() */
+static int parse_specifier_stat(GLogItem *logitem, const char **str,
+                                const char *p, const char *end) {
+  GParseStatMark mark;
+  const char *start = *str;
+  int ret;
+
+  begin_parse_stat(&mark);
+  ret = parse_specifier(logitem, str, p, end);
+  end_parse_stat(&mark, PARSE_STAT_SPECIFIER, *p, *str - start);
+
+  return ret;
+}
+#define parse_specifier parse_specifier_stat
+#endif
+
 /* Parse the special host specifier and extract the characters that
  * need to be rejected when attempting to parse the XFF field.
  *
@@ -2090,89 +4502,132 @@ static char *extract_braces(const char **p) {
   return ret;
 }
 
-/* Attempt to extract the client IP from an X-Forwarded-For (XFF) field.
+/* Walk the candidates of an X-Forwarded-For (XFF) slice, delimited by any
+ * of the chars in `skips`, looking for the client IP. Candidates are only
+ * trimmed and validated in place, so rejected ones cost no allocation. If
+ * `host` is already set, it's kept as is.
  *
  * If no IP is found, 1 is returned.
- * On success, the malloc'd token is assigned to a GLogItem->host and
- * 0 is returned. */
-static int set_xff_host(GLogItem *logitem, const char *str, const char *skips,
-                        int out) {
-  const char *ptr = NULL, *tkn = NULL;
-  int invalid_ip = 1, len = 0, type_ip = TYPE_IPINV;
-  int idx = 0, skips_len = 0;
-
-  skips_len = strlen(skips);
-  ptr = str;
-  while (*ptr != '\0') {
-    if ((len = strcspn(ptr, skips)) == 0) {
+ * On success, the IP slice is assigned to `host`, along with its type and
+ * binary address (see parse_ipaddr()), and 0 is returned. */
+static int scan_xff_host(const char *str, size_t slen, const char *skips,
+                         int out, GStrView *host, int *type_ip,
+                         uint8_t *addr) {
+  const char *ptr = str, *last = str + slen;
+  int invalid_ip = 1, type = TYPE_IPINV;
+  int idx = 0, skips_len = strlen(skips);
+  uint8_t bin[16];
+  size_t len = 0;
+  GStrView tkn;
+
+  while (ptr < last) {
+    for (len = 0; ptr + len < last && !strchr(skips, ptr[len]); len++)
+      ;
+    if (len == 0) {
       len++, ptr++, idx++;
       goto move;
     }
     /* If our index does not match the number of delimiters and we have already
      * a valid client IP, then we assume we have reached the length of the XFF
      */
-    if (idx < skips_len && logitem->host)
+    if (idx < skips_len && host->ptr)
       break;
 
     ptr += len;
     /* extract possible IP */
-    if (!(tkn = parsed_string(ptr, &str, 0)))
-      break;
+    tkn = trim_view(str, ptr - str);
 
-    invalid_ip = invalid_ipaddr(tkn, &type_ip);
+    invalid_ip = parse_ipaddr(tkn.ptr, tkn.len, &type, bin);
     /* done, already have IP and current token is not a host */
-    if (logitem->host && invalid_ip) {
-      free((void *)tkn);
+    if (host->ptr && invalid_ip)
       break;
+    if (!host->ptr && !invalid_ip) {
+      *host = tkn;
+      *type_ip = type;
+      memcpy(addr, bin, sizeof(bin));
     }
-    if (!logitem->host && !invalid_ip) {
-      logitem->host = xstrdup(tkn);
-      logitem->type_ip = type_ip;
-    }
-    free((void *)tkn);
     idx = 0;
 
     /* found the client IP, break then */
-    if (logitem->host && out)
+    if (host->ptr && out)
       break;
 
   move:
     str += len;
   }
 
-  return logitem->host == NULL;
+  return host->ptr == NULL;
 }
 
-/* Attempt to find possible delimiters in the X-Forwarded-For (XFF) field.
+/* Attempt to extract the client IP from an X-Forwarded-For (XFF) field, see
+ * scan_xff_host(). Only the client IP is copied out of the field.
+ *
+ * If no IP is found, 1 is returned.
+ * On success, the malloc'd token is assigned to a GLogItem->host and
+ * 0 is returned. */
+static int set_xff_host(GLogItem *logitem, const char *str, const char *skips,
+                        int out) {
+  GStrView host = {logitem->host, 0};
+  char *tkn = NULL;
+
+  if (scan_xff_host(str, strlen(str), skips, out, &host, &logitem->type_ip,
+                    logitem->addr))
+    return 1;
+
+  if (!logitem->host) {
+    tkn = xmalloc(host.len + 1);
+    memcpy(tkn, host.ptr, host.len);
+    tkn[host.len] = '\0';
+    logitem->host = intern_token(tkn, &logitem->host_id);
+  }
+
+  return 0;
+}
+
+/* Extract the client IP from an X-Forwarded-For (XFF) field given an already
+ * extracted reject set and the format char that follows the braces.
  *
  * If no IP is found, 1 is returned.
  * On success, the malloc'd token is assigned to a GLogItem->host and 0 is
  * returned. */
-static int find_xff_host(GLogItem *logitem, const char **str, const char **p) {
-  char *skips = NULL, *extract = NULL;
+static int find_xff_host_delim(GLogItem *logitem, const char **str,
+                               const char *skips, char delim) {
+  char *extract = NULL;
   char pch[2] = {0};
   int res = 0;
 
-  if (!(skips = extract_braces(p)))
-    return spec_err(logitem, ERR_SPEC_SFMT_MIS, **p, "{}");
-
   /* if the log format current char is not within the braces special chars, then
    * we assume the range of IPs are within hard delimiters */
-  if (!strchr(skips, **p) && strchr(*str, **p)) {
-    *pch = **p;
+  if (!strchr(skips, delim) && strchr(*str, delim)) {
+    *pch = delim;
     *(pch + 1) = '\0';
     if (!(extract = parse_string(&(*str), pch, 1)))
-      goto clean;
+      return 0;
 
     res = set_xff_host(logitem, extract, skips, 1);
-    free(extract);
+    xfree(extract);
     (*str)++; /* move a char forward from the trailing delim */
   } else {
     res = set_xff_host(logitem, *str, skips, 0);
   }
 
-clean:
-  free(skips);
+  return res;
+}
+
+/* Attempt to find possible delimiters in the X-Forwarded-For (XFF) field.
+ *
+ * If no IP is found, 1 is returned.
+ * On success, the malloc'd token is assigned to a GLogItem->host and 0 is
+ * returned. */
+static int find_xff_host(GLogItem *logitem, const char **str, const char **p) {
+  char *skips = NULL;
+  int res = 0;
+
+  if (!(skips = extract_braces(p)))
+    return spec_err(logitem, ERR_SPEC_SFMT_MIS, **p, "{}");
+
+  res = find_xff_host_delim(logitem, str, skips, **p);
+  xfree(skips);
 
   return res;
 }
@@ -2195,6 +4650,24 @@ static int special_specifier(GLogItem *logitem, const char **str,
   return 0;
 }
 
+#if defined(HAVE_PARSE_STATS)
+/* Timed special_specifier(), see end_parse_stat() */
+static int special_specifier_stat(GLogItem *logitem, const char **str,
+                                  const char **p) {
+  GParseStatMark mark;
+  const char *start = *str;
+  char spec = **p;
+  int ret;
+
+  begin_parse_stat(&mark);
+  ret = special_specifier(logitem, str, p);
+  end_parse_stat(&mark, PARSE_STAT_SPECIAL, spec, *str - start);
+
+  return ret;
+}
+#define special_specifier special_specifier_stat
+#endif
+
 /* Iterate over the given log format.
  *
  * On error, or unable to parse it, 1 is returned.
@@ -2252,37 +4725,273 @@ static int parse_format(GLogItem *logitem, const char *str, const char *lfmt) {
   return 0;
 }
 
-/* Determine if the log string is valid and if it's not a comment.
+/* Append a new operation to the given compiled log format.
  *
- * On error, or invalid, 1 is returned.
- * On success, or valid line, 0 is returned. */
-static int valid_line(char *line) {
-  /* invalid line */
-  if ((line == NULL) || (*line == '\0'))
-    return 1;
-  /* ignore comments */
-  if (*line == '#' || *line == '\n')
-    return 1;
+ * On success, a pointer to the zeroed operation is returned. */
+static GLogFmtOp *new_log_format_op(GLogFmtProg *prog, GLogFmtOpType type) {
+  GLogFmtOp *op = NULL;
 
-  return 0;
+  prog->ops = xrealloc(prog->ops, (prog->size + 1) * sizeof(GLogFmtOp));
+  op = &prog->ops[prog->size++];
+  memset(op, 0, sizeof *op);
+  op->type = type;
+
+  return op;
 }
 
-/* Ensure we have the following fields. */
-static int verify_missing_fields(GLogItem *logitem) {
-  /* must have the following fields */
-  if (logitem->host == NULL)
-    logitem->errstr = xstrdup("IPv4/6 is required.");
-  else if (logitem->date == NULL)
-    logitem->errstr = xstrdup("A valid date is required.");
-  else if (logitem->req == NULL)
-    logitem->errstr = xstrdup("A request is required.");
+/* Free all operations of a compiled log format. */
+static void free_log_format_prog(GLogFmtProg *prog) {
+  int i;
+
+  if (prog == NULL)
+    return;
 
-  return logitem->errstr != NULL;
+  for (i = 0; i < prog->size; i++)
+    free(prog->ops[i].skips);
+  free(prog->ops);
+  free(prog);
 }
 
-enum json_type {
-  JSON_ERROR = 1,
-  JSON_DONE,
+/* Compile the given log format into a flat array of operations.
+ *
+ * This walks the format exactly as parse_format() does, but since the
+ * %/~ state and delimiters only depend on the format, they are resolved
+ * once here instead of once per line.
+ *
+ * On success, the compiled log format is returned. */
+static GLogFmtProg *compile_log_format(const char *lfmt) {
+  GLogFmtProg *prog = xcalloc(1, sizeof(GLogFmtProg));
+  GLogFmtOp *op = NULL;
+  const char *p = NULL, *last = NULL;
+  char *skips = NULL;
+  int perc = 0, tilde = 0;
+
+  last = lfmt + strlen(lfmt);
+  for (p = lfmt; p < last; p++) {
+    if (*p == '%') {
+      perc++;
+      continue;
+    }
+    if (*p == '~' && perc == 0) {
+      tilde++;
+      continue;
+    }
+
+    if (tilde) {
+      if (*p != 'h')
+        new_log_format_op(prog, LFMT_OP_NOP);
+      else if (!(skips = extract_braces(&p)))
+        new_log_format_op(prog, LFMT_OP_FAIL);
+      else {
+        op = new_log_format_op(prog, LFMT_OP_XFF);
+        op->skips = skips;
+        op->end[0] = *p;
+      }
+      tilde = 0;
+    } else if (perc) {
+      op = new_log_format_op(prog, LFMT_OP_SPEC);
+      op->spec[0] = p[0];
+      op->spec[1] = p[1];
+      get_delim(op->end, p);
+      perc = 0;
+    } else if (prog->size && prog->ops[prog->size - 1].type == LFMT_OP_LITERAL) {
+      prog->ops[prog->size - 1].len++;
+    } else {
+      op = new_log_format_op(prog, LFMT_OP_LITERAL);
+      op->len = 1;
+    }
+  }
+
+  return prog;
+}
+
+/* Returned by the step_log_*() functions when the line goes on with the next
+ * log format operation */
+#define LFMT_NEXT INT_MIN
+
+/* Fail a log format operation, pointing the error at the token it started
+ * at.
+ *
+ * On success, the given error value is returned. */
+static int fail_log_format_op(GLogItem *logitem, int ret, const char *tok,
+                              const char *line) {
+  logitem->err.off = tok - line;
+  return ret;
+}
+
+/* Check the log string still has something to parse before an operation
+ * other than a literal.
+ *
+ * If the log string ends here, 0 or an error value is returned.
+ * Otherwise, LFMT_NEXT is returned. */
+static inline int step_log_op(GLogItem *logitem, const char *str,
+                              const char *line) {
+  if (*str == '\0')
+    return fail_log_format_op(
+        logitem, spec_err(logitem, ERR_SPEC_LINE_INV, '-', NULL), str, line);
+  if (*str == '\n')
+    return 0;
+
+  return LFMT_NEXT;
+}
+
+/* Skip the `len` chars of a LFMT_OP_LITERAL operation.
+ *
+ * If the log string ends within them, 0 or an error value is returned.
+ * Otherwise, LFMT_NEXT is returned. */
+static inline int step_log_literal(GLogItem *logitem, const char **str,
+                                   const char *line, int len) {
+  const char *s = *str;
+  int n;
+
+  for (n = 0; n < len; n++, s++) {
+    if (*s == '\0')
+      return fail_log_format_op(
+          logitem, spec_err(logitem, ERR_SPEC_LINE_INV, '-', NULL), *str,
+          line);
+    if (*s == '\n')
+      return 0;
+  }
+  *str = s;
+
+  return LFMT_NEXT;
+}
+
+/* Parse the token of a LFMT_OP_SPEC operation.
+ *
+ * If the log string ends here, 0 or an error value is returned.
+ * Otherwise, LFMT_NEXT is returned. */
+static inline int step_log_spec(GLogItem *logitem, const char **str,
+                                const char *line, const char *spec,
+                                const char *end) {
+  const char *tok = *str;
+  int ret = 0;
+
+  if ((ret = step_log_op(logitem, tok, line)) != LFMT_NEXT)
+    return ret;
+  if ((ret = parse_specifier(logitem, str, spec, end)))
+    return fail_log_format_op(logitem, ret, tok, line);
+
+  return LFMT_NEXT;
+}
+
+/* Execute the given compiled log format against a log string.
+ *
+ * On error, or unable to parse it, 1 is returned.
+ * On success, the malloc'd token is assigned to a GLogItem member and
+ * 0 is returned. */
+static int parse_format_prog(GLogItem *logitem, const char *str,
+                             const GLogFmtProg *prog) {
+  const GLogFmtOp *op = NULL;
+  const char *line = str, *tok = str;
+  int i, ret = 0;
+
+  if (str == NULL || *str == '\0')
+    return 1;
+
+  for (i = 0; i < prog->size; i++) {
+    op = &prog->ops[i];
+    tok = str;
+
+    switch (op->type) {
+    case LFMT_OP_LITERAL:
+      ret = step_log_literal(logitem, &str, line, op->len);
+      break;
+    case LFMT_OP_SPEC:
+      ret = step_log_spec(logitem, &str, line, op->spec, op->end);
+      break;
+    case LFMT_OP_XFF:
+      if ((ret = step_log_op(logitem, str, line)) == LFMT_NEXT &&
+          find_xff_host_delim(logitem, &str, op->skips, op->end[0]))
+        ret = fail_log_format_op(
+            logitem, spec_err(logitem, ERR_SPEC_TOKN_NUL, 'h', NULL), tok,
+            line);
+      break;
+    case LFMT_OP_FAIL:
+      if ((ret = step_log_op(logitem, str, line)) == LFMT_NEXT)
+        ret = fail_log_format_op(
+            logitem, spec_err(logitem, ERR_SPEC_TOKN_NUL, 'h', NULL), tok,
+            line);
+      break;
+    default:
+      ret = step_log_op(logitem, str, line);
+      break;
+    }
+
+    if (ret != LFMT_NEXT)
+      return ret;
+  }
+
+  return 0;
+}
+
+static GJsonFmtProg *compile_json_log_format(const char *lfmt);
+static void free_json_log_format_prog(GJsonFmtProg *prog);
+static GLogFmtFn find_preset_parser(const char *lfmt,
+                                    const GLogFmtProg *prog);
+
+/* Compile the parser's log format so parse_line() doesn't have to walk it on
+ * every line. JSON formats are compiled into a table of key paths, each
+ * holding the compiled format of its value, while preset formats get their
+ * specialized parser, if any. */
+static void set_log_format_prog(GLogParser *parser) {
+  free_log_format_prog(parser->log_format_prog);
+  parser->log_format_prog = NULL;
+  free_json_log_format_prog(parser->json_format_prog);
+  parser->json_format_prog = NULL;
+  parser->log_format_fn = NULL;
+
+  if (parser->log_format && parser->is_json_log_format) {
+    parser->json_format_prog = compile_json_log_format(parser->log_format);
+  } else if (parser->log_format) {
+    parser->log_format_prog = compile_log_format(parser->log_format);
+    parser->log_format_fn = find_preset_parser(parser->log_format,
+                                               parser->log_format_prog);
+  }
+}
+
+/* Determine if the log string is valid and if it's not a comment.
+ *
+ * On error, or invalid, 1 is returned.
+ * On success, or valid line, 0 is returned. */
+static int valid_line(const char *line) {
+  /* invalid line */
+  if ((line == NULL) || (*line == '\0'))
+    return 1;
+  /* ignore comments */
+  if (*line == '#' || *line == '\n')
+    return 1;
+
+  return 0;
+}
+
+char *log_err_str(const GLogErr *err);
+
+/* Ensure we have the following fields.
+ *
+ * If any is missing, the error is assigned to the log structure and 1 is
+ * returned.
+ * On success, 0 is returned. */
+static int verify_missing_fields(GLogItem *logitem) {
+  /* must have the following fields */
+  if (logitem->host == NULL)
+    logitem->err.code = ERR_MISS_HOST;
+  else if (logitem->date == NULL)
+    logitem->err.code = ERR_MISS_DATE;
+  else if (logitem->req == NULL)
+    logitem->err.code = ERR_MISS_REQ;
+  else
+    return 0;
+
+  if (!conf.compact_errors)
+    logitem->errstr = log_err_str(&logitem->err);
+
+  return 1;
+}
+
+enum json_type {
+  JSON_ERROR = 1,
+  JSON_DONE,
   JSON_OBJECT,
   JSON_OBJECT_END,
   JSON_ARRAY,
@@ -3154,7 +5863,7 @@ static int parse_json_string(void *ptr_data, const char *str,
       ctx = json_get_context(&json, &level);
       if (ctx != JSON_ARRAY)
         dec_json_key(key, 0);
-      free(val);
+      xfree(val);
       val = NULL;
       break;
     case JSON_FALSE:
@@ -3164,7 +5873,7 @@ static int parse_json_string(void *ptr_data, const char *str,
       ctx = json_get_context(&json, &level);
       if (ctx != JSON_ARRAY)
         dec_json_key(key, 0);
-      free(val);
+      xfree(val);
       val = NULL;
       break;
     case JSON_NULL:
@@ -3174,7 +5883,7 @@ static int parse_json_string(void *ptr_data, const char *str,
       ctx = json_get_context(&json, &level);
       if (ctx != JSON_ARRAY)
         dec_json_key(key, 0);
-      free(val);
+      xfree(val);
       val = NULL;
       break;
     case JSON_STRING:
@@ -3198,7 +5907,7 @@ static int parse_json_string(void *ptr_data, const char *str,
         if (ctx != JSON_ARRAY)
           dec_json_key(key, has_dot);
 
-        free(val);
+        xfree(val);
         val = NULL;
       }
       break;
@@ -3212,8 +5921,8 @@ static int parse_json_string(void *ptr_data, const char *str,
   } while (t != JSON_DONE && t != JSON_ERROR);
 
 clean:
-  free(val);
-  free(key);
+  xfree(val);
+  xfree(key);
   json_close(&json);
 
   return ret;
@@ -3235,7 +5944,7 @@ static int parse_json_specifier(void *ptr_data, char *key, char *str) {
     return 0;
 
   ret = parse_format(logitem, str, spec);
-  free(spec);
+  xfree(spec);
 
   return ret;
 }
@@ -3244,829 +5953,4538 @@ static int parse_json_format(GLogItem *logitem, char *str) {
   return parse_json_string(logitem, str, parse_json_specifier);
 }
 
-static int cleanup_logitem(int ret, GLogItem *logitem) {
-  free_glog(logitem);
+#if defined(HAVE_PARSE_STATS)
+/* Timed parse_json_format(), see end_parse_stat() */
+static int parse_json_format_stat(GLogItem *logitem, char *str) {
+  GParseStatMark mark;
+  size_t len = strlen(str);
+  int ret;
+
+  begin_parse_stat(&mark);
+  ret = parse_json_format(logitem, str);
+  end_parse_stat(&mark, PARSE_STAT_JSON_LINE, 0, len);
+
   return ret;
 }
+#define parse_json_format parse_json_format_stat
+#endif
 
-/* Process a line from the log and store it accordingly taking into
- * account multiple parsing options prior to setting data into the
- * corresponding data structure.
- *
- * On error, logitem->errstr will contains the error message. */
-static int parse_line(char *line, GLogItem **logitem_out) {
-  char *fmt = conf.log_format;
-  int ret = 0;
-  GLogItem *logitem = NULL;
-
-  /* soft ignore these lines */
-  if (valid_line(line))
-    return -1;
+/* Hash the given bytes (FNV-1a), e.g., a JSON key path. */
+static uint32_t fnv1a_hash(const char *key, size_t len) {
+  uint32_t h = 2166136261u;
+  size_t i;
 
-  logitem = init_log_item();
+  for (i = 0; i < len; i++) {
+    h ^= (unsigned char)key[i];
+    h *= 16777619u;
+  }
+  return h;
+}
 
-  /* Parse a line of log, and fill structure with appropriate values */
-  if (conf.is_json_log_format)
-    ret = parse_json_format(logitem, line);
-  else
-    ret = parse_format(logitem, line, fmt);
+/* Get the log item fields the given compiled log format may set.
+ *
+ * On success, the GLogField values are returned. */
+static uint32_t get_log_format_fields(const GLogFmtProg *prog) {
+  uint32_t fields = 0;
+  int i;
 
-  /* invalid log line (format issue) */
-  if (ret) {
-    // process_invalid (glog, logitem, line);
-    return cleanup_logitem(ret, logitem);
+  for (i = 0; i < prog->size; i++) {
+    if (prog->ops[i].type == LFMT_OP_SPEC)
+      fields |= get_spec_field(prog->ops[i].spec[0]);
+    else if (prog->ops[i].type == LFMT_OP_XFF)
+      fields |= LOG_FIELD_HOST;
   }
+  return fields;
+}
 
-  // if (!glog->piping && conf.fname_as_vhost && glog->fname_as_vhost)
-  //   logitem->vhost = xstrdup (glog->fname_as_vhost);
+/* Insert a JSON key path and its log format into the compiled table being
+ * built, see compile_json_log_format(). As in ht_insert_json_logfmt(), a
+ * repeated key replaces the previous format.
+ *
+ * On success, 0 is returned. */
+static int insert_json_format_key(void *ptr_data, char *key, char *spec) {
+  GJsonFmtProg *prog = ptr_data;
+  GJsonKeyFmt *k = NULL;
+  size_t len = strlen(key);
+  int i;
 
-  /* valid format but missing fields */
-  if (ret || (ret = verify_missing_fields(logitem))) {
-    return cleanup_logitem(ret, logitem);
+  for (i = 0; i < prog->size; i++) {
+    if (prog->keys[i].len == len && memcmp(prog->keys[i].key, key, len) == 0) {
+      free_log_format_prog(prog->keys[i].prog);
+      prog->keys[i].prog = compile_log_format(spec);
+      prog->keys[i].fields = get_log_format_fields(prog->keys[i].prog);
+      return 0;
+    }
   }
 
-  /* agent will be null in cases where %u is not specified */
-  if (logitem->agent == NULL) {
-    logitem->agent = alloc_string("-");
-    // set_agent_hash(logitem);
-  }
+  prog->keys = xrealloc(prog->keys, (prog->size + 1) * sizeof(GJsonKeyFmt));
+  k = &prog->keys[prog->size++];
+  k->key = xstrdup(key);
+  k->len = len;
+  k->hash = fnv1a_hash(key, len);
+  k->prog = compile_log_format(spec);
+  k->fields = get_log_format_fields(k->prog);
 
-  *logitem_out = logitem;
+  return 0;
+}
 
-  return ret;
+/* Free all key paths of a compiled JSON log format. */
+static void free_json_log_format_prog(GJsonFmtProg *prog) {
+  int i;
+
+  if (prog == NULL)
+    return;
+
+  for (i = 0; i < prog->size; i++) {
+    free(prog->keys[i].key);
+    free_log_format_prog(prog->keys[i].prog);
+  }
+  free(prog->keys);
+  free(prog->slots);
+  free(prog);
 }
 
-/* Determine if the log/date/time were set, otherwise exit the program
- * execution. */
-static const char *verify_formats(void) {
-  if (conf.time_format == NULL || *conf.time_format == '\0')
-    return ERR_FORMAT_NO_TIME_FMT;
+/* Compile the given JSON log format into a table of key paths, so a line
+ * can be matched against it without going through ht_get_json_logfmt().
+ *
+ * On error, NULL is returned.
+ * On success, the compiled JSON log format is returned. */
+static GJsonFmtProg *compile_json_log_format(const char *lfmt) {
+  GJsonFmtProg *prog = xcalloc(1, sizeof(GJsonFmtProg));
+  uint32_t nslots = 8, i, j;
+  int n;
+
+  if (parse_json_string(prog, lfmt, insert_json_format_key) != 0) {
+    free_json_log_format_prog(prog);
+    return NULL;
+  }
 
-  if (conf.date_format == NULL || *conf.date_format == '\0')
-    return ERR_FORMAT_NO_DATE_FMT;
+  /* keep the table at most half full */
+  while (nslots < (uint32_t)prog->size * 2)
+    nslots <<= 1;
+  prog->mask = nslots - 1;
+  prog->slots = xmalloc(nslots * sizeof(int32_t));
+  for (i = 0; i < nslots; i++)
+    prog->slots[i] = -1;
+
+  for (n = 0; n < prog->size; n++) {
+    for (j = prog->keys[n].hash & prog->mask; prog->slots[j] != -1;
+         j = (j + 1) & prog->mask)
+      ;
+    prog->slots[j] = n;
+  }
 
-  if (conf.log_format == NULL || *conf.log_format == '\0')
-    return ERR_FORMAT_NO_LOG_FMT;
+  return prog;
+}
 
+/* Find the given JSON key path within the compiled JSON log format.
+ *
+ * If not found, NULL is returned.
+ * On success, the key path entry is returned. */
+static const GJsonKeyFmt *find_json_format_key(const GJsonFmtProg *prog,
+                                               const char *key, size_t len) {
+  const GJsonKeyFmt *k = NULL;
+  uint32_t hash = fnv1a_hash(key, len), j;
+
+  for (j = hash & prog->mask; prog->slots[j] != -1; j = (j + 1) & prog->mask) {
+    k = &prog->keys[prog->slots[j]];
+    if (k->hash == hash && k->len == len && memcmp(k->key, key, len) == 0)
+      return k;
+  }
   return NULL;
 }
 
-/* predefined log times */
-typedef struct GPreConfTime_ {
-  const char *fmt24;
-  const char *usec;
-  const char *sec;
-} GPreConfTime;
+/* Match the given JSON value against the compiled log format of the
+ * current key path. The value is parsed straight from the JSON buffer.
+ *
+ * On error, a non-zero value is returned.
+ * On success, or if the key path has no wanted format, 0 is returned. */
+static int parse_json_value_prog(GLogItem *logitem, const GJsonFmtProg *prog,
+                                 const char *key, size_t keylen,
+                                 const char *val) {
+  const GJsonKeyFmt *k = NULL;
+
+  /* key path too long to match any format, or empty JSON value */
+  if (keylen >= JSON_KEY_LEN || *val == '\0')
+    return 0;
+  if (!(k = find_json_format_key(prog, key, keylen)) || !wants_fields(k->fields))
+    return 0;
 
-/* predefined log dates */
-typedef struct GPreConfDate_ {
-  const char *apache;
-  const char *w3c;
-  const char *usec;
-  const char *sec;
-} GPreConfDate;
+  return parse_format_prog(logitem, val, k->prog);
+}
 
-/* predefined log formats */
-typedef struct GPreConfLog_ {
-  const char *combined;
-  const char *vcombined;
-  const char *common;
-  const char *vcommon;
-  const char *w3c;
-  const char *cloudfront;
-  const char *cloudstorage;
-  const char *awselb;
-  const char *squid;
-  const char *awss3;
-  const char *caddy;
-  const char *awsalb;
-  const char *traefikclf;
-} GPreConfLog;
+static void json_walk_init(GJsonWalk *walk, GLogItem *logitem,
+                           const GJsonFmtProg *prog) {
+  walk->logitem = logitem;
+  walk->prog = prog;
+  walk->key[0] = '\0';
+  walk->keylen = walk->nkeys = walk->depth = 0;
+  walk->pending = walk->in_object = 0;
+}
 
-static const GPreConfLog logs = {
-    "%h %^[%d:%t %^] \"%r\" %s %b \"%R\" \"%u\"",       /* NCSA */
-    "%v:%^ %h %^[%d:%t %^] \"%r\" %s %b \"%R\" \"%u\"", /* NCSA + VHost
-                                                         */
-    "%h %^[%d:%t %^] \"%r\" %s %b",                     /* CLF */
-    "%v:%^ %h %^[%d:%t %^] \"%r\" %s %b",               /* CLF+VHost */
-    "%d %t %^ %m %U %q %^ %^ %h %u %R %s %^ %^ %L",     /* W3C */
-    "%d\\t%t\\t%^\\t%b\\t%h\\t%m\\t%v\\t%U\\t%s\\t%R\\t%u\\t%q\\t%^\\t%"
-    "C\\t%^"
-    "\\t%^\\t%^\\t%^\\t%T\\t%^\\t%K\\t%k\\t%^\\t%H\\t%^", /* CloudFront
-                                                           */
-    "\"%x\",\"%h\",%^,%^,\"%m\",\"%U\",\"%s\",%^,\"%b\",\"%D\",%^,\"%"
-    "R\",\"%"
-    "u\"", /* Cloud Storage */
-    "%^ %dT%t.%^ %^ %h:%^ %^ %^ %T %^ %s %^ %^ %b \"%r\" \"%u\" %k %K "
-    "%^ "
-    "\"%^\" \"%v\"", /* AWS Elastic Load Balancing */
-    "%^ %^ %^ %v %^: %x.%^ %~%L %h %^/%s %b %m %U", /* Squid Native */
-    "%^ %v [%d:%t %^] %h %^\"%r\" %s %^ %b %^ %L %^ \"%R\" \"%u\"", /* Amazon
-                                                                     * S3
-                                                                     */
+/* Enter an object or an array.
+ *
+ * On error, i.e., nested too deep, -1 is returned.
+ * On success, 0 is returned. */
+static int json_walk_open(GJsonWalk *walk, enum json_type t) {
+  if (walk->depth == JSON_MAX_DEPTH)
+    return -1;
+  walk->in_object |= t == JSON_OBJECT;
+  walk->keyed[walk->depth++] = walk->pending;
+  walk->pending = 0;
 
-    /* Caddy JSON */
-    "{ \"ts\": \"%x.%^\", \"request\": { \"client_ip\": \"%h\", "
-    "\"proto\":"
-    "\"%H\", \"method\": \"%m\", \"host\": \"%v\", \"uri\": \"%U\", "
-    "\"headers\": {"
-    "\"User-Agent\": [\"%u\"], \"Referer\": [\"%R\"] }, \"tls\": { "
-    "\"cipher_suite\":"
-    "\"%k\", \"proto\": \"%K\" } }, \"duration\": \"%T\", \"size\": "
-    "\"%b\","
-    "\"status\": \"%s\", \"resp_headers\": { \"Content-Type\": "
-    "[\"%M\"] } }",
+  return 0;
+}
 
-    "%^ %dT%t.%^ %v %h:%^ %^ %^ %T %^ %s %^ %^ %b \"%r\" \"%u\" %k %K "
-    "%^", /* Amazon
-             ALB
-           */
+/* Leave the innermost object or array. */
+static void json_walk_close(GJsonWalk *walk) {
+  if (walk->depth && walk->keyed[--walk->depth])
+    walk->keylen = walk->keylens[--walk->nkeys];
+}
 
-    "%h - %e [%d:%t %^] \"%r\" %s %b \"%R\" \"%u\" %^ \"%v\" \"%U\" "
-    "%Lms" /* Traefik's
-              CLF
-              flavor
-              with
-              header
-            */
-};
+/* Append the given member name to the key path.
+ *
+ * On error, i.e., nested too deep, -1 is returned.
+ * On success, 0 is returned. */
+static int json_walk_key(GJsonWalk *walk, const char *name) {
+  size_t len = strlen(name);
 
-static const GPreConfTime times = {
-    "%H:%M:%S", "%f", /* Cloud Storage (usec) */
-    "%s",             /* Squid (sec) */
-};
+  if (walk->nkeys == JSON_MAX_DEPTH)
+    return -1;
+  walk->keylens[walk->nkeys++] = walk->keylen;
+  if (walk->keylen != 0 && walk->keylen + 1 < JSON_KEY_LEN)
+    walk->key[walk->keylen++] = '.';
+  else if (walk->keylen != 0)
+    walk->keylen++;
+  if (walk->keylen + len < JSON_KEY_LEN)
+    memcpy(walk->key + walk->keylen, name, len);
+  walk->keylen += len;
+  walk->pending = 1;
 
-static const GPreConfDate dates = {
-    "%d/%b/%Y", /* Apache */
-    "%Y-%m-%d", /* W3C */
-    "%f",       /* Cloud Storage (usec) */
-    "%s",       /* Squid (sec) */
-};
+  return 0;
+}
 
-/* Iterate over the given format and clean unwanted chars and keep all
- * date/time specifiers such as %b%Y%d%M%S.
+/* Match a scalar value against the format of the current key path.
  *
- * On error NULL is returned.
- * On success, a clean format containing only date/time specifiers is
- * returned. */
-static char *clean_date_time_format(const char *format) {
-  char *fmt = NULL, *pr = NULL, *pw = NULL;
-  int special = 0;
-
-  if (format == NULL || *format == '\0')
-    return NULL;
+ * On error, a non-zero value is returned.
+ * On success, 0 is returned. */
+static int json_walk_value(GJsonWalk *walk, const char *val) {
+  int ret = 0;
 
-  fmt = xstrdup(format);
-  pr = fmt;
-  pw = fmt;
-  while (*pr) {
-    *pw = *pr++;
-    if (*pw == '%' || special) {
-      special = !special;
-      pw++;
-    }
+  /* values outside of an object have no key path */
+  if (walk->in_object &&
+      (ret = parse_json_value_prog(walk->logitem, walk->prog, walk->key,
+                                   walk->keylen, val)))
+    return ret;
+  /* array values keep their key path */
+  if (walk->pending) {
+    walk->keylen = walk->keylens[--walk->nkeys];
+    walk->pending = 0;
   }
-  *pw = '\0';
 
-  return fmt;
+  return 0;
 }
 
-/* A wrapper to extract date specifiers from a date format.
+/* Parse a JSON log line against the compiled JSON log format, same as
+ * parse_json_format(). The dotted key path is kept in a fixed buffer and
+ * values are matched without being copied, while the JSON stream itself
+ * allocates through xmalloc() so it comes from the active arena, if any.
  *
- * On error NULL is returned.
- * On success, a clean format containing only date specifiers is
- * returned. */
-static char *set_format_date(void) {
-  char *fdate = NULL;
+ * On error, a non-zero value is returned.
+ * On success, 0 is returned. */
+static int parse_json_prog(GLogItem *logitem, const char *str,
+                           const GJsonFmtProg *prog) {
+  enum json_type ctx = JSON_ERROR, t = JSON_ERROR;
+  const char *val = NULL;
+  size_t level = 0;
+  int ret = 0;
+  GJsonWalk walk;
+  json_stream json;
 
-  if (has_timestamp(conf.date_format))
-    fdate = xstrdup("%Y%m%d");
-  else
-    fdate = clean_date_time_format(conf.date_format);
+  json_walk_init(&walk, logitem, prog);
+  json_open_string(&json, str);
+  json.alloc.malloc = xmalloc;
+  json.alloc.realloc = xrealloc;
+  json.alloc.free = xfree;
 
-  return fdate;
-}
+  do {
+    t = json_next(&json);
+    val = NULL;
 
-/* Determine if the given specifier character is an abbreviated type
- * of date.
- *
- * If it is, 1 is returned, otherwise, 0 is returned. */
-static int is_date_abbreviated(const char *fdate) {
-  if (strpbrk(fdate, "cDF"))
-    return 1;
+    switch (t) {
+    case JSON_OBJECT:
+    case JSON_ARRAY:
+      if ((ret = json_walk_open(&walk, t)))
+        goto clean;
+      break;
+    case JSON_ARRAY_END:
+    case JSON_OBJECT_END:
+      json_walk_close(&walk);
+      break;
+    case JSON_TRUE:
+      val = "true";
+      break;
+    case JSON_FALSE:
+      val = "false";
+      break;
+    case JSON_NULL:
+      val = "-";
+      break;
+    case JSON_STRING:
+    case JSON_NUMBER:
+      ctx = json_get_context(&json, &level);
+      /* key */
+      if ((level % 2) != 0 && ctx != JSON_ARRAY) {
+        if ((ret = json_walk_key(&walk, json_get_string(&json, NULL))))
+          goto clean;
+      }
+      /* val */
+      else {
+        val = json_get_string(&json, NULL);
+      }
+      break;
+    case JSON_ERROR:
+      ret = -1;
+      goto clean;
+    default:
+      break;
+    }
 
-  return 0;
+    if (val != NULL && (ret = json_walk_value(&walk, val)))
+      goto clean;
+  } while (t != JSON_DONE && t != JSON_ERROR);
+
+clean:
+  json_close(&json);
+
+  return ret;
 }
 
-/* Normalize the date format from the date format given by the user to
- * Ymd so it can be sorted out properly afterwards.
- *
- * On error or unable to determine the format, 1 is returned.
- * On success, the numeric date format as Ymd is set and 0 is
- * returned. */
-static int set_date_num_format(void) {
-  char *fdate = NULL, *buf = NULL;
-  int buflen = 0, flen = 0;
+/* Bit masks of a 64-byte block of a JSON line, bit i being byte i */
+typedef struct GJsonBlock_ {
+  uint64_t quote;  /* '"' */
+  uint64_t bslash; /* '\' */
+  uint64_t op;     /* {}[]:, */
+  uint64_t ctrl;   /* control chars, below 0x20 */
+  uint64_t high;   /* non-ASCII */
+} GJsonBlock;
 
-  fdate = set_format_date();
-  if (!fdate)
-    return 1;
+#if !defined(__SSE2__) && !defined(__aarch64__)
+static void json_block_scalar(const unsigned char *p, GJsonBlock *blk) {
+  uint64_t bit = 0;
+  int i;
 
-  if (is_date_abbreviated(fdate)) {
-    free(fdate);
-    conf.date_num_format = xstrdup("%Y%m%d");
-    return 0;
+  memset(blk, 0, sizeof(*blk));
+  for (i = 0; i < 64; i++) {
+    bit = 1ULL << i;
+    switch (p[i]) {
+    case '"':
+      blk->quote |= bit;
+      break;
+    case '\\':
+      blk->bslash |= bit;
+      break;
+    case '{':
+    case '}':
+    case '[':
+    case ']':
+    case ':':
+    case ',':
+      blk->op |= bit;
+      break;
+    default:
+      if (p[i] < 0x20)
+        blk->ctrl |= bit;
+      else if (p[i] >= 0x80)
+        blk->high |= bit;
+    }
   }
+}
+#endif
 
-  flen = strlen(fdate) + 1;
-  flen = MAX(MIN_DATENUM_FMT_LEN, flen); /* at least %Y%m%d + 1 */
-  buf = xcalloc(flen, sizeof(char));
+#if defined(__SSE2__)
+static void json_block_sse2(const unsigned char *p, GJsonBlock *blk) {
+  const __m128i vq = _mm_set1_epi8('"'), vb = _mm_set1_epi8('\\');
+  const __m128i vcol = _mm_set1_epi8(':'), vcom = _mm_set1_epi8(',');
+  /* {} and [] only differ from each other by bit 0x20 */
+  const __m128i vlow = _mm_set1_epi8(0x20), vob = _mm_set1_epi8('{');
+  const __m128i vcb = _mm_set1_epi8('}'), vctrl = _mm_set1_epi8(0x1f);
+  __m128i v, vl, op;
+  int i;
 
-  /* always add a %Y */
-  buflen += snprintf(buf + buflen, flen - buflen, "%%Y");
-  if (strpbrk(fdate, "hbmBf*"))
-    buflen += snprintf(buf + buflen, flen - buflen, "%%m");
-  if (strpbrk(fdate, "def*"))
-    buflen += snprintf(buf + buflen, flen - buflen, "%%d");
+  memset(blk, 0, sizeof(*blk));
+  for (i = 0; i < 4; i++) {
+    v = _mm_loadu_si128((const __m128i *)(p + i * 16));
+    vl = _mm_or_si128(v, vlow);
+    blk->quote |= (uint64_t)(unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, vq))
+                  << (i * 16);
+    blk->bslash |= (uint64_t)(unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, vb))
+                   << (i * 16);
+    op = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(vl, vob), _mm_cmpeq_epi8(vl, vcb)),
+        _mm_or_si128(_mm_cmpeq_epi8(v, vcol), _mm_cmpeq_epi8(v, vcom)));
+    blk->op |= (uint64_t)(unsigned)_mm_movemask_epi8(op) << (i * 16);
+    blk->ctrl |= (uint64_t)(unsigned)_mm_movemask_epi8(
+                     _mm_cmpeq_epi8(_mm_max_epu8(v, vctrl), vctrl))
+                 << (i * 16);
+    blk->high |= (uint64_t)(unsigned)_mm_movemask_epi8(v) << (i * 16);
+  }
+}
+#endif
 
-  conf.date_num_format = buf;
-  free(fdate);
+#if defined(__aarch64__)
+/* Gather the top bit of each byte of 4 compare results into a 64-bit mask. */
+static inline uint64_t neon_bitmask64(uint8x16_t a, uint8x16_t b, uint8x16_t c,
+                                      uint8x16_t d) {
+  const uint8x16_t bits = {0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80,
+                           0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80};
+  uint8x16_t sum = vpaddq_u8(vpaddq_u8(vandq_u8(a, bits), vandq_u8(b, bits)),
+                             vpaddq_u8(vandq_u8(c, bits), vandq_u8(d, bits)));
 
-  return buflen == 0 ? 1 : 0;
+  sum = vpaddq_u8(sum, sum);
+  return vgetq_lane_u64(vreinterpretq_u64_u8(sum), 0);
 }
 
-/* Get the enumerated value given a string.
- *
- * On error, -1 is returned.
- * On success, the enumerated module value is returned. */
-static int str2enum(const GEnum map[], int len, const char *str) {
+static void json_block_neon(const unsigned char *p, GJsonBlock *blk) {
+  const uint8x16_t vq = vdupq_n_u8('"'), vb = vdupq_n_u8('\\');
+  const uint8x16_t vcol = vdupq_n_u8(':'), vcom = vdupq_n_u8(',');
+  /* {} and [] only differ from each other by bit 0x20 */
+  const uint8x16_t vlow = vdupq_n_u8(0x20), vob = vdupq_n_u8('{');
+  const uint8x16_t vcb = vdupq_n_u8('}'), vhigh = vdupq_n_u8(0x80);
+  uint8x16_t v[4], q[4], b[4], o[4], c[4], h[4], vl;
   int i;
 
-  for (i = 0; i < len; ++i) {
-    if (!strcmp(str, map[i].str))
-      return map[i].idx;
+  for (i = 0; i < 4; i++) {
+    v[i] = vld1q_u8(p + i * 16);
+    vl = vorrq_u8(v[i], vlow);
+    q[i] = vceqq_u8(v[i], vq);
+    b[i] = vceqq_u8(v[i], vb);
+    o[i] = vorrq_u8(vorrq_u8(vceqq_u8(vl, vob), vceqq_u8(vl, vcb)),
+                    vorrq_u8(vceqq_u8(v[i], vcol), vceqq_u8(v[i], vcom)));
+    c[i] = vcltq_u8(v[i], vlow);
+    h[i] = vcgeq_u8(v[i], vhigh);
   }
+  blk->quote = neon_bitmask64(q[0], q[1], q[2], q[3]);
+  blk->bslash = neon_bitmask64(b[0], b[1], b[2], b[3]);
+  blk->op = neon_bitmask64(o[0], o[1], o[2], o[3]);
+  blk->ctrl = neon_bitmask64(c[0], c[1], c[2], c[3]);
+  blk->high = neon_bitmask64(h[0], h[1], h[2], h[3]);
+}
+#endif
+
+static void json_block(const unsigned char *p, GJsonBlock *blk) {
+#if defined(__SSE2__)
+  json_block_sse2(p, blk);
+#elif defined(__aarch64__)
+  json_block_neon(p, blk);
+#else
+  json_block_scalar(p, blk);
+#endif
+}
+
+/* Find the chars escaped by a backslash within a block, carrying over a
+ * backslash run that continues from the previous block. */
+static uint64_t json_escaped(uint64_t bslash, uint64_t *carry) {
+  const uint64_t even = 0x5555555555555555ULL;
+  uint64_t escaped = 0, follows = 0, odd_starts = 0, seq = 0;
+
+  if (bslash == 0) {
+    escaped = *carry;
+    *carry = 0;
+    return escaped;
+  }
+  /* a backslash escaped by the previous block escapes nothing */
+  bslash &= ~*carry;
+  follows = bslash << 1 | *carry;
+  /* runs starting on an odd bit */
+  odd_starts = bslash & ~even & ~follows;
+  *carry = __builtin_add_overflow(odd_starts, bslash, &seq);
+
+  return ((seq << 1) ^ even) & follows;
+}
+
+/* Set every bit from each set bit up to the next one, excluded. */
+static uint64_t prefix_xor(uint64_t x) {
+  x ^= x << 1;
+  x ^= x << 2;
+  x ^= x << 4;
+  x ^= x << 8;
+  x ^= x << 16;
+  x ^= x << 32;
+  return x;
+}
+
+/* Structural index of a JSON line: the offsets of each unescaped quote and
+ * of each {}[]:, outside of a string. Any unescaped control char within a
+ * string or invalid UTF-8 sets err, the offset of the first one, which the
+ * reader only fails on once it gets there, as the byte-wise reader does. */
+typedef struct GJsonIndex_ {
+  const char *str;
+  size_t len;
+  size_t err;
+  uint32_t pos[LINE_BUFFER]; /* offsets, in order */
+  size_t cnt;                /* num offsets */
+  size_t next;               /* next offset to read */
+  size_t off;                /* end of the last token read */
+  char buf[LINE_BUFFER];     /* the last unescaped string */
+} GJsonIndex;
+
+/* Validate the UTF-8 sequences starting at the given non-ASCII bytes of a
+ * block, up to the first invalid one.
+ *
+ * On error, the offset of the invalid sequence is returned.
+ * On success, the length of the line is returned. */
+static size_t index_json_utf8(GJsonIndex *idx, size_t base, uint64_t high,
+                              size_t *utf8_end) {
+  const unsigned char *s = (const unsigned char *)idx->str;
+  size_t at = 0;
+  int n = 0;
 
-  return -1;
-}
-
-typedef enum LOGTYPE {
-  COMBINED,
-  VCOMBINED,
-  COMMON,
-  VCOMMON,
-  W3C,
-  CLOUDFRONT,
-  CLOUDSTORAGE,
-  AWSELB,
-  SQUID,
-  AWSS3,
-  CADDY,
-  AWSALB,
-  TRAEFIKCLF,
-} GLogType;
+  for (; high; high &= high - 1) {
+    /* continuation bytes of an already valid sequence */
+    if ((at = base + __builtin_ctzll(high)) < *utf8_end)
+      continue;
+    n = utf8_seq_length(s[at]);
+    if (n == 0 || at + n > idx->len || !is_legal_utf8(s + at, n))
+      return at;
+    *utf8_end = at + n;
+  }
 
-static const GEnum LOGTYPE[] = {
-    {"COMBINED", COMBINED},
-    {"VCOMBINED", VCOMBINED},
-    {"COMMON", COMMON},
-    {"VCOMMON", VCOMMON},
-    {"W3C", W3C},
-    {"CLOUDFRONT", CLOUDFRONT},
-    {"CLOUDSTORAGE", CLOUDSTORAGE},
-    {"AWSELB", AWSELB},
-    {"SQUID", SQUID},
-    {"AWSS3", AWSS3},
-    {"CADDY", CADDY},
-    {"AWSALB", AWSALB},
-    {"TRAEFIKCLF", TRAEFIKCLF},
-};
+  return idx->len;
+}
 
-/* Get the enumerated log format given its equivalent format string.
- * The case in the format string does not matter.
+/* Build the structural index of the given JSON line of `len` bytes, one
+ * 64-byte block at a time.
  *
- * On error, -1 is returned.
- * On success, the enumerated format is returned. */
-static int get_log_format_item_enum(const char *str) {
-  int ret;
-  char *upstr;
+ * On error, i.e., the line is too long for the index, -1 is returned.
+ * On success, 0 is returned. */
+static int index_json(GJsonIndex *idx, const char *str, size_t len) {
+  unsigned char tail[64];
+  const unsigned char *p = NULL;
+  uint64_t carry = 0, in_str = 0, instr = 0, quote = 0, bits = 0, mask = 0;
+  size_t base = 0, utf8_end = 0, at = 0;
+  GJsonBlock blk;
+
+  if (len >= LINE_BUFFER)
+    return -1;
 
-  ret = str2enum(LOGTYPE, ARRAY_SIZE(LOGTYPE), str);
-  if (ret >= 0)
-    return ret;
+  idx->str = str;
+  idx->len = idx->err = len;
+  idx->cnt = idx->next = idx->off = 0;
+
+  for (base = 0; base < len; base += 64) {
+    mask = ~0ULL;
+    p = (const unsigned char *)str + base;
+    if (len - base < 64) {
+      memset(tail, 0, sizeof(tail));
+      memcpy(tail, p, len - base);
+      p = tail;
+      mask = (1ULL << (len - base)) - 1;
+    }
+    json_block(p, &blk);
+
+    quote = blk.quote & ~json_escaped(blk.bslash, &carry);
+    /* within a string, from its opening quote up to its closing one */
+    instr = prefix_xor(quote) ^ in_str;
+    in_str = 0 - (instr >> 63);
+
+    if (idx->err == len) {
+      if ((bits = blk.ctrl & instr & mask))
+        idx->err = base + __builtin_ctzll(bits);
+      if ((bits = blk.high & mask) &&
+          (at = index_json_utf8(idx, base, bits, &utf8_end)) < idx->err)
+        idx->err = at;
+    }
 
-  /* uppercase the input string and try again */
-  upstr = strtoupper(xstrdup(str));
-  ret = str2enum(LOGTYPE, ARRAY_SIZE(LOGTYPE), upstr);
-  free(upstr);
+    for (bits = ((blk.op & ~instr) | quote) & mask; bits; bits &= bits - 1)
+      idx->pos[idx->cnt++] = base + __builtin_ctzll(bits);
+  }
 
-  return ret;
+  return 0;
 }
 
-/* Determine if we have a valid JSON format */
-static int is_json_log_format(const char *fmt) {
-  enum json_type t = JSON_ERROR;
-  json_stream json;
+/* Skip whitespace up to the next structural char, if nothing else is in
+ * between.
+ *
+ * If there's anything else, or nothing left, 0 is returned.
+ * On success, the structural char is returned. */
+static int json_index_peek(GJsonIndex *idx) {
+  size_t end = idx->next < idx->cnt ? idx->pos[idx->next] : idx->len, i;
 
-  json_open_string(&json, fmt);
-  /* ensure we use strict JSON when determining if we're using a JSON format */
-  json_set_streaming(&json, false);
-  do {
-    t = json_next(&json);
-    switch (t) {
-    case JSON_ERROR:
-      json_close(&json);
+  for (i = idx->off; i < end; i++)
+    if (!json_isspace((unsigned char)idx->str[i]))
       return 0;
-    default:
-      break;
-    }
-  } while (t != JSON_DONE && t != JSON_ERROR);
-  json_close(&json);
 
-  return 1;
+  return end < idx->len ? idx->str[end] : 0;
 }
 
-/* Determine if some global flags were set through log-format. */
-static void contains_specifier(void) {
-  conf.serve_usecs = conf.bandwidth = 0; /* flag */
-  if (!conf.log_format)
-    return;
-
-  if (strstr(conf.log_format, "%b"))
-    conf.bandwidth = 1; /* flag */
-  if (strstr(conf.log_format, "%D"))
-    conf.serve_usecs = 1; /* flag */
-  if (strstr(conf.log_format, "%T"))
-    conf.serve_usecs = 1; /* flag */
-  if (strstr(conf.log_format, "%L"))
-    conf.serve_usecs = 1; /* flag */
+/* Consume the structural char returned by json_index_peek(). */
+static void json_index_skip(GJsonIndex *idx) {
+  idx->off = idx->pos[idx->next++] + 1;
 }
 
-/* Determine the selected log format from the config file or command line
- * option.
+/* Unescape the string starting at the quote returned by json_index_peek()
+ * into idx->buf, same as read_string().
  *
  * On error, NULL is returned.
- * On success, an allocated string containing the log format is returned. */
-static char *get_selected_format_str(size_t idx) {
-  char *fmt = NULL;
-  switch (idx) {
-  case COMBINED:
-    fmt = alloc_string(logs.combined);
-    break;
-  case VCOMBINED:
-    fmt = alloc_string(logs.vcombined);
-    break;
-  case COMMON:
-    fmt = alloc_string(logs.common);
-    break;
-  case VCOMMON:
-    fmt = alloc_string(logs.vcommon);
-    break;
-  case W3C:
-    fmt = alloc_string(logs.w3c);
-    break;
-  case CLOUDFRONT:
-    fmt = alloc_string(logs.cloudfront);
-    break;
-  case CLOUDSTORAGE:
-    fmt = alloc_string(logs.cloudstorage);
-    break;
-  case AWSELB:
-    fmt = alloc_string(logs.awselb);
-    break;
-  case SQUID:
-    fmt = alloc_string(logs.squid);
-    break;
-  case AWSS3:
-    fmt = alloc_string(logs.awss3);
-    break;
-  case CADDY:
-    fmt = alloc_string(logs.caddy);
-    break;
-  case AWSALB:
-    fmt = alloc_string(logs.awsalb);
-    break;
-  case TRAEFIKCLF:
-    fmt = alloc_string(logs.traefikclf);
-    break;
+ * On success, the NUL-terminated string is returned. */
+static const char *json_index_string(GJsonIndex *idx) {
+  const char *s = NULL, *end = NULL, *esc = NULL;
+  char *out = idx->buf;
+  long cp = 0, lo = 0;
+  int i, hc;
+
+  if (idx->next + 1 >= idx->cnt)
+    return NULL;
+  s = idx->str + idx->pos[idx->next] + 1;
+  end = idx->str + idx->pos[idx->next + 1];
+  if ((size_t)(end - idx->str) >= idx->err)
+    return NULL;
+  idx->next += 2;
+  idx->off = end - idx->str + 1;
+
+  while ((esc = memchr(s, '\\', end - s))) {
+    memcpy(out, s, esc - s);
+    out += esc - s;
+    s = esc + 1;
+    switch (s < end ? *s++ : '\0') {
+    case '"':
+      *out++ = '"';
+      break;
+    case '\\':
+      *out++ = '\\';
+      break;
+    case '/':
+      *out++ = '/';
+      break;
+    case 'b':
+      *out++ = '\b';
+      break;
+    case 'f':
+      *out++ = '\f';
+      break;
+    case 'n':
+      *out++ = '\n';
+      break;
+    case 'r':
+      *out++ = '\r';
+      break;
+    case 't':
+      *out++ = '\t';
+      break;
+    case 'u':
+      for (cp = 0, i = 0; i < 4; i++) {
+        if (s >= end || (hc = hexchar(*s++)) == -1)
+          return NULL;
+        cp = cp << 4 | hc;
+      }
+      /* dangling low surrogate */
+      if (cp >= 0xdc00 && cp <= 0xdfff)
+        return NULL;
+      if (cp >= 0xd800 && cp <= 0xdbff) {
+        if (end - s < 6 || s[0] != '\\' || s[1] != 'u')
+          return NULL;
+        for (lo = 0, s += 2, i = 0; i < 4; i++) {
+          if ((hc = hexchar(*s++)) == -1)
+            return NULL;
+          lo = lo << 4 | hc;
+        }
+        if (lo < 0xdc00 || lo > 0xdfff)
+          return NULL;
+        cp = ((cp - 0xd800) * 0x400) + ((lo - 0xdc00) + 0x10000);
+      }
+      /* an escape is at least as long as its UTF-8 encoding */
+      if (cp < 0x80) {
+        *out++ = cp;
+      } else if (cp < 0x800) {
+        *out++ = (cp >> 6 & 0x1F) | 0xC0;
+        *out++ = (cp & 0x3F) | 0x80;
+      } else if (cp < 0x10000) {
+        *out++ = (cp >> 12 & 0x0F) | 0xE0;
+        *out++ = (cp >> 6 & 0x3F) | 0x80;
+        *out++ = (cp & 0x3F) | 0x80;
+      } else {
+        *out++ = (cp >> 18 & 0x07) | 0xF0;
+        *out++ = (cp >> 12 & 0x3F) | 0x80;
+        *out++ = (cp >> 6 & 0x3F) | 0x80;
+        *out++ = (cp & 0x3F) | 0x80;
+      }
+      break;
+    default:
+      return NULL;
+    }
   }
+  memcpy(out, s, end - s);
+  out[end - s] = '\0';
 
-  return fmt;
+  return idx->buf;
 }
 
-/* Determine the selected date format from the config file or command line
- * option.
+/* Length of the JSON number at the start of s, same as read_number().
  *
- * On error, NULL is returned.
- * On success, an allocated string containing the date format is returned. */
-static char *get_selected_date_str(size_t idx) {
-  char *fmt = NULL;
-  switch (idx) {
-  case COMMON:
-  case VCOMMON:
-  case COMBINED:
-  case VCOMBINED:
-  case AWSS3:
-  case TRAEFIKCLF:
-    fmt = alloc_string(dates.apache);
-    break;
-  case AWSELB:
-  case AWSALB:
-  case CLOUDFRONT:
-  case W3C:
-    fmt = alloc_string(dates.w3c);
-    break;
-  case CLOUDSTORAGE:
-    fmt = alloc_string(dates.usec);
-    break;
-  case SQUID:
-  case CADDY:
-    fmt = alloc_string(dates.sec);
-    break;
+ * If not a number, 0 is returned. */
+static size_t json_number_len(const char *s, const char *end) {
+  const char *p = s;
+
+  if (p < end && *p == '-')
+    p++;
+  if (p == end || !is_digit(*p))
+    return 0;
+  if (*p++ != '0')
+    while (p < end && is_digit(*p))
+      p++;
+  if (p < end && *p == '.') {
+    if (++p == end || !is_digit(*p))
+      return 0;
+    while (p < end && is_digit(*p))
+      p++;
+  }
+  if (p < end && (*p == 'e' || *p == 'E')) {
+    if (++p < end && (*p == '+' || *p == '-'))
+      p++;
+    if (p == end || !is_digit(*p))
+      return 0;
+    while (p < end && is_digit(*p))
+      p++;
   }
 
-  return fmt;
+  return p - s;
 }
 
-/* Attempt to set the date format given a command line option
- * argument. The supplied optarg can be either an actual format string
- * or the enumerated value such as VCOMBINED */
-static void set_date_format_str(const char *oarg) {
-  char *fmt = NULL;
-  int type = get_log_format_item_enum(oarg);
+/* Match the number or literal before the next structural char, as
+ * json_next() would. The byte-wise reader takes the longest valid prefix,
+ * so anything left after it is only an error once the value is matched,
+ * and not at all for a top-level value.
+ *
+ * On error, a non-zero value is returned.
+ * On success, 0 is returned. */
+static int json_index_scalar(GJsonIndex *idx, GJsonWalk *walk) {
+  size_t end = idx->next < idx->cnt ? idx->pos[idx->next] : idx->len;
+  const char *s = idx->str + idx->off, *e = idx->str + end, *val = NULL;
+  size_t n = 0;
+  int ret = 0;
 
-  /* free date format if it was previously set by set_log_format_str() */
-  if (conf.date_format)
-    free(conf.date_format);
+  while (s < e && json_isspace((unsigned char)*s))
+    s++;
+  if (s == e)
+    return -1;
 
-  /* type not found, use whatever was given by the user then */
-  if (type == -1) {
-    conf.date_format = unescape_str(oarg);
-    return;
+  if ((n = json_number_len(s, e))) {
+    if (n >= sizeof(idx->buf))
+      return -1;
+    memcpy(idx->buf, s, n);
+    idx->buf[n] = '\0';
+    val = idx->buf;
+  } else if (e - s >= 4 && memcmp(s, "true", 4) == 0) {
+    n = 4;
+    val = "true";
+  } else if (e - s >= 5 && memcmp(s, "false", 5) == 0) {
+    n = 5;
+    val = "false";
+  } else if (e - s >= 4 && memcmp(s, "null", 4) == 0) {
+    n = 4;
+    val = "-";
+  } else {
+    return -1;
   }
 
-  /* attempt to get the format string by the enum value */
-  if ((fmt = get_selected_date_str(type)) == NULL) {
-    LOG_DEBUG(("Unable to set date format from enum: %s\n", oarg));
-    return;
-  }
+  if ((ret = json_walk_value(walk, val)))
+    return ret;
+  for (s += n; walk->depth && s < e; s++)
+    if (!json_isspace((unsigned char)*s))
+      return -1;
+  idx->off = end;
 
-  conf.date_format = fmt;
+  return 0;
 }
 
-static char *get_selected_time_str(size_t idx) {
-  char *fmt = NULL;
-  switch (idx) {
-  case AWSELB:
-  case AWSALB:
-  case CLOUDFRONT:
-  case COMBINED:
-  case COMMON:
-  case VCOMBINED:
-  case VCOMMON:
-  case W3C:
-  case AWSS3:
-  case TRAEFIKCLF:
-    fmt = alloc_string(times.fmt24);
-    break;
-  case CLOUDSTORAGE:
-    fmt = alloc_string(times.usec);
-    break;
-  case SQUID:
-  case CADDY:
-    fmt = alloc_string(times.sec);
-    break;
-  }
+/* Structural index of the JSON line being parsed on this thread */
+static __thread GJsonIndex json_index;
 
-  return fmt;
-}
+/* Parse a JSON log line against the compiled JSON log format through its
+ * structural index, same as parse_json_prog(), but walking from one
+ * structural char to the next instead of reading one byte at a time. Lines
+ * too long for the index go through parse_json_prog().
+ *
+ * On error, a non-zero value is returned.
+ * On success, 0 is returned. */
+static int parse_json_index(GLogItem *logitem, const char *str,
+                            const GJsonFmtProg *prog) {
+  /* whether each open container is an object */
+  uint8_t objects[JSON_MAX_DEPTH];
+  const char *name = NULL, *val = NULL;
+  GJsonIndex *idx = &json_index;
+  GJsonWalk walk;
+  int c = 0, ret = 0;
+
+  if (index_json(idx, str, strlen(str)) != 0)
+    return parse_json_prog(logitem, str, prog);
+
+  json_walk_init(&walk, logitem, prog);
+  /* an empty line is a stream of no value */
+  while (idx->off < idx->len && json_isspace((unsigned char)str[idx->off]))
+    idx->off++;
+  if (idx->off == idx->len)
+    return 0;
 
-/* Attempt to set the time format given a command line option
- * argument. The supplied optarg can be either an actual format string
- * or the enumerated value such as VCOMBINED */
-static void set_time_format_str(const char *oarg) {
-  char *fmt = NULL;
-  int type = get_log_format_item_enum(oarg);
+value:
+  switch ((c = json_index_peek(idx))) {
+  case '"':
+    if (!(val = json_index_string(idx)))
+      return -1;
+    if ((ret = json_walk_value(&walk, val)))
+      return ret;
+    goto next;
+  case '{':
+  case '[':
+    if (json_walk_open(&walk, c == '{' ? JSON_OBJECT : JSON_ARRAY))
+      return -1;
+    objects[walk.depth - 1] = c == '{';
+    json_index_skip(idx);
+    if (json_index_peek(idx) == (c == '{' ? '}' : ']')) {
+      json_index_skip(idx);
+      json_walk_close(&walk);
+      goto next;
+    }
+    if (c == '[')
+      goto value;
+    goto member;
+  case 0:
+    /* neither a string nor a container */
+    if ((ret = json_index_scalar(idx, &walk)))
+      return ret;
+    goto next;
+  default:
+    return -1;
+  }
 
-  /* free time format if it was previously set by set_log_format_str() */
-  if (conf.time_format)
-    free(conf.time_format);
+member:
+  if (json_index_peek(idx) != '"' || !(name = json_index_string(idx)) ||
+      json_walk_key(&walk, name) || json_index_peek(idx) != ':')
+    return -1;
+  json_index_skip(idx);
+  goto value;
 
-  /* type not found, use whatever was given by the user then */
-  if (type == -1) {
-    conf.time_format = unescape_str(oarg);
-    return;
+next:
+  /* done with the top-level value, anything after it is left unread */
+  if (walk.depth == 0)
+    return 0;
+  c = json_index_peek(idx);
+  if (c == ',') {
+    json_index_skip(idx);
+    if (objects[walk.depth - 1])
+      goto member;
+    goto value;
   }
+  if (c != (objects[walk.depth - 1] ? '}' : ']'))
+    return -1;
+  json_index_skip(idx);
+  json_walk_close(&walk);
+  goto next;
+}
 
-  /* attempt to get the format string by the enum value */
-  if ((fmt = get_selected_time_str(type)) == NULL) {
-    LOG_DEBUG(("Unable to set time format from enum: %s\n", oarg));
-    return;
-  }
+#if defined(HAVE_PARSE_STATS)
+/* Timed parse_json_index(), see end_parse_stat() */
+static int parse_json_index_stat(GLogItem *logitem, const char *str,
+                                 const GJsonFmtProg *prog) {
+  GParseStatMark mark;
+  size_t len = strlen(str);
+  int ret;
 
-  conf.time_format = fmt;
+  begin_parse_stat(&mark);
+  ret = parse_json_index(logitem, str, prog);
+  end_parse_stat(&mark, PARSE_STAT_JSON_LINE, 0, len);
+
+  return ret;
 }
+#define parse_json_index parse_json_index_stat
+#endif
 
-/* Attempt to set the log format given a command line option argument.
- * The supplied optarg can be either an actual format string or the
- * enumerated value such as VCOMBINED */
-static void set_log_format_str(const char *oarg) {
-  char *fmt = NULL;
-  int type = get_log_format_item_enum(oarg);
+/* Error of the last line that failed to parse on this thread */
+static __thread GLogErr last_log_err;
 
-  /* free log format if it was previously set */
-  if (conf.log_format)
-    free(conf.log_format);
+/* Get the error of the last line that failed to parse, through parse_line()
+ * or parse_lines(), on the calling thread.
+ *
+ * On success, the error is returned, its code is 0 if there was none. */
+GLogErr get_log_err(void) {
+  return last_log_err;
+}
 
-  if (type == -1 && is_json_log_format(oarg)) {
-    conf.is_json_log_format = 1;
-    conf.log_format = unescape_str(oarg);
-    contains_specifier(); /* set flag */
-    return;
-  } else if (type == -1) {
-    conf.is_json_log_format = 0;
-  }
+static int cleanup_logitem(int ret, GLogItem *logitem) {
+  last_log_err = logitem->err;
+  free_glog(logitem);
+  return ret;
+}
 
-  /* type not found, use whatever was given by the user then */
-  if (type == -1) {
-    conf.log_format = unescape_str(oarg);
-    contains_specifier(); /* set flag */
-    return;
-  }
+static int parse_valid_line(char *line, GLogItem **logitem_out);
 
-  /* attempt to get the format string by the enum value */
-  if ((fmt = get_selected_format_str(type)) == NULL) {
-    LOG_DEBUG(("Unable to set log format from enum: %s\n", oarg));
-    return;
-  }
+/* Make the given parser, or the one of conf if NULL, the one lines are parsed
+ * with on the calling thread.
+ *
+ * On success, the previously active parser is returned. */
+GLogParser *set_active_parser(GLogParser *parser) {
+  GLogParser *prev = active_parser;
+  active_parser = parser ? parser : &log_parser;
+  return prev;
+}
 
-  if (is_json_log_format(fmt))
-    conf.is_json_log_format = 1;
-  else
-    conf.is_json_log_format = 0;
+/* Process a line from the log and store it accordingly taking into
+ * account multiple parsing options prior to setting data into the
+ * corresponding data structure.
+ *
+ * If the line is soft ignored, -1 is returned.
+ * If the line is dropped by a log filter, LINE_FILTERED is returned.
+ * On error, logitem->errstr will contains the error message. */
+static int parse_line(char *line, GLogItem **logitem_out) {
+  /* soft ignore these lines */
+  if (valid_line(line))
+    return -1;
 
-  conf.log_format = unescape_str(fmt);
-  contains_specifier(); /* set flag */
+  return parse_valid_line(line, logitem_out);
+}
 
-  /* assume we are using the default date/time formats */
-  set_time_format_str(oarg);
-  set_date_format_str(oarg);
-  free(fmt);
+/* Same as parse_line(), through the given parser rather than the active one.
+ * Any number of threads may parse through the same parser at once. */
+int parse_line_with(GLogParser *parser, char *line, GLogItem **logitem_out) {
+  GLogParser *prev = set_active_parser(parser);
+  int ret = parse_line(line, logitem_out);
+
+  set_active_parser(prev);
+  return ret;
 }
 
-#define DB_VERSION 2
-#define DB_INSTANCE 1
+/* Process a line already known to pass valid_line(), see parse_line(). */
+static int parse_valid_line(char *line, GLogItem **logitem_out) {
+  const GLogParser *parser = active_parser;
+  int ret = 0;
+  GLogItem *logitem = NULL;
 
-#define GAMTRC_TOTAL 8
+  logitem = init_log_item();
 
-typedef enum GAMetric_ {
-  MTRC_DATES,
-  MTRC_SEQS,
-  MTRC_CNT_OVERALL,
-  MTRC_HOSTNAMES,
-  MTRC_LAST_PARSE,
-  MTRC_JSON_LOGFMT,
-  MTRC_METH_PROTO,
-  MTRC_DB_PROPS,
-} GAMetric;
+  /* Parse a line of log, and fill structure with appropriate values */
+  if (parser->is_json_log_format && parser->json_format_prog)
+    ret = parse_json_index(logitem, line, parser->json_format_prog);
+  else if (parser->is_json_log_format)
+    ret = parse_json_format(logitem, line);
+  else if (parser->log_format_fn)
+    ret = parser->log_format_fn(logitem, line);
+  else if (parser->log_format_prog)
+    ret = parse_format_prog(logitem, line, parser->log_format_prog);
+  else
+    ret = parse_format(logitem, line, parser->log_format);
 
-typedef enum GSMetricType_ {
-  /* uint32_t key - uint32_t val */
-  MTRC_TYPE_II32,
-  /* uint32_t key - string val */
-  MTRC_TYPE_IS32,
-  /* uint32_t key - uint64_t val */
-  MTRC_TYPE_IU64,
-  /* string key   - uint32_t val */
-  MTRC_TYPE_SI32,
-  /* string key   - uint8_t val */
-  MTRC_TYPE_SI08,
-  /* uint32_t key - uint8_t val */
-  MTRC_TYPE_II08,
-  /* string key   - string val */
-  MTRC_TYPE_SS32,
-  /* uint32_t key - GSLList val */
-  MTRC_TYPE_IGSL,
-  /* string key   - uint64_t val */
-  MTRC_TYPE_SU64,
-  /* uint32_t key - GKHashStorage_ val */
-  MTRC_TYPE_IGKH,
-  /* uint64_t key - uint32_t val */
-  MTRC_TYPE_U648,
-  /* uint64_t key - GLastParse val */
-  MTRC_TYPE_IGLP,
-} GSMetricType;
+  /* invalid log line (format issue) */
+  if (ret) {
+    // process_invalid (glog, logitem, line);
+    return cleanup_logitem(ret, logitem);
+  }
 
-typedef struct GKHashMetric_ {
-  union {
-    GSMetric storem;
-    GAMetric dbm;
-  } metric;
-  GSMetricType type;
-  void *(*alloc)(void);
-  void (*des)(void *, uint8_t free_data);
-  void (*del)(void *, uint8_t free_data);
-  uint8_t free_data : 1;
-  void *hash;
-  const char *filename;
-} GKHashMetric;
+  // if (!glog->piping && conf.fname_as_vhost && glog->fname_as_vhost)
+  //   logitem->vhost = xstrdup (glog->fname_as_vhost);
 
-typedef struct GKHashDB_ {
-  GKHashMetric metrics[GAMTRC_TOTAL];
-} GKHashDB;
+  /* valid format but missing fields */
+  if (ret || (ret = verify_missing_fields(logitem))) {
+    return cleanup_logitem(ret, logitem);
+  }
 
-typedef struct GKHashModule_ {
-  GModule module;
-  GKHashMetric metrics[GSMTRC_TOTAL];
-} GKHashModule;
+  /* agent will be null in cases where %u is not specified */
+  if (logitem->agent == NULL) {
+    logitem->agent = intern_token(alloc_string("-"), &logitem->agent_id);
+    // set_agent_hash(logitem);
+  }
 
-/* Data store global */
-typedef struct GKHashGlobal_ {
-  GKHashMetric metrics[GSMTRC_TOTAL];
-} GKHashGlobal;
+  *logitem_out = logitem;
 
-typedef struct GKDB_ GKDB;
+  return ret;
+}
 
-typedef struct GKHashStorage_ GKHashStorage;
+/* Double the capacity of the job's logitems and rets. These outlive the
+ * batch, so they are allocated off the arena. */
+static void grow_job(GJob *job) {
+  GArena *prev = set_active_arena(NULL);
 
-struct GKHashStorage_ {
-  GKHashModule *mhash; /* modules */
-  GKHashGlobal *ghash; /* global */
-};
+  job->cap *= 2;
+  job->logitems = xrealloc(job->logitems, job->cap * sizeof(GLogItem *));
+  job->rets = xrealloc(job->rets, job->cap * sizeof(int));
+  if (job->rec_offs)
+    job->rec_offs = xrealloc(job->rec_offs, job->cap * sizeof(size_t));
 
-struct GKDB_ {
-  GKHashDB *hdb;        /* app-level hash tables */
-  Logs *logs;           /* logs parsing per db instance */
-  GKHashModule *cache;  /* cache modules */
-  GKHashStorage *store; /* per date OR module */
-};
+  set_active_arena(prev);
+}
 
-typedef unsigned int khint32_t;
-typedef khint32_t khint_t;
-typedef khint_t khiter_t;
-#define khash_t(name) kh_##name##_t
+/* Copy the given line into a reusable line buffer, off the arena.
+ *
+ * On success, the NUL-terminated copy is returned. */
+static char *copy_line(char **line, size_t *linecap, const char *s,
+                       size_t len) {
+  GArena *prev = NULL;
+
+  if (len + 1 > *linecap) {
+    prev = set_active_arena(NULL);
+    *linecap = len + 1;
+    *line = xrealloc(*line, *linecap);
+    set_active_arena(prev);
+  }
+  memcpy(*line, s, len);
+  (*line)[len] = '\0';
 
-typedef unsigned long khint64_t;
+  return *line;
+}
 
-#define kh_inline inline
-#define klib_unused __attribute__((__unused__))
+/* Count the error of an invalid line per GLogErr code and, if `err` is
+ * given, keep it. */
+static void count_log_err(int ret, uint64_t *err_counts, GLogErr *err) {
+  GLogErr none = {0};
 
-typedef khint32_t khint_t;
-typedef khint_t khiter_t;
+  if (ret <= 0) {
+    if (err)
+      *err = none;
+    return;
+  }
 
-#define __ac_isempty(flag, i) ((flag[i >> 4] >> ((i & 0xfU) << 1)) & 2)
-#define __ac_isdel(flag, i) ((flag[i >> 4] >> ((i & 0xfU) << 1)) & 1)
-#define __ac_iseither(flag, i) ((flag[i >> 4] >> ((i & 0xfU) << 1)) & 3)
-#define __ac_set_isdel_false(flag, i)                                          \
-  (flag[i >> 4] &= ~(1ul << ((i & 0xfU) << 1)))
-#define __ac_set_isempty_false(flag, i)                                        \
-  (flag[i >> 4] &= ~(2ul << ((i & 0xfU) << 1)))
-#define __ac_set_isboth_false(flag, i)                                         \
-  (flag[i >> 4] &= ~(3ul << ((i & 0xfU) << 1)))
-#define __ac_set_isdel_true(flag, i) (flag[i >> 4] |= 1ul << ((i & 0xfU) << 1))
+  err_counts[last_log_err.code < LOG_ERR_CODES ? last_log_err.code : 0]++;
+  if (err)
+    *err = last_log_err;
+}
 
-#define __ac_fsize(m) ((m) < 16 ? 1 : (m) >> 4)
+/* Bytes at the start of a line hashed to sample it, enough to cover the
+ * host and timestamp of the common formats. */
+#define SAMPLE_PREFIX_LEN 64
 
-#define kroundup32(x)                                                          \
-  (--(x), (x) |= (x) >> 1, (x) |= (x) >> 2, (x) |= (x) >> 4, (x) |= (x) >> 8,  \
-   (x) |= (x) >> 16, ++(x))
+/* Tell whether the given line is skipped when parsing 1 in `rate` lines.
+ * The choice is a hash of the first SAMPLE_PREFIX_LEN bytes of the line
+ * (FNV-1a), so the same lines are kept no matter how the input is split
+ * into batches or threads.
+ *
+ * If the line is to be parsed, 0 is returned.
+ * If it's skipped, 1 is returned. */
+static int is_line_sampled_out(const char *s, size_t len, uint32_t rate) {
+  uint32_t h = 2166136261u;
+  size_t i;
 
-#define kcalloc(N, Z) calloc(N, Z)
+  if (rate <= 1)
+    return 0;
 
-#define kmalloc(Z) malloc(Z)
+  len = MIN(len, (size_t)SAMPLE_PREFIX_LEN);
+  for (i = 0; i < len && s[i] != '\n' && s[i] != '\0'; i++) {
+    h ^= (unsigned char)s[i];
+    h *= 16777619u;
+  }
+  /* FNV's low bits mix poorly, fold the high ones in */
+  h ^= h >> 16;
+  h *= 0x85ebca6bu;
+  h ^= h >> 13;
 
-#define krealloc(P, Z) realloc(P, Z)
+  return h % rate != 0;
+}
 
-#define kfree(P) free(P)
+/* Get the sampling rate to parse the next batch with, given the bytes of
+ * input still pending behind it and the rate of the previous batch.
+ * Sampling is always on if conf.sample_backlog is 0. Otherwise, it's
+ * switched on once more than conf.sample_backlog bytes are pending and off
+ * once they drop to half of it, so it doesn't flap about the threshold.
+ *
+ * On success, the rate is returned, 1 if every line is to be parsed. */
+static uint32_t get_sample_rate(uint64_t pending, uint32_t prev) {
+  if (conf.sample_rate <= 1)
+    return 1;
+  if (conf.sample_backlog == 0 || pending > conf.sample_backlog)
+    return conf.sample_rate;
+  if (pending <= conf.sample_backlog / 2)
+    return 1;
 
-static const double __ac_HASH_UPPER = 0.77;
+  return MAX(prev, 1);
+}
 
-#define __KHASH_TYPE(name, khkey_t, khval_t)                                   \
-  typedef struct kh_##name##_s {                                               \
-    khint_t n_buckets, size, n_occupied, upper_bound;                          \
-    khint32_t *flags;                                                          \
-    khkey_t *keys;                                                             \
-    khval_t *vals;                                                             \
-  } kh_##name##_t;
+/* Split up to `max` lines out of the byte range [s, end) and parse them in
+ * place. Each line is NUL-terminated by overwriting the byte that follows
+ * its newline, which is restored right after, so lines look the same as
+ * when read by getline(3). The last line of the range isn't followed by a
+ * byte we own, so it's copied into the given line buffer instead.
+ *
+ * Only 1 in `sample` lines is parsed, the rest are left as LINE_SAMPLED,
+ * see is_line_sampled_out().
+ *
+ * Invalid lines are counted into `err_counts` and, if `errs` is given,
+ * their errors kept in it.
+ *
+ * On success, the number of lines parsed is assigned to `cnt` and a pointer
+ * past the last one is returned. */
+static char *parse_range(char *s, char *end, GLogItem **logitems, int *rets,
+                         GLogErr *errs, uint64_t *err_counts, uint32_t max,
+                         uint32_t sample, uint32_t *cnt, char **line,
+                         size_t *linecap) {
+  char *e = NULL, *nl = NULL, save;
+  uint32_t i;
+
+  for (i = 0; i < max && s < end; s = e, i++) {
+    nl = memchr(s, '\n', end - s);
+    e = nl ? nl + 1 : end;
+    logitems[i] = NULL;
+
+    /* soft ignore these lines, see valid_line() */
+    if (*s == '\0' || *s == '#' || *s == '\n') {
+      rets[i] = -1;
+      count_log_err(rets[i], err_counts, errs ? &errs[i] : NULL);
+      continue;
+    }
+    if (is_line_sampled_out(s, e - s, sample)) {
+      rets[i] = LINE_SAMPLED;
+      count_log_err(rets[i], err_counts, errs ? &errs[i] : NULL);
+      continue;
+    }
 
-#define __KHASH_PROTOTYPES(name, khkey_t, khval_t)                             \
-  extern kh_##name##_t *kh_init_##name(void);                                  \
-  extern void kh_destroy_##name(kh_##name##_t *h);                             \
-  extern void kh_clear_##name(kh_##name##_t *h);                               \
-  extern khint_t kh_get_##name(const kh_##name##_t *h, khkey_t key);           \
-  extern int kh_resize_##name(kh_##name##_t *h, khint_t new_n_buckets);        \
-  extern khint_t kh_put_##name(kh_##name##_t *h, khkey_t key, int *ret);       \
-  extern void kh_del_##name(kh_##name##_t *h, khint_t x);
+    if (e == end) {
+      rets[i] = parse_valid_line(copy_line(line, linecap, s, e - s),
+                                 &logitems[i]);
+    } else {
+      save = *e;
+      *e = '\0';
+      rets[i] = parse_valid_line(s, &logitems[i]);
+      *e = save;
+    }
+    count_log_err(rets[i], err_counts, errs ? &errs[i] : NULL);
+  }
+  *cnt = i;
 
-#define __KHASH_IMPL(name, SCOPE, khkey_t, khval_t, kh_is_map, __hash_func,    \
-                     __hash_equal)                                             \
-  SCOPE kh_##name##_t *kh_init_##name(void) {                                  \
-    return (kh_##name##_t *)kcalloc(1, sizeof(kh_##name##_t));                 \
-  }                                                                            \
-  SCOPE void kh_destroy_##name(kh_##name##_t *h) {                             \
-    if (h) {                                                                   \
-      kfree((void *)h->keys);                                                  \
-      kfree(h->flags);                                                         \
-      kfree((void *)h->vals);                                                  \
-      kfree(h);                                                                \
-    }                                                                          \
-  }                                                                            \
-  SCOPE void kh_clear_##name(kh_##name##_t *h) {                               \
-    if (h && h->flags) {                                                       \
-      memset(h->flags, 0xaa, __ac_fsize(h->n_buckets) * sizeof(khint32_t));    \
-      h->size = h->n_occupied = 0;                                             \
-    }                                                                          \
-  }                                                                            \
-  SCOPE khint_t kh_get_##name(const kh_##name##_t *h, khkey_t key) {           \
-    if (h->n_buckets) {                                                        \
-      khint_t k, i, last, mask, step = 0;                                      \
-      mask = h->n_buckets - 1;                                                 \
-      k = __hash_func(key);                                                    \
-      i = k & mask;                                                            \
-      last = i;                                                                \
-      while (!__ac_isempty(h->flags, i) &&                                     \
-             (__ac_isdel(h->flags, i) || !__hash_equal(h->keys[i], key))) {    \
-        i = (i + (++step)) & mask;                                             \
-        if (i == last)                                                         \
-          return h->n_buckets;                                                 \
-      }                                                                        \
-      return __ac_iseither(h->flags, i) ? h->n_buckets : i;                    \
-    } else                                                                     \
-      return 0;                                                                \
-  }                                                                            \
-  SCOPE int kh_resize_##name(kh_##name##_t *h, khint_t new_n_buckets) {        \
-    /* This function uses 0.25*n_buckets bytes of working space instead of */  \
-    /* [sizeof(key_t+val_t)+.25]*n_buckets. */                                 \
-    khint32_t *new_flags = 0;                                                  \
-    khint_t j = 1;                                                             \
-    {                                                                          \
-      kroundup32(new_n_buckets);                                               \
-      if (new_n_buckets < 4)                                                   \
-        new_n_buckets = 4;                                                     \
-      if (h->size >= (khint_t)(new_n_buckets * __ac_HASH_UPPER + 0.5))         \
-        j = 0; /* requested size is too small */                               \
-      else {   /* hash table size to be changed (shrink or expand); rehash */  \
-        new_flags = (khint32_t *)kmalloc(__ac_fsize(new_n_buckets) *           \
-                                         sizeof(khint32_t));                   \
-        if (!new_flags)                                                        \
-          return -1;                                                           \
-        memset(new_flags, 0xaa,                                                \
-               __ac_fsize(new_n_buckets) * sizeof(khint32_t));                 \
-        if (h->n_buckets < new_n_buckets) { /* expand */                       \
-          khkey_t *new_keys = (khkey_t *)krealloc(                             \
-              (void *)h->keys, new_n_buckets * sizeof(khkey_t));               \
-          if (!new_keys) {                                                     \
-            kfree(new_flags);                                                  \
-            return -1;                                                         \
-          }                                                                    \
-          h->keys = new_keys;                                                  \
-          if (kh_is_map) {                                                     \
-            khval_t *new_vals = (khval_t *)krealloc(                           \
-                (void *)h->vals, new_n_buckets * sizeof(khval_t));             \
-            if (!new_vals) {                                                   \
-              kfree(new_flags);                                                \
-              return -1;                                                       \
-            }                                                                  \
-            h->vals = new_vals;                                                \
-          }                                                                    \
-        } /* otherwise shrink */                                               \
-      }                                                                        \
-    }                                                                          \
-    if (j) { /* rehashing is needed */                                         \
-      for (j = 0; j != h->n_buckets; ++j) {                                    \
-        if (__ac_iseither(h->flags, j) == 0) {                                 \
-          khkey_t key = h->keys[j];                                            \
-          khval_t val;                                                         \
-          khint_t new_mask;                                                    \
-          new_mask = new_n_buckets - 1;                                        \
-          if (kh_is_map)                                                       \
-            val = h->vals[j];                                                  \
-          __ac_set_isdel_true(h->flags, j);                                    \
-          while (1) { /* kick-out process; sort of like in Cuckoo hashing */   \
-            khint_t k, i, step = 0;                                            \
-            k = __hash_func(key);                                              \
-            i = k & new_mask;                                                  \
-            while (!__ac_isempty(new_flags, i))                                \
-              i = (i + (++step)) & new_mask;                                   \
-            __ac_set_isempty_false(new_flags, i);                              \
-            if (i < h->n_buckets &&                                            \
-                __ac_iseither(h->flags, i) ==                                  \
-                    0) { /* kick out the existing element */                   \
-              {                                                                \
-                khkey_t tmp = h->keys[i];                                      \
-                h->keys[i] = key;                                              \
-                key = tmp;                                                     \
-              }                                                                \
-              if (kh_is_map) {                                                 \
-                khval_t tmp = h->vals[i];                                      \
-                h->vals[i] = val;                                              \
-                val = tmp;                                                     \
-              }                                                                \
-              __ac_set_isdel_true(                                             \
-                  h->flags, i); /* mark it as deleted in the old hash table */ \
-            } else { /* write the element and jump out of the loop */          \
-              h->keys[i] = key;                                                \
-              if (kh_is_map)                                                   \
+  return s;
+}
+
+static void aggregate_job(GJob *job, uint32_t from, uint32_t to);
+size_t pack_log_item(const GLogItem *logitem, GLogRecord *rec, size_t size);
+GLogItem *unpack_log_record(const GLogRecord *rec);
+static GAggShard *new_agg_shard(void);
+static void merge_agg_shard(GAggShard *shard, uint32_t min);
+static void free_agg_shard(GAggShard *shard);
+
+/* Pack the items of lines [from, to) into the job's records, then release
+ * them all at once. Items are aggregated first, if the job has a shard.
+ * Packing each line as soon as it's parsed keeps a whole batch packed, with
+ * the arena holding a single item at most, see conf.compact_items. */
+static void pack_job_items(GJob *job, uint32_t from, uint32_t to) {
+  GArena *prev = NULL;
+  GLogRecord *rec = NULL;
+  size_t size;
+  uint32_t i;
+
+  aggregate_job(job, from, to);
+
+  prev = set_active_arena(NULL);
+  for (i = from; i < to; i++) {
+    job->rec_offs[i] = 0;
+    if (job->logitems[i] == NULL)
+      continue;
+
+    rec = (GLogRecord *)(job->recs + job->recs_len);
+    while ((size = pack_log_item(job->logitems[i], rec,
+                                 job->recs_cap - job->recs_len)) >
+           job->recs_cap - job->recs_len) {
+      job->recs_cap = MAX(job->recs_cap * 2, job->recs_len + size);
+      job->recs = xrealloc(job->recs, job->recs_cap);
+      rec = (GLogRecord *)(job->recs + job->recs_len);
+    }
+    job->rec_offs[i] = job->recs_len + 1;
+    job->recs_len += size;
+    job->logitems[i] = NULL;
+  }
+  set_active_arena(prev);
+
+  arena_reset(&job->arena);
+}
+
+/* Get the item of the given line of a job. Packed items are unpacked into
+ * the job's arena, which is reset first, so they are only valid until the
+ * next call.
+ *
+ * If the line has no item, NULL is returned.
+ * On success, the item is returned. */
+static GLogItem *get_job_item(GJob *job, uint32_t i) {
+  GLogItem *logitem = NULL;
+  GArena *prev = NULL;
+
+  if (job->rec_offs == NULL)
+    return job->logitems[i];
+  if (job->rec_offs[i] == 0)
+    return NULL;
+
+  arena_reset(&job->arena);
+  prev = set_active_arena(&job->arena);
+  logitem =
+      unpack_log_record((GLogRecord *)(job->recs + job->rec_offs[i] - 1));
+  set_active_arena(prev);
+
+  return logitem;
+}
+
+/* Parse the job's whole mmap'd byte range, growing its logitems as
+ * needed. */
+static void parse_job_range(GJob *job) {
+  char *s = job->begin;
+  uint32_t cnt = 0;
+
+  job->cnt = 0;
+  while (s < job->end) {
+    if (job->cnt == job->cap)
+      grow_job(job);
+    s = parse_range(s, job->end, job->logitems + job->cnt,
+                    job->rets + job->cnt, NULL, job->err_counts,
+                    job->rec_offs ? 1 : job->cap - job->cnt, job->sample,
+                    &cnt, &job->lines[0], &job->linecap[0]);
+    if (job->rec_offs)
+      pack_job_items(job, job->cnt, job->cnt + cnt);
+    job->cnt += cnt;
+  }
+}
+
+/* Parse the job's batch of lines into its logitems. Every allocation made
+ * while parsing comes from the job's arena (see init_arena()), which is reset
+ * first, so the items of the previous batch are all released at once and the
+ * current ones stay valid until the next call.
+ *
+ * Lines that fail to parse, are soft ignored, filtered or sampled out (only
+ * 1 in job->sample lines is parsed, see get_sample_rate()) leave a NULL
+ * logitem, the parse_line() return value of each line is kept in job->rets
+ * and invalid lines are counted per error code into job->err_counts.
+ *
+ * If the job holds an mmap'd byte range (see mmap_lines()), its lines are
+ * split out of it first.
+ *
+ * Lines are parsed through the parser of the job's log, if any.
+ *
+ * If the job has a shard, its items are aggregated into it as well, on the
+ * parsing thread. If the job packs its items, they are packed and released
+ * line by line instead, see pack_job_items(). */
+void parse_job_lines(GJob *job) {
+  GLogParser *parser = NULL;
+  GArena *prev = NULL;
+  uint32_t i;
+
+  arena_reset(&job->arena);
+  prev = set_active_arena(&job->arena);
+  parser = set_active_parser(job->glog ? job->glog->parser : NULL);
+  job->recs_len = 0;
+
+  if (job->begin != job->end) {
+    parse_job_range(job);
+  } else {
+    for (i = 0; i < job->cnt; i++) {
+      job->logitems[i] = NULL;
+      if (!valid_line(job->lines[i]) &&
+          is_line_sampled_out(job->lines[i], SAMPLE_PREFIX_LEN, job->sample))
+        job->rets[i] = LINE_SAMPLED;
+      else
+        job->rets[i] = parse_line(job->lines[i], &job->logitems[i]);
+      count_log_err(job->rets[i], job->err_counts, NULL);
+      if (job->rec_offs)
+        pack_job_items(job, i, i + 1);
+    }
+  }
+
+  set_active_parser(parser);
+  set_active_arena(prev);
+  if (job->rec_offs == NULL)
+    aggregate_job(job, 0, job->cnt);
+}
+
+/* Allocate the result arrays of a batch of up to `cap` lines, see
+ * parse_lines(). */
+void init_log_batch(GLogBatch *batch, uint32_t cap) {
+  memset(batch, 0, sizeof *batch);
+  batch->cap = MAX(cap, 1);
+  batch->logitems = xcalloc(batch->cap, sizeof(GLogItem *));
+  batch->rets = xcalloc(batch->cap, sizeof(int));
+  batch->errs = xcalloc(batch->cap, sizeof(GLogErr));
+  init_arena(&batch->arena, 0);
+}
+
+/* Free the result arrays of a batch along with its last parsed items. */
+void free_log_batch(GLogBatch *batch) {
+  free(batch->logitems);
+  free(batch->rets);
+  free(batch->errs);
+  free(batch->line);
+  free_arena(&batch->arena);
+  memset(batch, 0, sizeof *batch);
+}
+
+/* Grow every column of the given layout to hold `cap` rows. */
+static void grow_log_columns(GLogColumns *cols, uint32_t cap) {
+  int c;
+
+  cols->cap = cap;
+  cols->line = xrealloc(cols->line, cap * sizeof(uint32_t));
+  cols->numdate = xrealloc(cols->numdate, cap * sizeof(uint32_t));
+  cols->status = xrealloc(cols->status, cap * sizeof(int16_t));
+  cols->type_ip = xrealloc(cols->type_ip, cap * sizeof(uint8_t));
+  cols->addr = xrealloc(cols->addr, cap * sizeof(*cols->addr));
+  cols->resp_size = xrealloc(cols->resp_size, cap * sizeof(uint64_t));
+  cols->serve_time = xrealloc(cols->serve_time, cap * sizeof(uint64_t));
+  cols->agent_id = xrealloc(cols->agent_id, cap * sizeof(uint32_t));
+  cols->host_id = xrealloc(cols->host_id, cap * sizeof(uint32_t));
+  cols->vhost_id = xrealloc(cols->vhost_id, cap * sizeof(uint32_t));
+  cols->site_id = xrealloc(cols->site_id, cap * sizeof(uint32_t));
+  for (c = 0; c < LOG_STR_COLS; c++) {
+    cols->off[c] = xrealloc(cols->off[c], cap * sizeof(uint32_t));
+    cols->len[c] = xrealloc(cols->len[c], cap * sizeof(uint32_t));
+  }
+  for (c = 0; c < LOG_DICT_COLS; c++)
+    cols->id[c] = xrealloc(cols->id[c], cap * sizeof(uint16_t));
+}
+
+/* Drop all rows of the given layout, keeping its dictionaries. */
+void reset_log_columns(GLogColumns *cols) {
+  cols->cnt = 0;
+  cols->buflen = 0;
+}
+
+/* Allocate the columns of a layout of `cap` rows, grown as needed. */
+void init_log_columns(GLogColumns *cols, uint32_t cap) {
+  GArena *prev = set_active_arena(NULL);
+
+  memset(cols, 0, sizeof *cols);
+  grow_log_columns(cols, MAX(cap, 1));
+  set_active_arena(prev);
+  reset_log_columns(cols);
+}
+
+/* Free the columns, string buffer and dictionaries of a layout. */
+void free_log_columns(GLogColumns *cols) {
+  uint32_t i;
+  int c;
+
+  free(cols->line);
+  free(cols->numdate);
+  free(cols->status);
+  free(cols->type_ip);
+  free(cols->addr);
+  free(cols->resp_size);
+  free(cols->serve_time);
+  free(cols->agent_id);
+  free(cols->host_id);
+  free(cols->vhost_id);
+  free(cols->site_id);
+  for (c = 0; c < LOG_STR_COLS; c++) {
+    free(cols->off[c]);
+    free(cols->len[c]);
+  }
+  for (c = 0; c < LOG_DICT_COLS; c++) {
+    free(cols->id[c]);
+    for (i = 1; i < cols->dict[c].size; i++)
+      free(cols->dict[c].values[i]);
+    free(cols->dict[c].values);
+  }
+  free(cols->buf);
+  memset(cols, 0, sizeof *cols);
+}
+
+/* Get the string behind a dictionary ID of the given column.
+ *
+ * If the ID is 0 (not set) or unknown, NULL is returned.
+ * On success, the string value is returned. */
+const char *get_log_dict_value(const GLogColumns *cols, GLogDictCol col,
+                               uint16_t id) {
+  const GLogDict *dict = &cols->dict[col];
+  return id < dict->size ? dict->values[id] : NULL;
+}
+
+/* Get the string of a row of the given string column.
+ *
+ * If the field was not set, NULL is returned.
+ * On success, the NUL-terminated string is returned. */
+const char *get_log_str_value(const GLogColumns *cols, GLogStrCol col,
+                              uint32_t row) {
+  uint32_t off = cols->off[col][row];
+  return off ? cols->buf + off : NULL;
+}
+
+/* Find, or add, the given value in a column dictionary. These columns hold a
+ * handful of distinct values, so a linear scan beats hashing.
+ *
+ * On error, i.e., the dictionary is full, the program exits.
+ * On success, the value's ID is returned, 0 for a NULL value. */
+static uint16_t get_log_dict_id(GLogDict *dict, const char *value) {
+  uint32_t i;
+
+  if (value == NULL)
+    return 0;
+
+  for (i = 1; i < dict->size; i++)
+    if (strcmp(dict->values[i], value) == 0)
+      return i;
+
+  if (dict->size > UINT16_MAX)
+    FATAL("Unable to add '%s' to a full column dictionary.", value);
+
+  if (dict->size == dict->cap) {
+    dict->cap = dict->cap ? dict->cap * 2 : 16;
+    dict->values = xrealloc(dict->values, dict->cap * sizeof(char *));
+  }
+  if (dict->size == 0)
+    dict->values[dict->size++] = NULL;
+  dict->values[dict->size] = xstrdup(value);
+
+  return dict->size++;
+}
+
+/* Append a string to the layout's buffer and store it into row `row` of the
+ * given string column. */
+static void set_log_str_col(GLogColumns *cols, GLogStrCol col, uint32_t row,
+                            const char *str) {
+  size_t len = str ? strlen(str) : 0;
+
+  cols->off[col][row] = 0;
+  cols->len[col][row] = len;
+  if (str == NULL)
+    return;
+
+  /* offset 0 is the empty string standing for unset fields */
+  if (cols->buflen == 0)
+    cols->buflen = 1;
+  if (cols->buflen + len + 1 > UINT32_MAX)
+    FATAL("Unable to fit %zu bytes into the column buffer.", len);
+  if (cols->buflen + len + 1 > cols->bufsize) {
+    cols->bufsize = MAX(cols->bufsize * 2, cols->buflen + len + 1);
+    cols->buf = xrealloc(cols->buf, cols->bufsize);
+    cols->buf[0] = '\0';
+  }
+
+  memcpy(cols->buf + cols->buflen, str, len + 1);
+  cols->off[col][row] = cols->buflen;
+  cols->buflen += len + 1;
+}
+
+/* Append the given item, parsed from line `line` of a batch, as a new row
+ * of the layout. Columns and dictionaries outlive the batch, so they are
+ * allocated off the arena. */
+static void append_log_columns(GLogColumns *cols, const GLogItem *logitem,
+                               uint32_t line) {
+  GArena *prev = set_active_arena(NULL);
+  uint32_t row = cols->cnt++;
+
+  if (row == cols->cap)
+    grow_log_columns(cols, cols->cap * 2);
+
+  cols->line[row] = line;
+  cols->numdate[row] = logitem->numdate;
+  cols->status[row] = logitem->status;
+  cols->type_ip[row] = logitem->type_ip;
+  memcpy(cols->addr[row], logitem->addr, sizeof(logitem->addr));
+  cols->resp_size[row] = logitem->resp_size;
+  cols->serve_time[row] = logitem->serve_time;
+  cols->agent_id[row] = logitem->agent_id;
+  cols->host_id[row] = logitem->host_id;
+  cols->vhost_id[row] = logitem->vhost_id;
+  cols->site_id[row] = logitem->site_id;
+
+  set_log_str_col(cols, LOG_COL_AGENT, row, logitem->agent);
+  set_log_str_col(cols, LOG_COL_DATE, row, logitem->date);
+  set_log_str_col(cols, LOG_COL_HOST, row, logitem->host);
+  set_log_str_col(cols, LOG_COL_KEYPHRASE, row, logitem->keyphrase);
+  set_log_str_col(cols, LOG_COL_QSTR, row, logitem->qstr);
+  set_log_str_col(cols, LOG_COL_REF, row, logitem->ref);
+  set_log_str_col(cols, LOG_COL_REQ, row, logitem->req);
+  set_log_str_col(cols, LOG_COL_TIME, row, logitem->time);
+  set_log_str_col(cols, LOG_COL_VHOST, row, logitem->vhost);
+  set_log_str_col(cols, LOG_COL_USERID, row, logitem->userid);
+  set_log_str_col(cols, LOG_COL_SITE, row,
+                  logitem->site[0] ? logitem->site : NULL);
+  set_log_str_col(cols, LOG_COL_TLS_CYPHER, row, logitem->tls_cypher);
+
+  cols->id[LOG_COL_METHOD][row] =
+      get_log_dict_id(&cols->dict[LOG_COL_METHOD], logitem->method);
+  cols->id[LOG_COL_PROTOCOL][row] =
+      get_log_dict_id(&cols->dict[LOG_COL_PROTOCOL], logitem->protocol);
+  cols->id[LOG_COL_CACHE_STATUS][row] = get_log_dict_id(
+      &cols->dict[LOG_COL_CACHE_STATUS], logitem->cache_status);
+  cols->id[LOG_COL_MIME_TYPE][row] =
+      get_log_dict_id(&cols->dict[LOG_COL_MIME_TYPE], logitem->mime_type);
+  cols->id[LOG_COL_TLS_TYPE][row] =
+      get_log_dict_id(&cols->dict[LOG_COL_TLS_TYPE], logitem->tls_type);
+
+  set_active_arena(prev);
+}
+
+/* Get the date and time of the given broken-down time as seconds since the
+ * Epoch, as if it were in UTC. */
+static int64_t get_tm_epoch(const struct tm *tm) {
+  int64_t days =
+      days_from_civil(tm->tm_year + 1900LL, tm->tm_mon + 1, tm->tm_mday);
+
+  return days * 86400 + tm->tm_hour * 3600LL + tm->tm_min * 60LL + tm->tm_sec;
+}
+
+/* Inverse of get_tm_epoch(), for the fields of a GLogItem's dt. */
+static void set_tm_epoch(struct tm *tm, int64_t epoch) {
+  int64_t days = (epoch >= 0 ? epoch : epoch - 86399) / 86400, secs, y;
+  int m, d;
+
+  secs = epoch - days * 86400;
+  civil_from_days(days, &y, &m, &d);
+
+  tm->tm_year = (int)(y - 1900);
+  tm->tm_mon = m - 1;
+  tm->tm_mday = d;
+  tm->tm_hour = (int)(secs / 3600);
+  tm->tm_min = (int)(secs % 3600 / 60);
+  tm->tm_sec = (int)(secs % 60);
+}
+
+/* Find the given string within a table of strings.
+ *
+ * If not found, 0 is returned.
+ * On success, 1 + its index is returned. */
+static uint8_t get_str_table_id(const char *const *table, size_t size,
+                                const char *str) {
+  size_t i;
+
+  for (i = 0; str && i < size; i++)
+    if (strcmp(table[i], str) == 0)
+      return i + 1;
+  return 0;
+}
+
+/* Find the given HTTP method within http_methods.
+ *
+ * If not found, 0 is returned.
+ * On success, 1 + its index is returned. */
+static uint8_t get_method_id(const char *method) {
+  size_t i;
+
+  for (i = 0; method && i < ARRAY_SIZE(http_methods); i++)
+    if (method == http_methods[i].method ||
+        strcmp(method, http_methods[i].method) == 0)
+      return i + 1;
+  return 0;
+}
+
+/* Find the given HTTP protocol within http_protocols.
+ *
+ * If not found, 0 is returned.
+ * On success, 1 + its index is returned. */
+static uint8_t get_protocol_id(const char *protocol) {
+  size_t i;
+
+  for (i = 0; protocol && i < ARRAY_SIZE(http_protocols); i++)
+    if (protocol == http_protocols[i].protocol ||
+        strcmp(protocol, http_protocols[i].protocol) == 0)
+      return i + 1;
+  return 0;
+}
+
+/* Pack the given item into `rec`, a buffer of `size` bytes, see GLogRecord.
+ * The date and time strings are only kept when numdate and epoch don't give
+ * them back. Note that dt is normalized along the way, so a leap second
+ * comes back as the first second of the next minute.
+ *
+ * If the record needs more than `size` bytes, nothing is written.
+ * On success, the size of the record is returned. */
+size_t pack_log_item(const GLogItem *logitem, GLogRecord *rec, size_t size) {
+  const char *strs[LOG_REC_STRS] = {NULL};
+  size_t lens[LOG_REC_STRS] = {0}, need = sizeof(GLogRecord), off;
+  char date[DATE_LEN], time[TIME_LEN];
+  int64_t epoch = get_tm_epoch(&logitem->dt);
+  uint8_t flags = 0, cache_status = 0, tls_type = 0;
+  struct tm tm;
+  int i;
+
+  if (logitem->date) {
+    snprintf(date, sizeof(date), "%u", logitem->numdate);
+    if (strcmp(date, logitem->date) == 0)
+      flags |= LOG_REC_NUMDATE;
+    else
+      strs[LOG_REC_DATE] = logitem->date;
+  }
+  if (logitem->time) {
+    memset(&tm, 0, sizeof(tm));
+    set_tm_epoch(&tm, epoch);
+    if (format_time(time, sizeof(time), &tm) > 0 &&
+        strcmp(time, logitem->time) == 0)
+      flags |= LOG_REC_EPOCH_TIME;
+    else
+      strs[LOG_REC_TIME] = logitem->time;
+  }
+
+  cache_status = get_str_table_id(cache_statuses, ARRAY_SIZE(cache_statuses),
+                                  logitem->cache_status);
+  tls_type =
+      get_str_table_id(tls_types, ARRAY_SIZE(tls_types), logitem->tls_type);
+
+  strs[LOG_REC_AGENT] = logitem->agent_id ? NULL : logitem->agent;
+  strs[LOG_REC_HOST] = logitem->host_id ? NULL : logitem->host;
+  strs[LOG_REC_KEYPHRASE] = logitem->keyphrase;
+  strs[LOG_REC_QSTR] = logitem->qstr;
+  strs[LOG_REC_REF] = logitem->ref;
+  strs[LOG_REC_REQ] = logitem->req;
+  strs[LOG_REC_VHOST] = logitem->vhost_id ? NULL : logitem->vhost;
+  strs[LOG_REC_USERID] = logitem->userid;
+  strs[LOG_REC_CACHE_STATUS] = cache_status ? NULL : logitem->cache_status;
+  strs[LOG_REC_SITE] =
+      logitem->site[0] && !logitem->site_id ? logitem->site : NULL;
+  strs[LOG_REC_MIME_TYPE] = logitem->mime_type;
+  strs[LOG_REC_TLS_TYPE] = tls_type ? NULL : logitem->tls_type;
+  strs[LOG_REC_TLS_CYPHER] = logitem->tls_cypher;
+  strs[LOG_REC_TLS_TYPE_CYPHER] = logitem->tls_type_cypher;
+  strs[LOG_REC_ERRSTR] = logitem->errstr;
+
+  for (i = 0; i < LOG_REC_STRS; i++) {
+    if (strs[i]) {
+      lens[i] = strlen(strs[i]);
+      need += lens[i] + 1;
+    }
+  }
+  need = (need + 7) & ~(size_t)7;
+  if (need > size)
+    return need;
+
+  memset(rec, 0, sizeof(GLogRecord));
+  rec->size = need;
+  rec->numdate = logitem->numdate;
+  rec->epoch = epoch;
+  rec->resp_size = logitem->resp_size;
+  rec->serve_time = logitem->serve_time;
+  rec->agent_id = logitem->agent_id;
+  rec->host_id = logitem->host_id;
+  rec->vhost_id = logitem->vhost_id;
+  rec->site_id = logitem->site_id;
+  rec->err = logitem->err;
+  rec->status = logitem->status;
+  rec->method = get_method_id(logitem->method);
+  rec->protocol = get_protocol_id(logitem->protocol);
+  rec->cache_status = cache_status;
+  rec->tls_type = tls_type;
+  rec->type_ip = logitem->type_ip;
+  rec->ignorelevel = logitem->ignorelevel;
+  rec->flags = flags;
+  memcpy(rec->addr, logitem->addr, sizeof(rec->addr));
+
+  for (i = 0, off = sizeof(GLogRecord); i < LOG_REC_STRS; i++) {
+    if (!strs[i])
+      continue;
+    memcpy((char *)rec + off, strs[i], lens[i] + 1);
+    rec->off[i] = off;
+    rec->len[i] = lens[i];
+    off += lens[i] + 1;
+  }
+
+  return need;
+}
+
+/* Copy a string out of the given record.
+ *
+ * If not set, NULL is returned.
+ * On success, the newly allocated string is returned. */
+static char *dup_log_rec_str(const GLogRecord *rec, GLogRecStr str) {
+  char *dup = NULL;
+
+  if (rec->off[str] == 0)
+    return NULL;
+
+  dup = xmalloc(rec->len[str] + 1);
+  memcpy(dup, (const char *)rec + rec->off[str], rec->len[str] + 1);
+  return dup;
+}
+
+/* Convert a record back into a classic GLogItem, allocated the same way
+ * parse_line() allocates its items, see free_glog(). Interned strings are
+ * shared again.
+ *
+ * On success, the newly allocated GLogItem is returned. */
+GLogItem *unpack_log_record(const GLogRecord *rec) {
+  GLogItem *logitem = init_log_item();
+  char buf[DATE_LEN];
+  const char *site = NULL;
+
+  set_tm_epoch(&logitem->dt, rec->epoch);
+  logitem->numdate = rec->numdate;
+  if (rec->flags & LOG_REC_NUMDATE) {
+    snprintf(buf, sizeof(buf), "%u", rec->numdate);
+    logitem->date = alloc_string(buf);
+  } else {
+    logitem->date = dup_log_rec_str(rec, LOG_REC_DATE);
+  }
+  if (rec->flags & LOG_REC_EPOCH_TIME) {
+    logitem->time = xmalloc(TIME_LEN);
+    format_time(logitem->time, TIME_LEN, &logitem->dt);
+  } else {
+    logitem->time = dup_log_rec_str(rec, LOG_REC_TIME);
+  }
+
+  logitem->agent_id = rec->agent_id;
+  logitem->host_id = rec->host_id;
+  logitem->vhost_id = rec->vhost_id;
+  logitem->site_id = rec->site_id;
+  logitem->agent = rec->agent_id ? (char *)get_intern_str(rec->agent_id)
+                                 : dup_log_rec_str(rec, LOG_REC_AGENT);
+  logitem->host = rec->host_id ? (char *)get_intern_str(rec->host_id)
+                               : dup_log_rec_str(rec, LOG_REC_HOST);
+  logitem->vhost = rec->vhost_id ? (char *)get_intern_str(rec->vhost_id)
+                                 : dup_log_rec_str(rec, LOG_REC_VHOST);
+  site = rec->site_id ? get_intern_str(rec->site_id)
+         : rec->off[LOG_REC_SITE] ? (const char *)rec + rec->off[LOG_REC_SITE]
+                                  : NULL;
+  if (site)
+    snprintf(logitem->site, sizeof(logitem->site), "%s", site);
+
+  logitem->keyphrase = dup_log_rec_str(rec, LOG_REC_KEYPHRASE);
+  logitem->qstr = dup_log_rec_str(rec, LOG_REC_QSTR);
+  logitem->ref = dup_log_rec_str(rec, LOG_REC_REF);
+  logitem->req = dup_log_rec_str(rec, LOG_REC_REQ);
+  logitem->userid = dup_log_rec_str(rec, LOG_REC_USERID);
+  logitem->cache_status =
+      rec->cache_status ? alloc_string(cache_statuses[rec->cache_status - 1])
+                        : dup_log_rec_str(rec, LOG_REC_CACHE_STATUS);
+  logitem->mime_type = dup_log_rec_str(rec, LOG_REC_MIME_TYPE);
+  logitem->tls_type = rec->tls_type
+                          ? alloc_string(tls_types[rec->tls_type - 1])
+                          : dup_log_rec_str(rec, LOG_REC_TLS_TYPE);
+  logitem->tls_cypher = dup_log_rec_str(rec, LOG_REC_TLS_CYPHER);
+  logitem->tls_type_cypher = dup_log_rec_str(rec, LOG_REC_TLS_TYPE_CYPHER);
+  logitem->errstr = dup_log_rec_str(rec, LOG_REC_ERRSTR);
+
+  logitem->method = rec->method ? http_methods[rec->method - 1].method : NULL;
+  logitem->protocol =
+      rec->protocol ? http_protocols[rec->protocol - 1].protocol : NULL;
+  logitem->err = rec->err;
+  logitem->status = rec->status;
+  logitem->resp_size = rec->resp_size;
+  logitem->serve_time = rec->serve_time;
+  logitem->type_ip = rec->type_ip;
+  logitem->ignorelevel = rec->ignorelevel;
+  memcpy(logitem->addr, rec->addr, sizeof(logitem->addr));
+
+  return logitem;
+}
+
+/* Parse up to batch->cap newline-separated lines out of the first `len`
+ * bytes of `buf`. This is the batch counterpart of parse_line(): lines are
+ * parsed in place (see parse_range()), so `buf` must be writable, though
+ * it's left unchanged. A last line lacking its newline is parsed as well.
+ *
+ * The parse_line() return value of each line is kept in batch->rets, the
+ * items of the lines that were parsed in batch->logitems, NULL otherwise,
+ * and the error of each invalid line in batch->errs. Invalid lines are also
+ * counted per error code into batch->err_counts, across calls.
+ * Items come from the batch's arena, which is reset on each call, so they
+ * stay valid until the next call and must not be released individually.
+ *
+ * If batch->cols is set (see init_log_columns()), it's reset and the items
+ * are copied into it as well, one row per item, in line order.
+ *
+ * Lines are parsed through batch->parser if set, the active parser
+ * otherwise. If batch->sample is above 1, only 1 in that many lines is
+ * parsed, the rest are left as LINE_SAMPLED, see is_line_sampled_out().
+ *
+ * On success, the number of lines parsed is assigned to batch->cnt and the
+ * number of bytes consumed is returned. Callers resume from there while it's
+ * less than `len`. */
+size_t parse_lines(GLogBatch *batch, char *buf, size_t len) {
+  GLogParser *parser = active_parser;
+  GArena *prev = NULL;
+  char *s = NULL;
+  uint32_t i;
+
+  arena_reset(&batch->arena);
+  prev = set_active_arena(&batch->arena);
+  if (batch->parser)
+    parser = set_active_parser(batch->parser);
+  s = parse_range(buf, buf + len, batch->logitems, batch->rets, batch->errs,
+                  batch->err_counts, batch->cap, batch->sample, &batch->cnt,
+                  &batch->line, &batch->linecap);
+  set_active_parser(parser);
+
+  if (batch->cols) {
+    reset_log_columns(batch->cols);
+    for (i = 0; i < batch->cnt; i++)
+      if (batch->logitems[i])
+        append_log_columns(batch->cols, batch->logitems[i], i);
+  }
+  set_active_arena(prev);
+
+  return s - buf;
+}
+
+/* Take the jobs of the banks handed to the pool until it's stopped. */
+static void *process_lines_thread(void *arg) {
+  GJobPool *pool = arg;
+  GJob *job = NULL;
+
+  pthread_mutex_lock(&pool->mutex);
+  while (1) {
+    while (!pool->stop && (!pool->bank || pool->next == pool->n))
+      pthread_cond_wait(&pool->cond, &pool->mutex);
+    if (pool->stop)
+      break;
+
+    job = &pool->bank[pool->next++];
+    pthread_mutex_unlock(&pool->mutex);
+    if (job->cnt || job->begin != job->end)
+      parse_job_lines(job);
+    pthread_mutex_lock(&pool->mutex);
+
+    if (--pool->busy == 0) {
+      pool->bank = NULL;
+      pthread_cond_signal(&pool->done);
+    }
+  }
+  pthread_mutex_unlock(&pool->mutex);
+
+  return NULL;
+}
+
+/* Start `n` parser threads, one per job of a bank. Even a single job gets
+ * its own thread, so the next bank is read while the current one is
+ * parsed.
+ *
+ * On error, the program exits.
+ * On success, the new pool is returned. */
+static GJobPool *new_job_pool(int n) {
+  GJobPool *pool = xcalloc(1, sizeof(GJobPool));
+  int k;
+
+  pthread_mutex_init(&pool->mutex, NULL);
+  pthread_cond_init(&pool->cond, NULL);
+  pthread_cond_init(&pool->done, NULL);
+  pool->threads = xcalloc(n, sizeof(pthread_t));
+  pool->nthreads = n;
+  for (k = 0; k < n; k++)
+    if (pthread_create(&pool->threads[k], NULL, process_lines_thread, pool))
+      FATAL("Unable to create parser thread - failed.");
+
+  return pool;
+}
+
+/* Stop and join the threads of the given pool, then free it. */
+static void free_job_pool(GJobPool *pool) {
+  int k;
+
+  pthread_mutex_lock(&pool->mutex);
+  pool->stop = 1;
+  pthread_cond_broadcast(&pool->cond);
+  pthread_mutex_unlock(&pool->mutex);
+
+  for (k = 0; k < pool->nthreads; k++)
+    pthread_join(pool->threads[k], NULL);
+
+  pthread_mutex_destroy(&pool->mutex);
+  pthread_cond_destroy(&pool->cond);
+  pthread_cond_destroy(&pool->done);
+  free(pool->threads);
+  free(pool);
+}
+
+/* Allocate the line and logitem buffers of `n` jobs. */
+static GJob *new_jobs(int n, GLog *glog) {
+  GJob *jobs = xcalloc(n, sizeof(GJob));
+  int k;
+
+  for (k = 0; k < n; k++) {
+    jobs[k].p = k;
+    jobs[k].glog = glog;
+    jobs[k].lines = xcalloc(conf.chunk_size, sizeof(char *));
+    jobs[k].linecap = xcalloc(conf.chunk_size, sizeof(size_t));
+    jobs[k].logitems = xcalloc(conf.chunk_size, sizeof(GLogItem *));
+    jobs[k].rets = xcalloc(conf.chunk_size, sizeof(int));
+    jobs[k].cap = conf.chunk_size;
+    init_arena(&jobs[k].arena, 0);
+    if (conf.aggregate)
+      jobs[k].shard = new_agg_shard();
+    if (conf.compact_items) {
+      jobs[k].rec_offs = xcalloc(conf.chunk_size, sizeof(size_t));
+      jobs[k].recs_cap = conf.chunk_size * sizeof(GLogRecord);
+      jobs[k].recs = xmalloc(jobs[k].recs_cap);
+    }
+  }
+
+  return jobs;
+}
+
+static void free_jobs(GJob *jobs, int n) {
+  int i, k;
+
+  for (k = 0; k < n; k++) {
+    for (i = 0; i < conf.chunk_size; i++)
+      free(jobs[k].lines[i]);
+    free(jobs[k].lines);
+    free(jobs[k].linecap);
+    free(jobs[k].logitems);
+    free(jobs[k].rets);
+    free_arena(&jobs[k].arena);
+    free(jobs[k].recs);
+    free(jobs[k].rec_offs);
+    merge_agg_shard(jobs[k].shard, 0);
+    free_agg_shard(jobs[k].shard);
+  }
+  free(jobs);
+}
+
+/* Read up to conf.chunk_size lines into each of the given jobs. Line
+ * buffers are reused across batches.
+ *
+ * On success, the number of lines read is returned. */
+static uint32_t read_jobs(FILE *fp, GJob *jobs, int n) {
+  uint32_t total = 0, cnt;
+  int k;
+
+  for (k = 0; k < n; k++) {
+    for (cnt = 0; cnt < (uint32_t)conf.chunk_size; cnt++) {
+      if (getline(&jobs[k].lines[cnt], &jobs[k].linecap[cnt], fp) == -1)
+        break;
+    }
+    jobs[k].cnt = cnt;
+    total += cnt;
+  }
+
+  return total;
+}
+
+/* Get the bytes of the given stream not read yet, as far as the system can
+ * tell: the bytes left in a regular file, or those waiting in a pipe or a
+ * socket.
+ *
+ * If they are unknown, 0 is returned. */
+static uint64_t get_stream_backlog(FILE *fp) {
+  struct stat st;
+  off_t pos;
+  int n = 0;
+
+  if (fstat(fileno(fp), &st) == 0 && S_ISREG(st.st_mode)) {
+    pos = ftello(fp);
+    return pos >= 0 && st.st_size > pos ? (uint64_t)(st.st_size - pos) : 0;
+  }
+#if defined(FIONREAD)
+  if (ioctl(fileno(fp), FIONREAD, &n) == 0 && n > 0)
+    return n;
+#endif
+
+  return 0;
+}
+
+/* Set the sampling rate of a bank of jobs about to be parsed, given the
+ * bytes still pending behind it and the rate of the bank before it, see
+ * get_sample_rate(). */
+static void set_jobs_sample(GJob *jobs, int n, uint64_t pending,
+                            uint32_t prev) {
+  uint32_t rate = get_sample_rate(pending, prev);
+  int k;
+
+  for (k = 0; k < n; k++)
+    jobs[k].sample = rate;
+}
+
+/* Hand the given bank of `n` jobs to the threads of the pool, an idle
+ * thread taking each job. Only one bank is parsed at a time, so the
+ * previous one must have been joined, see join_jobs(). */
+static void start_jobs(GJobPool *pool, GJob *jobs, int n) {
+  pthread_mutex_lock(&pool->mutex);
+  pool->bank = jobs;
+  pool->n = n;
+  pool->next = 0;
+  pool->busy = n;
+  pthread_cond_broadcast(&pool->cond);
+  pthread_mutex_unlock(&pool->mutex);
+}
+
+/* Wait until every job of the bank started on the pool is parsed. */
+static void join_jobs(GJobPool *pool) {
+  pthread_mutex_lock(&pool->mutex);
+  while (pool->bank)
+    pthread_cond_wait(&pool->done, &pool->mutex);
+  pthread_mutex_unlock(&pool->mutex);
+}
+
+/* Hand the parsed items of a bank of jobs to the consumer in input order.
+ * Shards of the jobs are merged into the store once they hold
+ * conf.agg_merge_lines items, i.e., after every batch by default.
+ *
+ * glog->sample_rate is set to the rate of each job before its items are
+ * handed over, so consumers can scale what they count back up, and lines
+ * skipped by sampling are counted into glog->sampled. */
+static void consume_jobs(GJob *jobs, int n, GLogItemCb cb, void *data) {
+  GLogItem *logitem = NULL;
+  GLog *glog = NULL;
+  uint32_t i;
+  int k, c;
+
+  for (k = 0; k < n; k++) {
+    glog = jobs[k].glog;
+    glog->sample_rate = MAX(jobs[k].sample, 1);
+    for (c = 0; c < LOG_ERR_CODES; c++)
+      glog->err_counts[c] += jobs[k].err_counts[c];
+    memset(jobs[k].err_counts, 0, sizeof(jobs[k].err_counts));
+    for (i = 0; i < jobs[k].cnt; i++) {
+      glog->read++;
+      if ((logitem = get_job_item(&jobs[k], i)) == NULL) {
+        /* soft ignored lines aren't invalid */
+        if (jobs[k].rets[i] == LINE_SAMPLED)
+          glog->sampled++;
+        else if (jobs[k].rets[i] == LINE_FILTERED)
+          glog->filtered++;
+        else if (jobs[k].rets[i] != -1)
+          glog->invalid++;
+        continue;
+      }
+      glog->processed++;
+      if (cb)
+        cb(glog, logitem, data);
+    }
+    merge_agg_shard(jobs[k].shard, conf.agg_merge_lines);
+  }
+}
+
+/* Read and parse the given stream through conf.jobs parser threads. Lines
+ * are read in chunks of conf.chunk_size per thread into one of two banks of
+ * jobs: the next bank is read while the current one is being parsed, and the
+ * current one is handed to the consumer, in input order, while the next one
+ * is being parsed.
+ *
+ * Items passed to `cb` are owned by their job's arena and are only valid
+ * during the callback.
+ *
+ * On success, the number of lines read is returned. */
+uint64_t read_lines(FILE *fp, GLog *glog, GLogItemCb cb, void *data) {
+  GJob *jobs[2] = {NULL};
+  GJobPool *pool = NULL;
+  uint64_t total = 0;
+  uint32_t cnt = 0;
+  int n = MAX(conf.jobs, 1), b = 0;
+
+  for (b = 0; b < 2; b++)
+    jobs[b] = new_jobs(n, glog);
+  pool = new_job_pool(n);
+
+  b = 0;
+  total = cnt = read_jobs(fp, jobs[b], n);
+  set_jobs_sample(jobs[b], n, get_stream_backlog(fp), 1);
+  if (cnt)
+    start_jobs(pool, jobs[b], n);
+
+  while (cnt) {
+    /* read the next bank while the current one is parsed */
+    total += cnt = read_jobs(fp, jobs[!b], n);
+    set_jobs_sample(jobs[!b], n, get_stream_backlog(fp), jobs[b][0].sample);
+    join_jobs(pool);
+
+    /* parse the next bank while the current one is consumed */
+    if (cnt)
+      start_jobs(pool, jobs[!b], n);
+    consume_jobs(jobs[b], n, cb, data);
+
+    b = !b;
+  }
+
+  free_job_pool(pool);
+  for (b = 0; b < 2; b++)
+    free_jobs(jobs[b], n);
+
+  return total;
+}
+
+/* Assumed average line length used to size the byte range of each job, so
+ * a range holds about conf.chunk_size lines. */
+#define MMAP_AVG_LINE_LEN 256
+
+/* Split the mapping from `pos` into up to `n` byte ranges ending on a
+ * newline, one per job.
+ *
+ * On success, the offset right past the last range is returned. */
+static size_t split_jobs(GJob *jobs, int n, char *map, size_t size,
+                         size_t pos) {
+  size_t len = (size_t)conf.chunk_size * MMAP_AVG_LINE_LEN, end;
+  const char *nl = NULL;
+  int k;
+
+  for (k = 0; k < n; k++) {
+    end = pos + MIN(len, size - pos);
+    if (end < size && map[end - 1] != '\n') {
+      nl = memchr(map + end, '\n', size - end);
+      end = nl ? (size_t)(nl - map) + 1 : size;
+    }
+
+    jobs[k].cnt = 0;
+    jobs[k].begin = map + pos;
+    jobs[k].end = map + end;
+    pos = end;
+  }
+
+  return pos;
+}
+
+/* Release the private pages of the given consumed bytes of the mapping. */
+static void release_mapping(char *map, size_t from, size_t to) {
+  long pagesz = sysconf(_SC_PAGESIZE);
+
+  from -= from % pagesz;
+  to -= to % pagesz;
+  if (to > from)
+    madvise(map + from, to - from, MADV_DONTNEED);
+}
+
+/* Parse the lines in the bytes [start, size) of the writable `buf` through
+ * the given two banks of `n` jobs, each job taking a byte range of about
+ * conf.chunk_size lines, see parse_job_range(). As with read_lines(), the
+ * next bank is split off while the current one is parsed, and items are
+ * handed to `cb` in input order.
+ *
+ * If `release` is set, `buf` is a private mapping whose consumed pages are
+ * dropped as it's walked.
+ *
+ * On success, the number of lines read is returned. */
+static uint64_t parse_jobs_range(GJob **jobs, GJobPool *pool, int n,
+                                 char *buf, size_t start, size_t size,
+                                 int release, GLogItemCb cb, void *data) {
+  size_t pos = 0, done = 0, next;
+  uint64_t total = 0;
+  int b = 0, k;
+
+  pos = split_jobs(jobs[b], n, buf, size, start);
+  set_jobs_sample(jobs[b], n, size - pos, jobs[!b][0].sample);
+  if (start < size)
+    start_jobs(pool, jobs[b], n);
+
+  for (done = start; done < size; done = next) {
+    /* split the next bank off the buffer while the current one is parsed */
+    next = pos;
+    if (pos < size) {
+      pos = split_jobs(jobs[!b], n, buf, size, pos);
+      set_jobs_sample(jobs[!b], n, size - pos, jobs[b][0].sample);
+    }
+    join_jobs(pool);
+
+    if (next < size)
+      start_jobs(pool, jobs[!b], n);
+    consume_jobs(jobs[b], n, cb, data);
+    for (k = 0; k < n; k++)
+      total += jobs[b][k].cnt;
+
+    if (release)
+      release_mapping(buf, done, next);
+    b = !b;
+  }
+
+  return total;
+}
+
+/* Parse the bytes [from, to) of the given open log through conf.jobs parser
+ * threads without copying lines out of the mapping, see parse_jobs_range().
+ *
+ * Unless `whole` is set, a trailing line lacking its newline is left for a
+ * later call and `to` is moved back right past the last complete line.
+ *
+ * The mapping is private and writable, so the kernel copies the pages lines
+ * are terminated on. Consumed ranges are dropped as the file is walked.
+ *
+ * On error, the program exits.
+ * On success, the number of lines read is returned. */
+static uint64_t map_lines(int fd, const char *filename, GLog *glog,
+                          uint64_t from, uint64_t *to, int whole,
+                          GLogItemCb cb, void *data) {
+  GJob *jobs[2] = {NULL};
+  GJobPool *pool = NULL;
+  char *map = NULL;
+  uint64_t base = from - from % (uint64_t)sysconf(_SC_PAGESIZE), total = 0;
+  size_t maplen = 0, size = 0, start = from - base;
+  int n = MAX(conf.jobs, 1), b = 0;
+
+  if (*to <= from)
+    return 0;
+
+  maplen = size = *to - base;
+  map = mmap(NULL, maplen, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd,
+             (off_t)base);
+  if (map == MAP_FAILED)
+    FATAL("Unable to map the specified log file '%s'. %s", filename,
+          strerror(errno));
+  madvise(map, maplen, MADV_SEQUENTIAL);
+
+  if (!whole) {
+    while (size > start && map[size - 1] != '\n')
+      size--;
+    *to = base + size;
+  }
+
+  for (b = 0; b < 2; b++)
+    jobs[b] = new_jobs(n, glog);
+  pool = new_job_pool(n);
+
+  total = parse_jobs_range(jobs, pool, n, map, start, size, 1, cb, data);
+
+  free_job_pool(pool);
+  for (b = 0; b < 2; b++)
+    free_jobs(jobs[b], n);
+  munmap(map, maplen);
+
+  glog->bytes = size - start;
+  glog->length += size - start;
+
+  return total;
+}
+
+/* Tell whether a gzip member may start at `p`: a deflate header with no
+ * reserved flags set and a known extra flags byte, see RFC 1952. Within
+ * compressed data, this only tells a plausible member start. */
+static int is_gzip_member(const unsigned char *p, size_t len) {
+  return len >= 10 && p[0] == 0x1f && p[1] == 0x8b && p[2] == 8 &&
+         (p[3] & 0xe0) == 0 && (p[8] == 0 || p[8] == 2 || p[8] == 4);
+}
+
+/* Tell whether a zstd frame, or a skippable one, starts at `p`. */
+static int is_zstd_frame(const unsigned char *p, size_t len) {
+  if (len < 4)
+    return 0;
+  if (p[0] == 0x28 && p[1] == 0xb5 && p[2] == 0x2f && p[3] == 0xfd)
+    return 1;
+  return (p[0] & 0xf0) == 0x50 && p[1] == 0x2a && p[2] == 0x4d &&
+         p[3] == 0x18;
+}
+
+/* Tell the compression of a log out of its first bytes.
+ *
+ * If the log isn't compressed, LOG_CODEC_NONE is returned.
+ * Otherwise, its GLogCodec is returned. */
+static GLogCodec get_log_codec(const unsigned char *buf, size_t len) {
+  if (is_gzip_member(buf, len))
+    return LOG_CODEC_GZIP;
+  if (is_zstd_frame(buf, len))
+    return LOG_CODEC_ZSTD;
+  return LOG_CODEC_NONE;
+}
+
+/* Tell whether support for the given GLogCodec was built in. */
+static int has_log_codec(uint8_t codec) {
+  switch (codec) {
+  case LOG_CODEC_NONE:
+    return 1;
+#if defined(HAVE_ZLIB)
+  case LOG_CODEC_GZIP:
+    return 1;
+#endif
+#if defined(HAVE_LIBZSTD)
+  case LOG_CODEC_ZSTD:
+    return 1;
+#endif
+  default:
+    return 0;
+  }
+}
+
+/* Set the inode, size and compression of the log open at `fd`.
+ *
+ * On error, -1 is returned.
+ * On success, 0 is returned. */
+static int stat_log(int fd, GLog *glog) {
+  unsigned char magic[10];
+  struct stat st;
+  ssize_t len = 0;
+
+  if (fstat(fd, &st) == -1)
+    return -1;
+
+  glog->props.inode = st.st_ino;
+  glog->props.size = st.st_size;
+  len = pread(fd, magic, sizeof(magic), 0);
+  glog->props.codec = get_log_codec(magic, len > 0 ? len : 0);
+
+  return 0;
+}
+
+/* Open the given log and set its inode, size and compression.
+ *
+ * On error, -1 is returned.
+ * On success, the file descriptor is returned. */
+static int open_log(const char *filename, GLog *glog) {
+  int fd = -1;
+
+  if ((fd = open(filename, O_RDONLY)) == -1)
+    return -1;
+  if (stat_log(fd, glog) == -1) {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+/* Bytes of decompressed data handed from the decompression stage to the
+ * parsers at once */
+#define INFLATE_BLOCK_SIZE (1 << 20)
+/* Blocks the decompression stage may get ahead of the parsers */
+#define INFLATE_QUEUE_DEPTH 8
+/* Compressed bytes of a segment decompressed by a worker, see
+ * split_inflate_segs() */
+#define INFLATE_SEG_BYTES (1 << 20)
+/* Decompressed bytes a worker may keep ahead of its segment being handed
+ * over, the rest of the segment is decompressed when it is */
+#define INFLATE_SEG_OUT_MAX (16 * INFLATE_BLOCK_SIZE)
+
+/* Statuses of inflate_block() */
+enum {
+  INFLATE_MORE,  /* the output block is full */
+  INFLATE_LIMIT, /* stopped right past the first member ending at the limit
+                    or later */
+  INFLATE_EOF,   /* no member follows, i.e., the end of the data or bytes
+                    that aren't a member */
+  INFLATE_TRUNC, /* the data ends within a member */
+  INFLATE_ERR,   /* corrupt data */
+};
+
+/* Decoder walking the members (gzip) or frames (zstd) of a mapped log */
+typedef struct GInflate_ {
+  uint8_t codec;            /* GLogCodec */
+  uint8_t open;             /* within a member */
+  uint8_t init;             /* the decoder below was set up */
+  const unsigned char *map; /* compressed data */
+  size_t size;              /* bytes of compressed data */
+  size_t pos;               /* offset of the next compressed byte */
+#if defined(HAVE_ZLIB)
+  z_stream zs;
+#endif
+#if defined(HAVE_LIBZSTD)
+  ZSTD_DStream *zds;
+#endif
+} GInflate;
+
+/* A block of decompressed data */
+typedef struct GInflateBlock_ {
+  struct GInflateBlock_ *next;
+  size_t len;
+  char *data; /* INFLATE_BLOCK_SIZE bytes */
+} GInflateBlock;
+
+/* Decompression stage of inflate_lines(), run on its own thread and
+ * handing blocks over in input order */
+typedef struct GInflateStage_ {
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  GInflateBlock *head, *tail; /* blocks handed over, not parsed yet */
+  GInflateBlock *spare;       /* parsed blocks, for reuse */
+  int queued;                 /* blocks from head */
+  int done;                   /* no more blocks will be handed over */
+  int status;                 /* inflate_block() status it stopped on */
+  int workers;                /* segments decompressed at once */
+  uint8_t codec;
+  const unsigned char *map;
+  size_t from, to; /* compressed range, `to` is moved to where it stopped */
+} GInflateStage;
+
+/* A segment of a log decompressed ahead by a worker, see
+ * split_inflate_segs() */
+typedef struct GInflateSeg_ {
+  GInflateStage *stage;
+  GInflate inf;
+  size_t start;               /* offset of its first member */
+  size_t limit;               /* stop past the first member ending here */
+  int status;                 /* inflate_block() status it stopped on */
+  size_t out;                 /* bytes in the blocks below */
+  GInflateBlock *head, *tail; /* decompressed data */
+} GInflateSeg;
+
+static void init_inflate(GInflate *inf, uint8_t codec,
+                         const unsigned char *map, size_t size, size_t pos) {
+  memset(inf, 0, sizeof(*inf));
+  inf->codec = codec;
+  inf->map = map;
+  inf->size = size;
+  inf->pos = pos;
+}
+
+static void free_inflate(GInflate *inf) {
+  if (!inf->init)
+    return;
+#if defined(HAVE_ZLIB)
+  if (inf->codec == LOG_CODEC_GZIP)
+    inflateEnd(&inf->zs);
+#endif
+#if defined(HAVE_LIBZSTD)
+  if (inf->codec == LOG_CODEC_ZSTD)
+    ZSTD_freeDStream(inf->zds);
+#endif
+  inf->init = 0;
+}
+
+/* Set the decoder up for the member or frame at its position.
+ *
+ * If the decoder can't be set up, -1 is returned.
+ * If no member starts there, 0 is returned.
+ * On success, 1 is returned. */
+static int open_inflate_member(GInflate *inf) {
+  const unsigned char *p = inf->map + inf->pos;
+  size_t len = inf->size - inf->pos;
+
+#if defined(HAVE_ZLIB)
+  if (inf->codec == LOG_CODEC_GZIP) {
+    if (!is_gzip_member(p, len))
+      return 0;
+    if (!inf->init && inflateInit2(&inf->zs, 15 + 16) != Z_OK)
+      return -1;
+    if (inf->init && inflateReset(&inf->zs) != Z_OK)
+      return -1;
+    inf->init = inf->open = 1;
+    return 1;
+  }
+#endif
+#if defined(HAVE_LIBZSTD)
+  if (inf->codec == LOG_CODEC_ZSTD) {
+    if (!is_zstd_frame(p, len))
+      return 0;
+    if (!inf->init && (inf->zds = ZSTD_createDStream()) == NULL)
+      return -1;
+    inf->init = 1;
+    if (ZSTD_isError(ZSTD_initDStream(inf->zds)))
+      return -1;
+    inf->open = 1;
+    return 1;
+  }
+#endif
+  (void)p;
+  (void)len;
+
+  return -1;
+}
+
+#if defined(HAVE_ZLIB)
+/* Decompress the current gzip member into `out` from `*len` on, see
+ * inflate_member(). */
+static int inflate_gzip(GInflate *inf, char *out, size_t cap, size_t *len) {
+  z_stream *zs = &inf->zs;
+  int ret;
+
+  zs->next_in = (Bytef *)(inf->map + inf->pos);
+  zs->avail_in = (uInt)MIN(inf->size - inf->pos, (size_t)UINT_MAX);
+  zs->next_out = (Bytef *)(out + *len);
+  zs->avail_out = (uInt)MIN(cap - *len, (size_t)UINT_MAX);
+
+  ret = inflate(zs, Z_NO_FLUSH);
+  inf->pos = (const unsigned char *)zs->next_in - inf->map;
+  *len = (char *)zs->next_out - out;
+
+  if (ret == Z_STREAM_END)
+    return 1;
+  if (ret == Z_BUF_ERROR && inf->pos == inf->size)
+    return -2;
+  return ret == Z_OK ? 0 : -1;
+}
+#endif
+
+#if defined(HAVE_LIBZSTD)
+/* Decompress the current zstd frame into `out` from `*len` on, see
+ * inflate_member(). */
+static int inflate_zstd(GInflate *inf, char *out, size_t cap, size_t *len) {
+  ZSTD_inBuffer in = {inf->map, inf->size, inf->pos};
+  ZSTD_outBuffer dst = {out, cap, *len};
+  size_t ret = ZSTD_decompressStream(inf->zds, &dst, &in);
+  int moved = in.pos != inf->pos || dst.pos != *len;
+
+  inf->pos = in.pos;
+  *len = dst.pos;
+
+  if (ZSTD_isError(ret))
+    return -1;
+  if (ret == 0)
+    return 1;
+  if (!moved)
+    return inf->pos == inf->size ? -2 : -1;
+  return 0;
+}
+#endif
+
+/* Decompress part of the current member or frame into `out` from `*len`
+ * on, up to `cap`.
+ *
+ * If the data is corrupt, -1 is returned, and -2 if it ends within the
+ * member.
+ * On success, 1 is returned if the member ended, 0 otherwise. */
+static int inflate_member(GInflate *inf, char *out, size_t cap,
+                          size_t *len) {
+#if defined(HAVE_ZLIB)
+  if (inf->codec == LOG_CODEC_GZIP)
+    return inflate_gzip(inf, out, cap, len);
+#endif
+#if defined(HAVE_LIBZSTD)
+  if (inf->codec == LOG_CODEC_ZSTD)
+    return inflate_zstd(inf, out, cap, len);
+#endif
+  (void)inf;
+  (void)out;
+  (void)cap;
+  (void)len;
+
+  return -1;
+}
+
+/* Decompress members from the decoder's position into `out`, up to `cap`
+ * bytes, stopping right past the first member ending at offset `limit` or
+ * later. Concatenated members make up a single stream, as with zcat(1).
+ *
+ * On success, the number of bytes written is assigned to `len` and the
+ * INFLATE_* status it stopped on is returned. */
+static int inflate_block(GInflate *inf, char *out, size_t cap, size_t *len,
+                         size_t limit) {
+  int ret = 0;
+
+  *len = 0;
+  while (*len < cap) {
+    if (!inf->open) {
+      if (inf->pos >= limit)
+        return INFLATE_LIMIT;
+      if ((ret = open_inflate_member(inf)) <= 0)
+        return ret == 0 ? INFLATE_EOF : INFLATE_ERR;
+    }
+
+    if ((ret = inflate_member(inf, out, cap, len)) < 0)
+      return ret == -2 ? INFLATE_TRUNC : INFLATE_ERR;
+    if (ret == 1)
+      inf->open = 0;
+  }
+
+  return INFLATE_MORE;
+}
+
+/* Take a spare block of the stage, or a new one. */
+static GInflateBlock *get_inflate_block(GInflateStage *st) {
+  GInflateBlock *blk = NULL;
+
+  pthread_mutex_lock(&st->mutex);
+  if ((blk = st->spare))
+    st->spare = blk->next;
+  pthread_mutex_unlock(&st->mutex);
+
+  if (blk == NULL) {
+    blk = xcalloc(1, sizeof(GInflateBlock));
+    blk->data = xmalloc(INFLATE_BLOCK_SIZE);
+  }
+  blk->next = NULL;
+  blk->len = 0;
+
+  return blk;
+}
+
+/* Give a parsed (or empty) block back to the stage for reuse. */
+static void put_inflate_block(GInflateStage *st, GInflateBlock *blk) {
+  pthread_mutex_lock(&st->mutex);
+  blk->next = st->spare;
+  st->spare = blk;
+  pthread_mutex_unlock(&st->mutex);
+}
+
+static void free_inflate_blocks(GInflateBlock *blk) {
+  GInflateBlock *next = NULL;
+
+  for (; blk; blk = next) {
+    next = blk->next;
+    free(blk->data);
+    free(blk);
+  }
+}
+
+/* Hand a block over to the parsers, waiting while the stage is
+ * INFLATE_QUEUE_DEPTH blocks ahead of them. Empty blocks are kept. */
+static void push_inflate_block(GInflateStage *st, GInflateBlock *blk) {
+  if (blk->len == 0) {
+    put_inflate_block(st, blk);
+    return;
+  }
+
+  pthread_mutex_lock(&st->mutex);
+  while (st->queued >= INFLATE_QUEUE_DEPTH)
+    pthread_cond_wait(&st->cond, &st->mutex);
+  blk->next = NULL;
+  if (st->tail)
+    st->tail->next = blk;
+  else
+    st->head = blk;
+  st->tail = blk;
+  st->queued++;
+  pthread_cond_broadcast(&st->cond);
+  pthread_mutex_unlock(&st->mutex);
+}
+
+/* Take the next block handed over by the stage, waiting for it.
+ *
+ * If the stage is done, NULL is returned.
+ * On success, the block is returned and must be given back through
+ * put_inflate_block(). */
+static GInflateBlock *pop_inflate_block(GInflateStage *st) {
+  GInflateBlock *blk = NULL;
+
+  pthread_mutex_lock(&st->mutex);
+  while (st->head == NULL && !st->done)
+    pthread_cond_wait(&st->cond, &st->mutex);
+  if ((blk = st->head)) {
+    if ((st->head = blk->next) == NULL)
+      st->tail = NULL;
+    st->queued--;
+    pthread_cond_broadcast(&st->cond);
+  }
+  pthread_mutex_unlock(&st->mutex);
+
+  return blk;
+}
+
+/* Decompress from the decoder's position up to the first member ending at
+ * `limit` or later, handing blocks over as they fill up.
+ *
+ * On success, the inflate_block() status it stopped on is returned. */
+static int stream_inflate(GInflateStage *st, GInflate *inf, size_t limit) {
+  GInflateBlock *blk = NULL;
+  int status;
+
+  do {
+    blk = get_inflate_block(st);
+    status =
+        inflate_block(inf, blk->data, INFLATE_BLOCK_SIZE, &blk->len, limit);
+    push_inflate_block(st, blk);
+  } while (status == INFLATE_MORE);
+
+  return status;
+}
+
+/* Find where to split the compressed data at or past `target`, given that
+ * a member or frame starts at `pos`. Zstd frames are walked from `pos`, so
+ * the split is exact. Gzip members are only found by a plausible header,
+ * so the split may well fall within a member, see merge_inflate_seg().
+ *
+ * If there's no split before `to`, `to` is returned.
+ * On success, the offset of the split is returned. */
+static size_t next_inflate_split(uint8_t codec, const unsigned char *map,
+                                 size_t pos, size_t target, size_t to) {
+  const unsigned char *p = NULL;
+
+#if defined(HAVE_LIBZSTD)
+  size_t len = 0;
+
+  if (codec == LOG_CODEC_ZSTD) {
+    while (pos < target && pos < to) {
+      len = ZSTD_findFrameCompressedSize(map + pos, to - pos);
+      if (ZSTD_isError(len))
+        return to;
+      pos += len;
+    }
+    return MIN(pos, to);
+  }
+#endif
+  if (codec != LOG_CODEC_GZIP)
+    return to;
+
+  for (pos = target; pos < to; pos = (p - map) + 1) {
+    if ((p = memchr(map + pos, 0x1f, to - pos)) == NULL)
+      break;
+    if (is_gzip_member(p, to - (p - map)))
+      return p - map;
+  }
+
+  return to;
+}
+
+/* Split the compressed data from `pos` into up to st->workers segments of
+ * about INFLATE_SEG_BYTES each.
+ *
+ * On success, the number of segments is returned. */
+static int split_inflate_segs(GInflateStage *st, GInflateSeg *segs,
+                              size_t pos) {
+  size_t next, len;
+  int k;
+
+  for (k = 0; k < st->workers && pos < st->to; k++, pos = next) {
+    len = MIN((size_t)INFLATE_SEG_BYTES, st->to - pos);
+    next = next_inflate_split(st->codec, st->map, pos, pos + len, st->to);
+    memset(&segs[k], 0, sizeof(segs[k]));
+    segs[k].stage = st;
+    init_inflate(&segs[k].inf, st->codec, st->map, st->to, pos);
+    segs[k].start = pos;
+    segs[k].limit = next;
+  }
+
+  return k;
+}
+
+/* Decompress a segment ahead, up to INFLATE_SEG_OUT_MAX bytes. */
+static void *inflate_seg_thread(void *arg) {
+  GInflateSeg *seg = arg;
+  GInflateBlock *blk = NULL;
+
+  do {
+    blk = get_inflate_block(seg->stage);
+    seg->status = inflate_block(&seg->inf, blk->data, INFLATE_BLOCK_SIZE,
+                                &blk->len, seg->limit);
+    if (seg->tail)
+      seg->tail->next = blk;
+    else
+      seg->head = blk;
+    seg->tail = blk;
+    seg->out += blk->len;
+  } while (seg->status == INFLATE_MORE && seg->out < INFLATE_SEG_OUT_MAX);
+
+  return NULL;
+}
+
+/* Hand a segment decompressed ahead over if it starts right where the data
+ * handed over so far stops, `*pos`, which is a member boundary. A segment
+ * starting before it began on a false gzip header within the member the
+ * previous segment ran past, and is dropped. A segment starting past it is
+ * preceded by a gap that's decompressed here first.
+ *
+ * On success, `pos` is moved to where the data handed over stops, and the
+ * inflate_block() status it stopped on is returned. */
+static int merge_inflate_seg(GInflateStage *st, GInflateSeg *seg,
+                             size_t *pos) {
+  GInflateBlock *blk = NULL;
+  GInflate inf;
+  int status = INFLATE_LIMIT;
+
+  if (seg->start > *pos) {
+    init_inflate(&inf, st->codec, st->map, st->to, *pos);
+    status = stream_inflate(st, &inf, seg->start);
+    *pos = inf.pos;
+    free_inflate(&inf);
+    if (status != INFLATE_LIMIT)
+      return status;
+  }
+  if (seg->start != *pos)
+    return INFLATE_LIMIT;
+
+  while ((blk = seg->head)) {
+    seg->head = blk->next;
+    push_inflate_block(st, blk);
+  }
+  seg->tail = NULL;
+
+  status = seg->status;
+  if (status == INFLATE_MORE)
+    status = stream_inflate(st, &seg->inf, seg->limit);
+  *pos = seg->inf.pos;
+
+  return status;
+}
+
+/* Run the decompression stage. Data made of several members or frames is
+ * split into segments decompressed by st->workers threads at once, and
+ * handed over in input order as each one is done. Anything else is
+ * decompressed by this thread alone. */
+static void *inflate_thread(void *arg) {
+  GInflateStage *st = arg;
+  GInflateSeg *segs = xcalloc(st->workers, sizeof(GInflateSeg));
+  pthread_t *threads = xcalloc(st->workers, sizeof(pthread_t));
+  size_t pos = st->from;
+  int status = INFLATE_LIMIT, cnt, k;
+
+  while (status == INFLATE_LIMIT && pos < st->to) {
+    if ((cnt = split_inflate_segs(st, segs, pos)) == 1) {
+      status = stream_inflate(st, &segs[0].inf, segs[0].limit);
+      pos = segs[0].inf.pos;
+      free_inflate(&segs[0].inf);
+      continue;
+    }
+
+    for (k = 0; k < cnt; k++)
+      if (pthread_create(&threads[k], NULL, inflate_seg_thread, &segs[k]))
+        FATAL("Unable to create decompression thread - failed.");
+    for (k = 0; k < cnt; k++) {
+      pthread_join(threads[k], NULL);
+      if (status == INFLATE_LIMIT)
+        status = merge_inflate_seg(st, &segs[k], &pos);
+      free_inflate_blocks(segs[k].head);
+      free_inflate(&segs[k].inf);
+    }
+  }
+
+  free(segs);
+  free(threads);
+
+  pthread_mutex_lock(&st->mutex);
+  st->to = pos;
+  st->status = status;
+  st->done = 1;
+  pthread_cond_broadcast(&st->cond);
+  pthread_mutex_unlock(&st->mutex);
+
+  return NULL;
+}
+
+/* Append `n` bytes to a growable buffer. */
+static void append_inflate_carry(char **buf, size_t *len, size_t *cap,
+                                 const char *src, size_t n) {
+  if (n == 0)
+    return;
+  if (*len + n > *cap) {
+    *cap = MAX(*len + n, *cap * 2);
+    *buf = xrealloc(*buf, *cap);
+  }
+  memcpy(*buf + *len, src, n);
+  *len += n;
+}
+
+/* Parse the members or frames in the bytes [from, to) of the given open
+ * compressed log through `n` parser threads. The log is decompressed
+ * by a dedicated stage, see inflate_thread(), and each block it hands over
+ * is parsed in place as with map_lines(), a line split across blocks being
+ * put together first.
+ *
+ * `to` is moved right past the last member decompressed, so appended
+ * members or frames are picked up on the next call. A trailing line lacking
+ * its newline is parsed as well.
+ *
+ * On error, the program exits.
+ * On success, the number of lines read is returned. */
+static uint64_t inflate_lines(int fd, const char *filename, GLog *glog,
+                              uint64_t from, uint64_t *to, int n,
+                              GLogItemCb cb, void *data) {
+  GInflateStage st;
+  GInflateBlock *blk = NULL;
+  GJob *jobs[2] = {NULL};
+  GJobPool *pool = NULL;
+  pthread_t thread;
+  const char *nl = NULL;
+  char *map = NULL, *carry = NULL;
+  size_t carrylen = 0, carrycap = 0, start = 0, end = 0;
+  uint64_t total = 0;
+  int b = 0;
+
+  if (*to <= from)
+    return 0;
+  if (!has_log_codec(glog->props.codec))
+    FATAL("Unable to read the compressed log file '%s'. Support for its "
+          "compression wasn't built in.",
+          filename);
+
+  map = mmap(NULL, *to, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED)
+    FATAL("Unable to map the specified log file '%s'. %s", filename,
+          strerror(errno));
+  madvise(map, *to, MADV_SEQUENTIAL);
+
+  memset(&st, 0, sizeof(st));
+  pthread_mutex_init(&st.mutex, NULL);
+  pthread_cond_init(&st.cond, NULL);
+  st.workers = n;
+  st.codec = glog->props.codec;
+  st.map = (const unsigned char *)map;
+  st.from = from;
+  st.to = *to;
+  if (pthread_create(&thread, NULL, inflate_thread, &st))
+    FATAL("Unable to create decompression thread - failed.");
+
+  for (b = 0; b < 2; b++)
+    jobs[b] = new_jobs(n, glog);
+  pool = new_job_pool(n);
+
+  while ((blk = pop_inflate_block(&st))) {
+    start = 0;
+    /* complete the line split off the previous blocks */
+    if (carrylen) {
+      nl = memchr(blk->data, '\n', blk->len);
+      start = nl ? (size_t)(nl - blk->data) + 1 : blk->len;
+      append_inflate_carry(&carry, &carrylen, &carrycap, blk->data, start);
+      if (nl) {
+        total += parse_jobs_range(jobs, pool, n, carry, 0, carrylen, 0,
+                                  cb, data);
+        carrylen = 0;
+      }
+    }
+
+    for (end = blk->len; end > start && blk->data[end - 1] != '\n'; end--)
+      ;
+    if (end > start)
+      total += parse_jobs_range(jobs, pool, n, blk->data, start, end, 0,
+                                cb, data);
+    append_inflate_carry(&carry, &carrylen, &carrycap, blk->data + end,
+                         blk->len - end);
+    put_inflate_block(&st, blk);
+  }
+  if (carrylen)
+    total +=
+        parse_jobs_range(jobs, pool, n, carry, 0, carrylen, 0, cb, data);
+  pthread_join(thread, NULL);
+
+  free_job_pool(pool);
+  for (b = 0; b < 2; b++)
+    free_jobs(jobs[b], n);
+  free(carry);
+  free_inflate_blocks(st.spare);
+  pthread_mutex_destroy(&st.mutex);
+  pthread_cond_destroy(&st.cond);
+  munmap(map, *to);
+
+  if (st.status == INFLATE_ERR)
+    FATAL("Unable to decompress the specified log file '%s'.", filename);
+  if (st.status == INFLATE_TRUNC)
+    LOG_DEBUG(("Unexpected end of the compressed log %s\n", filename));
+
+  *to = st.to;
+  glog->bytes = *to - from;
+  glog->length += *to - from;
+
+  return total;
+}
+
+/* Memory-map the given log and parse it as a whole, see map_lines().
+ * Compressed logs are decompressed on the fly, see inflate_lines().
+ *
+ * On error, the program exits.
+ * On success, the number of lines read is returned. */
+uint64_t mmap_lines(const char *filename, GLog *glog, GLogItemCb cb,
+                    void *data) {
+  uint64_t total = 0, to = 0;
+  int fd = -1;
+
+  if ((fd = open_log(filename, glog)) == -1)
+    FATAL("Unable to open the specified log file '%s'. %s", filename,
+          strerror(errno));
+
+  to = glog->props.size;
+  if (glog->props.codec != LOG_CODEC_NONE)
+    total = inflate_lines(fd, filename, glog, 0, &to, MAX(conf.jobs, 1), cb,
+                          data);
+  else
+    total = map_lines(fd, filename, glog, 0, &to, 1, cb, data);
+  close(fd);
+
+  return total;
+}
+
+/* Bytes of a log taken by a worker of parse_logs() at once */
+#define LOG_TASK_BYTES (4 << 20)
+
+/* A byte range of a log, parsed by a worker of parse_logs() */
+typedef struct GLogTask_ {
+  uint32_t file;   /* index into GLogSched.files */
+  uint32_t seq;    /* position of the range within its log */
+  uint32_t sample; /* sampling rate of the range, see take_log_task() */
+  size_t from, to; /* byte range of whole lines */
+} GLogTask;
+
+/* A log being parsed by parse_logs() */
+typedef struct GLogFile_ {
+  GLog *glog;
+  char *map;      /* private mapping of the whole log, if not compressed */
+  size_t size;    /* bytes of the log */
+  int fd;         /* compressed logs are parsed from it, -1 otherwise */
+  uint32_t tasks; /* ranges the log was cut into */
+  uint32_t next;  /* next range to hand over to the consumer */
+} GLogFile;
+
+/* Ranges queued to a worker. The worker and idle workers stealing from it
+ * both take them from the front, so each log's ranges are claimed in
+ * order. */
+typedef struct GLogQueue_ {
+  GLogTask *tasks;
+  uint32_t head, len, cap;
+  uint64_t bytes; /* bytes left in the queue */
+} GLogQueue;
+
+/* Scheduler of parse_logs() */
+typedef struct GLogSched_ {
+  pthread_mutex_t mutex;
+  pthread_cond_t cond; /* a range was handed over */
+  GLogFile *files;
+  GLogQueue *queues;
+  int nfiles;
+  int workers;
+  uint32_t sample; /* sampling rate of the last range handed out */
+  GLogItemCb cb;
+  void *data;
+} GLogSched;
+
+/* A worker of parse_logs() */
+typedef struct GLogWorker_ {
+  GLogSched *sched;
+  GJob *job;
+  int idx;
+  uint64_t total; /* lines read */
+} GLogWorker;
+
+/* Open and map the given log for parse_logs(). Compressed logs are kept
+ * open instead, see inflate_lines().
+ *
+ * On error, the program exits. */
+static void open_log_file(GLogFile *f, GLog *glog) {
+  const char *filename = glog->props.filename;
+
+  memset(f, 0, sizeof(*f));
+  f->glog = glog;
+  if ((f->fd = open_log(filename, glog)) == -1)
+    FATAL("Unable to open the specified log file '%s'. %s", filename,
+          strerror(errno));
+  f->size = glog->props.size;
+
+  if (glog->props.codec != LOG_CODEC_NONE)
+    return;
+  if (f->size == 0) {
+    close(f->fd);
+    f->fd = -1;
+    return;
+  }
+
+  f->map = mmap(NULL, f->size, PROT_READ | PROT_WRITE, MAP_PRIVATE, f->fd, 0);
+  if (f->map == MAP_FAILED)
+    FATAL("Unable to map the specified log file '%s'. %s", filename,
+          strerror(errno));
+  madvise(f->map, f->size, MADV_SEQUENTIAL);
+  close(f->fd);
+  f->fd = -1;
+}
+
+static void push_log_task(GLogQueue *q, const GLogTask *t) {
+  if (q->len == q->cap) {
+    q->cap = q->cap ? q->cap * 2 : 64;
+    q->tasks = xrealloc(q->tasks, q->cap * sizeof(GLogTask));
+  }
+  q->tasks[q->len++] = *t;
+  q->bytes += t->to - t->from;
+}
+
+/* Order logs by decreasing size, see split_log_tasks(). */
+static int cmp_log_file_size(const void *a, const void *b) {
+  const GLogFile *x = *(GLogFile *const *)a, *y = *(GLogFile *const *)b;
+
+  if (x->size != y->size)
+    return x->size < y->size ? 1 : -1;
+  return 0;
+}
+
+/* Find the end of the range of a log starting at `from`: right past the
+ * first newline about LOG_TASK_BYTES on, or the end of the log. */
+static size_t get_log_task_end(const GLogFile *f, size_t from) {
+  size_t to = from + MIN((size_t)LOG_TASK_BYTES, f->size - from);
+  const char *nl = NULL;
+
+  if (to < f->size && f->map[to - 1] != '\n')
+    to = (nl = memchr(f->map + to, '\n', f->size - to))
+             ? (size_t)(nl - f->map) + 1
+             : f->size;
+
+  return to;
+}
+
+/* Cut every log into ranges of whole lines of about LOG_TASK_BYTES, a
+ * compressed log making a single range, and queue all the ranges of a log
+ * to the same worker. Ranges are cut before any is parsed, as parsing
+ * terminates lines in place. The largest logs go first, each to the worker
+ * with the fewest bytes queued, so the queues start out about even. */
+static void split_log_tasks(GLogSched *sc) {
+  GLogFile **order = xcalloc(sc->nfiles, sizeof(GLogFile *));
+  GLogQueue *q = NULL;
+  GLogFile *f = NULL;
+  GLogTask t;
+  int i, k;
+
+  for (i = 0; i < sc->nfiles; i++)
+    order[i] = &sc->files[i];
+  qsort(order, sc->nfiles, sizeof(GLogFile *), cmp_log_file_size);
+
+  for (i = 0; i < sc->nfiles; i++) {
+    f = order[i];
+    for (q = &sc->queues[0], k = 1; k < sc->workers; k++)
+      if (sc->queues[k].bytes < q->bytes)
+        q = &sc->queues[k];
+
+    t.file = f - sc->files;
+    for (t.seq = 0, t.from = 0; t.from < f->size; t.seq++, t.from = t.to) {
+      t.to = f->fd != -1 ? f->size : get_log_task_end(f, t.from);
+      push_log_task(q, &t);
+    }
+    f->tasks = t.seq;
+  }
+
+  free(order);
+}
+
+/* Take the next range off the worker's queue or, once it's empty, off the
+ * queue with the most bytes left. The range is sampled depending on the
+ * bytes left across all queues, see get_sample_rate().
+ *
+ * If there are no ranges left, 0 is returned.
+ * On success, 1 is returned and the range is copied to `t`. */
+static int take_log_task(GLogSched *sc, int idx, GLogTask *t) {
+  GLogQueue *q = &sc->queues[idx];
+  uint64_t pending = 0;
+  int k;
+
+  pthread_mutex_lock(&sc->mutex);
+  if (q->head == q->len) {
+    for (k = 0; k < sc->workers; k++)
+      if (sc->queues[k].bytes > q->bytes)
+        q = &sc->queues[k];
+  }
+  if (q->head == q->len) {
+    pthread_mutex_unlock(&sc->mutex);
+    return 0;
+  }
+  *t = q->tasks[q->head++];
+  q->bytes -= t->to - t->from;
+  for (pending = 0, k = 0; k < sc->workers; k++)
+    pending += sc->queues[k].bytes;
+  sc->sample = t->sample = get_sample_rate(pending, sc->sample);
+  pthread_mutex_unlock(&sc->mutex);
+
+  return 1;
+}
+
+/* Parse a range of a log and hand its items over to the consumer once the
+ * ranges before it are, so items of a log keep their order and its GLog
+ * counters are only updated by one worker at a time. */
+static void run_log_task(GLogWorker *w, const GLogTask *t) {
+  GLogSched *sc = w->sched;
+  GLogFile *f = &sc->files[t->file];
+  GJob *job = w->job;
+  uint64_t len = f->size;
+
+  if (f->fd != -1) {
+    w->total += inflate_lines(f->fd, f->glog->props.filename, f->glog, 0,
+                              &len, 1, sc->cb, sc->data);
+    close(f->fd);
+    f->fd = -1;
+    return;
+  }
+
+  job->glog = f->glog;
+  job->cnt = 0;
+  job->sample = t->sample;
+  job->begin = f->map + t->from;
+  job->end = f->map + t->to;
+  parse_job_lines(job);
+
+  pthread_mutex_lock(&sc->mutex);
+  while (f->next != t->seq)
+    pthread_cond_wait(&sc->cond, &sc->mutex);
+  pthread_mutex_unlock(&sc->mutex);
+
+  consume_jobs(job, 1, sc->cb, sc->data);
+  w->total += job->cnt;
+  job->begin = job->end = NULL;
+  release_mapping(f->map, t->from, t->to);
+  if (t->seq + 1 == f->tasks) {
+    munmap(f->map, f->size);
+    f->map = NULL;
+    f->glog->bytes = f->size;
+    f->glog->length += f->size;
+  }
+
+  pthread_mutex_lock(&sc->mutex);
+  f->next++;
+  pthread_cond_broadcast(&sc->cond);
+  pthread_mutex_unlock(&sc->mutex);
+}
+
+static void *parse_logs_thread(void *arg) {
+  GLogWorker *w = arg;
+  GLogTask t;
+
+  while (take_log_task(w->sched, w->idx, &t))
+    run_log_task(w, &t);
+
+  return NULL;
+}
+
+/* Parse every log of the given set through a pool of conf.jobs workers.
+ * Logs are cut into ranges of about LOG_TASK_BYTES, queued to the workers
+ * up front, and idle workers steal ranges from the busiest queue, so a
+ * large log is shared among all workers once the small ones are done.
+ *
+ * Items of a log are handed to `cb` in input order, and its GLog counters
+ * are kept as with mmap_lines(). `cb` may run concurrently for different
+ * logs, though never for the same one, and items passed to it are only
+ * valid during the callback.
+ *
+ * On error, the program exits.
+ * On success, the number of lines read is returned. */
+uint64_t parse_logs(Logs *logs, GLogItemCb cb, void *data) {
+  GLogSched sc;
+  GLogWorker *workers = NULL;
+  pthread_t *threads = NULL;
+  uint64_t total = 0;
+  int i, k;
+
+  memset(&sc, 0, sizeof(sc));
+  pthread_mutex_init(&sc.mutex, NULL);
+  pthread_cond_init(&sc.cond, NULL);
+  sc.workers = MAX(conf.jobs, 1);
+  sc.cb = cb;
+  sc.data = data;
+  sc.files = xcalloc(MAX(logs->size, 1), sizeof(GLogFile));
+  sc.queues = xcalloc(sc.workers, sizeof(GLogQueue));
+
+  for (i = 0; i < logs->size; i++)
+    if (logs->glog[i].props.filename)
+      open_log_file(&sc.files[sc.nfiles++], &logs->glog[i]);
+  split_log_tasks(&sc);
+
+  workers = xcalloc(sc.workers, sizeof(GLogWorker));
+  threads = xcalloc(sc.workers, sizeof(pthread_t));
+  for (k = 0; k < sc.workers; k++) {
+    workers[k].sched = &sc;
+    workers[k].idx = k;
+    workers[k].job = new_jobs(1, NULL);
+  }
+
+  if (sc.workers == 1)
+    parse_logs_thread(&workers[0]);
+  for (k = 0; sc.workers > 1 && k < sc.workers; k++)
+    if (pthread_create(&threads[k], NULL, parse_logs_thread, &workers[k]))
+      FATAL("Unable to create parser thread - failed.");
+  for (k = 0; sc.workers > 1 && k < sc.workers; k++)
+    pthread_join(threads[k], NULL);
+
+  for (k = 0; k < sc.workers; k++) {
+    total += workers[k].total;
+    free_jobs(workers[k].job, 1);
+    free(sc.queues[k].tasks);
+  }
+  for (i = 0; i < sc.nfiles; i++)
+    if (sc.files[i].fd != -1)
+      close(sc.files[i].fd);
+
+  free(workers);
+  free(threads);
+  free(sc.queues);
+  free(sc.files);
+  pthread_mutex_destroy(&sc.mutex);
+  pthread_cond_destroy(&sc.cond);
+
+  return total;
+}
+
+static int ht_insert_last_parse(uint64_t key, const GLastParse *lp);
+static GLastParse ht_get_last_parse(uint64_t key);
+int save_last_parse(const char *path);
+
+/* Record the resume state of the given log: the offset right past the last
+ * parsed line, the number of lines up to it and a snippet of the bytes
+ * right before it. The hash of its path lets the state of the file it
+ * replaced, once rotated, be dropped, see ht_insert_last_parse(). */
+static void set_last_parse(GLog *glog, const char *filename, int fd,
+                           uint64_t to, uint32_t line) {
+  GLastParse lp;
+
+  memset(&lp, 0, sizeof(lp));
+  lp.line = line;
+  lp.ts = time(NULL);
+  lp.size = to;
+  lp.pathhash = fnv1a_hash(filename, strlen(filename));
+  lp.snippetlen = MIN(to, READ_BYTES);
+  if (pread(fd, lp.snippet, lp.snippetlen, to - lp.snippetlen) !=
+      (ssize_t)lp.snippetlen)
+    lp.snippetlen = 0;
+
+  glog->lp = lp;
+  ht_insert_last_parse(glog->props.inode, &lp);
+}
+
+/* Determine where to continue parsing the given log from. The log is the
+ * same one as last parsed if the snippet recorded by set_last_parse() is
+ * still found right before the recorded offset.
+ *
+ * If the log was never parsed, rotated or truncated, 0 is returned.
+ * Otherwise, the offset right past the last parsed line is returned. */
+static uint64_t get_resume_offset(GLog *glog, int fd, GLastParse *lp) {
+  char buf[READ_BYTES];
+
+  *lp = ht_get_last_parse(glog->props.inode);
+  if (lp->size == 0 || lp->size > glog->props.size ||
+      lp->snippetlen > lp->size)
+    return 0;
+
+  if (pread(fd, buf, lp->snippetlen, lp->size - lp->snippetlen) !=
+          (ssize_t)lp->snippetlen ||
+      memcmp(buf, lp->snippet, lp->snippetlen) != 0)
+    return 0;
+
+  return lp->size;
+}
+
+/* Parse the complete lines appended to the log open at `fd` since its last
+ * parse and record the new state, see resume_lines(). If `whole` is set, a
+ * trailing line lacking its newline is parsed as well.
+ *
+ * On success, the number of lines read is returned. */
+static uint64_t parse_log_fd(int fd, const char *filename, GLog *glog,
+                             int whole, GLogItemCb cb, void *data) {
+  GLastParse lp;
+  uint64_t from = 0, to = 0, cnt = 0;
+
+  if ((from = get_resume_offset(glog, fd, &lp)) == 0)
+    lp.line = 0;
+
+  to = glog->props.size;
+  if (glog->props.codec != LOG_CODEC_NONE)
+    cnt = inflate_lines(fd, filename, glog, from, &to, MAX(conf.jobs, 1), cb,
+                        data);
+  else
+    cnt = map_lines(fd, filename, glog, from, &to, whole, cb, data);
+  if (to == from)
+    return cnt;
+
+  set_last_parse(glog, filename, fd, to, lp.line + cnt);
+  if (conf.resume_file && save_last_parse(conf.resume_file))
+    LOG_DEBUG(("Unable to save the resume state to %s\n", conf.resume_file));
+
+  return cnt;
+}
+
+/* Parse the complete lines appended to the given log since its last parse,
+ * see resume_lines().
+ *
+ * If unable to open the log, -1 is returned.
+ * On success, 0 is returned and the number of lines read is added to
+ * `total`. */
+static int resume_log(const char *filename, GLog *glog, GLogItemCb cb,
+                      void *data, uint64_t *total) {
+  int fd = -1;
+
+  if ((fd = open_log(filename, glog)) == -1)
+    return -1;
+
+  *total += parse_log_fd(fd, filename, glog, 0, cb, data);
+  close(fd);
+
+  return 0;
+}
+
+/* Parse the lines appended to the followed log open at `fd`, see
+ * follow_lines(). The log is kept open across passes, so once another file
+ * shows up at its path, i.e., it was rotated, the lines appended to it
+ * until then are parsed, a trailing partial one included, before the new
+ * file is opened. A log that was deleted is kept open until it's replaced,
+ * as it may still be written to.
+ *
+ * On success, the number of lines read is added to `total`. */
+static void follow_log(const char *filename, GLog *glog, int *fd,
+                       GLogItemCb cb, void *data, uint64_t *total) {
+  struct stat st;
+  int rotated = 0;
+
+  if (*fd != -1 && stat_log(*fd, glog) == 0) {
+    rotated = stat(filename, &st) == 0 &&
+              (uint64_t)st.st_ino != glog->props.inode;
+    *total += parse_log_fd(*fd, filename, glog, rotated, cb, data);
+    if (!rotated)
+      return;
+  }
+
+  if (*fd != -1)
+    close(*fd);
+  if ((*fd = open_log(filename, glog)) != -1)
+    *total += parse_log_fd(*fd, filename, glog, 0, cb, data);
+}
+
+/* Parse the lines appended to the given log since its last parse, as kept
+ * by ht_insert_last_parse() (see load_last_parse() to restore it on
+ * restart), and record the new state. A log whose snippet no longer matches
+ * was rotated or truncated, so it's parsed from the start. Only lines ending
+ * in a newline are parsed, a trailing partial line is left for the next
+ * call. Compressed logs are picked up from the last member or frame parsed,
+ * i.e., members appended since.
+ *
+ * If conf.resume_file is set, the state of all logs is saved to it after
+ * new lines were parsed.
+ *
+ * On error, the program exits.
+ * On success, the number of lines read is returned. */
+uint64_t resume_lines(const char *filename, GLog *glog, GLogItemCb cb,
+                      void *data) {
+  uint64_t total = 0;
+
+  if (resume_log(filename, glog, cb, data, &total) == -1)
+    FATAL("Unable to open the specified log file '%s'. %s", filename,
+          strerror(errno));
+
+  return total;
+}
+
+/* Time to wait for the log to change before checking it anyway */
+#define FOLLOW_POLL_MS 250
+
+#if defined(__linux__)
+#define FOLLOW_EVENTS (IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF)
+
+/* (Re)watch the given log for changes, e.g., after it was rotated.
+ *
+ * On error, -1 is returned.
+ * On success, the watch descriptor is returned. */
+static int watch_log(int ifd, int wd, const char *filename) {
+  if (wd != -1)
+    inotify_rm_watch(ifd, wd);
+  return inotify_add_watch(ifd, filename, FOLLOW_EVENTS);
+}
+
+/* Wait up to FOLLOW_POLL_MS for an inotify event on the log, rewatching it
+ * if it was moved or deleted. */
+static void wait_log(int ifd, int *wd, const char *filename) {
+  char buf[4096]
+      __attribute__((aligned(__alignof__(struct inotify_event))));
+  const struct inotify_event *ev = NULL;
+  struct pollfd pfd = {.fd = ifd, .events = POLLIN};
+  ssize_t len = 0, i;
+  int rewatch = *wd == -1;
+
+  if (poll(&pfd, 1, FOLLOW_POLL_MS) > 0) {
+    while ((len = read(ifd, buf, sizeof(buf))) > 0) {
+      for (i = 0; i < len; i += sizeof(*ev) + ev->len) {
+        ev = (const struct inotify_event *)(buf + i);
+        if (ev->mask & (IN_MOVE_SELF | IN_DELETE_SELF | IN_IGNORED))
+          rewatch = 1;
+      }
+    }
+  }
+
+  if (rewatch)
+    *wd = watch_log(ifd, *wd, filename);
+}
+#endif
+
+/* Follow the given log, parsing lines as they are appended to it, until
+ * `stop` is set. Changes are waited for through inotify when available, or
+ * by polling every FOLLOW_POLL_MS otherwise, and each pass goes through
+ * follow_log(), which also takes care of rotated and truncated logs. A log
+ * missing for a while, e.g., while being rotated, is waited for.
+ *
+ * On success, the number of lines read is returned. */
+uint64_t follow_lines(const char *filename, GLog *glog, GLogItemCb cb,
+                      void *data, const volatile int *stop) {
+  uint64_t total = 0;
+  int fd = -1;
+#if defined(__linux__)
+  int ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC), wd = -1;
+
+  if (ifd != -1)
+    wd = watch_log(ifd, -1, filename);
+#endif
+
+  while (!*stop) {
+    follow_log(filename, glog, &fd, cb, data, &total);
+#if defined(__linux__)
+    if (ifd != -1) {
+      wait_log(ifd, &wd, filename);
+      continue;
+    }
+#endif
+    poll(NULL, 0, FOLLOW_POLL_MS);
+  }
+
+#if defined(__linux__)
+  if (ifd != -1)
+    close(ifd);
+#endif
+  if (fd != -1)
+    close(fd);
+
+  return total;
+}
+
+/* Attempt to extract the client IP from an X-Forwarded-For (XFF) slice, see
+ * scan_xff_host().
+ *
+ * If no IP is found, 1 is returned.
+ * On success, the slice is assigned to GLogItemView->host and 0 is
+ * returned. */
+static int set_xff_host_view(GLogItemView *view, const char *str, size_t slen,
+                             const char *skips, int out) {
+  return scan_xff_host(str, slen, skips, out, &view->host, &view->type_ip,
+                       view->addr);
+}
+
+/* Extract the client IP from an X-Forwarded-For (XFF) field, same as
+ * find_xff_host_delim().
+ *
+ * If no IP is found, 1 is returned.
+ * On success, the slice is assigned to GLogItemView->host and 0 is
+ * returned. */
+static int find_xff_host_view(GLogItemView *view, const char **str,
+                              const char *skips, char delim) {
+  GStrView extract;
+  char pch[2] = {0};
+  int res = 0;
+
+  /* range of IPs within hard delimiters */
+  if (!strchr(skips, delim) && strchr(*str, delim)) {
+    *pch = delim;
+    if (parse_string_view(&(*str), pch, 1, &extract))
+      return 0;
+
+    res = set_xff_host_view(view, extract.ptr, extract.len, skips, 1);
+    (*str)++; /* move a char forward from the trailing delim */
+  } else {
+    res = set_xff_host_view(view, *str, strlen(*str), skips, 0);
+  }
+
+  return res;
+}
+
+/* Execute the given compiled log format against a log string, same as
+ * parse_format_prog() but filling a GLogItemView.
+ *
+ * On error, or unable to parse it, 1 is returned.
+ * On success, 0 is returned. */
+static int parse_format_prog_view(GLogItemView *view, const char *str,
+                                  const GLogFmtProg *prog) {
+  const GLogFmtOp *op = NULL;
+  const char *line = str, *tok = str;
+  int i, n, ret = 0;
+
+  if (str == NULL || *str == '\0')
+    return 1;
+
+  for (i = 0; i < prog->size; i++) {
+    op = &prog->ops[i];
+    tok = str;
+
+    if (op->type == LFMT_OP_LITERAL) {
+      for (n = 0; n < op->len; n++, str++) {
+        if (*str == '\0') {
+          ret = spec_err_view(view, ERR_SPEC_LINE_INV, '-', NULL);
+          goto fail;
+        }
+        if (*str == '\n')
+          return 0;
+      }
+      continue;
+    }
+
+    if (*str == '\0') {
+      ret = spec_err_view(view, ERR_SPEC_LINE_INV, '-', NULL);
+      goto fail;
+    }
+    if (*str == '\n')
+      return 0;
+
+    switch (op->type) {
+    case LFMT_OP_SPEC:
+      if ((ret = parse_specifier_view(view, &str, op->spec, op->end)))
+        goto fail;
+      break;
+    case LFMT_OP_XFF:
+      if (find_xff_host_view(view, &str, op->skips, op->end[0])) {
+        ret = spec_err_view(view, ERR_SPEC_TOKN_NUL, 'h', NULL);
+        goto fail;
+      }
+      break;
+    case LFMT_OP_FAIL:
+      ret = spec_err_view(view, ERR_SPEC_TOKN_NUL, 'h', NULL);
+      goto fail;
+    default:
+      break;
+    }
+  }
+
+  return 0;
+
+fail:
+  view->err.off = tok - line;
+  return ret;
+}
+
+/* Ensure we have the following fields, see verify_missing_fields(). */
+static int verify_missing_fields_view(GLogItemView *view) {
+  /* must have the following fields */
+  if (view->host.ptr == NULL)
+    view->err.code = ERR_MISS_HOST;
+  else if (view->date.ptr == NULL)
+    view->err.code = ERR_MISS_DATE;
+  else if (view->req.ptr == NULL)
+    view->err.code = ERR_MISS_REQ;
+  else
+    return 0;
+
+  if (!conf.compact_errors)
+    view->errstr = log_err_str(&view->err);
+
+  return 1;
+}
+
+/* Process a line from the log without copying its fields. This is the
+ * zero-copy counterpart of parse_line(): slices in the view point into
+ * `line`, so they are only valid for as long as `line` is and until the
+ * next call that reuses the same view.
+ *
+ * Only non-JSON log formats are supported as JSON values are unescaped into
+ * a temporary buffer by the JSON reader.
+ *
+ * The return values are the same as parse_line().
+ * On error, view->errstr will contains the error message. */
+int parse_line_view(const char *line, GLogItemView *view) {
+  int ret = 0;
+
+  /* soft ignore these lines */
+  if (valid_line(line))
+    return -1;
+
+  reset_log_item_view(view, strlen(line));
+
+  if (active_parser->is_json_log_format || !active_parser->log_format_prog) {
+    view->err.code = ERR_LOG_FMT_UNSUP;
+    if (!conf.compact_errors)
+      view->errstr = log_err_str(&view->err);
+    return 1;
+  }
+
+  /* invalid log line (format issue) */
+  if ((ret = parse_format_prog_view(view, line,
+                                    active_parser->log_format_prog)))
+    return ret;
+
+  /* valid format but missing fields */
+  if ((ret = verify_missing_fields_view(view)))
+    return ret;
+
+  /* agent will be null in cases where %u is not specified */
+  if (view->agent.ptr == NULL)
+    view->agent = str_view("-");
+
+  return ret;
+}
+
+/* Determine if the log/date/time were set, otherwise exit the program
+ * execution. */
+static const char *verify_formats(const char *log_format,
+                                  const char *date_format,
+                                  const char *time_format) {
+  if (time_format == NULL || *time_format == '\0')
+    return ERR_FORMAT_NO_TIME_FMT;
+
+  if (date_format == NULL || *date_format == '\0')
+    return ERR_FORMAT_NO_DATE_FMT;
+
+  if (log_format == NULL || *log_format == '\0')
+    return ERR_FORMAT_NO_LOG_FMT;
+
+  return NULL;
+}
+
+/* predefined log times */
+typedef struct GPreConfTime_ {
+  const char *fmt24;
+  const char *usec;
+  const char *sec;
+} GPreConfTime;
+
+/* predefined log dates */
+typedef struct GPreConfDate_ {
+  const char *apache;
+  const char *w3c;
+  const char *usec;
+  const char *sec;
+} GPreConfDate;
+
+/* predefined log formats */
+typedef struct GPreConfLog_ {
+  const char *combined;
+  const char *vcombined;
+  const char *common;
+  const char *vcommon;
+  const char *w3c;
+  const char *cloudfront;
+  const char *cloudstorage;
+  const char *awselb;
+  const char *squid;
+  const char *awss3;
+  const char *caddy;
+  const char *awsalb;
+  const char *traefikclf;
+} GPreConfLog;
+
+static const GPreConfLog logs = {
+    "%h %^[%d:%t %^] \"%r\" %s %b \"%R\" \"%u\"",       /* NCSA */
+    "%v:%^ %h %^[%d:%t %^] \"%r\" %s %b \"%R\" \"%u\"", /* NCSA + VHost
+                                                         */
+    "%h %^[%d:%t %^] \"%r\" %s %b",                     /* CLF */
+    "%v:%^ %h %^[%d:%t %^] \"%r\" %s %b",               /* CLF+VHost */
+    "%d %t %^ %m %U %q %^ %^ %h %u %R %s %^ %^ %L",     /* W3C */
+    "%d\\t%t\\t%^\\t%b\\t%h\\t%m\\t%v\\t%U\\t%s\\t%R\\t%u\\t%q\\t%^\\t%"
+    "C\\t%^"
+    "\\t%^\\t%^\\t%^\\t%T\\t%^\\t%K\\t%k\\t%^\\t%H\\t%^", /* CloudFront
+                                                           */
+    "\"%x\",\"%h\",%^,%^,\"%m\",\"%U\",\"%s\",%^,\"%b\",\"%D\",%^,\"%"
+    "R\",\"%"
+    "u\"", /* Cloud Storage */
+    "%^ %dT%t.%^ %^ %h:%^ %^ %^ %T %^ %s %^ %^ %b \"%r\" \"%u\" %k %K "
+    "%^ "
+    "\"%^\" \"%v\"", /* AWS Elastic Load Balancing */
+    "%^ %^ %^ %v %^: %x.%^ %~%L %h %^/%s %b %m %U", /* Squid Native */
+    "%^ %v [%d:%t %^] %h %^\"%r\" %s %^ %b %^ %L %^ \"%R\" \"%u\"", /* Amazon
+                                                                     * S3
+                                                                     */
+
+    /* Caddy JSON */
+    "{ \"ts\": \"%x.%^\", \"request\": { \"client_ip\": \"%h\", "
+    "\"proto\":"
+    "\"%H\", \"method\": \"%m\", \"host\": \"%v\", \"uri\": \"%U\", "
+    "\"headers\": {"
+    "\"User-Agent\": [\"%u\"], \"Referer\": [\"%R\"] }, \"tls\": { "
+    "\"cipher_suite\":"
+    "\"%k\", \"proto\": \"%K\" } }, \"duration\": \"%T\", \"size\": "
+    "\"%b\","
+    "\"status\": \"%s\", \"resp_headers\": { \"Content-Type\": "
+    "[\"%M\"] } }",
+
+    "%^ %dT%t.%^ %v %h:%^ %^ %^ %T %^ %s %^ %^ %b \"%r\" \"%u\" %k %K "
+    "%^", /* Amazon
+             ALB
+           */
+
+    "%h - %e [%d:%t %^] \"%r\" %s %b \"%R\" \"%u\" %^ \"%v\" \"%U\" "
+    "%Lms" /* Traefik's
+              CLF
+              flavor
+              with
+              header
+            */
+};
+
+/* Operations of the preset log formats, as compile_log_format() outputs
+ * them, one L(len) per LFMT_OP_LITERAL and one S(spec, end) per
+ * LFMT_OP_SPEC. Each list is expanded twice by LFMT_PRESET_PARSER(), once
+ * into the table find_preset_parser() checks against the compiled preset,
+ * and once into the straight-line body of its parser. */
+#define LFMT_COMBINED_OPS(L, S) \
+  S("h ", " ") L(1) S("^[", "[") L(1) S("d:", ":") L(1) S("t ", " ") L(1) \
+  S("^]", "]") L(3) S("r\"", "\"") L(2) S("s ", " ") L(1) S("b ", " ") L(2) \
+  S("R\"", "\"") L(3) S("u\"", "\"") L(1)
+
+#define LFMT_VCOMBINED_OPS(L, S) \
+  S("v:", ":") L(1) S("^ ", " ") L(1) S("h ", " ") L(1) S("^[", "[") L(1) \
+  S("d:", ":") L(1) S("t ", " ") L(1) S("^]", "]") L(3) S("r\"", "\"") L(2) \
+  S("s ", " ") L(1) S("b ", " ") L(2) S("R\"", "\"") L(3) S("u\"", "\"") \
+  L(1)
+
+#define LFMT_COMMON_OPS(L, S) \
+  S("h ", " ") L(1) S("^[", "[") L(1) S("d:", ":") L(1) S("t ", " ") L(1) \
+  S("^]", "]") L(3) S("r\"", "\"") L(2) S("s ", " ") L(1) S("b", "")
+
+#define LFMT_VCOMMON_OPS(L, S) \
+  S("v:", ":") L(1) S("^ ", " ") L(1) S("h ", " ") L(1) S("^[", "[") L(1) \
+  S("d:", ":") L(1) S("t ", " ") L(1) S("^]", "]") L(3) S("r\"", "\"") L(2) \
+  S("s ", " ") L(1) S("b", "")
+
+#define LFMT_W3C_OPS(L, S) \
+  S("d ", " ") L(1) S("t ", " ") L(1) S("^ ", " ") L(1) S("m ", " ") L(1) \
+  S("U ", " ") L(1) S("q ", " ") L(1) S("^ ", " ") L(1) S("^ ", " ") L(1) \
+  S("h ", " ") L(1) S("u ", " ") L(1) S("R ", " ") L(1) S("s ", " ") L(1) \
+  S("^ ", " ") L(1) S("^ ", " ") L(1) S("L", "")
+
+#define LFMT_CLOUDFRONT_OPS(L, S) \
+  S("d\t", "\t") L(1) S("t\t", "\t") L(1) S("^\t", "\t") L(1) \
+  S("b\t", "\t") L(1) S("h\t", "\t") L(1) S("m\t", "\t") L(1) \
+  S("v\t", "\t") L(1) S("U\t", "\t") L(1) S("s\t", "\t") L(1) \
+  S("R\t", "\t") L(1) S("u\t", "\t") L(1) S("q\t", "\t") L(1) \
+  S("^\t", "\t") L(1) S("C\t", "\t") L(1) S("^\t", "\t") L(1) \
+  S("^\t", "\t") L(1) S("^\t", "\t") L(1) S("^\t", "\t") L(1) \
+  S("T\t", "\t") L(1) S("^\t", "\t") L(1) S("K\t", "\t") L(1) \
+  S("k\t", "\t") L(1) S("^\t", "\t") L(1) S("H\t", "\t") L(1) S("^", "")
+
+#define LFMT_CLOUDSTORAGE_OPS(L, S) \
+  L(1) S("x\"", "\"") L(3) S("h\"", "\"") L(2) S("^,", ",") L(1) \
+  S("^,", ",") L(2) S("m\"", "\"") L(3) S("U\"", "\"") L(3) S("s\"", "\"") \
+  L(2) S("^,", ",") L(2) S("b\"", "\"") L(3) S("D\"", "\"") L(2) \
+  S("^,", ",") L(2) S("R\"", "\"") L(3) S("u\"", "\"") L(1)
+
+#define LFMT_AWSELB_OPS(L, S) \
+  S("^ ", " ") L(1) S("dT", "T") L(1) S("t.", ".") L(1) S("^ ", " ") L(1) \
+  S("^ ", " ") L(1) S("h:", ":") L(1) S("^ ", " ") L(1) S("^ ", " ") L(1) \
+  S("^ ", " ") L(1) S("T ", " ") L(1) S("^ ", " ") L(1) S("s ", " ") L(1) \
+  S("^ ", " ") L(1) S("^ ", " ") L(1) S("b ", " ") L(2) S("r\"", "\"") L(3) \
+  S("u\"", "\"") L(2) S("k ", " ") L(1) S("K ", " ") L(1) S("^ ", " ") L(2) \
+  S("^\"", "\"") L(3) S("v\"", "\"") L(1)
+
+#define LFMT_SQUID_OPS(L, S) \
+  S("^ ", " ") L(1) S("^ ", " ") L(1) S("^ ", " ") L(1) S("v ", " ") L(1) \
+  S("^:", ":") L(2) S("x.", ".") L(1) S("^ ", " ") L(1) S("~%", "%") \
+  S("L ", " ") L(1) S("h ", " ") L(1) S("^/", "/") L(1) S("s ", " ") L(1) \
+  S("b ", " ") L(1) S("m ", " ") L(1) S("U", "")
+
+#define LFMT_AWSS3_OPS(L, S) \
+  S("^ ", " ") L(1) S("v ", " ") L(2) S("d:", ":") L(1) S("t ", " ") L(1) \
+  S("^]", "]") L(2) S("h ", " ") L(1) S("^\"", "\"") L(1) S("r\"", "\"") \
+  L(2) S("s ", " ") L(1) S("^ ", " ") L(1) S("b ", " ") L(1) S("^ ", " ") \
+  L(1) S("L ", " ") L(1) S("^ ", " ") L(2) S("R\"", "\"") L(3) \
+  S("u\"", "\"") L(1)
+
+#define LFMT_AWSALB_OPS(L, S) \
+  S("^ ", " ") L(1) S("dT", "T") L(1) S("t.", ".") L(1) S("^ ", " ") L(1) \
+  S("v ", " ") L(1) S("h:", ":") L(1) S("^ ", " ") L(1) S("^ ", " ") L(1) \
+  S("^ ", " ") L(1) S("T ", " ") L(1) S("^ ", " ") L(1) S("s ", " ") L(1) \
+  S("^ ", " ") L(1) S("^ ", " ") L(1) S("b ", " ") L(2) S("r\"", "\"") L(3) \
+  S("u\"", "\"") L(2) S("k ", " ") L(1) S("K ", " ") L(1) S("^", "")
+
+#define LFMT_TRAEFIKCLF_OPS(L, S) \
+  S("h ", " ") L(3) S("e ", " ") L(2) S("d:", ":") L(1) S("t ", " ") L(1) \
+  S("^]", "]") L(3) S("r\"", "\"") L(2) S("s ", " ") L(1) S("b ", " ") L(2) \
+  S("R\"", "\"") L(3) S("u\"", "\"") L(2) S("^ ", " ") L(2) S("v\"", "\"") \
+  L(3) S("U\"", "\"") L(2) S("Lm", "m") L(2)
+
+#define LFMT_TABLE_LIT(n) {LFMT_OP_LITERAL, (n), "", "", NULL},
+#define LFMT_TABLE_SPEC(spec, end) {LFMT_OP_SPEC, 0, spec, end, NULL},
+#define LFMT_STEP_LIT(n)                                                       \
+  if ((ret = step_log_literal(logitem, &str, line, (n))) != LFMT_NEXT)         \
+    return ret;
+#define LFMT_STEP_SPEC(spec, end)                                              \
+  if ((ret = step_log_spec(logitem, &str, line, spec, end)) != LFMT_NEXT)      \
+    return ret;
+
+/* Define name_ops[] and parse_name_format(), the latter being
+ * parse_format_prog() unrolled over the former, so delimiters and field
+ * order are constants instead of being dispatched on for every line. */
+#define LFMT_PRESET_PARSER(name, OPS)                                          \
+  static const GLogFmtOp name##_ops[] = {OPS(LFMT_TABLE_LIT, LFMT_TABLE_SPEC)};\
+  static int parse_##name##_format(GLogItem *logitem, const char *str) {       \
+    const char *line = str;                                                    \
+    int ret = 0;                                                               \
+                                                                               \
+    if (str == NULL || *str == '\0')                                           \
+      return 1;                                                                \
+    OPS(LFMT_STEP_LIT, LFMT_STEP_SPEC)                                         \
+    return 0;                                                                  \
+  }
+
+LFMT_PRESET_PARSER(combined, LFMT_COMBINED_OPS)
+LFMT_PRESET_PARSER(vcombined, LFMT_VCOMBINED_OPS)
+LFMT_PRESET_PARSER(common, LFMT_COMMON_OPS)
+LFMT_PRESET_PARSER(vcommon, LFMT_VCOMMON_OPS)
+LFMT_PRESET_PARSER(w3c, LFMT_W3C_OPS)
+LFMT_PRESET_PARSER(cloudfront, LFMT_CLOUDFRONT_OPS)
+LFMT_PRESET_PARSER(cloudstorage, LFMT_CLOUDSTORAGE_OPS)
+LFMT_PRESET_PARSER(awselb, LFMT_AWSELB_OPS)
+LFMT_PRESET_PARSER(squid, LFMT_SQUID_OPS)
+LFMT_PRESET_PARSER(awss3, LFMT_AWSS3_OPS)
+LFMT_PRESET_PARSER(awsalb, LFMT_AWSALB_OPS)
+LFMT_PRESET_PARSER(traefikclf, LFMT_TRAEFIKCLF_OPS)
+
+/* A preset log format along with its specialized parser */
+typedef struct GLogPresetParser_ {
+  const char *const *lfmt; /* preset log format, within logs */
+  const GLogFmtOp *ops;    /* operations the parser was generated from */
+  int size;                /* num ops */
+  GLogFmtFn parse;
+} GLogPresetParser;
+
+#define LFMT_PRESET(name)                                                      \
+  {&logs.name, name##_ops, ARRAY_SIZE(name##_ops), parse_##name##_format}
+
+static const GLogPresetParser preset_parsers[] = {
+    LFMT_PRESET(combined), LFMT_PRESET(vcombined),    LFMT_PRESET(common),
+    LFMT_PRESET(vcommon),  LFMT_PRESET(w3c),          LFMT_PRESET(cloudfront),
+    LFMT_PRESET(cloudstorage), LFMT_PRESET(awselb),   LFMT_PRESET(squid),
+    LFMT_PRESET(awss3),    LFMT_PRESET(awsalb),       LFMT_PRESET(traefikclf),
+};
+
+/* Determine if the given compiled log format is made of the given
+ * operations.
+ *
+ * If it isn't, 0 is returned.
+ * If it is, 1 is returned. */
+static int is_log_format_ops(const GLogFmtProg *prog, const GLogFmtOp *ops,
+                             int size) {
+  int i;
+
+  if (prog->size != size)
+    return 0;
+
+  for (i = 0; i < size; i++) {
+    if (prog->ops[i].type != ops[i].type || prog->ops[i].len != ops[i].len ||
+        strcmp(prog->ops[i].spec, ops[i].spec) != 0 ||
+        strcmp(prog->ops[i].end, ops[i].end) != 0)
+      return 0;
+  }
+  return 1;
+}
+
+/* Find the specialized parser of the given log format, which has to be one
+ * of the presets as is. Should the preset have changed without its
+ * LFMT_*_OPS list, the compiled log format tells them apart and the generic
+ * parser is used instead.
+ *
+ * If there's none, NULL is returned.
+ * On success, the parser is returned. */
+static GLogFmtFn find_preset_parser(const char *lfmt,
+                                    const GLogFmtProg *prog) {
+  const GLogPresetParser *p = NULL;
+  char *preset = NULL;
+  size_t i;
+  int match = 0;
+
+  for (i = 0; i < ARRAY_SIZE(preset_parsers); i++) {
+    p = &preset_parsers[i];
+    preset = unescape_str(*p->lfmt);
+    match = strcmp(preset, lfmt) == 0;
+    free(preset);
+
+    if (match)
+      return is_log_format_ops(prog, p->ops, p->size) ? p->parse : NULL;
+  }
+  return NULL;
+}
+
+static const GPreConfTime times = {
+    "%H:%M:%S", "%f", /* Cloud Storage (usec) */
+    "%s",             /* Squid (sec) */
+};
+
+static const GPreConfDate dates = {
+    "%d/%b/%Y", /* Apache */
+    "%Y-%m-%d", /* W3C */
+    "%f",       /* Cloud Storage (usec) */
+    "%s",       /* Squid (sec) */
+};
+
+/* Iterate over the given format and clean unwanted chars and keep all
+ * date/time specifiers such as %b%Y%d%M%S.
+ *
+ * On error NULL is returned.
+ * On success, a clean format containing only date/time specifiers is
+ * returned. */
+static char *clean_date_time_format(const char *format) {
+  char *fmt = NULL, *pr = NULL, *pw = NULL;
+  int special = 0;
+
+  if (format == NULL || *format == '\0')
+    return NULL;
+
+  fmt = xstrdup(format);
+  pr = fmt;
+  pw = fmt;
+  while (*pr) {
+    *pw = *pr++;
+    if (*pw == '%' || special) {
+      special = !special;
+      pw++;
+    }
+  }
+  *pw = '\0';
+
+  return fmt;
+}
+
+/* A wrapper to extract date specifiers from a date format.
+ *
+ * On error NULL is returned.
+ * On success, a clean format containing only date specifiers is
+ * returned. */
+static char *set_format_date(const GLogParser *parser) {
+  char *fdate = NULL;
+
+  if (has_timestamp(parser->date_format))
+    fdate = xstrdup("%Y%m%d");
+  else
+    fdate = clean_date_time_format(parser->date_format);
+
+  return fdate;
+}
+
+/* Determine if the given specifier character is an abbreviated type
+ * of date.
+ *
+ * If it is, 1 is returned, otherwise, 0 is returned. */
+static int is_date_abbreviated(const char *fdate) {
+  if (strpbrk(fdate, "cDF"))
+    return 1;
+
+  return 0;
+}
+
+/* Normalize the date format from the date format given by the user to
+ * Ymd so it can be sorted out properly afterwards.
+ *
+ * On error or unable to determine the format, 1 is returned.
+ * On success, the numeric date format as Ymd is set and 0 is
+ * returned. */
+static int set_date_num_format(GLogParser *parser) {
+  char *fdate = NULL, *buf = NULL;
+  int buflen = 0, flen = 0;
+
+  fdate = set_format_date(parser);
+  if (!fdate)
+    return 1;
+
+  if (is_date_abbreviated(fdate)) {
+    free(fdate);
+    parser->date_num_format = xstrdup("%Y%m%d");
+    return 0;
+  }
+
+  flen = strlen(fdate) + 1;
+  flen = MAX(MIN_DATENUM_FMT_LEN, flen); /* at least %Y%m%d + 1 */
+  buf = xcalloc(flen, sizeof(char));
+
+  /* always add a %Y */
+  buflen += snprintf(buf + buflen, flen - buflen, "%%Y");
+  if (strpbrk(fdate, "hbmBf*"))
+    buflen += snprintf(buf + buflen, flen - buflen, "%%m");
+  if (strpbrk(fdate, "def*"))
+    buflen += snprintf(buf + buflen, flen - buflen, "%%d");
+
+  parser->date_num_format = buf;
+  free(fdate);
+
+  return buflen == 0 ? 1 : 0;
+}
+
+/* Get the enumerated value given a string.
+ *
+ * On error, -1 is returned.
+ * On success, the enumerated module value is returned. */
+static int str2enum(const GEnum map[], int len, const char *str) {
+  int i;
+
+  for (i = 0; i < len; ++i) {
+    if (!strcmp(str, map[i].str))
+      return map[i].idx;
+  }
+
+  return -1;
+}
+
+typedef enum LOGTYPE {
+  COMBINED,
+  VCOMBINED,
+  COMMON,
+  VCOMMON,
+  W3C,
+  CLOUDFRONT,
+  CLOUDSTORAGE,
+  AWSELB,
+  SQUID,
+  AWSS3,
+  CADDY,
+  AWSALB,
+  TRAEFIKCLF,
+} GLogType;
+
+static const GEnum LOGTYPE[] = {
+    {"COMBINED", COMBINED},
+    {"VCOMBINED", VCOMBINED},
+    {"COMMON", COMMON},
+    {"VCOMMON", VCOMMON},
+    {"W3C", W3C},
+    {"CLOUDFRONT", CLOUDFRONT},
+    {"CLOUDSTORAGE", CLOUDSTORAGE},
+    {"AWSELB", AWSELB},
+    {"SQUID", SQUID},
+    {"AWSS3", AWSS3},
+    {"CADDY", CADDY},
+    {"AWSALB", AWSALB},
+    {"TRAEFIKCLF", TRAEFIKCLF},
+};
+
+/* Get the enumerated log format given its equivalent format string.
+ * The case in the format string does not matter.
+ *
+ * On error, -1 is returned.
+ * On success, the enumerated format is returned. */
+static int get_log_format_item_enum(const char *str) {
+  int ret;
+  char *upstr;
+
+  ret = str2enum(LOGTYPE, ARRAY_SIZE(LOGTYPE), str);
+  if (ret >= 0)
+    return ret;
+
+  /* uppercase the input string and try again */
+  upstr = strtoupper(xstrdup(str));
+  ret = str2enum(LOGTYPE, ARRAY_SIZE(LOGTYPE), upstr);
+  free(upstr);
+
+  return ret;
+}
+
+/* Determine if we have a valid JSON format */
+static int is_json_log_format(const char *fmt) {
+  enum json_type t = JSON_ERROR;
+  json_stream json;
+
+  json_open_string(&json, fmt);
+  /* ensure we use strict JSON when determining if we're using a JSON format */
+  json_set_streaming(&json, false);
+  do {
+    t = json_next(&json);
+    switch (t) {
+    case JSON_ERROR:
+      json_close(&json);
+      return 0;
+    default:
+      break;
+    }
+  } while (t != JSON_DONE && t != JSON_ERROR);
+  json_close(&json);
+
+  return 1;
+}
+
+/* Determine if some parser flags were set through log-format. */
+static void contains_specifier(GLogParser *parser) {
+  parser->serve_usecs = parser->bandwidth = 0; /* flag */
+  if (!parser->log_format)
+    return;
+
+  if (strstr(parser->log_format, "%b"))
+    parser->bandwidth = 1; /* flag */
+  if (strstr(parser->log_format, "%D"))
+    parser->serve_usecs = 1; /* flag */
+  if (strstr(parser->log_format, "%T"))
+    parser->serve_usecs = 1; /* flag */
+  if (strstr(parser->log_format, "%L"))
+    parser->serve_usecs = 1; /* flag */
+}
+
+/* Determine the selected log format from the config file or command line
+ * option.
+ *
+ * On error, NULL is returned.
+ * On success, an allocated string containing the log format is returned. */
+static char *get_selected_format_str(size_t idx) {
+  char *fmt = NULL;
+  switch (idx) {
+  case COMBINED:
+    fmt = alloc_string(logs.combined);
+    break;
+  case VCOMBINED:
+    fmt = alloc_string(logs.vcombined);
+    break;
+  case COMMON:
+    fmt = alloc_string(logs.common);
+    break;
+  case VCOMMON:
+    fmt = alloc_string(logs.vcommon);
+    break;
+  case W3C:
+    fmt = alloc_string(logs.w3c);
+    break;
+  case CLOUDFRONT:
+    fmt = alloc_string(logs.cloudfront);
+    break;
+  case CLOUDSTORAGE:
+    fmt = alloc_string(logs.cloudstorage);
+    break;
+  case AWSELB:
+    fmt = alloc_string(logs.awselb);
+    break;
+  case SQUID:
+    fmt = alloc_string(logs.squid);
+    break;
+  case AWSS3:
+    fmt = alloc_string(logs.awss3);
+    break;
+  case CADDY:
+    fmt = alloc_string(logs.caddy);
+    break;
+  case AWSALB:
+    fmt = alloc_string(logs.awsalb);
+    break;
+  case TRAEFIKCLF:
+    fmt = alloc_string(logs.traefikclf);
+    break;
+  }
+
+  return fmt;
+}
+
+/* Determine the selected date format from the config file or command line
+ * option.
+ *
+ * On error, NULL is returned.
+ * On success, an allocated string containing the date format is returned. */
+static char *get_selected_date_str(size_t idx) {
+  char *fmt = NULL;
+  switch (idx) {
+  case COMMON:
+  case VCOMMON:
+  case COMBINED:
+  case VCOMBINED:
+  case AWSS3:
+  case TRAEFIKCLF:
+    fmt = alloc_string(dates.apache);
+    break;
+  case AWSELB:
+  case AWSALB:
+  case CLOUDFRONT:
+  case W3C:
+    fmt = alloc_string(dates.w3c);
+    break;
+  case CLOUDSTORAGE:
+    fmt = alloc_string(dates.usec);
+    break;
+  case SQUID:
+  case CADDY:
+    fmt = alloc_string(dates.sec);
+    break;
+  }
+
+  return fmt;
+}
+
+/* Attempt to set the date format given a command line option
+ * argument. The supplied optarg can be either an actual format string
+ * or the enumerated value such as VCOMBINED */
+static void set_date_format_str(const char *oarg) {
+  char *fmt = NULL;
+  int type = get_log_format_item_enum(oarg);
+
+  /* free date format if it was previously set by set_log_format_str() */
+  if (conf.date_format)
+    free(conf.date_format);
+
+  /* type not found, use whatever was given by the user then */
+  if (type == -1) {
+    conf.date_format = unescape_str(oarg);
+    return;
+  }
+
+  /* attempt to get the format string by the enum value */
+  if ((fmt = get_selected_date_str(type)) == NULL) {
+    LOG_DEBUG(("Unable to set date format from enum: %s\n", oarg));
+    return;
+  }
+
+  conf.date_format = fmt;
+}
+
+static char *get_selected_time_str(size_t idx) {
+  char *fmt = NULL;
+  switch (idx) {
+  case AWSELB:
+  case AWSALB:
+  case CLOUDFRONT:
+  case COMBINED:
+  case COMMON:
+  case VCOMBINED:
+  case VCOMMON:
+  case W3C:
+  case AWSS3:
+  case TRAEFIKCLF:
+    fmt = alloc_string(times.fmt24);
+    break;
+  case CLOUDSTORAGE:
+    fmt = alloc_string(times.usec);
+    break;
+  case SQUID:
+  case CADDY:
+    fmt = alloc_string(times.sec);
+    break;
+  }
+
+  return fmt;
+}
+
+/* Attempt to set the time format given a command line option
+ * argument. The supplied optarg can be either an actual format string
+ * or the enumerated value such as VCOMBINED */
+static void set_time_format_str(const char *oarg) {
+  char *fmt = NULL;
+  int type = get_log_format_item_enum(oarg);
+
+  /* free time format if it was previously set by set_log_format_str() */
+  if (conf.time_format)
+    free(conf.time_format);
+
+  /* type not found, use whatever was given by the user then */
+  if (type == -1) {
+    conf.time_format = unescape_str(oarg);
+    return;
+  }
+
+  /* attempt to get the format string by the enum value */
+  if ((fmt = get_selected_time_str(type)) == NULL) {
+    LOG_DEBUG(("Unable to set time format from enum: %s\n", oarg));
+    return;
+  }
+
+  conf.time_format = fmt;
+}
+
+/* Attempt to set the log format given a command line option argument.
+ * The supplied optarg can be either an actual format string or the
+ * enumerated value such as VCOMBINED */
+static void set_log_format_str(const char *oarg) {
+  char *fmt = NULL;
+  int type = get_log_format_item_enum(oarg);
+
+  /* free log format if it was previously set */
+  if (conf.log_format)
+    free(conf.log_format);
+
+  if (type == -1 && is_json_log_format(oarg)) {
+    conf.is_json_log_format = 1;
+    conf.log_format = unescape_str(oarg);
+    return;
+  } else if (type == -1) {
+    conf.is_json_log_format = 0;
+  }
+
+  /* type not found, use whatever was given by the user then */
+  if (type == -1) {
+    conf.log_format = unescape_str(oarg);
+    return;
+  }
+
+  /* attempt to get the format string by the enum value */
+  if ((fmt = get_selected_format_str(type)) == NULL) {
+    LOG_DEBUG(("Unable to set log format from enum: %s\n", oarg));
+    return;
+  }
+
+  if (is_json_log_format(fmt))
+    conf.is_json_log_format = 1;
+  else
+    conf.is_json_log_format = 0;
+
+  conf.log_format = unescape_str(fmt);
+
+  /* assume we are using the default date/time formats */
+  set_time_format_str(oarg);
+  set_date_format_str(oarg);
+  free(fmt);
+}
+
+#define DB_VERSION 2
+#define DB_INSTANCE 1
+
+#define GAMTRC_TOTAL 7
+
+typedef enum GAMetric_ {
+  MTRC_DATES,
+  MTRC_SEQS,
+  MTRC_CNT_OVERALL,
+  MTRC_HOSTNAMES,
+  MTRC_LAST_PARSE,
+  MTRC_METH_PROTO,
+  MTRC_DB_PROPS,
+} GAMetric;
+
+typedef enum GSMetricType_ {
+  /* uint32_t key - uint32_t val */
+  MTRC_TYPE_II32,
+  /* uint32_t key - string val */
+  MTRC_TYPE_IS32,
+  /* uint32_t key - uint64_t val */
+  MTRC_TYPE_IU64,
+  /* string key   - uint32_t val */
+  MTRC_TYPE_SI32,
+  /* string key   - uint8_t val */
+  MTRC_TYPE_SI08,
+  /* uint32_t key - uint8_t val */
+  MTRC_TYPE_II08,
+  /* string key   - string val */
+  MTRC_TYPE_SS32,
+  /* uint32_t key - GSLList val */
+  MTRC_TYPE_IGSL,
+  /* string key   - uint64_t val */
+  MTRC_TYPE_SU64,
+  /* uint32_t key - GKHashStorage_ val */
+  MTRC_TYPE_IGKH,
+  /* uint64_t key - uint32_t val */
+  MTRC_TYPE_U648,
+  /* uint64_t key - GLastParse val */
+  MTRC_TYPE_IGLP,
+} GSMetricType;
+
+typedef struct GKHashMetric_ {
+  union {
+    GSMetric storem;
+    GAMetric dbm;
+  } metric;
+  GSMetricType type;
+  void *(*alloc)(void);
+  void (*des)(void *, uint8_t free_data);
+  void (*del)(void *, uint8_t free_data);
+  uint8_t free_data : 1;
+  void *hash;
+  const char *filename;
+} GKHashMetric;
+
+typedef struct GKHashDB_ {
+  GKHashMetric metrics[GAMTRC_TOTAL];
+} GKHashDB;
+
+typedef struct GKHashModule_ {
+  GModule module;
+  GKHashMetric metrics[GSMTRC_TOTAL];
+} GKHashModule;
+
+/* Data store global */
+typedef struct GKHashGlobal_ {
+  GKHashMetric metrics[GSMTRC_TOTAL];
+} GKHashGlobal;
+
+typedef struct GKDB_ GKDB;
+
+typedef struct GKHashStorage_ GKHashStorage;
+
+struct GKHashStorage_ {
+  GKHashModule *mhash; /* modules */
+  GKHashGlobal *ghash; /* global */
+};
+
+struct GKDB_ {
+  GKHashDB *hdb;        /* app-level hash tables */
+  Logs *logs;           /* logs parsing per db instance */
+  GKHashModule *cache;  /* cache modules */
+  GKHashStorage *store; /* per date OR module */
+};
+
+typedef unsigned int khint32_t;
+typedef khint32_t khint_t;
+typedef khint_t khiter_t;
+#define khash_t(name) kh_##name##_t
+
+typedef unsigned long khint64_t;
+
+#define kh_inline inline
+#define klib_unused __attribute__((__unused__))
+
+typedef khint32_t khint_t;
+typedef khint_t khiter_t;
+
+#define __ac_isempty(flag, i) ((flag[i >> 4] >> ((i & 0xfU) << 1)) & 2)
+#define __ac_isdel(flag, i) ((flag[i >> 4] >> ((i & 0xfU) << 1)) & 1)
+#define __ac_iseither(flag, i) ((flag[i >> 4] >> ((i & 0xfU) << 1)) & 3)
+#define __ac_set_isdel_false(flag, i)                                          \
+  (flag[i >> 4] &= ~(1ul << ((i & 0xfU) << 1)))
+#define __ac_set_isempty_false(flag, i)                                        \
+  (flag[i >> 4] &= ~(2ul << ((i & 0xfU) << 1)))
+#define __ac_set_isboth_false(flag, i)                                         \
+  (flag[i >> 4] &= ~(3ul << ((i & 0xfU) << 1)))
+#define __ac_set_isdel_true(flag, i) (flag[i >> 4] |= 1ul << ((i & 0xfU) << 1))
+
+#define __ac_fsize(m) ((m) < 16 ? 1 : (m) >> 4)
+
+#define kroundup32(x)                                                          \
+  (--(x), (x) |= (x) >> 1, (x) |= (x) >> 2, (x) |= (x) >> 4, (x) |= (x) >> 8,  \
+   (x) |= (x) >> 16, ++(x))
+
+#define kcalloc(N, Z) calloc(N, Z)
+
+#define kmalloc(Z) malloc(Z)
+
+#define krealloc(P, Z) realloc(P, Z)
+
+#define kfree(P) free(P)
+
+static const double __ac_HASH_UPPER = 0.77;
+
+#define __KHASH_TYPE(name, khkey_t, khval_t)                                   \
+  typedef struct kh_##name##_s {                                               \
+    khint_t n_buckets, size, n_occupied, upper_bound;                          \
+    khint32_t *flags;                                                          \
+    khkey_t *keys;                                                             \
+    khval_t *vals;                                                             \
+  } kh_##name##_t;
+
+#define __KHASH_PROTOTYPES(name, khkey_t, khval_t)                             \
+  extern kh_##name##_t *kh_init_##name(void);                                  \
+  extern void kh_destroy_##name(kh_##name##_t *h);                             \
+  extern void kh_clear_##name(kh_##name##_t *h);                               \
+  extern khint_t kh_get_##name(const kh_##name##_t *h, khkey_t key);           \
+  extern int kh_resize_##name(kh_##name##_t *h, khint_t new_n_buckets);        \
+  extern khint_t kh_put_##name(kh_##name##_t *h, khkey_t key, int *ret);       \
+  extern void kh_del_##name(kh_##name##_t *h, khint_t x);
+
+#define __KHASH_IMPL(name, SCOPE, khkey_t, khval_t, kh_is_map, __hash_func,    \
+                     __hash_equal)                                             \
+  SCOPE kh_##name##_t *kh_init_##name(void) {                                  \
+    return (kh_##name##_t *)kcalloc(1, sizeof(kh_##name##_t));                 \
+  }                                                                            \
+  SCOPE void kh_destroy_##name(kh_##name##_t *h) {                             \
+    if (h) {                                                                   \
+      kfree((void *)h->keys);                                                  \
+      kfree(h->flags);                                                         \
+      kfree((void *)h->vals);                                                  \
+      kfree(h);                                                                \
+    }                                                                          \
+  }                                                                            \
+  SCOPE void kh_clear_##name(kh_##name##_t *h) {                               \
+    if (h && h->flags) {                                                       \
+      memset(h->flags, 0xaa, __ac_fsize(h->n_buckets) * sizeof(khint32_t));    \
+      h->size = h->n_occupied = 0;                                             \
+    }                                                                          \
+  }                                                                            \
+  SCOPE khint_t kh_get_##name(const kh_##name##_t *h, khkey_t key) {           \
+    if (h->n_buckets) {                                                        \
+      khint_t k, i, last, mask, step = 0;                                      \
+      mask = h->n_buckets - 1;                                                 \
+      k = __hash_func(key);                                                    \
+      i = k & mask;                                                            \
+      last = i;                                                                \
+      while (!__ac_isempty(h->flags, i) &&                                     \
+             (__ac_isdel(h->flags, i) || !__hash_equal(h->keys[i], key))) {    \
+        i = (i + (++step)) & mask;                                             \
+        if (i == last)                                                         \
+          return h->n_buckets;                                                 \
+      }                                                                        \
+      return __ac_iseither(h->flags, i) ? h->n_buckets : i;                    \
+    } else                                                                     \
+      return 0;                                                                \
+  }                                                                            \
+  SCOPE int kh_resize_##name(kh_##name##_t *h, khint_t new_n_buckets) {        \
+    /* This function uses 0.25*n_buckets bytes of working space instead of */  \
+    /* [sizeof(key_t+val_t)+.25]*n_buckets. */                                 \
+    khint32_t *new_flags = 0;                                                  \
+    khint_t j = 1;                                                             \
+    {                                                                          \
+      kroundup32(new_n_buckets);                                               \
+      if (new_n_buckets < 4)                                                   \
+        new_n_buckets = 4;                                                     \
+      if (h->size >= (khint_t)(new_n_buckets * __ac_HASH_UPPER + 0.5))         \
+        j = 0; /* requested size is too small */                               \
+      else {   /* hash table size to be changed (shrink or expand); rehash */  \
+        new_flags = (khint32_t *)kmalloc(__ac_fsize(new_n_buckets) *           \
+                                         sizeof(khint32_t));                   \
+        if (!new_flags)                                                        \
+          return -1;                                                           \
+        memset(new_flags, 0xaa,                                                \
+               __ac_fsize(new_n_buckets) * sizeof(khint32_t));                 \
+        if (h->n_buckets < new_n_buckets) { /* expand */                       \
+          khkey_t *new_keys = (khkey_t *)krealloc(                             \
+              (void *)h->keys, new_n_buckets * sizeof(khkey_t));               \
+          if (!new_keys) {                                                     \
+            kfree(new_flags);                                                  \
+            return -1;                                                         \
+          }                                                                    \
+          h->keys = new_keys;                                                  \
+          if (kh_is_map) {                                                     \
+            khval_t *new_vals = (khval_t *)krealloc(                           \
+                (void *)h->vals, new_n_buckets * sizeof(khval_t));             \
+            if (!new_vals) {                                                   \
+              kfree(new_flags);                                                \
+              return -1;                                                       \
+            }                                                                  \
+            h->vals = new_vals;                                                \
+          }                                                                    \
+        } /* otherwise shrink */                                               \
+      }                                                                        \
+    }                                                                          \
+    if (j) { /* rehashing is needed */                                         \
+      for (j = 0; j != h->n_buckets; ++j) {                                    \
+        if (__ac_iseither(h->flags, j) == 0) {                                 \
+          khkey_t key = h->keys[j];                                            \
+          khval_t val;                                                         \
+          khint_t new_mask;                                                    \
+          new_mask = new_n_buckets - 1;                                        \
+          if (kh_is_map)                                                       \
+            val = h->vals[j];                                                  \
+          __ac_set_isdel_true(h->flags, j);                                    \
+          while (1) { /* kick-out process; sort of like in Cuckoo hashing */   \
+            khint_t k, i, step = 0;                                            \
+            k = __hash_func(key);                                              \
+            i = k & new_mask;                                                  \
+            while (!__ac_isempty(new_flags, i))                                \
+              i = (i + (++step)) & new_mask;                                   \
+            __ac_set_isempty_false(new_flags, i);                              \
+            if (i < h->n_buckets &&                                            \
+                __ac_iseither(h->flags, i) ==                                  \
+                    0) { /* kick out the existing element */                   \
+              {                                                                \
+                khkey_t tmp = h->keys[i];                                      \
+                h->keys[i] = key;                                              \
+                key = tmp;                                                     \
+              }                                                                \
+              if (kh_is_map) {                                                 \
+                khval_t tmp = h->vals[i];                                      \
+                h->vals[i] = val;                                              \
+                val = tmp;                                                     \
+              }                                                                \
+              __ac_set_isdel_true(                                             \
+                  h->flags, i); /* mark it as deleted in the old hash table */ \
+            } else { /* write the element and jump out of the loop */          \
+              h->keys[i] = key;                                                \
+              if (kh_is_map)                                                   \
                 h->vals[i] = val;                                              \
               break;                                                           \
             }                                                                  \
@@ -4131,1277 +10549,4051 @@ static const double __ac_HASH_UPPER = 0.77;
         }                                                                      \
       }                                                                        \
     }                                                                          \
-    if (__ac_isempty(h->flags, x)) { /* not present at all */                  \
-      h->keys[x] = key;                                                        \
-      __ac_set_isboth_false(h->flags, x);                                      \
-      ++h->size;                                                               \
-      ++h->n_occupied;                                                         \
-      *ret = 1;                                                                \
-    } else if (__ac_isdel(h->flags, x)) { /* deleted */                        \
-      h->keys[x] = key;                                                        \
-      __ac_set_isboth_false(h->flags, x);                                      \
-      ++h->size;                                                               \
-      *ret = 2;                                                                \
-    } else                                                                     \
-      *ret = 0; /* Don't touch h->keys[x] if present and not deleted */        \
-    return x;                                                                  \
-  }                                                                            \
-  SCOPE void kh_del_##name(kh_##name##_t *h, khint_t x) {                      \
-    if (x != h->n_buckets && !__ac_iseither(h->flags, x)) {                    \
-      __ac_set_isdel_true(h->flags, x);                                        \
-      --h->size;                                                               \
+    if (__ac_isempty(h->flags, x)) { /* not present at all */                  \
+      h->keys[x] = key;                                                        \
+      __ac_set_isboth_false(h->flags, x);                                      \
+      ++h->size;                                                               \
+      ++h->n_occupied;                                                         \
+      *ret = 1;                                                                \
+    } else if (__ac_isdel(h->flags, x)) { /* deleted */                        \
+      h->keys[x] = key;                                                        \
+      __ac_set_isboth_false(h->flags, x);                                      \
+      ++h->size;                                                               \
+      *ret = 2;                                                                \
+    } else                                                                     \
+      *ret = 0; /* Don't touch h->keys[x] if present and not deleted */        \
+    return x;                                                                  \
+  }                                                                            \
+  SCOPE void kh_del_##name(kh_##name##_t *h, khint_t x) {                      \
+    if (x != h->n_buckets && !__ac_iseither(h->flags, x)) {                    \
+      __ac_set_isdel_true(h->flags, x);                                        \
+      --h->size;                                                               \
+    }                                                                          \
+  }
+
+#define KHASH_DECLARE(name, khkey_t, khval_t)                                  \
+  __KHASH_TYPE(name, khkey_t, khval_t)                                         \
+  __KHASH_PROTOTYPES(name, khkey_t, khval_t)
+
+#define KHASH_INIT2(name, SCOPE, khkey_t, khval_t, kh_is_map, __hash_func,     \
+                    __hash_equal)                                              \
+  __KHASH_TYPE(name, khkey_t, khval_t)                                         \
+  __KHASH_IMPL(name, SCOPE, khkey_t, khval_t, kh_is_map, __hash_func,          \
+               __hash_equal)
+
+#define KHASH_INIT(name, khkey_t, khval_t, kh_is_map, __hash_func,             \
+                   __hash_equal)                                               \
+  KHASH_INIT2(name, static kh_inline klib_unused, khkey_t, khval_t, kh_is_map, \
+              __hash_func, __hash_equal)
+
+/* --- BEGIN OF HASH FUNCTIONS --- */
+
+/*! @function
+  @abstract     Integer hash function
+  @param  key   The integer [khint32_t]
+  @return       The hash value [khint_t]
+ */
+#define kh_int_hash_func(key) (khint32_t)(key)
+/*! @function
+  @abstract     Integer comparison function
+ */
+#define kh_int_hash_equal(a, b) ((a) == (b))
+/*! @function
+  @abstract     64-bit integer hash function
+  @param  key   The integer [khint64_t]
+  @return       The hash value [khint_t]
+ */
+#define kh_int64_hash_func(key) (khint32_t)((key) >> 33 ^ (key) ^ (key) << 11)
+/*! @function
+  @abstract     64-bit integer comparison function
+ */
+#define kh_int64_hash_equal(a, b) ((a) == (b))
+/*! @function
+  @abstract     const char* hash function
+  @param  s     Pointer to a null terminated string
+  @return       The hash value
+ */
+static kh_inline khint_t
+__ac_X31_hash_string(const char *s) {
+  khint_t h = (khint_t)*s;
+  if (h)
+    for (++s; *s; ++s)
+      h = (h << 5) - h + (khint_t)*s;
+  return h;
+}
+
+/*! @function
+  @abstract     Another interface to const char* hash function
+  @param  key   Pointer to a null terminated string [const char*]
+  @return       The hash value [khint_t]
+ */
+#define kh_str_hash_func(key) __ac_X31_hash_string(key)
+/*! @function
+  @abstract     Const char* comparison function
+ */
+#define kh_str_hash_equal(a, b) (strcmp(a, b) == 0)
+
+static kh_inline khint_t __ac_Wang_hash(khint_t key) {
+  key += ~(key << 15);
+  key ^= (key >> 10);
+  key += (key << 3);
+  key ^= (key >> 6);
+  key += ~(key << 11);
+  key ^= (key >> 16);
+  return key;
+}
+
+#define kh_int_hash_func2(k) __ac_Wang_hash((khint_t)key)
+
+/* --- END OF HASH FUNCTIONS --- */
+
+/* Other convenient macros... */
+
+/*!
+  @abstract Type of the hash table.
+  @param  name  Name of the hash table [symbol]
+ */
+#define khash_t(name) kh_##name##_t
+
+/*! @function
+  @abstract     Initiate a hash table.
+  @param  name  Name of the hash table [symbol]
+  @return       Pointer to the hash table [khash_t(name)*]
+ */
+#define kh_init(name) kh_init_##name()
+
+/*! @function
+  @abstract     Destroy a hash table.
+  @param  name  Name of the hash table [symbol]
+  @param  h     Pointer to the hash table [khash_t(name)*]
+ */
+#define kh_destroy(name, h) kh_destroy_##name(h)
+
+/*! @function
+  @abstract     Reset a hash table without deallocating memory.
+  @param  name  Name of the hash table [symbol]
+  @param  h     Pointer to the hash table [khash_t(name)*]
+ */
+#define kh_clear(name, h) kh_clear_##name(h)
+
+/*! @function
+  @abstract     Resize a hash table.
+  @param  name  Name of the hash table [symbol]
+  @param  h     Pointer to the hash table [khash_t(name)*]
+  @param  s     New size [khint_t]
+ */
+#define kh_resize(name, h, s) kh_resize_##name(h, s)
+
+/*! @function
+  @abstract     Insert a key to the hash table.
+  @param  name  Name of the hash table [symbol]
+  @param  h     Pointer to the hash table [khash_t(name)*]
+  @param  k     Key [type of keys]
+  @param  r     Extra return code: -1 if the operation failed;
+                0 if the key is present in the hash table;
+                1 if the bucket is empty (never used); 2 if the element in
+        the bucket has been deleted [int*]
+  @return       Iterator to the inserted element [khint_t]
+ */
+#define kh_put(name, h, k, r) kh_put_##name(h, k, r)
+
+/*! @function
+  @abstract     Retrieve a key from the hash table.
+  @param  name  Name of the hash table [symbol]
+  @param  h     Pointer to the hash table [khash_t(name)*]
+  @param  k     Key [type of keys]
+  @return       Iterator to the found element, or kh_end(h) if the element is
+  absent [khint_t]
+ */
+#define kh_get(name, h, k) kh_get_##name(h, k)
+
+/*! @function
+  @abstract     Remove a key from the hash table.
+  @param  name  Name of the hash table [symbol]
+  @param  h     Pointer to the hash table [khash_t(name)*]
+  @param  k     Iterator to the element to be deleted [khint_t]
+ */
+#define kh_del(name, h, k) kh_del_##name(h, k)
+
+/*! @function
+  @abstract     Test whether a bucket contains data.
+  @param  h     Pointer to the hash table [khash_t(name)*]
+  @param  x     Iterator to the bucket [khint_t]
+  @return       1 if containing data; 0 otherwise [int]
+ */
+#define kh_exist(h, x) (!__ac_iseither((h)->flags, (x)))
+
+/*! @function
+  @abstract     Get key given an iterator
+  @param  h     Pointer to the hash table [khash_t(name)*]
+  @param  x     Iterator to the bucket [khint_t]
+  @return       Key [type of keys]
+ */
+#define kh_key(h, x) ((h)->keys[x])
+
+/*! @function
+  @abstract     Get value given an iterator
+  @param  h     Pointer to the hash table [khash_t(name)*]
+  @param  x     Iterator to the bucket [khint_t]
+  @return       Value [type of values]
+  @discussion   For hash sets, calling this results in segfault.
+ */
+#define kh_val(h, x) ((h)->vals[x])
+
+/*! @function
+  @abstract     Alias of kh_val()
+ */
+#define kh_value(h, x) ((h)->vals[x])
+
+/*! @function
+  @abstract     Get the start iterator
+  @param  h     Pointer to the hash table [khash_t(name)*]
+  @return       The start iterator [khint_t]
+ */
+#define kh_begin(h) (khint_t)(0)
+
+/*! @function
+  @abstract     Get the end iterator
+  @param  h     Pointer to the hash table [khash_t(name)*]
+  @return       The end iterator [khint_t]
+ */
+#define kh_end(h) ((h)->n_buckets)
+
+/*! @function
+  @abstract     Get the number of elements in the hash table
+  @param  h     Pointer to the hash table [khash_t(name)*]
+  @return       Number of elements in the hash table [khint_t]
+ */
+#define kh_size(h) ((h)->size)
+
+/*! @function
+  @abstract     Get the number of buckets in the hash table
+  @param  h     Pointer to the hash table [khash_t(name)*]
+  @return       Number of buckets in the hash table [khint_t]
+ */
+#define kh_n_buckets(h) ((h)->n_buckets)
+
+/*! @function
+  @abstract     Iterate over the entries in the hash table
+  @param  h     Pointer to the hash table [khash_t(name)*]
+  @param  kvar  Variable to which key will be assigned
+  @param  vvar  Variable to which value will be assigned
+  @param  code  Block of code to execute
+ */
+#define kh_foreach(h, kvar, vvar, code)                                        \
+  {                                                                            \
+    khint_t __i;                                                               \
+    for (__i = kh_begin(h); __i != kh_end(h); ++__i) {                         \
+      if (!kh_exist(h, __i))                                                   \
+        continue;                                                              \
+      (kvar) = kh_key(h, __i);                                                 \
+      (vvar) = kh_val(h, __i);                                                 \
+      code;                                                                    \
+    }                                                                          \
+  }
+
+/*! @function
+  @abstract     Iterate over the values in the hash table
+  @param  h     Pointer to the hash table [khash_t(name)*]
+  @param  vvar  Variable to which value will be assigned
+  @param  code  Block of code to execute
+ */
+#define kh_foreach_value(h, vvar, code)                                        \
+  {                                                                            \
+    khint_t __i;                                                               \
+    for (__i = kh_begin(h); __i != kh_end(h); ++__i) {                         \
+      if (!kh_exist(h, __i))                                                   \
+        continue;                                                              \
+      (vvar) = kh_val(h, __i);                                                 \
+      code;                                                                    \
     }                                                                          \
   }
 
-#define KHASH_DECLARE(name, khkey_t, khval_t)                                  \
-  __KHASH_TYPE(name, khkey_t, khval_t)                                         \
-  __KHASH_PROTOTYPES(name, khkey_t, khval_t)
+/* More convenient interfaces */
+
+/*! @function
+  @abstract     Instantiate a hash set containing integer keys
+  @param  name  Name of the hash table [symbol]
+ */
+#define KHASH_SET_INIT_INT(name)                                               \
+  KHASH_INIT(name, khint32_t, char, 0, kh_int_hash_func, kh_int_hash_equal)
+
+/*! @function
+  @abstract     Instantiate a hash map containing integer keys
+  @param  name  Name of the hash table [symbol]
+  @param  khval_t  Type of values [type]
+ */
+#define KHASH_MAP_INIT_INT(name, khval_t)                                      \
+  KHASH_INIT(name, khint32_t, khval_t, 1, kh_int_hash_func, kh_int_hash_equal)
+
+/*! @function
+  @abstract     Instantiate a hash map containing 64-bit integer keys
+  @param  name  Name of the hash table [symbol]
+ */
+#define KHASH_SET_INIT_INT64(name)                                             \
+  KHASH_INIT(name, khint64_t, char, 0, kh_int64_hash_func, kh_int64_hash_equal)
+
+/*! @function
+  @abstract     Instantiate a hash map containing 64-bit integer keys
+  @param  name  Name of the hash table [symbol]
+  @param  khval_t  Type of values [type]
+ */
+#define KHASH_MAP_INIT_INT64(name, khval_t)                                    \
+  KHASH_INIT(name, khint64_t, khval_t, 1, kh_int64_hash_func,                  \
+             kh_int64_hash_equal)
+
+typedef const char *kh_cstr_t;
+/*! @function
+  @abstract     Instantiate a hash map containing const char* keys
+  @param  name  Name of the hash table [symbol]
+ */
+#define KHASH_SET_INIT_STR(name)                                               \
+  KHASH_INIT(name, kh_cstr_t, char, 0, kh_str_hash_func, kh_str_hash_equal)
+
+/*! @function
+  @abstract     Instantiate a hash map containing const char* keys
+  @param  name  Name of the hash table [symbol]
+  @param  khval_t  Type of values [type]
+ */
+#define KHASH_MAP_INIT_STR(name, khval_t)                                      \
+  KHASH_INIT(name, kh_cstr_t, khval_t, 1, kh_str_hash_func, kh_str_hash_equal)
+
+/* uint32_t keys           , GKDB payload */
+KHASH_MAP_INIT_INT(igdb, GKDB *);
+/* uint32_t keys           , GKHashStorage payload */
+KHASH_MAP_INIT_INT(igkh, GKHashStorage *);
+/* uint32_t keys           , uint32_t payload */
+KHASH_MAP_INIT_INT(ii32, uint32_t);
+/* uint32_t keys           , string payload */
+KHASH_MAP_INIT_INT(is32, char *);
+/* uint32_t keys           , uint64_t payload */
+KHASH_MAP_INIT_INT(iu64, uint64_t);
+/* string keys             , uint32_t payload */
+KHASH_MAP_INIT_STR(si32, uint32_t);
+/* string keys             , uint8_t payload */
+KHASH_MAP_INIT_STR(si08, uint8_t);
+/* uint8_t keys            , uint8_t payload */
+KHASH_MAP_INIT_INT(ii08, uint8_t);
+/* string keys             , string payload */
+KHASH_MAP_INIT_STR(ss32, char *);
+/* uint64_t key            , GLastParse payload */
+KHASH_MAP_INIT_INT64(iglp, GLastParse);
+/* uint32_t keys           , GSLList payload */
+KHASH_MAP_INIT_INT(igsl, GSLList *);
+/* string keys             , uint64_t payload */
+KHASH_MAP_INIT_STR(su64, uint64_t);
+/* uint64_t key            , uint8_t payload */
+KHASH_MAP_INIT_INT64(u648, uint8_t);
+
+static khash_t(igdb) *ht_db = NULL;
+
+/* Given a key (date), get the relevant store
+ *
+ * On error or not found, NULL is returned.
+ * On success, a pointer to that store is returned. */
+static void *get_db_instance(uint32_t key) {
+  GKDB *db = NULL;
+  khint_t k;
+
+  khash_t(igdb) *hash = ht_db;
+
+  k = kh_get(igdb, hash, key);
+  /* key not found, return NULL */
+  if (k == kh_end(hash))
+    return NULL;
+
+  db = kh_val(hash, k);
+  return db;
+}
+
+/* Get an app hash table given a DB instance and a GAMetric
+ *
+ * On success, a pointer to that store is returned. */
+static void *get_hdb(GKDB *db, GAMetric mtrc) {
+  return db->hdb->metrics[mtrc].hash;
+}
+
+/* Insert a JSON log format specification such as request.method => %m
+ * into the given parser's JSON key map.
+ *
+ * On error -1 is returned.
+ * On success or if key exists, 0 is returned */
+static int ht_insert_json_logfmt(void *userdata, char *key, char *spec) {
+  GLogParser *parser = userdata;
+  khash_t(ss32) *hash = parser->json_logfmt;
+  khint_t k;
+  int ret;
+  char *dupkey = NULL;
+
+  if (!hash)
+    return -1;
+
+  k = kh_get(ss32, hash, key);
+  /* key found, free it then to insert */
+  if (k != kh_end(hash))
+    free(kh_val(hash, k));
+  else {
+    dupkey = xstrdup(key);
+    k = kh_put(ss32, hash, dupkey, &ret);
+    /* operation failed */
+    if (ret == -1) {
+      free(dupkey);
+      return -1;
+    }
+  }
+  kh_val(hash, k) = xstrdup(spec);
+
+  return 0;
+}
+
+/* A wrapper to extract time specifiers from a time format.
+ *
+ * On error NULL is returned.
+ * On success, a clean format containing only time specifiers is
+ * returned. */
+static char *set_format_time(const GLogParser *parser) {
+  char *ftime = NULL;
+
+  if (has_timestamp(parser->date_format) || !strcmp("%T", parser->time_format))
+    ftime = xstrdup("%H%M%S");
+  else
+    ftime = clean_date_time_format(parser->time_format);
+
+  return ftime;
+}
+
+/* A wrapper function to concat the given specificity to the date
+ * format. */
+static char *append_spec_date_format(const char *date_format,
+                                     const char *spec_format) {
+  char *s = xmalloc(snprintf(NULL, 0, "%s%s", date_format, spec_format) + 1);
+  sprintf(s, "%s%s", date_format, spec_format);
+
+  return s;
+}
+
+/* Once we have a numeric date format, we attempt to read the time
+ * format and construct a date_time numeric specificity format (if any
+ * specificity is given). The result may look like Ymd[HM].
+ *
+ * On success, the numeric date time specificity format is set. */
+static void set_spec_date_time_num_format(GLogParser *parser) {
+  char *buf = NULL, *tf = set_format_time(parser);
+  const char *df = parser->date_num_format;
+
+  if (!df || !tf) {
+    free(tf);
+    return;
+  }
+
+  if (conf.date_spec_hr == 1 && strchr(tf, 'H'))
+    buf = append_spec_date_format(df, "%H");
+  else if (conf.date_spec_hr == 2 && strchr(tf, 'M'))
+    buf = append_spec_date_format(df, "%H%M");
+  else
+    buf = xstrdup(df);
+
+  parser->spec_date_time_num_format = buf;
+  free(tf);
+}
+
+/* Set a human-readable specificity date and time format.
+ *
+ * On success, the human-readable date time specificity format is set. */
+static void set_spec_date_time_format(GLogParser *parser) {
+  char *buf = NULL;
+  const char *fmt = parser->spec_date_time_num_format;
+  int buflen = 0, flen = 0;
+
+  if (!fmt)
+    return;
+
+  flen = (strlen(fmt) * 2) + 1;
+  buf = xcalloc(flen, sizeof(char));
+
+  if (strchr(fmt, 'd'))
+    buflen += snprintf(buf + buflen, flen - buflen, "%%d/");
+  if (strchr(fmt, 'm'))
+    buflen += snprintf(buf + buflen, flen - buflen, "%%b/");
+  if (strchr(fmt, 'Y'))
+    buflen += snprintf(buf + buflen, flen - buflen, "%%Y");
+  if (strchr(fmt, 'H'))
+    buflen += snprintf(buf + buflen, flen - buflen, ":%%H");
+  if (strchr(fmt, 'M'))
+    buflen += snprintf(buf + buflen, flen - buflen, ":%%M");
+
+  parser->spec_date_time_format = buf;
+}
+
+static void *new_ss32_ht(void);
+static void des_ss32_free(void *h, uint8_t free_data);
+
+/* Release everything the given parser holds, leaving it empty. */
+static void clear_log_parser(GLogParser *parser) {
+  free(parser->tz_name);
+  free(parser->date_format);
+  free(parser->date_num_format);
+  free(parser->time_format);
+  free(parser->spec_date_time_format);
+  free(parser->spec_date_time_num_format);
+  free(parser->log_format);
+  free_log_format_prog(parser->log_format_prog);
+  free_json_log_format_prog(parser->json_format_prog);
+  if (parser->json_logfmt)
+    des_ss32_free(parser->json_logfmt, 1);
+  free_tz_table(parser->tz_table);
+  memset(parser, 0, sizeof *parser);
+}
+
+/* Free a parser allocated by new_log_parser(). It must not be active on any
+ * thread anymore. */
+void free_log_parser(GLogParser *parser) {
+  if (parser == NULL)
+    return;
+
+  clear_log_parser(parser);
+  free(parser);
+}
+
+/* Compile the log, date and time formats and the timezone a parser was
+ * given. If specificity is supplied, the value we need to append to the
+ * date format is determined as well. A timezone already resolved into
+ * tz_table is kept.
+ *
+ * On error, 1 is returned.
+ * On success, 0 is returned. */
+static int compile_log_parser(GLogParser *parser) {
+  contains_specifier(parser);
+  set_log_format_prog(parser);
+
+  if (parser->is_json_log_format) {
+    parser->json_logfmt = new_ss32_ht();
+    if (parse_json_string(parser, parser->log_format,
+                          ht_insert_json_logfmt) == -1)
+      return 1;
+  }
+
+  if (set_date_num_format(parser) == 0) {
+    set_spec_date_time_num_format(parser);
+    set_spec_date_time_format(parser);
+  }
+
+  if (parser->tz_name && !parser->tz_table)
+    parser->tz_table = new_tz_table(parser->tz_name);
+
+  /* entries may be keyed on a parser reusing a freed one's address */
+  reset_dt_cache();
+
+  return 0;
+}
+
+/* Compile the formats set in conf into the parser lines are parsed with by
+ * default, see set_active_parser(). */
+static void set_spec_date_format(void) {
+  GTzTable *tz_table = NULL;
+
+  if (verify_formats(conf.log_format, conf.date_format, conf.time_format))
+    return;
+
+  /* resolving a timezone is costly, keep it across formats */
+  if (log_parser.tz_table && conf.tz_name &&
+      strcmp(log_parser.tz_table->name, conf.tz_name) == 0) {
+    tz_table = log_parser.tz_table;
+    log_parser.tz_table = NULL;
+  }
+  clear_log_parser(&log_parser);
+
+  log_parser.tz_name = conf.tz_name ? xstrdup(conf.tz_name) : NULL;
+  log_parser.tz_table = tz_table;
+  log_parser.date_format = xstrdup(conf.date_format);
+  log_parser.time_format = xstrdup(conf.time_format);
+  log_parser.log_format = xstrdup(conf.log_format);
+  log_parser.is_json_log_format = conf.is_json_log_format;
+
+  if (compile_log_parser(&log_parser) != 0)
+    FATAL("Invalid JSON log format. Verify the syntax.");
+}
+
+/* Get a date or time format option, either a format string or the
+ * enumerated value such as VCOMBINED, the same way set_date_format_str()
+ * and set_time_format_str() do. If not given, the one of the preset log
+ * format `type`, if any, is used instead.
+ *
+ * If there's none, NULL is returned.
+ * On success, the newly allocated format is returned. */
+static char *get_parser_format_str(const char *oarg, int type,
+                                   char *(*get_selected)(size_t)) {
+  if (oarg)
+    type = get_log_format_item_enum(oarg);
+  if (oarg && type == -1)
+    return unescape_str(oarg);
+
+  return type == -1 ? NULL : get_selected(type);
+}
+
+/* Allocate a parser owning its own compiled log format, date/time formats,
+ * timezone and JSON key map. Formats are given the same way as through
+ * set_log_format_str(), set_date_format_str() and set_time_format_str(), as
+ * a format string or the enumerated value such as VCOMBINED, in which case
+ * the date and time formats default to the preset's. A NULL tz_name keeps
+ * the process timezone.
+ *
+ * Unlike set_spec_date_format(), nothing global is changed, so a process can
+ * hold many parsers and use them from different threads at once, see
+ * parse_line_with() and set_active_parser().
+ *
+ * On error, NULL is returned.
+ * On success, the newly allocated GLogParser is returned. */
+GLogParser *new_log_parser(const char *log_format, const char *date_format,
+                           const char *time_format, const char *tz_name) {
+  GLogParser *parser = NULL;
+  GArena *prev = set_active_arena(NULL);
+  char *fmt = NULL;
+  int type;
+
+  if (log_format == NULL || *log_format == '\0')
+    goto out;
+
+  parser = xcalloc(1, sizeof(GLogParser));
+  type = get_log_format_item_enum(log_format);
+  if (type != -1 && (fmt = get_selected_format_str(type)) != NULL) {
+    parser->is_json_log_format = is_json_log_format(fmt);
+    parser->log_format = unescape_str(fmt);
+    free(fmt);
+  } else {
+    type = -1;
+    parser->is_json_log_format = is_json_log_format(log_format);
+    parser->log_format = unescape_str(log_format);
+  }
+  parser->date_format =
+      get_parser_format_str(date_format, type, get_selected_date_str);
+  parser->time_format =
+      get_parser_format_str(time_format, type, get_selected_time_str);
+  parser->tz_name = tz_name ? xstrdup(tz_name) : NULL;
+
+  if (verify_formats(parser->log_format, parser->date_format,
+                     parser->time_format) ||
+      compile_log_parser(parser) != 0) {
+    free_log_parser(parser);
+    parser = NULL;
+  }
+
+out:
+  set_active_arena(prev);
+  return parser;
+}
+
+/* Allocate memory for a new module GKHashModule instance.
+ *
+ * On success, the newly allocated GKHashStorage is returned . */
+static GKHashModule *new_gkhmodule(uint32_t size) {
+  GKHashModule *storage = xcalloc(size, sizeof(GKHashModule));
+  return storage;
+}
+
+/* list of available modules/panels */
+static int module_list[TOTAL_MODULES] = {[0 ... TOTAL_MODULES - 1] = -1};
+
+/* Initialize a new uint32_t key - GSLList value hash table */
+static void *new_igsl_ht(void) {
+  khash_t(igsl) *h = kh_init(igsl);
+  return h;
+}
+
+/* Initialize a new string key - uint32_t value hash table */
+static void *new_ii08_ht(void) {
+  khash_t(ii08) *h = kh_init(ii08);
+  return h;
+}
+
+/* Initialize a new uint32_t key - uint32_t value hash table */
+static void *new_ii32_ht(void) {
+  khash_t(ii32) *h = kh_init(ii32);
+  return h;
+}
+
+/* Initialize a new uint32_t key - string value hash table */
+static void *new_is32_ht(void) {
+  khash_t(is32) *h = kh_init(is32);
+  return h;
+}
+
+/* Initialize a new uint32_t key - uint64_t value hash table */
+static void *new_iu64_ht(void) {
+  khash_t(iu64) *h = kh_init(iu64);
+  return h;
+}
+
+/* Initialize a new string key - uint32_t value hash table */
+static void *new_si32_ht(void) {
+  khash_t(si32) *h = kh_init(si32);
+  return h;
+}
+
+/* Initialize a new string key - uint64_t value hash table */
+static void *new_su64_ht(void) {
+  khash_t(su64) *h = kh_init(su64);
+  return h;
+}
+
+/* Initialize a new uint64_t key - uint8_t value hash table */
+static void *new_u648_ht(void) {
+  khash_t(u648) *h = kh_init(u648);
+  return h;
+}
+
+/* Initialize a new uint64_t key - GLastParse value hash table */
+static void *new_iglp_ht(void) {
+  khash_t(iglp) *h = kh_init(iglp);
+  return h;
+}
+
+/* Initialize a new uint32_t key - GKHashStorage value hash table */
+static void *new_igdb_ht(void) {
+  khash_t(igdb) *h = kh_init(igdb);
+  return h;
+}
+
+/* Initialize a new uint32_t key - GKHashStorage value hash table */
+static void *new_igkh_ht(void) {
+  khash_t(igkh) *h = kh_init(igkh);
+  return h;
+}
+
+/* Initialize a new string key - uint32_t value hash table */
+static void *new_si08_ht(void) {
+  khash_t(si08) *h = kh_init(si08);
+  return h;
+}
+
+/* Initialize a new string key - string value hash table */
+static void *new_ss32_ht(void) {
+  khash_t(ss32) *h = kh_init(ss32);
+  return h;
+}
+
+/* Remove all nodes from the list.
+ *
+ * On success, 0 is returned. */
+static int list_remove_nodes(GSLList *list) {
+  GSLList *tmp;
+  while (list != NULL) {
+    tmp = list->next;
+    if (list->data)
+      free(list->data);
+    free(list);
+    list = tmp;
+  }
+
+  return 0;
+}
+
+/* Deletes all entries from the hash table and optionally frees its GSLList */
+static void del_igsl_free(void *h, uint8_t free_data) {
+  khint_t k;
+  khash_t(igsl) *hash = h;
+  void *list = NULL;
+  if (!hash)
+    return;
+
+  for (k = 0; k < kh_end(hash); ++k) {
+    if (!kh_exist(hash, k))
+      continue;
+
+    if (free_data) {
+      list = kh_value(hash, k);
+      list_remove_nodes(list);
+    }
+    kh_del(igsl, hash, k);
+  }
+}
+
+/* Deletes all entries from the hash table */
+static void del_ii08(void *h, uint8_t free_data) {
+  khint_t k;
+  khash_t(ii08) *hash = h;
+  if (!hash)
+    return;
+
+  for (k = 0; k < kh_end(hash); ++k) {
+    if (kh_exist(hash, k)) {
+      kh_del(ii08, hash, k);
+    }
+  }
+}
+
+/* Deletes all entries from the hash table */
+static void del_ii32(void *h, uint8_t free_data) {
+  khint_t k;
+  khash_t(ii32) *hash = h;
+  if (!hash)
+    return;
+
+  for (k = 0; k < kh_end(hash); ++k) {
+    if (kh_exist(hash, k)) {
+      kh_del(ii32, hash, k);
+    }
+  }
+}
+
+/* Deletes both the hash entry and its string values */
+static void del_is32_free(void *h, uint8_t free_data) {
+  khint_t k;
+  khash_t(is32) *hash = h;
+  if (!hash)
+    return;
+
+  for (k = 0; k < kh_end(hash); ++k) {
+    if (kh_exist(hash, k)) {
+      if (free_data)
+        free((char *)kh_value(hash, k));
+      kh_del(is32, hash, k);
+    }
+  }
+}
+
+/* Deletes all entries from the hash table */
+static void del_iu64(void *h, uint8_t free_data) {
+  khint_t k;
+  khash_t(iu64) *hash = h;
+  if (!hash)
+    return;
+
+  for (k = 0; k < kh_end(hash); ++k) {
+    if (kh_exist(hash, k)) {
+      kh_del(iu64, hash, k);
+    }
+  }
+}
+
+/* Deletes an entry from the hash table and optionally the keys for a string
+ * key - uint32_t value hash */
+static void del_si32_free(void *h, uint8_t free_data) {
+  khint_t k;
+  khash_t(si32) *hash = h;
+  if (!hash)
+    return;
+
+  for (k = 0; k < kh_end(hash); ++k) {
+    if (kh_exist(hash, k)) {
+      if (free_data)
+        free((char *)kh_key(hash, k));
+      kh_del(si32, hash, k);
+    }
+  }
+}
+
+/* Deletes all entries from the hash table and optionally frees its string key
+ */
+static void del_su64_free(void *h, uint8_t free_data) {
+  khint_t k;
+  khash_t(su64) *hash = h;
+  if (!hash)
+    return;
+
+  for (k = 0; k < kh_end(hash); ++k) {
+    if (kh_exist(hash, k)) {
+      if (free_data)
+        free((char *)kh_key(hash, k));
+      kh_del(su64, hash, k);
+    }
+  }
+}
+
+/* Deletes all entries from the hash table */
+static void del_u648(void *h, uint8_t free_data) {
+  khint_t k;
+  khash_t(u648) *hash = h;
+  if (!hash)
+    return;
+
+  for (k = 0; k < kh_end(hash); ++k) {
+    if (kh_exist(hash, k)) {
+      kh_del(u648, hash, k);
+    }
+  }
+}
+
+/* Destroys both the hash structure and its GSLList
+ * values */
+static void des_igsl_free(void *h, uint8_t free_data) {
+  khash_t(igsl) *hash = h;
+  khint_t k;
+  void *list = NULL;
+  if (!hash)
+    return;
+
+  if (!free_data)
+    goto des;
+
+  for (k = 0; k < kh_end(hash); ++k) {
+    if (kh_exist(hash, k) && (list = kh_value(hash, k))) {
+      list_remove_nodes(list);
+    }
+  }
+des:
+  kh_destroy(igsl, hash);
+}
+
+/* Destroys the hash structure */
+static void des_ii08(void *h, uint8_t free_data) {
+  khash_t(ii08) *hash = h;
+  if (!hash)
+    return;
+  kh_destroy(ii08, hash);
+}
+
+/* Destroys the hash structure */
+static void des_ii32(void *h, uint8_t free_data) {
+  khash_t(ii32) *hash = h;
+  if (!hash)
+    return;
+  kh_destroy(ii32, hash);
+}
+
+/* Destroys both the hash structure and its string values */
+static void des_is32_free(void *h, uint8_t free_data) {
+  khint_t k;
+  khash_t(is32) *hash = h;
+  if (!hash)
+    return;
+
+  if (!free_data)
+    goto des;
+
+  for (k = 0; k < kh_end(hash); ++k) {
+    if (kh_exist(hash, k)) {
+      free((char *)kh_value(hash, k));
+    }
+  }
+des:
+  kh_destroy(is32, hash);
+}
+
+/* Destroys the hash structure */
+static void des_iu64(void *h, uint8_t free_data) {
+  khash_t(iu64) *hash = h;
+  if (!hash)
+    return;
+  kh_destroy(iu64, hash);
+}
+
+/* Destroys both the hash structure and the keys for a
+ * string key - uint32_t value hash */
+static void des_si32_free(void *h, uint8_t free_data) {
+  khint_t k;
+  khash_t(si32) *hash = h;
+  if (!hash)
+    return;
+
+  if (!free_data)
+    goto des;
+
+  for (k = 0; k < kh_end(hash); ++k) {
+    if (kh_exist(hash, k)) {
+      free((char *)kh_key(hash, k));
+    }
+  }
+
+des:
+  kh_destroy(si32, hash);
+}
+
+/* Destroys both the hash structure and the keys for a
+ * string key - uint64_t value hash */
+static void des_su64_free(void *h, uint8_t free_data) {
+  khash_t(su64) *hash = h;
+  khint_t k;
+  if (!hash)
+    return;
+
+  if (!free_data)
+    goto des;
+
+  for (k = 0; k < kh_end(hash); ++k) {
+    if (kh_exist(hash, k)) {
+      free((char *)kh_key(hash, k));
+    }
+  }
+
+des:
+  kh_destroy(su64, hash);
+}
+
+/* Destroys the hash structure */
+static void des_u648(void *h, uint8_t free_data) {
+  khash_t(u648) *hash = h;
+  if (!hash)
+    return;
+  kh_destroy(u648, hash);
+}
+
+/* Destroys both the hash structure and the keys for a
+ * string key - uint32_t value hash */
+static void des_si08_free(void *h, uint8_t free_data) {
+  khint_t k;
+  khash_t(si08) *hash = h;
+  if (!hash)
+    return;
+
+  if (!free_data)
+    goto des;
+
+  for (k = 0; k < kh_end(hash); ++k) {
+    if (kh_exist(hash, k)) {
+      free((char *)kh_key(hash, k));
+    }
+  }
+
+des:
+  kh_destroy(si08, hash);
+}
+
+/* Deletes an entry from the hash table and optionally the keys for a string
+ * key - uint32_t value hash */
+static void del_si08_free(void *h, uint8_t free_data) {
+  khint_t k;
+  khash_t(si08) *hash = h;
+  if (!hash)
+    return;
+
+  for (k = 0; k < kh_end(hash); ++k) {
+    if (kh_exist(hash, k)) {
+      if (free_data)
+        free((char *)kh_key(hash, k));
+      kh_del(si08, hash, k);
+    }
+  }
+}
+
+/* Deletes an entry from the hash table and optionally the keys for a string
+ * keys and string values */
+static void del_ss32_free(void *h, uint8_t free_data) {
+  khint_t k;
+  khash_t(ss32) *hash = h;
+  if (!hash)
+    return;
+
+  for (k = 0; k < kh_end(hash); ++k) {
+    if (kh_exist(hash, k)) {
+      if (free_data) {
+        free((char *)kh_key(hash, k));
+        free((char *)kh_value(hash, k));
+      }
+      kh_del(ss32, hash, k);
+    }
+  }
+}
+
+/* Destroys both the hash structure and its string
+ * keys and string values */
+static void des_ss32_free(void *h, uint8_t free_data) {
+  khint_t k;
+  khash_t(ss32) *hash = h;
+  if (!hash)
+    return;
+
+  if (!free_data)
+    goto des;
+
+  for (k = 0; k < kh_end(hash); ++k) {
+    if (kh_exist(hash, k)) {
+      free((char *)kh_key(hash, k));
+      free((char *)kh_value(hash, k));
+    }
+  }
+
+des:
+  kh_destroy(ss32, hash);
+}
+
+/* Destroys the hash structure */
+static void des_iglp(void *h, uint8_t free_data) {
+  khash_t(iglp) *hash = h;
+  if (!hash)
+    return;
+  kh_destroy(iglp, hash);
+}
+
+/* Per module & per date */
+static const GKHashMetric module_metrics[] = {
+    {.metric.storem = MTRC_KEYMAP,
+     MTRC_TYPE_II32,
+     new_ii32_ht,
+     des_ii32,
+     del_ii32,
+     1,
+     NULL,
+     NULL},
+    {.metric.storem = MTRC_ROOTMAP,
+     MTRC_TYPE_IS32,
+     new_is32_ht,
+     des_is32_free,
+     del_is32_free,
+     1,
+     NULL,
+     NULL},
+    {.metric.storem = MTRC_DATAMAP,
+     MTRC_TYPE_IS32,
+     new_is32_ht,
+     des_is32_free,
+     del_is32_free,
+     1,
+     NULL,
+     NULL},
+    {.metric.storem = MTRC_UNIQMAP,
+     MTRC_TYPE_U648,
+     new_u648_ht,
+     des_u648,
+     del_u648,
+     1,
+     NULL,
+     NULL},
+    {.metric.storem = MTRC_ROOT,
+     MTRC_TYPE_II32,
+     new_ii32_ht,
+     des_ii32,
+     del_ii32,
+     1,
+     NULL,
+     NULL},
+    {.metric.storem = MTRC_HITS,
+     MTRC_TYPE_II32,
+     new_ii32_ht,
+     des_ii32,
+     del_ii32,
+     1,
+     NULL,
+     NULL},
+    {.metric.storem = MTRC_VISITORS,
+     MTRC_TYPE_II32,
+     new_ii32_ht,
+     des_ii32,
+     del_ii32,
+     1,
+     NULL,
+     NULL},
+    {.metric.storem = MTRC_BW,
+     MTRC_TYPE_IU64,
+     new_iu64_ht,
+     des_iu64,
+     del_iu64,
+     1,
+     NULL,
+     NULL},
+    {.metric.storem = MTRC_CUMTS,
+     MTRC_TYPE_IU64,
+     new_iu64_ht,
+     des_iu64,
+     del_iu64,
+     1,
+     NULL,
+     NULL},
+    {.metric.storem = MTRC_MAXTS,
+     MTRC_TYPE_IU64,
+     new_iu64_ht,
+     des_iu64,
+     del_iu64,
+     1,
+     NULL,
+     NULL},
+    {.metric.storem = MTRC_METHODS,
+     MTRC_TYPE_II08,
+     new_ii08_ht,
+     des_ii08,
+     del_ii08,
+     0,
+     NULL,
+     NULL},
+    {.metric.storem = MTRC_PROTOCOLS,
+     MTRC_TYPE_II08,
+     new_ii08_ht,
+     des_ii08,
+     del_ii08,
+     0,
+     NULL,
+     NULL},
+    {.metric.storem = MTRC_AGENTS,
+     MTRC_TYPE_IGSL,
+     new_igsl_ht,
+     des_igsl_free,
+     del_igsl_free,
+     1,
+     NULL,
+     NULL},
+    {.metric.storem = MTRC_METADATA,
+     MTRC_TYPE_SU64,
+     new_su64_ht,
+     des_su64_free,
+     del_su64_free,
+     1,
+     NULL,
+     NULL},
+};
+static const size_t module_metrics_len = ARRAY_SIZE(module_metrics);
+
+/* Initialize module metrics and mallocs its hash structure */
+static void init_tables(GModule module, GKHashModule *storage) {
+  int n = 0, i;
+
+  n = module_metrics_len;
+  for (i = 0; i < n; i++) {
+    storage[module].metrics[i] = module_metrics[i];
+    storage[module].metrics[i].hash = module_metrics[i].alloc();
+  }
+}
+
+/* Initialize a module hash structure.
+ *
+ * On success, a pointer to that hash structure is returned. */
+static GKHashModule *init_gkhashmodule(void) {
+  GKHashModule *storage = NULL;
+  GModule module;
+  size_t idx = 0;
+
+  storage = new_gkhmodule(TOTAL_MODULES);
+  FOREACH_MODULE(idx, module_list) {
+    module = module_list[idx];
+
+    storage[module].module = module;
+    init_tables(module, storage);
+  }
+
+  return storage;
+}
 
-#define KHASH_INIT2(name, SCOPE, khkey_t, khval_t, kh_is_map, __hash_func,     \
-                    __hash_equal)                                              \
-  __KHASH_TYPE(name, khkey_t, khval_t)                                         \
-  __KHASH_IMPL(name, SCOPE, khkey_t, khval_t, kh_is_map, __hash_func,          \
-               __hash_equal)
+/* Initialize hash tables */
+static void init_storage(void) {
+  GKDB *db = get_db_instance(DB_INSTANCE);
+  db->cache = init_gkhashmodule();
+}
 
-#define KHASH_INIT(name, khkey_t, khval_t, kh_is_map, __hash_func,             \
-                   __hash_equal)                                               \
-  KHASH_INIT2(name, static kh_inline klib_unused, khkey_t, khval_t, kh_is_map, \
-              __hash_func, __hash_equal)
+/* Allocate memory for a new GKDB instance.
+ *
+ * On success, the newly allocated GKHashDB is returned . */
+static GKDB *new_gkdb(void) {
+  GKDB *db = xcalloc(1, sizeof(GKDB));
+  return db;
+}
 
-/* --- BEGIN OF HASH FUNCTIONS --- */
+/* Allocate memory for a new global GKHashDB instance.
+ *
+ * On success, the newly allocated GKHashDB is returned . */
+static GKHashDB *new_gkhdb(void) {
+  GKHashDB *storage = xcalloc(1, sizeof(GKHashDB));
+  return storage;
+}
 
-/*! @function
-  @abstract     Integer hash function
-  @param  key   The integer [khint32_t]
-  @return       The hash value [khint_t]
- */
-#define kh_int_hash_func(key) (khint32_t)(key)
-/*! @function
-  @abstract     Integer comparison function
- */
-#define kh_int_hash_equal(a, b) ((a) == (b))
-/*! @function
-  @abstract     64-bit integer hash function
-  @param  key   The integer [khint64_t]
-  @return       The hash value [khint_t]
- */
-#define kh_int64_hash_func(key) (khint32_t)((key) >> 33 ^ (key) ^ (key) << 11)
-/*! @function
-  @abstract     64-bit integer comparison function
- */
-#define kh_int64_hash_equal(a, b) ((a) == (b))
-/*! @function
-  @abstract     const char* hash function
-  @param  s     Pointer to a null terminated string
-  @return       The hash value
- */
-static kh_inline khint_t
-__ac_X31_hash_string(const char *s) {
-  khint_t h = (khint_t)*s;
-  if (h)
-    for (++s; *s; ++s)
-      h = (h << 5) - h + (khint_t)*s;
-  return h;
+/* Whole application */
+static const GKHashMetric app_metrics[] = {
+    {.metric.dbm = MTRC_DATES,
+     MTRC_TYPE_IGKH,
+     new_igkh_ht,
+     NULL,
+     NULL,
+     1,
+     NULL,
+     NULL},
+    {.metric.dbm = MTRC_SEQS,
+     MTRC_TYPE_SI32,
+     new_si32_ht,
+     des_si32_free,
+     del_si32_free,
+     1,
+     NULL,
+     "SI32_SEQS.db"},
+    {.metric.dbm = MTRC_CNT_OVERALL,
+     MTRC_TYPE_SI32,
+     new_si32_ht,
+     des_si32_free,
+     del_si32_free,
+     1,
+     NULL,
+     "SI32_CNT_OVERALL.db"},
+    {.metric.dbm = MTRC_HOSTNAMES,
+     MTRC_TYPE_SS32,
+     new_ss32_ht,
+     des_ss32_free,
+     del_ss32_free,
+     1,
+     NULL,
+     NULL},
+    {.metric.dbm = MTRC_LAST_PARSE,
+     MTRC_TYPE_IGLP,
+     new_iglp_ht,
+     des_iglp,
+     NULL,
+     1,
+     NULL,
+     "IGLP_LAST_PARSE.db"},
+    {.metric.dbm = MTRC_METH_PROTO,
+     MTRC_TYPE_SI08,
+     new_si08_ht,
+     des_si08_free,
+     del_si08_free,
+     1,
+     NULL,
+     "SI08_METH_PROTO.db"},
+    {.metric.dbm = MTRC_DB_PROPS,
+     MTRC_TYPE_SI32,
+     new_si32_ht,
+     des_si32_free,
+     del_si32_free,
+     1,
+     NULL,
+     "SI32_DB_PROPS.db"},
+};
+
+static const size_t app_metrics_len = ARRAY_SIZE(app_metrics);
+
+/* Initialize a global hash structure.
+ *
+ * On success, a pointer to that hash structure is returned. */
+static GKHashDB *init_gkhashdb(void) {
+  GKHashDB *storage = NULL;
+
+  int n = 0, i;
+
+  storage = new_gkhdb();
+  n = app_metrics_len;
+  for (i = 0; i < n; i++) {
+    storage->metrics[i] = app_metrics[i];
+    storage->metrics[i].hash = app_metrics[i].alloc();
+  }
+
+  return storage;
 }
 
-/*! @function
-  @abstract     Another interface to const char* hash function
-  @param  key   Pointer to a null terminated string [const char*]
-  @return       The hash value [khint_t]
- */
-#define kh_str_hash_func(key) __ac_X31_hash_string(key)
-/*! @function
-  @abstract     Const char* comparison function
- */
-#define kh_str_hash_equal(a, b) (strcmp(a, b) == 0)
+/* Create a new GKDB instance given a uint32_t key
+ *
+ * On error, -1 is returned.
+ * On key found, 1 is returned.
+ * On success 0 is returned */
+static GKDB *new_db(khash_t(igdb) * hash, uint32_t key) {
+  GKDB *db = NULL;
+  khint_t k;
+  int ret;
 
-static kh_inline khint_t __ac_Wang_hash(khint_t key) {
-  key += ~(key << 15);
-  key ^= (key >> 10);
-  key += (key << 3);
-  key ^= (key >> 6);
-  key += ~(key << 11);
-  key ^= (key >> 16);
-  return key;
+  if (!hash)
+    return NULL;
+
+  k = kh_put(igdb, hash, key, &ret);
+  /* operation failed */
+  if (ret == -1)
+    return NULL;
+  /* the key is present in the hash table */
+  if (ret == 0)
+    return kh_val(hash, k);
+
+  db = new_gkdb();
+  db->hdb = init_gkhashdb();
+  db->cache = NULL;
+  db->store = NULL;
+  db->logs = NULL;
+  kh_val(hash, k) = db;
+
+  return db;
 }
 
-#define kh_int_hash_func2(k) __ac_Wang_hash((khint_t)key)
+static void init_pre_storage() {
+  ht_db = (khash_t(igdb) *)new_igdb_ht();
+  new_db(ht_db, DB_INSTANCE);
+}
+
+/* Get the string value of a given string key.
+ *
+ * On error, NULL is returned.
+ * On success the string value for the given key is returned */
+static char *get_ss32(khash_t(ss32) * hash, const char *key) {
+  khint_t k;
+  char *value = NULL;
+
+  if (!hash)
+    return NULL;
+
+  k = kh_get(ss32, hash, key);
+  /* key found, return current value */
+  if (k != kh_end(hash) && (value = kh_val(hash, k)))
+    return xstrdup(value);
+
+  return NULL;
+}
+
+/* Number of independently locked intern table shards */
+#define INTERN_SHARD_BITS 4
+#define INTERN_SHARDS (1 << INTERN_SHARD_BITS)
+/* Initial slots of a shard, kept at most half full */
+#define INTERN_MIN_SLOTS 64
+
+/* Open addressing table of a shard, see find_intern_idx(). Each slot holds
+ * the hash of a string in the upper 32 bits and its local index + 1 in the
+ * lower 32 bits, 0 if empty. */
+typedef struct GInternSlots_ {
+  uint32_t mask;
+  uint64_t slot[];
+} GInternSlots;
+
+/* A shard of the intern table, see intern_str(). Lookups take no lock: the
+ * arrays of a shard are only replaced by larger copies and published through
+ * release stores, the previous ones being retired until free_intern_table(),
+ * so a reader still holding one keeps a valid view. Inserts are serialized by
+ * the mutex. */
+typedef struct GInternShard_ {
+  pthread_mutex_t mutex;
+  GInternSlots *slots; /* string to local index */
+  char **strs;         /* local index to string */
+  uint32_t size;       /* strings published, see get_intern_str() */
+  uint32_t cap;
+  void **retired; /* arrays replaced by a larger copy */
+  uint32_t nretired;
+} GInternShard;
+
+static GInternShard intern_shards[INTERN_SHARDS];
+/* maximum number of strings per shard, 0 if interning is disabled */
+static uint32_t intern_max = 0;
+
+static GInternSlots *new_intern_slots(uint32_t n) {
+  GInternSlots *slots = xcalloc(1, sizeof(GInternSlots) + n * sizeof(uint64_t));
+
+  slots->mask = n - 1;
+
+  return slots;
+}
+
+/* Enable interning of up to `max` distinct agent, host, vhost and referring
+ * site values, see intern_str(). Once the table is full, further values are
+ * kept per item as usual. This is a no-op if interning is already enabled. */
+void init_intern_table(uint32_t max) {
+  int s;
+
+  if (max == 0 || intern_max)
+    return;
+
+  for (s = 0; s < INTERN_SHARDS; s++) {
+    memset(&intern_shards[s], 0, sizeof(GInternShard));
+    pthread_mutex_init(&intern_shards[s].mutex, NULL);
+    intern_shards[s].slots = new_intern_slots(INTERN_MIN_SLOTS);
+  }
+  max = MAX(max / INTERN_SHARDS, 1);
+  intern_max = MIN(max, (UINT32_MAX >> INTERN_SHARD_BITS) - 1);
+}
+
+/* Free all interned strings and disable interning. Items still pointing to
+ * interned strings must not be used afterwards. */
+void free_intern_table(void) {
+  GInternShard *shard = NULL;
+  uint32_t i;
+  int s;
+
+  if (intern_max == 0)
+    return;
+
+  for (s = 0; s < INTERN_SHARDS; s++) {
+    shard = &intern_shards[s];
+    for (i = 0; i < shard->size; i++)
+      free(shard->strs[i]);
+    for (i = 0; i < shard->nretired; i++)
+      free(shard->retired[i]);
+    free(shard->retired);
+    free(shard->strs);
+    free(shard->slots);
+    pthread_mutex_destroy(&shard->mutex);
+  }
+  intern_max = 0;
+}
+
+/* Get the string of the given intern ID. This takes no lock, see
+ * GInternShard.
+ *
+ * If the ID is 0 or unknown, NULL is returned.
+ * On success, the shared string is returned. */
+const char *get_intern_str(uint32_t id) {
+  GInternShard *shard = &intern_shards[id & (INTERN_SHARDS - 1)];
+  uint32_t idx = id >> INTERN_SHARD_BITS;
+  char **strs = NULL;
+
+  if (intern_max == 0 || idx == 0)
+    return NULL;
+
+  /* the string was set before the size covering it was published */
+  if (idx > __atomic_load_n(&shard->size, __ATOMIC_ACQUIRE))
+    return NULL;
+  strs = __atomic_load_n(&shard->strs, __ATOMIC_ACQUIRE);
+
+  return strs[idx - 1];
+}
+
+/* Find the local index of the given string of hash `hash` in a shard. This
+ * takes no lock, see GInternShard.
+ *
+ * If not found, -1 is returned.
+ * On success, the index is returned. */
+static int64_t find_intern_idx(GInternShard *shard, const char *str,
+                               uint32_t hash) {
+  GInternSlots *slots = __atomic_load_n(&shard->slots, __ATOMIC_ACQUIRE);
+  char **strs = NULL;
+  uint64_t v;
+  uint32_t i;
+
+  for (i = hash & slots->mask;; i = (i + 1) & slots->mask) {
+    /* the string was set before the slot pointing to it was published */
+    if ((v = __atomic_load_n(&slots->slot[i], __ATOMIC_ACQUIRE)) == 0)
+      return -1;
+    if ((uint32_t)(v >> 32) != hash)
+      continue;
+    strs = __atomic_load_n(&shard->strs, __ATOMIC_ACQUIRE);
+    if (strcmp(strs[(uint32_t)v - 1], str) == 0)
+      return (uint32_t)v - 1;
+  }
+}
+
+/* Put a slot into the given table, which has room for it. */
+static void put_intern_slot(GInternSlots *slots, uint64_t v) {
+  uint32_t i = (uint32_t)(v >> 32) & slots->mask;
+
+  while (slots->slot[i] != 0)
+    i = (i + 1) & slots->mask;
+  __atomic_store_n(&slots->slot[i], v, __ATOMIC_RELEASE);
+}
+
+/* Replace an array of a shard by a larger copy, retiring it rather than
+ * freeing it, as readers may still hold it. Callers hold the shard's
+ * mutex. */
+static void retire_intern_array(GInternShard *shard, void *array) {
+  shard->retired = xrealloc(shard->retired,
+                            (shard->nretired + 1) * sizeof(void *));
+  shard->retired[shard->nretired++] = array;
+}
+
+/* Add the given string of hash `hash` to a shard, growing its arrays as
+ * needed. Callers hold the shard's mutex and checked there is room.
+ *
+ * On success, the local index of the new string is returned. */
+static uint32_t add_intern_str(GInternShard *shard, const char *str,
+                               uint32_t hash) {
+  GInternSlots *slots = shard->slots, *grown = NULL;
+  char **strs = NULL;
+  uint32_t i, idx = shard->size;
+
+  if (idx == shard->cap) {
+    shard->cap = shard->cap ? shard->cap * 2 : 64;
+    strs = xmalloc(shard->cap * sizeof(char *));
+    if (idx)
+      memcpy(strs, shard->strs, idx * sizeof(char *));
+    if (shard->strs)
+      retire_intern_array(shard, shard->strs);
+    __atomic_store_n(&shard->strs, strs, __ATOMIC_RELEASE);
+  }
+  shard->strs[idx] = xstrdup(str);
+
+  /* keep the table at most half full, so probes stay short and end */
+  if ((uint64_t)(idx + 1) * 2 > (uint64_t)slots->mask + 1) {
+    grown = new_intern_slots((slots->mask + 1) * 2);
+    for (i = 0; i <= slots->mask; i++)
+      if (slots->slot[i])
+        put_intern_slot(grown, slots->slot[i]);
+    retire_intern_array(shard, slots);
+    __atomic_store_n(&shard->slots, grown, __ATOMIC_RELEASE);
+    slots = grown;
+  }
+  put_intern_slot(slots, (uint64_t)hash << 32 | (idx + 1));
+  __atomic_store_n(&shard->size, idx + 1, __ATOMIC_RELEASE);
+
+  return idx;
+}
+
+/* Look up the given string in the intern table, adding it if there's room.
+ * The shard is picked off the top bits of the hash, so that the slot bits
+ * used within a shard remain spread out. IDs encode their shard in the low
+ * INTERN_SHARD_BITS and stay stable until free_intern_table(). Lookups take
+ * no lock, only adding a string does, see GInternShard.
+ *
+ * If interning is disabled or the table is full, NULL is returned and `id`
+ * is set to 0.
+ * On success, the shared string is returned and its ID assigned to `id`. */
+static const char *intern_str(const char *str, uint32_t *id) {
+  GInternShard *shard = NULL;
+  GArena *prev = NULL;
+  int64_t found;
+  uint32_t s, hash, idx;
+
+  *id = 0;
+  if (intern_max == 0)
+    return NULL;
 
-/* --- END OF HASH FUNCTIONS --- */
+  hash = kh_str_hash_func(str);
+  s = (hash * 2654435769u) >> (32 - INTERN_SHARD_BITS);
+  shard = &intern_shards[s];
+
+  if ((found = find_intern_idx(shard, str, hash)) == -1) {
+    pthread_mutex_lock(&shard->mutex);
+    /* it may have been added meanwhile */
+    found = find_intern_idx(shard, str, hash);
+    if (found == -1 && shard->size < intern_max) {
+      /* interned strings outlive any batch, keep them off the active arena */
+      prev = set_active_arena(NULL);
+      found = add_intern_str(shard, str, hash);
+      set_active_arena(prev);
+    }
+    pthread_mutex_unlock(&shard->mutex);
+    if (found == -1)
+      return NULL;
+  }
+  idx = found;
 
-/* Other convenient macros... */
+  str = __atomic_load_n(&shard->strs, __ATOMIC_ACQUIRE)[idx];
+  *id = ((idx + 1) << INTERN_SHARD_BITS) | s;
 
-/*!
-  @abstract Type of the hash table.
-  @param  name  Name of the hash table [symbol]
- */
-#define khash_t(name) kh_##name##_t
+  return str;
+}
 
-/*! @function
-  @abstract     Initiate a hash table.
-  @param  name  Name of the hash table [symbol]
-  @return       Pointer to the hash table [khash_t(name)*]
- */
-#define kh_init(name) kh_init_##name()
+/* Intern the given token, see intern_str(). Interned strings are shared
+ * across items, so they are never modified nor released through an item.
+ *
+ * If the token can't be interned, it is returned as is and `id` is set to 0.
+ * On success, the token is released and the shared string is returned. */
+static char *intern_token(char *tkn, uint32_t *id) {
+  const char *str = intern_str(tkn, id);
 
-/*! @function
-  @abstract     Destroy a hash table.
-  @param  name  Name of the hash table [symbol]
-  @param  h     Pointer to the hash table [khash_t(name)*]
- */
-#define kh_destroy(name, h) kh_destroy_##name(h)
+  if (str == NULL)
+    return tkn;
 
-/*! @function
-  @abstract     Reset a hash table without deallocating memory.
-  @param  name  Name of the hash table [symbol]
-  @param  h     Pointer to the hash table [khash_t(name)*]
- */
-#define kh_clear(name, h) kh_clear_##name(h)
+  xfree(tkn);
+  return (char *)str;
+}
 
-/*! @function
-  @abstract     Resize a hash table.
-  @param  name  Name of the hash table [symbol]
-  @param  h     Pointer to the hash table [khash_t(name)*]
-  @param  s     New size [khint_t]
- */
-#define kh_resize(name, h, s) kh_resize_##name(h, s)
+/* Insert the resume state of a log given its inode, replacing the previous
+ * one. The states of other inodes last seen at the same path are dropped,
+ * as those files were rotated away.
+ *
+ * On error -1 is returned.
+ * On success 0 is returned */
+static int ht_insert_last_parse(uint64_t key, const GLastParse *lp) {
+  GKDB *db = get_db_instance(DB_INSTANCE);
+  khash_t(iglp) *hash = db ? get_hdb(db, MTRC_LAST_PARSE) : NULL;
+  khint_t k;
+  int ret;
 
-/*! @function
-  @abstract     Insert a key to the hash table.
-  @param  name  Name of the hash table [symbol]
-  @param  h     Pointer to the hash table [khash_t(name)*]
-  @param  k     Key [type of keys]
-  @param  r     Extra return code: -1 if the operation failed;
-                0 if the key is present in the hash table;
-                1 if the bucket is empty (never used); 2 if the element in
-        the bucket has been deleted [int*]
-  @return       Iterator to the inserted element [khint_t]
- */
-#define kh_put(name, h, k, r) kh_put_##name(h, k, r)
+  if (!hash)
+    return -1;
 
-/*! @function
-  @abstract     Retrieve a key from the hash table.
-  @param  name  Name of the hash table [symbol]
-  @param  h     Pointer to the hash table [khash_t(name)*]
-  @param  k     Key [type of keys]
-  @return       Iterator to the found element, or kh_end(h) if the element is
-  absent [khint_t]
- */
-#define kh_get(name, h, k) kh_get_##name(h, k)
+  for (k = kh_begin(hash); lp->pathhash && k != kh_end(hash); ++k) {
+    if (kh_exist(hash, k) && kh_key(hash, k) != key &&
+        kh_val(hash, k).pathhash == lp->pathhash)
+      kh_del(iglp, hash, k);
+  }
 
-/*! @function
-  @abstract     Remove a key from the hash table.
-  @param  name  Name of the hash table [symbol]
-  @param  h     Pointer to the hash table [khash_t(name)*]
-  @param  k     Iterator to the element to be deleted [khint_t]
- */
-#define kh_del(name, h, k) kh_del_##name(h, k)
+  k = kh_put(iglp, hash, key, &ret);
+  if (ret == -1)
+    return -1;
+  kh_val(hash, k) = *lp;
 
-/*! @function
-  @abstract     Test whether a bucket contains data.
-  @param  h     Pointer to the hash table [khash_t(name)*]
-  @param  x     Iterator to the bucket [khint_t]
-  @return       1 if containing data; 0 otherwise [int]
- */
-#define kh_exist(h, x) (!__ac_iseither((h)->flags, (x)))
+  return 0;
+}
 
-/*! @function
-  @abstract     Get key given an iterator
-  @param  h     Pointer to the hash table [khash_t(name)*]
-  @param  x     Iterator to the bucket [khint_t]
-  @return       Key [type of keys]
- */
-#define kh_key(h, x) ((h)->keys[x])
+/* Get the resume state of a log given its inode.
+ *
+ * If not found, a zeroed state is returned.
+ * On success, the resume state is returned. */
+static GLastParse ht_get_last_parse(uint64_t key) {
+  GKDB *db = get_db_instance(DB_INSTANCE);
+  khash_t(iglp) *hash = db ? get_hdb(db, MTRC_LAST_PARSE) : NULL;
+  GLastParse lp;
+  khint_t k;
 
-/*! @function
-  @abstract     Get value given an iterator
-  @param  h     Pointer to the hash table [khash_t(name)*]
-  @param  x     Iterator to the bucket [khint_t]
-  @return       Value [type of values]
-  @discussion   For hash sets, calling this results in segfault.
- */
-#define kh_val(h, x) ((h)->vals[x])
+  memset(&lp, 0, sizeof(lp));
+  if (!hash)
+    return lp;
 
-/*! @function
-  @abstract     Alias of kh_val()
- */
-#define kh_value(h, x) ((h)->vals[x])
+  k = kh_get(iglp, hash, key);
+  if (k != kh_end(hash))
+    lp = kh_val(hash, k);
 
-/*! @function
-  @abstract     Get the start iterator
-  @param  h     Pointer to the hash table [khash_t(name)*]
-  @return       The start iterator [khint_t]
- */
-#define kh_begin(h) (khint_t)(0)
+  return lp;
+}
 
-/*! @function
-  @abstract     Get the end iterator
-  @param  h     Pointer to the hash table [khash_t(name)*]
-  @return       The end iterator [khint_t]
- */
-#define kh_end(h) ((h)->n_buckets)
+#define LAST_PARSE_MAGIC "GLP2"
+/* States saved before the path hash was recorded */
+#define LAST_PARSE_MAGIC_V1 "GLP1"
 
-/*! @function
-  @abstract     Get the number of elements in the hash table
-  @param  h     Pointer to the hash table [khash_t(name)*]
-  @return       Number of elements in the hash table [khint_t]
- */
-#define kh_size(h) ((h)->size)
+/* Save the resume state of all logs to the given file, in host byte order.
+ * The state is written to a temporary file first and renamed over the given
+ * one, so a crash never leaves a partial state behind.
+ *
+ * On error -1 is returned.
+ * On success 0 is returned */
+int save_last_parse(const char *path) {
+  GKDB *db = get_db_instance(DB_INSTANCE);
+  khash_t(iglp) *hash = db ? get_hdb(db, MTRC_LAST_PARSE) : NULL;
+  char tmp[PATH_MAX];
+  uint64_t inode = 0, cnt = 0;
+  GLastParse *lp = NULL;
+  FILE *fp = NULL;
+  khint_t k;
+  int err = 0;
 
-/*! @function
-  @abstract     Get the number of buckets in the hash table
-  @param  h     Pointer to the hash table [khash_t(name)*]
-  @return       Number of buckets in the hash table [khint_t]
- */
-#define kh_n_buckets(h) ((h)->n_buckets)
+  if (!hash || snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp))
+    return -1;
+  if (!(fp = fopen(tmp, "wb")))
+    return -1;
 
-/*! @function
-  @abstract     Iterate over the entries in the hash table
-  @param  h     Pointer to the hash table [khash_t(name)*]
-  @param  kvar  Variable to which key will be assigned
-  @param  vvar  Variable to which value will be assigned
-  @param  code  Block of code to execute
- */
-#define kh_foreach(h, kvar, vvar, code)                                        \
-  {                                                                            \
-    khint_t __i;                                                               \
-    for (__i = kh_begin(h); __i != kh_end(h); ++__i) {                         \
-      if (!kh_exist(h, __i))                                                   \
-        continue;                                                              \
-      (kvar) = kh_key(h, __i);                                                 \
-      (vvar) = kh_val(h, __i);                                                 \
-      code;                                                                    \
-    }                                                                          \
+  cnt = kh_size(hash);
+  err |= fwrite(LAST_PARSE_MAGIC, 4, 1, fp) != 1;
+  err |= fwrite(&cnt, sizeof(cnt), 1, fp) != 1;
+  for (k = kh_begin(hash); k != kh_end(hash); ++k) {
+    if (!kh_exist(hash, k))
+      continue;
+    inode = kh_key(hash, k);
+    lp = &kh_val(hash, k);
+    err |= fwrite(&inode, sizeof(inode), 1, fp) != 1;
+    err |= fwrite(&lp->pathhash, sizeof(lp->pathhash), 1, fp) != 1;
+    err |= fwrite(&lp->line, sizeof(lp->line), 1, fp) != 1;
+    err |= fwrite(&lp->ts, sizeof(lp->ts), 1, fp) != 1;
+    err |= fwrite(&lp->size, sizeof(lp->size), 1, fp) != 1;
+    err |= fwrite(&lp->snippetlen, sizeof(lp->snippetlen), 1, fp) != 1;
+    err |= fwrite(lp->snippet, 1, lp->snippetlen, fp) != lp->snippetlen;
   }
 
-/*! @function
-  @abstract     Iterate over the values in the hash table
-  @param  h     Pointer to the hash table [khash_t(name)*]
-  @param  vvar  Variable to which value will be assigned
-  @param  code  Block of code to execute
- */
-#define kh_foreach_value(h, vvar, code)                                        \
-  {                                                                            \
-    khint_t __i;                                                               \
-    for (__i = kh_begin(h); __i != kh_end(h); ++__i) {                         \
-      if (!kh_exist(h, __i))                                                   \
-        continue;                                                              \
-      (vvar) = kh_val(h, __i);                                                 \
-      code;                                                                    \
-    }                                                                          \
+  err |= fclose(fp) != 0;
+  if (err || rename(tmp, path) != 0) {
+    unlink(tmp);
+    return -1;
   }
 
-/* More convenient interfaces */
-
-/*! @function
-  @abstract     Instantiate a hash set containing integer keys
-  @param  name  Name of the hash table [symbol]
- */
-#define KHASH_SET_INIT_INT(name)                                               \
-  KHASH_INIT(name, khint32_t, char, 0, kh_int_hash_func, kh_int_hash_equal)
-
-/*! @function
-  @abstract     Instantiate a hash map containing integer keys
-  @param  name  Name of the hash table [symbol]
-  @param  khval_t  Type of values [type]
- */
-#define KHASH_MAP_INIT_INT(name, khval_t)                                      \
-  KHASH_INIT(name, khint32_t, khval_t, 1, kh_int_hash_func, kh_int_hash_equal)
+  return 0;
+}
 
-/*! @function
-  @abstract     Instantiate a hash map containing 64-bit integer keys
-  @param  name  Name of the hash table [symbol]
- */
-#define KHASH_SET_INIT_INT64(name)                                             \
-  KHASH_INIT(name, khint64_t, char, 0, kh_int64_hash_func, kh_int64_hash_equal)
+/* Load the resume state of all logs saved by save_last_parse(). States
+ * saved without a path hash are loaded as well.
+ *
+ * On error, including a missing file, -1 is returned.
+ * On success 0 is returned */
+int load_last_parse(const char *path) {
+  char magic[4];
+  uint64_t inode = 0, cnt = 0, i;
+  GLastParse lp;
+  FILE *fp = NULL;
+  int err = 0, v1 = 0;
 
-/*! @function
-  @abstract     Instantiate a hash map containing 64-bit integer keys
-  @param  name  Name of the hash table [symbol]
-  @param  khval_t  Type of values [type]
- */
-#define KHASH_MAP_INIT_INT64(name, khval_t)                                    \
-  KHASH_INIT(name, khint64_t, khval_t, 1, kh_int64_hash_func,                  \
-             kh_int64_hash_equal)
+  if (!(fp = fopen(path, "rb")))
+    return -1;
 
-typedef const char *kh_cstr_t;
-/*! @function
-  @abstract     Instantiate a hash map containing const char* keys
-  @param  name  Name of the hash table [symbol]
- */
-#define KHASH_SET_INIT_STR(name)                                               \
-  KHASH_INIT(name, kh_cstr_t, char, 0, kh_str_hash_func, kh_str_hash_equal)
+  err |= fread(magic, 4, 1, fp) != 1;
+  v1 = !err && memcmp(magic, LAST_PARSE_MAGIC_V1, 4) == 0;
+  err |= !v1 && memcmp(magic, LAST_PARSE_MAGIC, 4) != 0;
+  err |= !err && fread(&cnt, sizeof(cnt), 1, fp) != 1;
+  for (i = 0; !err && i < cnt; i++) {
+    memset(&lp, 0, sizeof(lp));
+    err |= fread(&inode, sizeof(inode), 1, fp) != 1;
+    err |= !v1 && fread(&lp.pathhash, sizeof(lp.pathhash), 1, fp) != 1;
+    err |= fread(&lp.line, sizeof(lp.line), 1, fp) != 1;
+    err |= fread(&lp.ts, sizeof(lp.ts), 1, fp) != 1;
+    err |= fread(&lp.size, sizeof(lp.size), 1, fp) != 1;
+    err |= fread(&lp.snippetlen, sizeof(lp.snippetlen), 1, fp) != 1;
+    err |= lp.snippetlen > READ_BYTES ||
+           fread(lp.snippet, 1, lp.snippetlen, fp) != lp.snippetlen;
+    err |= !err && ht_insert_last_parse(inode, &lp) == -1;
+  }
+  fclose(fp);
 
-/*! @function
-  @abstract     Instantiate a hash map containing const char* keys
-  @param  name  Name of the hash table [symbol]
-  @param  khval_t  Type of values [type]
- */
-#define KHASH_MAP_INIT_STR(name, khval_t)                                      \
-  KHASH_INIT(name, kh_cstr_t, khval_t, 1, kh_str_hash_func, kh_str_hash_equal)
+  return err ? -1 : 0;
+}
 
-/* uint32_t keys           , GKDB payload */
-KHASH_MAP_INIT_INT(igdb, GKDB *);
-/* uint32_t keys           , GKHashStorage payload */
-KHASH_MAP_INIT_INT(igkh, GKHashStorage *);
-/* uint32_t keys           , uint32_t payload */
-KHASH_MAP_INIT_INT(ii32, uint32_t);
-/* uint32_t keys           , string payload */
-KHASH_MAP_INIT_INT(is32, char *);
-/* uint32_t keys           , uint64_t payload */
-KHASH_MAP_INIT_INT(iu64, uint64_t);
-/* string keys             , uint32_t payload */
-KHASH_MAP_INIT_STR(si32, uint32_t);
-/* string keys             , uint8_t payload */
-KHASH_MAP_INIT_STR(si08, uint8_t);
-/* uint8_t keys            , uint8_t payload */
-KHASH_MAP_INIT_INT(ii08, uint8_t);
-/* string keys             , string payload */
-KHASH_MAP_INIT_STR(ss32, char *);
-/* uint64_t key            , GLastParse payload */
-KHASH_MAP_INIT_INT64(iglp, GLastParse);
-/* uint32_t keys           , GSLList payload */
-KHASH_MAP_INIT_INT(igsl, GSLList *);
-/* string keys             , uint64_t payload */
-KHASH_MAP_INIT_STR(su64, uint64_t);
-/* uint64_t key            , uint8_t payload */
-KHASH_MAP_INIT_INT64(u648, uint8_t);
+/* Modules items are aggregated into by aggregate_job(). OS and browsers
+ * need the agent to be classified first, static requests a list of
+ * extensions, so neither is kept. */
+static const GModule agg_modules[] = {
+    VISITORS,        REQUESTS,      NOT_FOUND,    HOSTS,
+    VISIT_TIMES,     VIRTUAL_HOSTS, REFERRERS,    REFERRING_SITES,
+    KEYPHRASES,      STATUS_CODES,  REMOTE_USER,  CACHE_STATUS,
+    MIME_TYPE,       TLS_TYPE,
+};
 
-static khash_t(igdb) *ht_db = NULL;
+/* Per-thread aggregation of parsed items, kept as the store is, one
+ * GKHashStorage per date, and merged into it by merge_agg_shard() */
+struct GAggShard_ {
+  khash_t(igkh) *dates; /* numdate to GKHashStorage */
+  uint32_t items;       /* items aggregated since the last merge */
+};
 
-/* Given a key (date), get the relevant store
- *
- * On error or not found, NULL is returned.
- * On success, a pointer to that store is returned. */
-static void *get_db_instance(uint32_t key) {
-  GKDB *db = NULL;
+/* Serializes merges into the store, shards themselves are never shared */
+static pthread_mutex_t agg_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Hash a string the way the store keys its data. */
+static uint32_t djb2(const unsigned char *str) {
+  uint32_t hash = 5381;
+  int c;
+
+  while ((c = *str++))
+    hash = ((hash << 5) + hash) + c;
+
+  return hash;
+}
+
+/* Add to the value of the given key, inserting it first if needed. */
+static void inc_ii32(khash_t(ii32) * hash, uint32_t key, uint32_t inc) {
   khint_t k;
+  int ret;
 
-  khash_t(igdb) *hash = ht_db;
+  k = kh_put(ii32, hash, key, &ret);
+  if (ret == -1)
+    return;
+  kh_val(hash, k) = (ret ? 0 : kh_val(hash, k)) + inc;
+}
 
-  k = kh_get(igdb, hash, key);
-  /* key not found, return NULL */
-  if (k == kh_end(hash))
-    return NULL;
+/* Add to the value of the given key, inserting it first if needed. */
+static void inc_iu64(khash_t(iu64) * hash, uint32_t key, uint64_t inc) {
+  khint_t k;
+  int ret;
 
-  db = kh_val(hash, k);
-  return db;
+  k = kh_put(iu64, hash, key, &ret);
+  if (ret == -1)
+    return;
+  kh_val(hash, k) = (ret ? 0 : kh_val(hash, k)) + inc;
 }
 
-/* Get an app hash table given a DB instance and a GAMetric
- *
- * On success, a pointer to that store is returned. */
-static void *get_hdb(GKDB *db, GAMetric mtrc) {
-  return db->hdb->metrics[mtrc].hash;
+/* Get the value of the given key, 0 if not found. */
+static uint32_t get_ii32(khash_t(ii32) * hash, uint32_t key) {
+  khint_t k = kh_get(ii32, hash, key);
+  return k != kh_end(hash) ? kh_val(hash, k) : 0;
+}
+
+/* Get the value of the given key, 0 if not found. */
+static uint64_t get_iu64(khash_t(iu64) * hash, uint32_t key) {
+  khint_t k = kh_get(iu64, hash, key);
+  return k != kh_end(hash) ? kh_val(hash, k) : 0;
+}
+
+/* Enable the modules items are aggregated into, see init_gkhashmodule(). */
+static void set_agg_modules(void) {
+  size_t i;
+
+  for (i = 0; i < ARRAY_SIZE(agg_modules); i++)
+    module_list[i] = agg_modules[i];
 }
 
-/* Insert a JSON log format specification such as request.method => %m.
+/* Get the store of the given date, creating it if needed.
  *
- * On error -1 is returned.
- * On success or if key exists, 0 is returned */
-static int ht_insert_json_logfmt(void *userdata, char *key, char *spec) {
-  GKDB *db = get_db_instance(DB_INSTANCE);
-  khash_t(ss32) *hash = get_hdb(db, MTRC_JSON_LOGFMT);
+ * On error, NULL is returned.
+ * On success, the store is returned. */
+static GKHashStorage *get_date_store(khash_t(igkh) * dates, uint32_t date) {
+  GKHashStorage *store = NULL;
   khint_t k;
   int ret;
-  char *dupkey = NULL;
 
-  if (!hash)
-    return -1;
+  k = kh_put(igkh, dates, date, &ret);
+  if (ret == -1)
+    return NULL;
+  if (ret == 0)
+    return kh_val(dates, k);
 
-  k = kh_get(ss32, hash, key);
-  /* key found, free it then to insert */
-  if (k != kh_end(hash))
-    free(kh_val(hash, k));
-  else {
-    dupkey = xstrdup(key);
-    k = kh_put(ss32, hash, dupkey, &ret);
-    /* operation failed */
-    if (ret == -1) {
-      free(dupkey);
-      return -1;
+  store = xcalloc(1, sizeof(GKHashStorage));
+  store->mhash = init_gkhashmodule();
+  kh_val(dates, k) = store;
+
+  return store;
+}
+
+static void free_date_store(GKHashStorage *store) {
+  GKHashMetric *mtrc = NULL;
+  size_t idx = 0, i;
+
+  FOREACH_MODULE(idx, module_list) {
+    for (i = 0; i < module_metrics_len; i++) {
+      mtrc = &store->mhash[module_list[idx]].metrics[i];
+      mtrc->des(mtrc->hash, mtrc->free_data);
     }
   }
-  kh_val(hash, k) = xstrdup(spec);
-
-  return 0;
+  free(store->mhash);
+  free(store);
 }
 
-/* A wrapper to extract time specifiers from a time format.
- *
- * On error NULL is returned.
- * On success, a clean format containing only time specifiers is
- * returned. */
-static char *set_format_time(void) {
-  char *ftime = NULL;
+/* Allocate a shard for a parser thread, see aggregate_job(). */
+static GAggShard *new_agg_shard(void) {
+  GAggShard *shard = xcalloc(1, sizeof(GAggShard));
 
-  if (has_timestamp(conf.date_format) || !strcmp("%T", conf.time_format))
-    ftime = xstrdup("%H%M%S");
-  else
-    ftime = clean_date_time_format(conf.time_format);
+  if (module_list[0] == -1)
+    set_agg_modules();
+  shard->dates = kh_init(igkh);
 
-  return ftime;
+  return shard;
 }
 
-/* A wrapper function to concat the given specificity to the date
- * format. */
-static char *append_spec_date_format(const char *date_format,
-                                     const char *spec_format) {
-  char *s = xmalloc(snprintf(NULL, 0, "%s%s", date_format, spec_format) + 1);
-  sprintf(s, "%s%s", date_format, spec_format);
+/* Empty a table keeping its room. The tables agg_module_hit() fills are
+ * cleared at once, the others through their `del` hook. */
+static void clear_agg_table(GKHashMetric *mtrc) {
+  khash_t(is32) *datamap = NULL;
+  khint_t k;
 
-  return s;
+  switch (mtrc->type) {
+  case MTRC_TYPE_II32:
+    kh_clear(ii32, mtrc->hash);
+    break;
+  case MTRC_TYPE_IU64:
+    kh_clear(iu64, mtrc->hash);
+    break;
+  case MTRC_TYPE_U648:
+    kh_clear(u648, mtrc->hash);
+    break;
+  case MTRC_TYPE_IS32:
+    datamap = mtrc->hash;
+    for (k = kh_begin(datamap); mtrc->free_data && k != kh_end(datamap); ++k)
+      if (kh_exist(datamap, k))
+        free(kh_val(datamap, k));
+    kh_clear(is32, datamap);
+    break;
+  default:
+    mtrc->del(mtrc->hash, mtrc->free_data);
+  }
 }
 
-/* Once we have a numeric date format, we attempt to read the time
- * format and construct a date_time numeric specificity format (if any
- * specificity is given). The result may look like Ymd[HM].
- *
- * On success, the numeric date time specificity format is set. */
-static void set_spec_date_time_num_format(void) {
-  char *buf = NULL, *tf = set_format_time();
-  const char *df = conf.date_num_format;
+/* Empty the tables of a shard after a merge. Its per-date stores are kept,
+ * as is the room of their tables, since the next batch most likely falls on
+ * the same dates. */
+static void clear_agg_shard(GAggShard *shard) {
+  GKHashStorage *store = NULL;
+  size_t idx, i;
+  khint_t k;
 
-  if (!df || !tf) {
-    free(tf);
-    return;
+  for (k = kh_begin(shard->dates); k != kh_end(shard->dates); ++k) {
+    if (!kh_exist(shard->dates, k))
+      continue;
+    store = kh_val(shard->dates, k);
+    idx = 0;
+    FOREACH_MODULE(idx, module_list) {
+      for (i = 0; i < module_metrics_len; i++)
+        clear_agg_table(&store->mhash[module_list[idx]].metrics[i]);
+    }
   }
+  shard->items = 0;
+}
 
-  if (conf.date_spec_hr == 1 && strchr(tf, 'H'))
-    buf = append_spec_date_format(df, "%H");
-  else if (conf.date_spec_hr == 2 && strchr(tf, 'M'))
-    buf = append_spec_date_format(df, "%H%M");
-  else
-    buf = xstrdup(df);
+static void free_agg_shard(GAggShard *shard) {
+  khint_t k;
 
-  conf.spec_date_time_num_format = buf;
-  free(tf);
+  if (!shard)
+    return;
+  for (k = kh_begin(shard->dates); k != kh_end(shard->dates); ++k)
+    if (kh_exist(shard->dates, k))
+      free_date_store(kh_val(shard->dates, k));
+  kh_destroy(igkh, shard->dates);
+  free(shard);
 }
 
-/* Set a human-readable specificity date and time format.
+/* Get the data an item is keyed by in the given module. `buf` holds keys
+ * made up from the item, e.g., the hour of the visit.
  *
- * On success, the human-readable date time specificity format is set. */
-static void set_spec_date_time_format(void) {
-  char *buf = NULL;
-  const char *fmt = conf.spec_date_time_num_format;
-  int buflen = 0, flen = 0;
+ * If the item isn't counted in the module, NULL is returned.
+ * On success, the key is returned. */
+static const char *get_agg_key(GModule module, const GLogItem *logitem,
+                               char *buf, size_t size) {
+  switch (module) {
+  case VISITORS:
+    return logitem->date;
+  case REQUESTS:
+    return logitem->status == 404 ? NULL : logitem->req;
+  case NOT_FOUND:
+    return logitem->status == 404 ? logitem->req : NULL;
+  case HOSTS:
+    return logitem->host;
+  case VISIT_TIMES:
+    if (!logitem->time || strlen(logitem->time) < 2)
+      return NULL;
+    snprintf(buf, size, "%.2s", logitem->time);
+    return buf;
+  case VIRTUAL_HOSTS:
+    return logitem->vhost;
+  case REFERRERS:
+    return logitem->ref;
+  case REFERRING_SITES:
+    return logitem->site[0] ? logitem->site : NULL;
+  case KEYPHRASES:
+    return logitem->keyphrase;
+  case STATUS_CODES:
+    snprintf(buf, size, "%d", logitem->status);
+    return buf;
+  case REMOTE_USER:
+    return logitem->userid;
+  case CACHE_STATUS:
+    return logitem->cache_status;
+  case MIME_TYPE:
+    return logitem->mime_type;
+  case TLS_TYPE:
+    return logitem->tls_type;
+  default:
+    return NULL;
+  }
+}
 
-  if (!fmt)
+/* Count a hit of `data` into the tables of a module: its hash is mapped to
+ * a sequential key (MTRC_KEYMAP) holding the data (MTRC_DATAMAP), hits
+ * (MTRC_HITS) and bandwidth (MTRC_BW), and the visitor is recorded against
+ * the hash (MTRC_UNIQMAP). Visitors are only counted when merged, as a
+ * visitor may well show up in several shards. A hit of a sampled line stands
+ * for `weight` lines, hence counts that many times. */
+static void agg_module_hit(GKHashModule *mod, const char *data,
+                           uint32_t visitor, uint64_t bw, uint32_t weight) {
+  khash_t(ii32) *keymap = mod->metrics[MTRC_KEYMAP].hash;
+  khash_t(is32) *datamap = mod->metrics[MTRC_DATAMAP].hash;
+  khash_t(u648) *uniqmap = mod->metrics[MTRC_UNIQMAP].hash;
+  uint32_t hash = djb2((const unsigned char *)data), nkey = 0;
+  khint_t k;
+  int ret;
+
+  k = kh_put(ii32, keymap, hash, &ret);
+  if (ret == -1)
     return;
+  if (ret) {
+    nkey = kh_val(keymap, k) = kh_size(keymap);
+    k = kh_put(is32, datamap, nkey, &ret);
+    if (ret == -1)
+      return;
+    kh_val(datamap, k) = xstrdup(data);
+  } else {
+    nkey = kh_val(keymap, k);
+  }
 
-  flen = (strlen(fmt) * 2) + 1;
-  buf = xcalloc(flen, sizeof(char));
+  inc_ii32(mod->metrics[MTRC_HITS].hash, nkey, weight);
+  inc_iu64(mod->metrics[MTRC_BW].hash, nkey, bw * weight);
+  k = kh_put(u648, uniqmap, (uint64_t)visitor << 32 | hash, &ret);
+  if (ret > 0)
+    kh_val(uniqmap, k) = 1;
+}
+
+/* Aggregate a parsed item into the shard of the date it was logged on,
+ * scaled up by the sampling rate of its batch, `weight`, see
+ * get_sample_rate(). Shards built at different rates are merged into the
+ * same store, so the rate can't be applied once merged. */
+static void agg_item(GAggShard *shard, const GLogItem *logitem,
+                     uint32_t weight) {
+  GKHashStorage *store = NULL;
+  const char *data = NULL;
+  char buf[16];
+  uint32_t visitor;
+  size_t idx = 0;
 
-  if (strchr(fmt, 'd'))
-    buflen += snprintf(buf + buflen, flen - buflen, "%%d/");
-  if (strchr(fmt, 'm'))
-    buflen += snprintf(buf + buflen, flen - buflen, "%%b/");
-  if (strchr(fmt, 'Y'))
-    buflen += snprintf(buf + buflen, flen - buflen, "%%Y");
-  if (strchr(fmt, 'H'))
-    buflen += snprintf(buf + buflen, flen - buflen, ":%%H");
-  if (strchr(fmt, 'M'))
-    buflen += snprintf(buf + buflen, flen - buflen, ":%%M");
+  if ((store = get_date_store(shard->dates, logitem->numdate)) == NULL)
+    return;
+
+  visitor = djb2((const unsigned char *)(logitem->host ? logitem->host : ""));
+  if (logitem->agent)
+    visitor ^= djb2((const unsigned char *)logitem->agent) * 2654435761u;
 
-  conf.spec_date_time_format = buf;
+  FOREACH_MODULE(idx, module_list) {
+    data = get_agg_key(module_list[idx], logitem, buf, sizeof(buf));
+    if (data)
+      agg_module_hit(&store->mhash[module_list[idx]], data, visitor,
+                     logitem->resp_size, weight);
+  }
+  shard->items++;
 }
 
-/* If specificity is supplied, then determine which value we need to
- * append to the date format. */
-static void set_spec_date_format(void) {
-  if (verify_formats())
+/* Aggregate the items of lines [from, to) the job just parsed into its
+ * shard. Shards belong to a single job, so this takes no lock, see
+ * merge_agg_shard(). */
+static void aggregate_job(GJob *job, uint32_t from, uint32_t to) {
+  GArena *prev = NULL;
+  uint32_t i, weight = job->sample > 1 ? job->sample : 1;
+
+  if (!job->shard)
     return;
 
-  if (conf.is_json_log_format) {
-    if (parse_json_string(NULL, conf.log_format, ht_insert_json_logfmt) == -1)
-      FATAL("Invalid JSON log format. Verify the syntax.");
+  /* shards outlive the batch, keep them off the active arena */
+  prev = set_active_arena(NULL);
+  for (i = from; i < to; i++)
+    if (job->logitems[i])
+      agg_item(job->shard, job->logitems[i], weight);
+  set_active_arena(prev);
+}
+
+/* Merge the tables of a module of a shard into the store's. Data is
+ * matched by hash, so the data strings of new keys are moved over. */
+static void merge_agg_module(GKHashModule *src, GKHashModule *dst) {
+  khash_t(ii32) *keymap = src->metrics[MTRC_KEYMAP].hash;
+  khash_t(is32) *datamap = src->metrics[MTRC_DATAMAP].hash;
+  khash_t(u648) *uniqmap = src->metrics[MTRC_UNIQMAP].hash;
+  khash_t(ii32) *gkeymap = dst->metrics[MTRC_KEYMAP].hash;
+  khash_t(is32) *gdatamap = dst->metrics[MTRC_DATAMAP].hash;
+  khash_t(u648) *guniqmap = dst->metrics[MTRC_UNIQMAP].hash;
+  uint32_t hash, nkey, gnkey;
+  uint64_t key;
+  khint_t k, d, s;
+  int ret;
+
+  for (k = kh_begin(keymap); k != kh_end(keymap); ++k) {
+    if (!kh_exist(keymap, k))
+      continue;
+    hash = kh_key(keymap, k);
+    nkey = kh_val(keymap, k);
+
+    d = kh_put(ii32, gkeymap, hash, &ret);
+    if (ret == -1)
+      continue;
+    if (ret) {
+      gnkey = kh_val(gkeymap, d) = kh_size(gkeymap);
+      d = kh_put(is32, gdatamap, gnkey, &ret);
+      if (ret == -1)
+        continue;
+      /* move the data string over */
+      s = kh_get(is32, datamap, nkey);
+      kh_val(gdatamap, d) = s != kh_end(datamap) ? kh_val(datamap, s) : NULL;
+      if (s != kh_end(datamap))
+        kh_val(datamap, s) = NULL;
+    } else {
+      gnkey = kh_val(gkeymap, d);
+    }
+
+    inc_ii32(dst->metrics[MTRC_HITS].hash, gnkey,
+             get_ii32(src->metrics[MTRC_HITS].hash, nkey));
+    inc_iu64(dst->metrics[MTRC_BW].hash, gnkey,
+             get_iu64(src->metrics[MTRC_BW].hash, nkey));
   }
 
-  if (conf.date_num_format)
-    free(conf.date_num_format);
-  if (conf.spec_date_time_format)
-    free(conf.spec_date_time_format);
-  if (conf.spec_date_time_num_format)
-    free(conf.spec_date_time_num_format);
+  for (k = kh_begin(uniqmap); k != kh_end(uniqmap); ++k) {
+    if (!kh_exist(uniqmap, k))
+      continue;
+    key = kh_key(uniqmap, k);
+    gnkey = get_ii32(gkeymap, (uint32_t)key);
+    d = kh_put(u648, guniqmap, (key & 0xffffffff00000000ULL) | gnkey, &ret);
+    if (ret > 0) {
+      kh_val(guniqmap, d) = 1;
+      inc_ii32(dst->metrics[MTRC_VISITORS].hash, gnkey, 1);
+    }
+  }
+}
+
+/* Merge a shard into the store, see aggregate_job(), and clear it, once it
+ * holds at least `min` items. Merges take a lock, so shards of all parser
+ * threads may be merged at any time, e.g., at the end of each batch they
+ * parsed or every so many items. */
+static void merge_agg_shard(GAggShard *shard, uint32_t min) {
+  GKDB *db = get_db_instance(DB_INSTANCE);
+  khash_t(igkh) *dates = db ? get_hdb(db, MTRC_DATES) : NULL;
+  GKHashStorage *src = NULL, *dst = NULL;
+  size_t idx = 0;
+  khint_t k;
 
-  if (set_date_num_format() == 0) {
-    set_spec_date_time_num_format();
-    set_spec_date_time_format();
+  if (!shard || shard->items == 0 || shard->items < min)
+    return;
+
+  pthread_mutex_lock(&agg_mutex);
+  for (k = kh_begin(shard->dates); dates && k != kh_end(shard->dates); ++k) {
+    if (!kh_exist(shard->dates, k))
+      continue;
+    src = kh_val(shard->dates, k);
+    if ((dst = get_date_store(dates, kh_key(shard->dates, k))) == NULL)
+      continue;
+    idx = 0;
+    FOREACH_MODULE(idx, module_list) {
+      merge_agg_module(&src->mhash[module_list[idx]],
+                       &dst->mhash[module_list[idx]]);
+    }
   }
+  pthread_mutex_unlock(&agg_mutex);
+
+  clear_agg_shard(shard);
 }
 
-/* Allocate memory for a new module GKHashModule instance.
+/* Get the aggregated metrics of the given data in a module on a date, see
+ * aggregate_job().
  *
- * On success, the newly allocated GKHashStorage is returned . */
-static GKHashModule *new_gkhmodule(uint32_t size) {
-  GKHashModule *storage = xcalloc(size, sizeof(GKHashModule));
-  return storage;
+ * If not found, -1 is returned.
+ * On success, 0 is returned and the metrics are assigned. */
+int ht_get_agg_metrics(GModule module, uint32_t date, const char *data,
+                       uint32_t *hits, uint32_t *visitors, uint64_t *bw) {
+  GKDB *db = get_db_instance(DB_INSTANCE);
+  khash_t(igkh) *dates = db ? get_hdb(db, MTRC_DATES) : NULL;
+  GKHashModule *mod = NULL;
+  uint32_t nkey;
+  khint_t k;
+  int ret = -1;
+
+  pthread_mutex_lock(&agg_mutex);
+  if (!dates || (k = kh_get(igkh, dates, date)) == kh_end(dates))
+    goto out;
+  mod = &kh_val(dates, k)->mhash[module];
+  if (!mod->metrics[MTRC_KEYMAP].hash)
+    goto out;
+
+  k = kh_get(ii32, mod->metrics[MTRC_KEYMAP].hash,
+             djb2((const unsigned char *)data));
+  if (k == kh_end((khash_t(ii32) *)mod->metrics[MTRC_KEYMAP].hash))
+    goto out;
+  nkey = kh_val((khash_t(ii32) *)mod->metrics[MTRC_KEYMAP].hash, k);
+
+  *hits = get_ii32(mod->metrics[MTRC_HITS].hash, nkey);
+  *visitors = get_ii32(mod->metrics[MTRC_VISITORS].hash, nkey);
+  *bw = get_iu64(mod->metrics[MTRC_BW].hash, nkey);
+  ret = 0;
+
+out:
+  pthread_mutex_unlock(&agg_mutex);
+  return ret;
 }
 
-/* list of available modules/panels */
-static int module_list[TOTAL_MODULES] = {[0 ... TOTAL_MODULES - 1] = -1};
+#define LOG_CACHE_MAGIC "GLC1"
+#define LOG_CACHE_VERSION 2
+/* Rows of a cache block, see add_log_cache_item() */
+#define LOG_CACHE_BLOCK_ROWS 65536
+/* Sections of a cache start on an 8-byte boundary */
+#define LOG_CACHE_ALIGN(n) (((n) + 7) & ~(size_t)7)
 
-/* Initialize a new uint32_t key - GSLList value hash table */
-static void *new_igsl_ht(void) {
-  khash_t(igsl) *h = kh_init(igsl);
-  return h;
-}
+/* Append to a cache key, see get_log_cache_key(). */
+static void append_log_cache_key(char **key, size_t *len, const char *fmt,
+                                 ...) {
+  va_list args;
+  int n;
 
-/* Initialize a new string key - uint32_t value hash table */
-static void *new_ii08_ht(void) {
-  khash_t(ii08) *h = kh_init(ii08);
-  return h;
-}
+  va_start(args, fmt);
+  n = vsnprintf(NULL, 0, fmt, args);
+  va_end(args);
 
-/* Initialize a new uint32_t key - uint32_t value hash table */
-static void *new_ii32_ht(void) {
-  khash_t(ii32) *h = kh_init(ii32);
-  return h;
+  *key = xrealloc(*key, *len + n + 1);
+  va_start(args, fmt);
+  vsnprintf(*key + *len, n + 1, fmt, args);
+  va_end(args);
+  *len += n;
 }
 
-/* Initialize a new uint32_t key - string value hash table */
-static void *new_is32_ht(void) {
-  khash_t(is32) *h = kh_init(is32);
-  return h;
-}
+/* Build the key a cache is matched against: the log, date and time formats
+ * and the timezone of the given parser, the active one if NULL, and every
+ * setting that changes which lines are kept or what their items hold, so a
+ * filtered or sampled cache is never served back as a full one. Filter
+ * values are prefixed by their length, as they may hold the separators.
+ *
+ * On success, the newly allocated key is returned. */
+static char *get_log_cache_key(const GLogParser *parser) {
+  const char *fmt = NULL, *datefmt = NULL, *timefmt = NULL, *tz = NULL;
+  const GLogFilter *filter = NULL;
+  char *key = NULL;
+  size_t len = 0;
+  int i, j;
+
+  if (parser == NULL)
+    parser = active_parser;
+  fmt = parser->log_format ? parser->log_format : "";
+  datefmt = parser->date_format ? parser->date_format : "";
+  timefmt = parser->time_format ? parser->time_format : "";
+  tz = parser->tz_name ? parser->tz_name : "";
+
+  append_log_cache_key(&key, &len, "%s\n%s\n%s\n%s", fmt, datefmt, timefmt,
+                       tz);
+  append_log_cache_key(
+      &key, &len, "\nfields=%" PRIu32 " spec=%d:%d decode=%d append=%d:%d",
+      conf.field_mask, conf.date_spec_hr, conf.hour_spec_min,
+      conf.double_decode, conf.append_method, conf.append_protocol);
+  append_log_cache_key(&key, &len,
+                       " ip=%d status=%d sample=%" PRIu32 ":%" PRIu64,
+                       conf.no_ip_validation, conf.no_strict_status,
+                       conf.sample_rate, conf.sample_backlog);
+  for (i = 0; i < conf.filters_len; i++) {
+    filter = conf.filters[i];
+    append_log_cache_key(&key, &len, "\nfilter=%d:%d:%d:%d", filter->type,
+                         filter->drop, filter->min, filter->max);
+    for (j = 0; j < filter->size; j++)
+      append_log_cache_key(&key, &len, " %zu:%s", filter->lens[j],
+                           filter->values[j]);
+  }
 
-/* Initialize a new uint32_t key - uint64_t value hash table */
-static void *new_iu64_ht(void) {
-  khash_t(iu64) *h = kh_init(iu64);
-  return h;
+  return key;
 }
 
-/* Initialize a new string key - uint32_t value hash table */
-static void *new_si32_ht(void) {
-  khash_t(si32) *h = kh_init(si32);
-  return h;
-}
+/* Get the bytes of a cache block of `rows` rows, header included. */
+static size_t get_log_cache_block_size(size_t rows, size_t dict_len,
+                                       size_t buflen) {
+  size_t size = sizeof(GLogCacheBlock);
 
-/* Initialize a new string key - uint64_t value hash table */
-static void *new_su64_ht(void) {
-  khash_t(su64) *h = kh_init(su64);
-  return h;
+  /* line, numdate and the offset and length of each string */
+  size += LOG_CACHE_ALIGN(rows * sizeof(uint32_t)) * (2 + 2 * LOG_STR_COLS);
+  size += LOG_CACHE_ALIGN(rows * sizeof(int16_t));
+  size += LOG_CACHE_ALIGN(rows * sizeof(uint8_t));
+  size += LOG_CACHE_ALIGN(rows * 16);
+  size += LOG_CACHE_ALIGN(rows * sizeof(uint64_t)) * 2;
+  size += LOG_CACHE_ALIGN(rows * sizeof(uint16_t)) * LOG_DICT_COLS;
+  size += LOG_CACHE_ALIGN(dict_len) + LOG_CACHE_ALIGN(buflen);
+
+  return size;
 }
 
-/* Initialize a new uint64_t key - uint8_t value hash table */
-static void *new_u648_ht(void) {
-  khash_t(u648) *h = kh_init(u648);
-  return h;
+/* Pad a section of `len` bytes of a cache to an 8-byte boundary. */
+static int write_log_cache_pad(FILE *fp, size_t len) {
+  static const char pad[8] = {0};
+  size_t n = LOG_CACHE_ALIGN(len) - len;
+
+  return fwrite(pad, 1, n, fp) != n;
 }
 
-/* Initialize a new uint64_t key - GLastParse value hash table */
-static void *new_iglp_ht(void) {
-  khash_t(iglp) *h = kh_init(iglp);
-  return h;
+/* Write a section of `len` bytes of a cache, padded. */
+static int write_log_cache_col(FILE *fp, const void *col, size_t len) {
+  int err = 0;
+
+  err |= len && fwrite(col, 1, len, fp) != len;
+  err |= write_log_cache_pad(fp, len);
+
+  return err;
 }
 
-/* Initialize a new uint32_t key - GKHashStorage value hash table */
-static void *new_igdb_ht(void) {
-  khash_t(igdb) *h = kh_init(igdb);
-  return h;
-}
+/* Write the rows held by the writer as a block of the cache, and drop them.
+ * Intern IDs are only meaningful to the process that interned them, so
+ * they aren't kept.
+ *
+ * On error, -1 is returned.
+ * On success, 0 is returned. */
+static int write_log_cache_block(GLogCacheWriter *w) {
+  GLogColumns *cols = &w->cols;
+  GLogCacheBlock blk;
+  FILE *fp = w->fp;
+  uint32_t i, n = cols->cnt;
+  int c, err = 0;
+
+  if (n == 0)
+    return 0;
+
+  memset(&blk, 0, sizeof(blk));
+  blk.rows = n;
+  blk.sample = MAX(w->sample, 1);
+  blk.min_numdate = UINT32_MAX;
+  blk.min_status = INT16_MAX;
+  blk.max_status = INT16_MIN;
+  for (i = 0; i < n; i++) {
+    blk.min_numdate = MIN(blk.min_numdate, cols->numdate[i]);
+    blk.max_numdate = MAX(blk.max_numdate, cols->numdate[i]);
+    blk.min_status = MIN(blk.min_status, cols->status[i]);
+    blk.max_status = MAX(blk.max_status, cols->status[i]);
+  }
+  for (c = 0; c < LOG_DICT_COLS; c++) {
+    blk.dict_size[c] = cols->dict[c].size;
+    for (i = 1; i < cols->dict[c].size; i++)
+      blk.dict_len += strlen(cols->dict[c].values[i]) + 1;
+  }
+  blk.buflen = cols->buflen;
+  blk.size = get_log_cache_block_size(n, blk.dict_len, blk.buflen);
+
+  err |= fwrite(&blk, sizeof(blk), 1, fp) != 1;
+  err |= write_log_cache_col(fp, cols->line, n * sizeof(uint32_t));
+  err |= write_log_cache_col(fp, cols->numdate, n * sizeof(uint32_t));
+  err |= write_log_cache_col(fp, cols->status, n * sizeof(int16_t));
+  err |= write_log_cache_col(fp, cols->type_ip, n * sizeof(uint8_t));
+  err |= write_log_cache_col(fp, cols->addr, n * sizeof(*cols->addr));
+  err |= write_log_cache_col(fp, cols->resp_size, n * sizeof(uint64_t));
+  err |= write_log_cache_col(fp, cols->serve_time, n * sizeof(uint64_t));
+  for (c = 0; c < LOG_STR_COLS; c++) {
+    err |= write_log_cache_col(fp, cols->off[c], n * sizeof(uint32_t));
+    err |= write_log_cache_col(fp, cols->len[c], n * sizeof(uint32_t));
+  }
+  for (c = 0; c < LOG_DICT_COLS; c++)
+    err |= write_log_cache_col(fp, cols->id[c], n * sizeof(uint16_t));
+  for (c = 0; c < LOG_DICT_COLS; c++)
+    for (i = 1; i < cols->dict[c].size; i++)
+      err |= fputs(cols->dict[c].values[i], fp) == EOF || fputc(0, fp) == EOF;
+  err |= write_log_cache_pad(fp, blk.dict_len);
+  err |= write_log_cache_col(fp, cols->buf, cols->buflen);
+
+  w->hdr.blocks++;
+  w->hdr.rows += n;
+  reset_log_columns(cols);
+
+  return err ? -1 : 0;
+}
+
+/* Create a cache of parsed items at the given path, keyed by the formats of
+ * the given parser, the active one if NULL. Items are added through
+ * add_log_cache_item(). The cache is written to path.tmp, then renamed
+ * over `path` by close_log_cache_writer(), so a partial cache is never
+ * left behind.
+ *
+ * On error, -1 is returned.
+ * On success, 0 is returned. */
+int open_log_cache_writer(GLogCacheWriter *w, const char *path,
+                          const GLogParser *parser) {
+  char tmp[PATH_MAX], *key = NULL;
+  int err = 0;
+
+  memset(w, 0, sizeof(*w));
+  if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp))
+    return -1;
+  if (!(w->fp = fopen(tmp, "wb")))
+    return -1;
+
+  key = get_log_cache_key(parser);
+  memcpy(w->hdr.magic, LOG_CACHE_MAGIC, 4);
+  w->hdr.version = LOG_CACHE_VERSION;
+  w->hdr.keylen = strlen(key) + 1;
+  err |= fwrite(&w->hdr, sizeof(w->hdr), 1, w->fp) != 1;
+  err |= write_log_cache_col(w->fp, key, w->hdr.keylen);
+  free(key);
 
-/* Initialize a new uint32_t key - GKHashStorage value hash table */
-static void *new_igkh_ht(void) {
-  khash_t(igkh) *h = kh_init(igkh);
-  return h;
-}
+  if (err) {
+    fclose(w->fp);
+    unlink(tmp);
+    return -1;
+  }
+  w->path = xstrdup(path);
+  init_log_columns(&w->cols, LOG_CACHE_BLOCK_ROWS);
 
-/* Initialize a new string key - uint32_t value hash table */
-static void *new_si08_ht(void) {
-  khash_t(si08) *h = kh_init(si08);
-  return h;
+  return 0;
 }
 
-/* Initialize a new string key - string value hash table */
-static void *new_ss32_ht(void) {
-  khash_t(ss32) *h = kh_init(ss32);
-  return h;
+/* Add a parsed item to the cache, parsed at the given sampling rate, see
+ * GLog.sample_rate. A block is written every LOG_CACHE_BLOCK_ROWS items, and
+ * whenever the rate changes, as a block holds rows of a single rate. Errors
+ * are kept for close_log_cache_writer(). */
+void add_log_cache_item(GLogCacheWriter *w, const GLogItem *logitem,
+                        uint32_t sample) {
+  if (w->cols.cnt && sample != w->sample)
+    w->err |= write_log_cache_block(w);
+  w->sample = sample;
+  append_log_columns(&w->cols, logitem, w->cols.cnt);
+  if (w->cols.cnt == LOG_CACHE_BLOCK_ROWS)
+    w->err |= write_log_cache_block(w);
 }
 
-/* Remove all nodes from the list.
+/* Write the last block of the cache and the GLogProp of the log its items
+ * were parsed from, if given, so stale caches can be told apart, see
+ * open_log_cache(). The writer is released either way.
  *
+ * On error, -1 is returned and no cache is left behind.
  * On success, 0 is returned. */
-static int list_remove_nodes(GSLList *list) {
-  GSLList *tmp;
-  while (list != NULL) {
-    tmp = list->next;
-    if (list->data)
-      free(list->data);
-    free(list);
-    list = tmp;
+int close_log_cache_writer(GLogCacheWriter *w, const GLogProp *props) {
+  char tmp[PATH_MAX];
+  int err = w->err;
+
+  snprintf(tmp, sizeof(tmp), "%s.tmp", w->path);
+  err |= write_log_cache_block(w);
+  if (props) {
+    w->hdr.inode = props->inode;
+    w->hdr.size = props->size;
+    w->hdr.codec = props->codec;
+  }
+  err |= fseeko(w->fp, 0, SEEK_SET) != 0;
+  err |= fwrite(&w->hdr, sizeof(w->hdr), 1, w->fp) != 1;
+  err |= fclose(w->fp) != 0;
+  if (err || rename(tmp, w->path) != 0) {
+    unlink(tmp);
+    err = 1;
   }
 
-  return 0;
+  free_log_columns(&w->cols);
+  free(w->path);
+  memset(w, 0, sizeof(*w));
+
+  return err ? -1 : 0;
 }
 
-/* Deletes all entries from the hash table and optionally frees its GSLList */
-static void del_igsl_free(void *h, uint8_t free_data) {
-  khint_t k;
-  khash_t(igsl) *hash = h;
-  void *list = NULL;
-  if (!hash)
-    return;
+static void cache_log_item(GLog *glog, GLogItem *logitem, void *data) {
+  add_log_cache_item(data, logitem, glog->sample_rate);
+}
 
-  for (k = 0; k < kh_end(hash); ++k) {
-    if (!kh_exist(hash, k))
-      continue;
+/* Parse the given log as a whole, see mmap_lines(), and cache its items at
+ * `path`, keyed by the active parser.
+ *
+ * If the log can't be opened, the program exits.
+ * On error, -1 is returned.
+ * On success, 0 is returned. */
+int save_log_cache(const char *path, const char *filename) {
+  GLogCacheWriter w;
+  GLog glog;
 
-    if (free_data) {
-      list = kh_value(hash, k);
-      list_remove_nodes(list);
-    }
-    kh_del(igsl, hash, k);
-  }
-}
+  memset(&glog, 0, sizeof(glog));
+  if (open_log_cache_writer(&w, path, NULL) != 0)
+    return -1;
+  mmap_lines(filename, &glog, cache_log_item, &w);
 
-/* Deletes all entries from the hash table */
-static void del_ii08(void *h, uint8_t free_data) {
-  khint_t k;
-  khash_t(ii08) *hash = h;
-  if (!hash)
-    return;
+  return close_log_cache_writer(&w, &glog.props);
+}
 
-  for (k = 0; k < kh_end(hash); ++k) {
-    if (kh_exist(hash, k)) {
-      kh_del(ii08, hash, k);
-    }
-  }
+/* Move the given cache back to its first block. */
+void rewind_log_cache(GLogCache *cache) {
+  cache->pos = sizeof(GLogCacheHeader) + LOG_CACHE_ALIGN(cache->hdr->keylen);
 }
 
-/* Deletes all entries from the hash table */
-static void del_ii32(void *h, uint8_t free_data) {
-  khint_t k;
-  khash_t(ii32) *hash = h;
-  if (!hash)
-    return;
+/* Release the views of the current block of a cache, but not the mapping
+ * itself. */
+static void free_log_cache_cols(GLogCache *cache) {
+  int c;
 
-  for (k = 0; k < kh_end(hash); ++k) {
-    if (kh_exist(hash, k)) {
-      kh_del(ii32, hash, k);
-    }
-  }
+  for (c = 0; c < LOG_DICT_COLS; c++)
+    free(cache->cols.dict[c].values);
+  free(cache->zeros);
+  memset(&cache->cols, 0, sizeof(cache->cols));
+  cache->zeros = NULL;
+  cache->zeros_cap = 0;
 }
 
-/* Deletes both the hash entry and its string values */
-static void del_is32_free(void *h, uint8_t free_data) {
-  khint_t k;
-  khash_t(is32) *hash = h;
-  if (!hash)
-    return;
-
-  for (k = 0; k < kh_end(hash); ++k) {
-    if (kh_exist(hash, k)) {
-      if (free_data)
-        free((char *)kh_value(hash, k));
-      kh_del(is32, hash, k);
-    }
-  }
+/* Unmap a cache opened by open_log_cache(). */
+void close_log_cache(GLogCache *cache) {
+  free_log_cache_cols(cache);
+  if (cache->map)
+    munmap(cache->map, cache->size);
+  memset(cache, 0, sizeof(*cache));
 }
 
-/* Deletes all entries from the hash table */
-static void del_iu64(void *h, uint8_t free_data) {
-  khint_t k;
-  khash_t(iu64) *hash = h;
-  if (!hash)
-    return;
+/* Map the cache at the given path for reading. A cache only matches the
+ * parser it was built with, the active one if NULL, and, if `filename` is
+ * given, the log as it was: a log that was since rotated or appended to has
+ * its inode or size changed.
+ *
+ * If the cache is missing, corrupt or stale, -1 is returned.
+ * On success, 0 is returned. */
+int open_log_cache(GLogCache *cache, const char *path, const char *filename,
+                   const GLogParser *parser) {
+  const GLogCacheHeader *hdr = NULL;
+  struct stat st;
+  char *key = NULL;
+  int fd = -1, err = 0;
+
+  memset(cache, 0, sizeof(*cache));
+  if ((fd = open(path, O_RDONLY)) == -1)
+    return -1;
+  if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(GLogCacheHeader)) {
+    close(fd);
+    return -1;
+  }
+  cache->size = st.st_size;
+  cache->map = mmap(NULL, cache->size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (cache->map == MAP_FAILED) {
+    cache->map = NULL;
+    return -1;
+  }
+  madvise(cache->map, cache->size, MADV_SEQUENTIAL);
+
+  hdr = cache->hdr = (const GLogCacheHeader *)cache->map;
+  err |= memcmp(hdr->magic, LOG_CACHE_MAGIC, 4) != 0;
+  err |= !err && hdr->version != LOG_CACHE_VERSION;
+  err |= !err && LOG_CACHE_ALIGN(hdr->keylen) >
+                     cache->size - sizeof(GLogCacheHeader);
+  if (!err) {
+    key = get_log_cache_key(parser);
+    err |= hdr->keylen != strlen(key) + 1 ||
+           memcmp(cache->map + sizeof(GLogCacheHeader), key, hdr->keylen);
+    free(key);
+  }
+  if (!err && filename)
+    err |= stat(filename, &st) == -1 || (uint64_t)st.st_ino != hdr->inode ||
+           (uint64_t)st.st_size != hdr->size;
 
-  for (k = 0; k < kh_end(hash); ++k) {
-    if (kh_exist(hash, k)) {
-      kh_del(iu64, hash, k);
-    }
+  if (err) {
+    close_log_cache(cache);
+    return -1;
   }
+  rewind_log_cache(cache);
+
+  return 0;
 }
 
-/* Deletes an entry from the hash table and optionally the keys for a string
- * key - uint32_t value hash */
-static void del_si32_free(void *h, uint8_t free_data) {
-  khint_t k;
-  khash_t(si32) *hash = h;
-  if (!hash)
-    return;
+/* Get the next section of `len` bytes of a cache block, moving `off` past
+ * it. Sections are read in place as arrays of up to 8-byte integers, hence
+ * must start on an 8-byte boundary.
+ *
+ * If the block is too short to hold it, or it is misaligned, NULL is
+ * returned.
+ * On success, a pointer to the section is returned. */
+static const char *get_log_cache_col(const GLogCacheBlock *blk, size_t *off,
+                                     size_t len) {
+  const char *col = (const char *)blk + *off;
+
+  if ((uintptr_t)col % 8 != 0)
+    return NULL;
+  if (len > blk->size || LOG_CACHE_ALIGN(len) > blk->size - *off)
+    return NULL;
+  *off += LOG_CACHE_ALIGN(len);
 
-  for (k = 0; k < kh_end(hash); ++k) {
-    if (kh_exist(hash, k)) {
-      if (free_data)
-        free((char *)kh_key(hash, k));
-      kh_del(si32, hash, k);
-    }
-  }
+  return col;
 }
 
-/* Deletes all entries from the hash table and optionally frees its string key
- */
-static void del_su64_free(void *h, uint8_t free_data) {
-  khint_t k;
-  khash_t(su64) *hash = h;
-  if (!hash)
-    return;
-
-  for (k = 0; k < kh_end(hash); ++k) {
-    if (kh_exist(hash, k)) {
-      if (free_data)
-        free((char *)kh_key(hash, k));
-      kh_del(su64, hash, k);
+/* Point the columns of the cache at those of the given block, without
+ * copying them. Only the dictionaries' arrays of values are allocated.
+ * Intern IDs weren't kept, so they are all 0.
+ *
+ * If the block is corrupt, -1 is returned.
+ * On success, 0 is returned. */
+static int set_log_cache_cols(GLogCache *cache, const GLogCacheBlock *blk) {
+  GLogColumns *cols = &cache->cols;
+  GLogDict *dict = NULL;
+  size_t off = sizeof(GLogCacheBlock), n = blk->rows, soff, slen;
+  const char *s = NULL, *end = NULL;
+  uint32_t i;
+  int c, err = 0;
+
+  if (blk->sample == 0)
+    return -1;
+  if (n > cache->zeros_cap) {
+    free(cache->zeros);
+    cache->zeros = xcalloc(n, sizeof(uint32_t));
+    cache->zeros_cap = n;
+  }
+  cols->cnt = cols->cap = n;
+  cols->agent_id = cols->host_id = cache->zeros;
+  cols->vhost_id = cols->site_id = cache->zeros;
+
+  err |= !(cols->line = (uint32_t *)get_log_cache_col(blk, &off, n * 4));
+  err |= !(cols->numdate = (uint32_t *)get_log_cache_col(blk, &off, n * 4));
+  err |= !(cols->status = (int16_t *)get_log_cache_col(blk, &off, n * 2));
+  err |= !(cols->type_ip = (uint8_t *)get_log_cache_col(blk, &off, n));
+  err |= !(cols->addr = (uint8_t(*)[16])get_log_cache_col(blk, &off, n * 16));
+  err |= !(cols->resp_size = (uint64_t *)get_log_cache_col(blk, &off, n * 8));
+  err |= !(cols->serve_time = (uint64_t *)get_log_cache_col(blk, &off, n * 8));
+  for (c = 0; c < LOG_STR_COLS; c++) {
+    err |= !(cols->off[c] = (uint32_t *)get_log_cache_col(blk, &off, n * 4));
+    err |= !(cols->len[c] = (uint32_t *)get_log_cache_col(blk, &off, n * 4));
+  }
+  for (c = 0; c < LOG_DICT_COLS; c++)
+    err |= !(cols->id[c] = (uint16_t *)get_log_cache_col(blk, &off, n * 2));
+  err |= !(s = get_log_cache_col(blk, &off, blk->dict_len));
+  err |= !(cols->buf = (char *)get_log_cache_col(blk, &off, blk->buflen));
+  err |= blk->buflen && cols->buf[blk->buflen - 1] != '\0';
+  if (err)
+    return -1;
+  cols->buflen = cols->bufsize = blk->buflen;
+
+  /* strings must end within the buffer, where their length says */
+  for (c = 0; c < LOG_STR_COLS; c++) {
+    for (i = 0; i < n; i++) {
+      if ((soff = cols->off[c][i]) == 0)
+        continue;
+      slen = cols->len[c][i];
+      if (soff >= blk->buflen || slen >= blk->buflen - soff ||
+          cols->buf[soff + slen] != '\0')
+        return -1;
     }
   }
-}
-
-/* Deletes all entries from the hash table */
-static void del_u648(void *h, uint8_t free_data) {
-  khint_t k;
-  khash_t(u648) *hash = h;
-  if (!hash)
-    return;
 
-  for (k = 0; k < kh_end(hash); ++k) {
-    if (kh_exist(hash, k)) {
-      kh_del(u648, hash, k);
+  /* values are NUL-terminated back to back, see write_log_cache_block() */
+  for (end = s + blk->dict_len, c = 0; c < LOG_DICT_COLS; c++) {
+    dict = &cols->dict[c];
+    if (blk->dict_size[c] > dict->cap) {
+      dict->cap = blk->dict_size[c];
+      dict->values = xrealloc(dict->values, dict->cap * sizeof(char *));
+    }
+    dict->size = blk->dict_size[c];
+    for (i = 0; i < dict->size; i++) {
+      if (i == 0) {
+        dict->values[i] = NULL;
+        continue;
+      }
+      if (s >= end || memchr(s, '\0', end - s) == NULL)
+        return -1;
+      dict->values[i] = (char *)s;
+      s += strlen(s) + 1;
     }
   }
-}
-
-/* Destroys both the hash structure and its GSLList
- * values */
-static void des_igsl_free(void *h, uint8_t free_data) {
-  khash_t(igsl) *hash = h;
-  khint_t k;
-  void *list = NULL;
-  if (!hash)
-    return;
 
-  if (!free_data)
-    goto des;
+  return 0;
+}
 
-  for (k = 0; k < kh_end(hash); ++k) {
-    if (kh_exist(hash, k) && (list = kh_value(hash, k))) {
-      list_remove_nodes(list);
-    }
+/* Move past the blocks of a cache dated outside [from, to], going by the
+ * dates in their headers.
+ *
+ * If there are no blocks left, NULL is returned.
+ * On success, the next block in range is returned and the cache moved past
+ * it. */
+static const GLogCacheBlock *skip_log_cache_blocks(GLogCache *cache,
+                                                   uint32_t from, uint32_t to) {
+  const GLogCacheBlock *blk = NULL;
+
+  while (cache->size - cache->pos >= sizeof(GLogCacheBlock)) {
+    blk = (const GLogCacheBlock *)(cache->map + cache->pos);
+    if (blk->size < sizeof(GLogCacheBlock) || blk->size % 8 != 0 ||
+        blk->size > cache->size - cache->pos)
+      return NULL;
+    cache->pos += blk->size;
+    if (blk->rows && blk->max_numdate >= from && blk->min_numdate <= to)
+      return blk;
   }
-des:
-  kh_destroy(igsl, hash);
-}
 
-/* Destroys the hash structure */
-static void des_ii08(void *h, uint8_t free_data) {
-  khash_t(ii08) *hash = h;
-  if (!hash)
-    return;
-  kh_destroy(ii08, hash);
+  return NULL;
 }
 
-/* Destroys the hash structure */
-static void des_ii32(void *h, uint8_t free_data) {
-  khash_t(ii32) *hash = h;
-  if (!hash)
-    return;
-  kh_destroy(ii32, hash);
+/* Get the next block of a cache holding rows dated within [from, to]. Its
+ * rows are exposed through cache->cols, which points into the mapping and
+ * is valid until the next call. Rows of the block may still fall outside
+ * the range.
+ *
+ * If there are no blocks left, or the next one is corrupt, NULL is
+ * returned.
+ * On success, the header of the block is returned, its min/max numdate and
+ * status allowing to skip it. */
+const GLogCacheBlock *next_log_cache_block(GLogCache *cache, uint32_t from,
+                                           uint32_t to) {
+  const GLogCacheBlock *blk = skip_log_cache_blocks(cache, from, to);
+
+  if (blk == NULL || set_log_cache_cols(cache, blk) != 0)
+    return NULL;
+
+  return blk;
 }
 
-/* Destroys both the hash structure and its string values */
-static void des_is32_free(void *h, uint8_t free_data) {
-  khint_t k;
-  khash_t(is32) *hash = h;
-  if (!hash)
-    return;
+/* Aggregate the rows of a layout dated within [from, to] into the given
+ * shard, as agg_item() does for parsed items, each row standing for `weight`
+ * lines. Each row is viewed as an item whose strings point into the layout,
+ * only the site is copied, as items hold it inline.
+ *
+ * On success, the number of rows aggregated is returned. */
+static uint64_t agg_log_columns(GAggShard *shard, const GLogColumns *cols,
+                                uint32_t from, uint32_t to, uint32_t weight) {
+  GLogItem logitem;
+  const char *site = NULL;
+  uint64_t rows = 0;
+  uint32_t i;
+  size_t len;
 
-  if (!free_data)
-    goto des;
+  memset(&logitem, 0, sizeof(logitem));
+  for (i = 0; i < cols->cnt; i++) {
+    if (cols->numdate[i] < from || cols->numdate[i] > to)
+      continue;
 
-  for (k = 0; k < kh_end(hash); ++k) {
-    if (kh_exist(hash, k)) {
-      free((char *)kh_value(hash, k));
-    }
+    logitem.numdate = cols->numdate[i];
+    logitem.status = cols->status[i];
+    logitem.resp_size = cols->resp_size[i];
+    logitem.serve_time = cols->serve_time[i];
+    logitem.agent = (char *)get_log_str_value(cols, LOG_COL_AGENT, i);
+    logitem.date = (char *)get_log_str_value(cols, LOG_COL_DATE, i);
+    logitem.host = (char *)get_log_str_value(cols, LOG_COL_HOST, i);
+    logitem.keyphrase = (char *)get_log_str_value(cols, LOG_COL_KEYPHRASE, i);
+    logitem.qstr = (char *)get_log_str_value(cols, LOG_COL_QSTR, i);
+    logitem.ref = (char *)get_log_str_value(cols, LOG_COL_REF, i);
+    logitem.req = (char *)get_log_str_value(cols, LOG_COL_REQ, i);
+    logitem.time = (char *)get_log_str_value(cols, LOG_COL_TIME, i);
+    logitem.vhost = (char *)get_log_str_value(cols, LOG_COL_VHOST, i);
+    logitem.userid = (char *)get_log_str_value(cols, LOG_COL_USERID, i);
+    logitem.tls_cypher =
+        (char *)get_log_str_value(cols, LOG_COL_TLS_CYPHER, i);
+    logitem.method = get_log_dict_value(cols, LOG_COL_METHOD,
+                                        cols->id[LOG_COL_METHOD][i]);
+    logitem.protocol = get_log_dict_value(cols, LOG_COL_PROTOCOL,
+                                          cols->id[LOG_COL_PROTOCOL][i]);
+    logitem.cache_status = (char *)get_log_dict_value(
+        cols, LOG_COL_CACHE_STATUS, cols->id[LOG_COL_CACHE_STATUS][i]);
+    logitem.mime_type = (char *)get_log_dict_value(
+        cols, LOG_COL_MIME_TYPE, cols->id[LOG_COL_MIME_TYPE][i]);
+    logitem.tls_type = (char *)get_log_dict_value(
+        cols, LOG_COL_TLS_TYPE, cols->id[LOG_COL_TLS_TYPE][i]);
+
+    len = 0;
+    if ((site = get_log_str_value(cols, LOG_COL_SITE, i)))
+      memcpy(logitem.site, site,
+             len = MIN(strlen(site), (size_t)REF_SITE_LEN));
+    logitem.site[len] = '\0';
+
+    agg_item(shard, &logitem, weight);
+    rows++;
   }
-des:
-  kh_destroy(is32, hash);
-}
 
-/* Destroys the hash structure */
-static void des_iu64(void *h, uint8_t free_data) {
-  khash_t(iu64) *hash = h;
-  if (!hash)
-    return;
-  kh_destroy(iu64, hash);
-}
+  return rows;
+}
+
+/* Blocks of a cache shared by the workers of aggregate_log_cache() */
+typedef struct GLogCacheAgg_ {
+  pthread_mutex_t mutex; /* guards the cache's position */
+  GLogCache *cache;
+  uint32_t from, to;
+  uint64_t rows;
+} GLogCacheAgg;
+
+static void *agg_log_cache_thread(void *arg) {
+  GLogCacheAgg *agg = arg;
+  const GLogCacheBlock *blk = NULL;
+  GAggShard *shard = new_agg_shard();
+  GLogCache view;
+  uint64_t rows = 0;
+
+  /* a view of the same mapping, holding its own columns. Only the fields
+   * that never change are copied, other workers move agg->cache->pos */
+  memset(&view, 0, sizeof(view));
+  view.map = agg->cache->map;
+  view.size = agg->cache->size;
+  view.hdr = agg->cache->hdr;
+
+  for (;;) {
+    pthread_mutex_lock(&agg->mutex);
+    blk = skip_log_cache_blocks(agg->cache, agg->from, agg->to);
+    pthread_mutex_unlock(&agg->mutex);
+    if (blk == NULL || set_log_cache_cols(&view, blk) != 0)
+      break;
+    rows += agg_log_columns(shard, &view.cols, agg->from, agg->to,
+                            blk->sample);
+    merge_agg_shard(shard, conf.agg_merge_lines);
+  }
 
-/* Destroys both the hash structure and the keys for a
- * string key - uint32_t value hash */
-static void des_si32_free(void *h, uint8_t free_data) {
-  khint_t k;
-  khash_t(si32) *hash = h;
-  if (!hash)
-    return;
+  merge_agg_shard(shard, 0);
+  free_agg_shard(shard);
+  free_log_cache_cols(&view);
 
-  if (!free_data)
-    goto des;
+  pthread_mutex_lock(&agg->mutex);
+  agg->rows += rows;
+  pthread_mutex_unlock(&agg->mutex);
 
-  for (k = 0; k < kh_end(hash); ++k) {
-    if (kh_exist(hash, k)) {
-      free((char *)kh_key(hash, k));
-    }
+  return NULL;
+}
+
+/* Aggregate the rows of a cache dated within [from, to] into the store, as
+ * aggregate_job() does for parsed items, without parsing anything again.
+ * Blocks outside the range are skipped by their header, and the rest are
+ * shared among conf.jobs threads, each aggregating into its own shard. The
+ * cache is rewound first.
+ *
+ * On success, the number of rows aggregated is returned. */
+uint64_t aggregate_log_cache(GLogCache *cache, uint32_t from, uint32_t to) {
+  GLogCacheAgg agg;
+  GArena *prev = NULL;
+  pthread_t *threads = NULL;
+  int n = MAX(conf.jobs, 1), k;
+
+  memset(&agg, 0, sizeof(agg));
+  pthread_mutex_init(&agg.mutex, NULL);
+  agg.cache = cache;
+  agg.from = from;
+  agg.to = to;
+  rewind_log_cache(cache);
+
+  /* shards are merged into the store, keep them off the active arena, which
+   * doesn't carry over to the threads */
+  prev = set_active_arena(NULL);
+  if (n == 1) {
+    agg_log_cache_thread(&agg);
+  } else {
+    threads = xcalloc(n, sizeof(pthread_t));
+    for (k = 0; k < n; k++)
+      if (pthread_create(&threads[k], NULL, agg_log_cache_thread, &agg))
+        FATAL("Unable to create aggregation thread - failed.");
+    for (k = 0; k < n; k++)
+      pthread_join(threads[k], NULL);
+    free(threads);
   }
+  set_active_arena(prev);
+  pthread_mutex_destroy(&agg.mutex);
 
-des:
-  kh_destroy(si32, hash);
+  return agg.rows;
 }
 
-/* Destroys both the hash structure and the keys for a
- * string key - uint64_t value hash */
-static void des_su64_free(void *h, uint8_t free_data) {
-  khash_t(su64) *hash = h;
-  khint_t k;
+/* Get the string value from the active parser's JSON key map given a JSON
+ * specifier key.
+ *
+ * On error, NULL is returned.
+ * On success the string value for the given key is returned */
+static char *ht_get_json_logfmt(const char *key) {
+  khash_t(ss32) *hash = active_parser->json_logfmt;
+
   if (!hash)
-    return;
+    return NULL;
 
-  if (!free_data)
-    goto des;
+  return get_ss32(hash, key);
+}
 
-  for (k = 0; k < kh_end(hash); ++k) {
-    if (kh_exist(hash, k)) {
-      free((char *)kh_key(hash, k));
+void printlog(int ret, GLogItem *logitem) {
+  if (!logitem) {
+    printf("logitem returns as NULL\n");
+  } else {
+    if (ret != 0) {
+      printf("err: %s\n", logitem->errstr);
     }
+    printf("URL: %s\n", logitem->req);
+    printf("Size: %ld\n", logitem->resp_size);
+    printf("From: %s\n", logitem->host);
   }
-
-des:
-  kh_destroy(su64, hash);
 }
 
-/* Destroys the hash structure */
-static void des_u648(void *h, uint8_t free_data) {
-  khash_t(u648) *hash = h;
-  if (!hash)
-    return;
-  kh_destroy(u648, hash);
+#if defined(HAVE_PARSE_STATS)
+/* Sum the parse stats of every thread, running or not, into `out`. Threads
+ * keep parsing meanwhile, so calls in flight may be counted in part. */
+void get_parse_stats(GParseStats *out) {
+  const GParseStats *stats = NULL;
+  int f, c;
+
+  pthread_mutex_lock(&parse_stats_mutex);
+  *out = parse_stats_retired;
+  out->next = NULL;
+  for (stats = parse_stats_list; stats; stats = stats->next) {
+    for (f = 0; f < PARSE_STAT_FNS; f++)
+      sum_parse_stat(&out->fns[f], &stats->fns[f]);
+    for (f = 0; f <= PARSE_STAT_SPECIAL; f++)
+      for (c = 0; c < 128; c++)
+        sum_parse_stat(&out->specs[f][c], &stats->specs[f][c]);
+  }
+  pthread_mutex_unlock(&parse_stats_mutex);
 }
 
-/* Destroys both the hash structure and the keys for a
- * string key - uint32_t value hash */
-static void des_si08_free(void *h, uint8_t free_data) {
-  khint_t k;
-  khash_t(si08) *hash = h;
-  if (!hash)
-    return;
+/* Zero the parse stats of every thread, running or not. */
+void reset_parse_stats(void) {
+  GParseStats *stats = NULL;
+  uint64_t *counter = NULL, *end = NULL;
 
-  if (!free_data)
-    goto des;
+  pthread_mutex_lock(&parse_stats_mutex);
+  memset(&parse_stats_retired, 0, sizeof(parse_stats_retired));
+  for (stats = parse_stats_list; stats; stats = stats->next) {
+    counter = (uint64_t *)stats;
+    end = (uint64_t *)&stats->next;
+    for (; counter < end; counter++)
+      __atomic_store_n(counter, 0, __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&parse_stats_mutex);
+}
 
-  for (k = 0; k < kh_end(hash); ++k) {
-    if (kh_exist(hash, k)) {
-      free((char *)kh_key(hash, k));
+/* Write a specifier character as a JSON string or a Prometheus label value,
+ * both escaping quotes and backslashes the same way. */
+static void dump_parse_stat_spec(FILE *fp, int spec) {
+  if (spec == '"' || spec == '\\')
+    fprintf(fp, "\"\\%c\"", spec);
+  else if (isprint(spec))
+    fprintf(fp, "\"%c\"", spec);
+  else
+    fprintf(fp, "\"0x%02x\"", spec);
+}
+
+static void dump_parse_stat_json(FILE *fp, const GParseStat *st) {
+  int b;
+
+  fprintf(fp,
+          "{\"calls\":%" PRIu64 ",\"ns\":%" PRIu64 ",\"bytes\":%" PRIu64
+          ",\"allocs\":%" PRIu64 ",\"strdups\":%" PRIu64 ",\"hist\":[",
+          st->calls, st->ns, st->bytes, st->allocs, st->strdups);
+  for (b = 0; b < PARSE_STAT_BUCKETS; b++)
+    fprintf(fp, "%s%" PRIu64, b ? "," : "", st->hist[b]);
+  fputs("]", fp);
+}
+
+/* Write the parse stats of every thread, summed, as a JSON object keyed by
+ * function. Functions timed per specifier hold a "specifiers" object of
+ * the specifiers that were called. Bucket i of "hist" counts the calls
+ * that took [2^i, 2^(i+1)) ns, see PARSE_STAT_BUCKETS. */
+void dump_parse_stats_json(FILE *fp) {
+  GParseStats *stats = xmalloc(sizeof(GParseStats));
+  const GParseStat *st = NULL;
+  int f, c, n;
+
+  get_parse_stats(stats);
+  fputs("{", fp);
+  for (f = 0; f < PARSE_STAT_FNS; f++) {
+    fprintf(fp, "%s\"%s\":", f ? "," : "", parse_stat_fns[f]);
+    dump_parse_stat_json(fp, &stats->fns[f]);
+    if (f > PARSE_STAT_SPECIAL) {
+      fputs("}", fp);
+      continue;
+    }
+
+    fputs(",\"specifiers\":{", fp);
+    for (c = 0, n = 0; c < 128; c++) {
+      if ((st = &stats->specs[f][c])->calls == 0)
+        continue;
+      fputs(n++ ? "," : "", fp);
+      dump_parse_stat_spec(fp, c);
+      fputs(":", fp);
+      dump_parse_stat_json(fp, st);
+      fputs("}", fp);
     }
+    fputs("}}", fp);
   }
+  fputs("}\n", fp);
+  free(stats);
+}
 
-des:
-  kh_destroy(si08, hash);
+static void dump_parse_stat_labels(FILE *fp, const char *fn, int spec) {
+  fprintf(fp, "{fn=\"%s\"", fn);
+  if (spec >= 0) {
+    fputs(",spec=", fp);
+    dump_parse_stat_spec(fp, spec);
+  }
 }
 
-/* Deletes an entry from the hash table and optionally the keys for a string
- * key - uint32_t value hash */
-static void del_si08_free(void *h, uint8_t free_data) {
-  khint_t k;
-  khash_t(si08) *hash = h;
-  if (!hash)
+/* Write a family of Prometheus metrics of a parse stat, given the labels
+ * identifying it: family 0 is the duration histogram, then come the bytes,
+ * allocs and strdups counters. */
+static void dump_parse_stat_prom(FILE *fp, const char *name, int family,
+                                 const char *fn, int spec,
+                                 const GParseStat *st) {
+  static const char *counters[] = {"bytes", "allocs", "strdups"};
+  uint64_t cnt = 0, val = 0;
+  int b;
+
+  if (family > 0) {
+    val = family == 1 ? st->bytes : family == 2 ? st->allocs : st->strdups;
+    fprintf(fp, "%s_%s_total", name, counters[family - 1]);
+    dump_parse_stat_labels(fp, fn, spec);
+    fprintf(fp, "} %" PRIu64 "\n", val);
     return;
+  }
 
-  for (k = 0; k < kh_end(hash); ++k) {
-    if (kh_exist(hash, k)) {
-      if (free_data)
-        free((char *)kh_key(hash, k));
-      kh_del(si08, hash, k);
+  /* the last bucket has no upper bound, so it only counts toward +Inf */
+  for (b = 0; b < PARSE_STAT_BUCKETS - 1; b++) {
+    cnt += st->hist[b];
+    fprintf(fp, "%s_duration_ns_bucket", name);
+    dump_parse_stat_labels(fp, fn, spec);
+    fprintf(fp, ",le=\"%" PRIu64 "\"} %" PRIu64 "\n", (uint64_t)2 << b, cnt);
+  }
+  fprintf(fp, "%s_duration_ns_bucket", name);
+  dump_parse_stat_labels(fp, fn, spec);
+  fprintf(fp, ",le=\"+Inf\"} %" PRIu64 "\n", st->calls);
+  fprintf(fp, "%s_duration_ns_sum", name);
+  dump_parse_stat_labels(fp, fn, spec);
+  fprintf(fp, "} %" PRIu64 "\n", st->ns);
+  fprintf(fp, "%s_duration_ns_count", name);
+  dump_parse_stat_labels(fp, fn, spec);
+  fprintf(fp, "} %" PRIu64 "\n", st->calls);
+}
+
+/* Write the parse stats of every thread, summed, in the Prometheus text
+ * format: a duration histogram and bytes, allocs and strdups counters per
+ * function under goaccess_parse, and per specifier under
+ * goaccess_parse_spec. */
+void dump_parse_stats_prometheus(FILE *fp) {
+  static const char *types[] = {"histogram", "counter", "counter",
+                                "counter"};
+  static const char *suffixes[] = {"_duration_ns", "_bytes_total",
+                                   "_allocs_total", "_strdups_total"};
+  static const char *names[] = {"goaccess_parse", "goaccess_parse_spec"};
+  GParseStats *stats = xmalloc(sizeof(GParseStats));
+  int family, f, c, k;
+
+  get_parse_stats(stats);
+  for (k = 0; k < 2; k++) {
+    for (family = 0; family < 4; family++) {
+      fprintf(fp, "# TYPE %s%s %s\n", names[k], suffixes[family],
+              types[family]);
+      for (f = 0; k == 0 && f < PARSE_STAT_FNS; f++)
+        dump_parse_stat_prom(fp, names[k], family, parse_stat_fns[f], -1,
+                             &stats->fns[f]);
+      for (f = 0; k == 1 && f <= PARSE_STAT_SPECIAL; f++)
+        for (c = 0; c < 128; c++)
+          if (stats->specs[f][c].calls)
+            dump_parse_stat_prom(fp, names[k], family, parse_stat_fns[f], c,
+                                 &stats->specs[f][c]);
     }
   }
+  free(stats);
+}
+#endif
+
+/* Synthetic corpus of a log format, see gen_bench_line() */
+typedef struct GBenchFmt_ {
+  const char *name; /* preset name, also used for the corpus file name */
+  const char *fmt;  /* log format if not a preset, see set_log_format_str() */
+} GBenchFmt;
+
+static const GBenchFmt bench_fmts[] = {
+    {"combined", NULL},
+    {"vcombined", NULL},
+    {"common", NULL},
+    {"vcommon", NULL},
+    {"w3c", NULL},
+    {"cloudfront", NULL},
+    {"cloudstorage", NULL},
+    {"awselb", NULL},
+    {"squid", NULL},
+    {"awss3", NULL},
+    {"caddy", NULL},
+    {"awsalb", NULL},
+    {"traefikclf", NULL},
+    /* combined behind a CDN, the client IP being taken from a quoted XFF */
+    {"xff", "%^ - - [%d:%t %^] \"%r\" %s %b \"%R\" \"%u\" \"~h{, }\""},
+};
+
+/* Real-world user agents, from short clients to long browser strings */
+static const char *const bench_agents[] = {
+    "curl/8.1.2",
+    "Go-http-client/2.0",
+    "python-requests/2.31.0",
+    "Googlebot/2.1 (+http://www.google.com/bot.html)",
+    "Mozilla/5.0 (compatible; bingbot/2.0; +http://www.bing.com/bingbot.htm)",
+    "Mozilla/5.0 (iPhone; CPU iPhone OS 16_5 like Mac OS X) AppleWebKit/605.1"
+    ".15 (KHTML, like Gecko) Version/16.5 Mobile/15E148 Safari/604.1",
+    "Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like "
+    "Gecko) Chrome/114.0.0.0 Safari/537.36",
+    "Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like "
+    "Gecko) Chrome/114.0.0.0 Safari/537.36",
+    "Mozilla/5.0 (X11; Linux x86_64; rv:109.0) Gecko/20100101 Firefox/114.0",
+    "Mozilla/5.0 (Linux; Android 13; SM-S918B) AppleWebKit/537.36 (KHTML, like "
+    "Gecko) Chrome/114.0.5735.130 Mobile Safari/537.36",
+    "Mozilla/5.0 (Macintosh; Intel Mac OS X 10_15_7) AppleWebKit/537.36 "
+    "(KHTML, like Gecko) Chrome/114.0.0.0 Safari/537.36 Edg/114.0.1823.51",
+    "Mozilla/5.0 (Linux; Android 10; K) AppleWebKit/537.36 (KHTML, like Gecko) "
+    "Chrome/114.0.0.0 Mobile Safari/537.36 [FBAN/EMA;FBLC/en_US;FBAV/360.0.0."
+    "12.110;FBDV/SM-A125F;FBSV/10;FBCR/T-Mobile;FBOP/1;FBMF/samsung]",
+};
+
+static const char *const bench_words[] = {
+    "api", "v1", "v2", "static", "assets", "images", "blog", "2023", "users",
+    "search", "product", "category", "wp-content", "uploads", "js", "css",
+    "index", "feed", "cart", "checkout", "docs", "download", "thumbnails",
+};
+
+static const char *const bench_exts[] = {
+    "", "", "", ".html", ".php", ".js", ".css", ".png", ".jpg", ".json",
+};
+
+static const char *const bench_sites[] = {
+    "https://www.google.com/", "https://www.bing.com/search?q=log+parser",
+    "https://t.co/x9Ab3", "https://news.ycombinator.com/item?id=36312345",
+    "https://example.com/blog/2023/06/some-article-title",
+};
+
+/* xorshift32, so corpora are the same on every run */
+static uint32_t bench_rand(uint32_t *seed) {
+  uint32_t x = *seed;
+
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+
+  return (*seed = x);
 }
 
-/* Deletes an entry from the hash table and optionally the keys for a string
- * keys and string values */
-static void del_ss32_free(void *h, uint8_t free_data) {
-  khint_t k;
-  khash_t(ss32) *hash = h;
-  if (!hash)
-    return;
+/* Pick an index out of `n` values, the first ones being the most likely. */
+static uint32_t bench_skewed(uint32_t *seed, uint32_t n) {
+  uint32_t a = bench_rand(seed) % n, b = bench_rand(seed) % n;
+  return MIN(a, b);
+}
 
-  for (k = 0; k < kh_end(hash); ++k) {
-    if (kh_exist(hash, k)) {
-      if (free_data) {
-        free((char *)kh_key(hash, k));
-        free((char *)kh_value(hash, k));
-      }
-      kh_del(ss32, hash, k);
+/* Fields of a synthetic line */
+typedef struct GBenchLine_ {
+  char host[64];
+  char xff[160];
+  char path[256];
+  char qstr[128];
+  char agent[512];
+  char ref[128];
+  const char *method;
+  const char *protocol;
+  int status;
+  uint64_t size;
+  uint32_t msecs; /* time taken to serve the request */
+  time_t ts;
+  uint32_t usecs;
+} GBenchLine;
+
+static void gen_bench_ip(uint32_t *seed, char *out, size_t size) {
+  uint32_t r = bench_rand(seed);
+
+  if (r % 5 == 0)
+    snprintf(out, size, "2001:db8:%x:%x::%x", (r >> 8) & 0xffff,
+             (r >> 4) & 0xfff, bench_rand(seed) & 0xffff);
+  else
+    snprintf(out, size, "%u.%u.%u.%u", 1 + (r >> 24) % 223, (r >> 16) & 0xff,
+             (r >> 8) & 0xff, 1 + r % 254);
+}
+
+/* Fill the fields of the i-th synthetic line. Field lengths are drawn from
+ * skewed distributions: paths of 1 to 6 segments, a query string on a third
+ * of them, user agents from 10 to 250+ bytes, with a few escaped quotes. */
+static void gen_bench_fields(GBenchLine *ln, uint32_t *seed, uint32_t i) {
+  static const char *const methods[] = {"GET", "GET", "GET", "GET", "POST",
+                                        "HEAD", "PUT", "OPTIONS", "DELETE"};
+  static const char *const protocols[] = {"HTTP/1.1", "HTTP/2.0", "HTTP/1.0"};
+  static const int codes[] = {200, 200, 200, 304, 404, 301, 302, 206, 500};
+  uint32_t n = 1 + bench_skewed(seed, 6), k, hops;
+  size_t len = 0;
+
+  gen_bench_ip(seed, ln->host, sizeof(ln->host));
+
+  for (k = 0; k < n; k++)
+    len += snprintf(ln->path + len, sizeof(ln->path) - len, "/%s",
+                    bench_words[bench_rand(seed) % ARRAY_SIZE(bench_words)]);
+  if (bench_rand(seed) % 20 == 0)
+    len += snprintf(ln->path + len, sizeof(ln->path) - len, "/caf%%C3%%A9");
+  snprintf(ln->path + len, sizeof(ln->path) - len, "%s",
+           bench_exts[bench_rand(seed) % ARRAY_SIZE(bench_exts)]);
+
+  ln->qstr[0] = '\0';
+  if (bench_rand(seed) % 3 == 0)
+    snprintf(ln->qstr, sizeof(ln->qstr), "id=%u&page=%u&utm_source=%s",
+             bench_rand(seed) % 100000, bench_skewed(seed, 50),
+             bench_words[bench_rand(seed) % ARRAY_SIZE(bench_words)]);
+
+  snprintf(ln->agent, sizeof(ln->agent), "%s",
+           bench_agents[bench_skewed(seed, ARRAY_SIZE(bench_agents))]);
+  snprintf(ln->ref, sizeof(ln->ref), "%s",
+           bench_rand(seed) % 5 < 2
+               ? "-"
+               : bench_sites[bench_rand(seed) % ARRAY_SIZE(bench_sites)]);
+
+  /* client -> CDN edge -> load balancer chains */
+  hops = 3 + bench_rand(seed) % 4;
+  len = snprintf(ln->xff, sizeof(ln->xff), "%s",
+                 bench_rand(seed) % 8 == 0 ? "unknown, " : "");
+  len += snprintf(ln->xff + len, sizeof(ln->xff) - len, "%s", ln->host);
+  for (k = 1; k < hops; k++)
+    len += snprintf(ln->xff + len, sizeof(ln->xff) - len, ", 10.%u.%u.%u",
+                    bench_rand(seed) & 0xff, bench_rand(seed) & 0xff,
+                    1 + bench_rand(seed) % 254);
+
+  ln->method = methods[bench_skewed(seed, ARRAY_SIZE(methods))];
+  ln->protocol = protocols[bench_skewed(seed, ARRAY_SIZE(protocols))];
+  ln->status = codes[bench_skewed(seed, ARRAY_SIZE(codes))];
+  ln->size = ln->status == 304
+                 ? 0
+                 : (uint64_t)(bench_rand(seed) % 4096)
+                       << (bench_rand(seed) % 8);
+  ln->msecs = bench_skewed(seed, 2000);
+  ln->ts = 1686446625 + i / 4;
+  ln->usecs = bench_rand(seed) % 1000000;
+}
+
+/* Write the given user agent into out for formats that can't hold spaces or
+ * quotes: W3C replaces spaces with '+' and CloudFront %-encodes them. */
+static void bench_agent_as(const char *agent, char *out, size_t size,
+                           const char *space) {
+  size_t len = 0, slen = strlen(space);
+
+  for (; *agent && len + slen + 1 < size; agent++) {
+    if (*agent == ' ') {
+      memcpy(out + len, space, slen);
+      len += slen;
+    } else {
+      out[len++] = *agent;
     }
   }
+  out[len] = '\0';
 }
 
-/* Destroys both the hash structure and its string
- * keys and string values */
-static void des_ss32_free(void *h, uint8_t free_data) {
-  khint_t k;
-  khash_t(ss32) *hash = h;
-  if (!hash)
-    return;
+/* Write a synthetic line of the given corpus into out, see
+ * gen_bench_fields().
+ *
+ * On success, the line length, newline included, is returned. */
+static size_t gen_bench_line(const char *name, char *out, size_t size,
+                             uint32_t *seed, uint32_t i) {
+  GBenchLine ln;
+  char clf[32], day[16], tod[16], agent[1024], *a = ln.agent;
+  const char *q = NULL;
+  struct tm tm;
+  int len = 0;
 
-  if (!free_data)
-    goto des;
+  gen_bench_fields(&ln, seed, i);
+  q = *ln.qstr ? ln.qstr : "-";
+  gmtime_r(&ln.ts, &tm);
+  strftime(clf, sizeof(clf), "%d/%b/%Y:%H:%M:%S +0000", &tm);
+  strftime(day, sizeof(day), "%Y-%m-%d", &tm);
+  strftime(tod, sizeof(tod), "%H:%M:%S", &tm);
+
+  /* escaped quotes within quoted user agents */
+  if (bench_rand(seed) % 32 == 0) {
+    snprintf(agent, sizeof(agent), "%s \\\"quoted\\\"", ln.agent);
+    a = agent;
+  }
 
-  for (k = 0; k < kh_end(hash); ++k) {
-    if (kh_exist(hash, k)) {
-      free((char *)kh_key(hash, k));
-      free((char *)kh_value(hash, k));
-    }
+  if (!strcmp(name, "combined") || !strcmp(name, "vcombined")) {
+    len = snprintf(out, size, "%s%s - - [%s] \"%s %s%s%s %s\" %d %" PRIu64
+                   " \"%s\" \"%s\"\n",
+                   *name == 'v' ? "www.example.com:443 " : "", ln.host, clf,
+                   ln.method, ln.path, *ln.qstr ? "?" : "", ln.qstr,
+                   ln.protocol, ln.status, ln.size, ln.ref, a);
+  } else if (!strcmp(name, "common") || !strcmp(name, "vcommon")) {
+    len = snprintf(out, size, "%s%s - - [%s] \"%s %s %s\" %d %" PRIu64 "\n",
+                   *name == 'v' ? "www.example.com:443 " : "", ln.host, clf,
+                   ln.method, ln.path, ln.protocol, ln.status, ln.size);
+  } else if (!strcmp(name, "w3c")) {
+    bench_agent_as(ln.agent, agent, sizeof(agent), "+");
+    len = snprintf(out, size,
+                   "%s %s 10.0.0.5 %s %s %s 443 - %s %s %s %d 0 0 %u\n", day,
+                   tod, ln.method, ln.path, q, ln.host, agent, ln.ref,
+                   ln.status, ln.msecs);
+  } else if (!strcmp(name, "cloudfront")) {
+    bench_agent_as(ln.agent, agent, sizeof(agent), "%20");
+    len = snprintf(out, size,
+                   "%s\t%s\tIAD89-C1\t%" PRIu64 "\t%s\t%s\t"
+                   "d111111abcdef8.cloudfront.net\t%s\t%d\t%s\t%s\t%s\t-\t"
+                   "%s\tSOX4xwn4XV6Q4rgb7XiVGOHms_BGlTAC4KyHmure"
+                   "ZmBNrjGdRLiNIQ==\twww.example.com\thttps\t%u\t%u.%03u\t-\t"
+                   "TLSv1.3\t"
+                   "TLS_AES_128_GCM_SHA256\tHit\t%s\t-\n",
+                   day, tod, ln.size, ln.host, ln.method, ln.path, ln.status,
+                   ln.ref, agent, q, bench_rand(seed) % 2 ? "Hit" : "Miss",
+                   200 + bench_rand(seed) % 800, ln.msecs / 1000,
+                   ln.msecs % 1000, ln.protocol);
+  } else if (!strcmp(name, "cloudstorage")) {
+    len = snprintf(out, size,
+                   "\"%ld%06u\",\"%s\",\"1\",\"\",\"%s\",\"%s\",\"%d\","
+                   "\"0\",\"%" PRIu64 "\",\"%u\",\"storage.googleapis.com\","
+                   "\"%s\",\"%s\",\"\",\"GET_Object\",\"bucket\",\"obj\"\n",
+                   (long)ln.ts, ln.usecs, ln.host, ln.method, ln.path,
+                   ln.status, ln.size, ln.msecs * 1000, ln.ref, ln.agent);
+  } else if (!strcmp(name, "awselb") || !strcmp(name, "awsalb")) {
+    /* unbracketed IPv6 client:port pairs can't be split by `%h:%^` */
+    while (strchr(ln.host, ':'))
+      gen_bench_ip(seed, ln.host, sizeof(ln.host));
+    len = snprintf(out, size, "https %sT%s.%06uZ %s %s:%u 10.0.1.%u:80 0.000 "
+                   "%u.%03u 0.000 %d %d %u %" PRIu64 " \"%s "
+                   "https://www.example.com:443%s%s%s %s\" \"%s\" "
+                   "ECDHE-RSA-AES128-GCM-SHA256 TLSv1.2 "
+                   "arn:aws:elasticloadbalancing:us-east-2:123456789012:"
+                   "targetgroup/my-targets/73e2d6bc24d8a067",
+                   day, tod, ln.usecs,
+                   name[3] == 'a' ? "www.example.com"
+                                  : "app/my-lb/50dc6c495c0c9188",
+                   ln.host, 1024 + bench_rand(seed) % 60000,
+                   1 + bench_rand(seed) % 254, ln.msecs / 1000,
+                   ln.msecs % 1000, ln.status, ln.status,
+                   200 + bench_rand(seed) % 800, ln.size, ln.method, ln.path,
+                   *ln.qstr ? "?" : "", ln.qstr, ln.protocol, a);
+    if (name[3] == 'e')
+      len += snprintf(out + len, size - len, " \"Root=1-58337262-%08x\" "
+                      "\"www.example.com\"", bench_rand(seed));
+    len += snprintf(out + len, size - len, "\n");
+  } else if (!strcmp(name, "squid")) {
+    strftime(tod, sizeof(tod), "%b %d %H:%M:%S", &tm);
+    len = snprintf(out, size, "%s proxy squid[1234]: %ld.%03u %6u %s "
+                   "TCP_%s/%d %" PRIu64 " %s http://www.example.com%s - "
+                   "HIER_DIRECT/93.184.216.34 text/html\n",
+                   tod, (long)ln.ts, ln.usecs / 1000, ln.msecs, ln.host,
+                   bench_rand(seed) % 2 ? "MISS" : "HIT", ln.status, ln.size,
+                   ln.method, ln.path);
+  } else if (!strcmp(name, "awss3")) {
+    len = snprintf(out, size, "79a59df900b949e55d96a1e698fbacedfd6e09d98eacf8"
+                   "f8d5218e7cd47ef2be "
+                   "mybucket [%s] %s arn:aws:iam::123456789012:user/alice "
+                   "3E57427F3EXAMPLE REST.GET.OBJECT %s \"%s %s%s%s %s\" %d "
+                   "- %" PRIu64 " %" PRIu64 " %u %u \"%s\" \"%s\" -\n",
+                   clf, ln.host, ln.path + 1, ln.method, ln.path,
+                   *ln.qstr ? "?" : "", ln.qstr, ln.protocol, ln.status,
+                   ln.size, ln.size, ln.msecs, ln.msecs / 2, ln.ref, a);
+  } else if (!strcmp(name, "caddy")) {
+    len = snprintf(out, size, "{\"level\":\"info\",\"ts\":%ld.%06u,"
+                   "\"logger\":\"http.log.access\",\"msg\":\"handled "
+                   "request\",\"request\":{\"remote_ip\":\"%s\","
+                   "\"remote_port\":\"%u\",\"client_ip\":\"%s\","
+                   "\"proto\":\"%s\",\"method\":\"%s\",\"host\":"
+                   "\"www.example.com\",\"uri\":\"%s%s%s\",\"headers\":"
+                   "{\"User-Agent\":[\"%s\"],\"Referer\":[\"%s\"],"
+                   "\"Accept-Encoding\":[\"gzip, br\"]},\"tls\":"
+                   "{\"resumed\":false,\"version\":772,\"cipher_suite\":4865,"
+                   "\"proto\":\"h2\"}},\"duration\":0.%06u,\"size\":%"
+                   PRIu64 ",\"status\":%d,\"resp_headers\":{\"Content-"
+                   "Type\":[\"text/html; charset=utf-8\"]}}\n",
+                   (long)ln.ts, ln.usecs, ln.host,
+                   1024 + bench_rand(seed) % 60000,
+                   ln.host, ln.protocol, ln.method, ln.path,
+                   *ln.qstr ? "?" : "", ln.qstr, a, ln.ref, ln.msecs * 100,
+                   ln.size, ln.status);
+  } else if (!strcmp(name, "traefikclf")) {
+    len = snprintf(out, size, "%s - %s [%s] \"%s %s %s\" %d %" PRIu64
+                   " \"%s\" \"%s\" %u \"web@docker\" \"http://10.0.2.%u:80\" "
+                   "%ums\n",
+                   ln.host, bench_rand(seed) % 4 ? "-" : "alice", clf,
+                   ln.method, ln.path, ln.protocol, ln.status, ln.size, ln.ref,
+                   a, i + 1, 1 + bench_rand(seed) % 254, ln.msecs);
+  } else if (!strcmp(name, "xff")) {
+    len = snprintf(out, size, "172.16.%u.%u - - [%s] \"%s %s %s\" %d %" PRIu64
+                   " \"%s\" \"%s\" \"%s\"\n",
+                   bench_rand(seed) & 0xff, 1 + bench_rand(seed) % 254, clf,
+                   ln.method, ln.path, ln.protocol, ln.status, ln.size, ln.ref,
+                   a, ln.xff);
   }
 
-des:
-  kh_destroy(ss32, hash);
+  return len > 0 && (size_t)len < size ? (size_t)len : 0;
 }
 
-/* Destroys the hash structure */
-static void des_iglp(void *h, uint8_t free_data) {
-  khash_t(iglp) *hash = h;
-  if (!hash)
-    return;
-  kh_destroy(iglp, hash);
+/* Generate `lines` synthetic lines of the given corpus into a buffer.
+ *
+ * On success, the malloc'd corpus is returned and its length assigned. */
+static char *gen_bench_corpus(const char *name, uint32_t lines,
+                              size_t *len) {
+  size_t size = (size_t)lines * 1024 + 1, used = 0;
+  char *buf = xmalloc(size);
+  uint32_t seed = 2463534242u, i;
+
+  for (i = 0; i < lines; i++)
+    used += gen_bench_line(name, buf + used, size - used, &seed, i);
+  buf[used] = '\0';
+  *len = used;
+
+  return buf;
 }
 
-/* Per module & per date */
-static const GKHashMetric module_metrics[] = {
-    {.metric.storem = MTRC_KEYMAP,
-     MTRC_TYPE_II32,
-     new_ii32_ht,
-     des_ii32,
-     del_ii32,
-     1,
-     NULL,
-     NULL},
-    {.metric.storem = MTRC_ROOTMAP,
-     MTRC_TYPE_IS32,
-     new_is32_ht,
-     des_is32_free,
-     del_is32_free,
-     1,
-     NULL,
-     NULL},
-    {.metric.storem = MTRC_DATAMAP,
-     MTRC_TYPE_IS32,
-     new_is32_ht,
-     des_is32_free,
-     del_is32_free,
-     1,
-     NULL,
-     NULL},
-    {.metric.storem = MTRC_UNIQMAP,
-     MTRC_TYPE_U648,
-     new_u648_ht,
-     des_u648,
-     del_u648,
-     1,
-     NULL,
-     NULL},
-    {.metric.storem = MTRC_ROOT,
-     MTRC_TYPE_II32,
-     new_ii32_ht,
-     des_ii32,
-     del_ii32,
-     1,
-     NULL,
-     NULL},
-    {.metric.storem = MTRC_HITS,
-     MTRC_TYPE_II32,
-     new_ii32_ht,
-     des_ii32,
-     del_ii32,
-     1,
-     NULL,
-     NULL},
-    {.metric.storem = MTRC_VISITORS,
-     MTRC_TYPE_II32,
-     new_ii32_ht,
-     des_ii32,
-     del_ii32,
-     1,
-     NULL,
-     NULL},
-    {.metric.storem = MTRC_BW,
-     MTRC_TYPE_IU64,
-     new_iu64_ht,
-     des_iu64,
-     del_iu64,
-     1,
-     NULL,
-     NULL},
-    {.metric.storem = MTRC_CUMTS,
-     MTRC_TYPE_IU64,
-     new_iu64_ht,
-     des_iu64,
-     del_iu64,
-     1,
-     NULL,
-     NULL},
-    {.metric.storem = MTRC_MAXTS,
-     MTRC_TYPE_IU64,
-     new_iu64_ht,
-     des_iu64,
-     del_iu64,
-     1,
-     NULL,
-     NULL},
-    {.metric.storem = MTRC_METHODS,
-     MTRC_TYPE_II08,
-     new_ii08_ht,
-     des_ii08,
-     del_ii08,
-     0,
-     NULL,
-     NULL},
-    {.metric.storem = MTRC_PROTOCOLS,
-     MTRC_TYPE_II08,
-     new_ii08_ht,
-     des_ii08,
-     del_ii08,
-     0,
-     NULL,
-     NULL},
-    {.metric.storem = MTRC_AGENTS,
-     MTRC_TYPE_IGSL,
-     new_igsl_ht,
-     des_igsl_free,
-     del_igsl_free,
-     1,
-     NULL,
-     NULL},
-    {.metric.storem = MTRC_METADATA,
-     MTRC_TYPE_SU64,
-     new_su64_ht,
-     des_su64_free,
-     del_su64_free,
-     1,
-     NULL,
-     NULL},
-};
-static const size_t module_metrics_len = ARRAY_SIZE(module_metrics);
+/* Monotonic clock in nanoseconds */
+static uint64_t bench_now(void) {
+  struct timespec ts;
 
-/* Initialize module metrics and mallocs its hash structure */
-static void init_tables(GModule module, GKHashModule *storage) {
-  int n = 0, i;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* Print the throughput of a parsing pass over a corpus of `len` bytes. */
+static void bench_report(const char *name, const char *mode, uint32_t lines,
+                         size_t len, uint64_t ns, uint64_t allocs,
+                         uint64_t invalid) {
+  double secs = ns / 1e9;
+
+  printf("%-12s %-6s %11.0f lines/s %8.1f ns/line %8.1f MB/s %6.2f "
+         "allocs/line %" PRIu64 " invalid\n",
+         name, mode, lines / secs, (double)ns / lines, len / secs / 1e6,
+         (double)allocs / lines, invalid);
+}
+
+/* Parse the given corpus line by line through parse_line(), copying each
+ * line out first as getline(3) would, then in place through parse_lines(),
+ * and report both. */
+static void bench_corpus(const char *name, char *buf, size_t len,
+                         uint32_t lines) {
+  GLogBatch batch;
+  GLogItem *logitem = NULL;
+  char *line = NULL, *s = NULL, *nl = NULL;
+  size_t linecap = 0, n = 0, off = 0;
+  uint64_t t0 = 0, allocs = 0, invalid = 0;
+  uint32_t i;
+
+  allocs = heap_allocs;
+  t0 = bench_now();
+  for (s = buf; s < buf + len; s += n) {
+    nl = memchr(s, '\n', buf + len - s);
+    n = nl ? (size_t)(nl - s) + 1 : (size_t)(buf + len - s);
+    if (n + 1 > linecap)
+      line = xrealloc(line, (linecap = 2 * n + 1));
+    memcpy(line, s, n);
+    line[n] = '\0';
+
+    logitem = NULL;
+    if (parse_line(line, &logitem) != 0)
+      invalid++;
+    if (logitem)
+      free_glog(logitem);
+  }
+  bench_report(name, "line", lines, len, bench_now() - t0,
+               heap_allocs - allocs, invalid);
+  free(line);
+
+  init_log_batch(&batch, 4096);
+  invalid = 0;
+  allocs = heap_allocs;
+  t0 = bench_now();
+  for (off = 0; off < len;) {
+    off += parse_lines(&batch, buf + off, len - off);
+    for (i = 0; i < batch.cnt; i++)
+      invalid += batch.rets[i] != 0;
+  }
+  bench_report(name, "batch", lines, len, bench_now() - t0,
+               heap_allocs - allocs, invalid);
+  free_log_batch(&batch);
+}
 
-  n = module_metrics_len;
-  for (i = 0; i < n; i++) {
-    storage[module].metrics[i] = module_metrics[i];
-    storage[module].metrics[i].hash = module_metrics[i].alloc();
+/* Set the log format, and for a custom one its date/time formats, of the
+ * given corpus. */
+static void set_bench_format(const GBenchFmt *f) {
+  set_log_format_str(f->fmt ? f->fmt : f->name);
+  if (f->fmt) {
+    free(conf.date_format);
+    free(conf.time_format);
+    conf.date_format = xstrdup("%d/%b/%Y");
+    conf.time_format = xstrdup("%H:%M:%S");
   }
+  set_spec_date_format();
 }
 
-/* Initialize a module hash structure.
+/* Generate a synthetic corpus for every preset log format, plus XFF and
+ * escaped-quote variants, and report how fast each is parsed. Comparing runs
+ * is only meaningful on the same machine and build flags.
  *
- * On success, a pointer to that hash structure is returned. */
-static GKHashModule *init_gkhashmodule(void) {
-  GKHashModule *storage = NULL;
-  GModule module;
-  size_t idx = 0;
-
-  storage = new_gkhmodule(TOTAL_MODULES);
-  FOREACH_MODULE(idx, module_list) {
-    module = module_list[idx];
+ * If `dir` is given, each corpus is also written to `dir`/<name>.log so the
+ * Go implementation can be measured against the same lines, see
+ * BenchmarkPresets in pkg/goaccessfmt.
+ *
+ * On error, 1 is returned.
+ * On success, 0 is returned. */
+static int bench_presets(const char *dir, uint32_t lines) {
+  char path[PATH_MAX], *buf = NULL;
+  size_t len = 0, k;
+  FILE *fp = NULL;
+
+  for (k = 0; k < ARRAY_SIZE(bench_fmts); k++) {
+    set_bench_format(&bench_fmts[k]);
+    buf = gen_bench_corpus(bench_fmts[k].name, lines, &len);
+    if (dir) {
+      snprintf(path, sizeof(path), "%s/%s.log", dir, bench_fmts[k].name);
+      if (!(fp = fopen(path, "w")) || fwrite(buf, 1, len, fp) != len) {
+        fprintf(stderr, "Unable to write %s: %s\n", path, strerror(errno));
+        if (fp)
+          fclose(fp);
+        free(buf);
+        return 1;
+      }
+      fclose(fp);
+    }
 
-    storage[module].module = module;
-    init_tables(module, storage);
+    bench_corpus(bench_fmts[k].name, buf, len, lines);
+    free(buf);
   }
 
-  return storage;
+  return 0;
 }
 
-/* Initialize hash tables */
-static void init_storage(void) {
-  GKDB *db = get_db_instance(DB_INSTANCE);
-  db->cache = init_gkhashmodule();
+/* Mismatches of a self-test check printed before only counting them */
+#define SELFTEST_SHOWN 5
+
+/* Counters of a self-test check, see run_selftest() */
+typedef struct GSelftest_ {
+  const char *name;
+  uint64_t checks;
+  uint64_t bad;
+} GSelftest;
+
+/* Count a mismatch of the given check, printing it if it's one of the
+ * first SELFTEST_SHOWN. */
+static void selftest_fail(GSelftest *st, const char *fmt, ...) {
+  va_list args;
+
+  if (st->bad++ >= SELFTEST_SHOWN)
+    return;
+
+  printf("%-12s mismatch: ", st->name);
+  va_start(args, fmt);
+  vprintf(fmt, args);
+  va_end(args);
+  putchar('\n');
 }
 
-/* Allocate memory for a new GKDB instance.
- *
- * On success, the newly allocated GKHashDB is returned . */
-static GKDB *new_gkdb(void) {
-  GKDB *db = xcalloc(1, sizeof(GKDB));
-  return db;
+static void selftest_report(const GSelftest *st) {
+  printf("%-12s %10" PRIu64 " checks %8" PRIu64 " mismatches %s\n", st->name,
+         st->checks, st->bad, st->bad ? "FAIL" : "OK");
 }
 
-/* Allocate memory for a new global GKHashDB instance.
- *
- * On success, the newly allocated GKHashDB is returned . */
-static GKHashDB *new_gkhdb(void) {
-  GKHashDB *storage = xcalloc(1, sizeof(GKHashDB));
-  return storage;
+/* Apply up to `max` random edits to the given string of `cap` bytes:
+ * replacing, inserting or deleting a byte out of `alpha`, or truncating
+ * it. */
+static void mutate_str(char *s, size_t cap, const char *alpha, int max,
+                       uint32_t *seed) {
+  size_t len = strlen(s), na = strlen(alpha), pos = 0;
+  int n = bench_rand(seed) % (max + 1), i;
+
+  for (i = 0; i < n && len; i++) {
+    pos = bench_rand(seed) % len;
+    switch (bench_rand(seed) % 8) {
+    case 0:
+    case 1:
+    case 2:
+      s[pos] = alpha[bench_rand(seed) % na];
+      break;
+    case 3:
+    case 4:
+      if (len + 1 >= cap)
+        break;
+      memmove(s + pos + 1, s + pos, len - pos + 1);
+      s[pos] = alpha[bench_rand(seed) % na];
+      len++;
+      break;
+    case 5:
+    case 6:
+      memmove(s + pos, s + pos + 1, len - pos);
+      len--;
+      break;
+    default:
+      s[pos] = '\0';
+      len = pos;
+    }
+  }
 }
 
-/* Whole application */
-static const GKHashMetric app_metrics[] = {
-    {.metric.dbm = MTRC_DATES,
-     MTRC_TYPE_IGKH,
-     new_igkh_ht,
-     NULL,
-     NULL,
-     1,
-     NULL,
-     NULL},
-    {.metric.dbm = MTRC_SEQS,
-     MTRC_TYPE_SI32,
-     new_si32_ht,
-     des_si32_free,
-     del_si32_free,
-     1,
-     NULL,
-     "SI32_SEQS.db"},
-    {.metric.dbm = MTRC_CNT_OVERALL,
-     MTRC_TYPE_SI32,
-     new_si32_ht,
-     des_si32_free,
-     del_si32_free,
-     1,
-     NULL,
-     "SI32_CNT_OVERALL.db"},
-    {.metric.dbm = MTRC_HOSTNAMES,
-     MTRC_TYPE_SS32,
-     new_ss32_ht,
-     des_ss32_free,
-     del_ss32_free,
-     1,
-     NULL,
-     NULL},
-    {.metric.dbm = MTRC_LAST_PARSE,
-     MTRC_TYPE_IGLP,
-     new_iglp_ht,
-     des_iglp,
-     NULL,
-     1,
-     NULL,
-     "IGLP_LAST_PARSE.db"},
-    {.metric.dbm = MTRC_JSON_LOGFMT,
-     MTRC_TYPE_SS32,
-     new_ss32_ht,
-     des_ss32_free,
-     del_ss32_free,
-     1,
-     NULL,
-     NULL},
-    {.metric.dbm = MTRC_METH_PROTO,
-     MTRC_TYPE_SI08,
-     new_si08_ht,
-     des_si08_free,
-     del_si08_free,
-     1,
-     NULL,
-     "SI08_METH_PROTO.db"},
-    {.metric.dbm = MTRC_DB_PROPS,
-     MTRC_TYPE_SI32,
-     new_si32_ht,
-     des_si32_free,
-     del_si32_free,
-     1,
-     NULL,
-     "SI32_DB_PROPS.db"},
+static int same_str(const char *a, const char *b) {
+  return a == b || (a && b && strcmp(a, b) == 0);
+}
+
+/* Tell whether two log items, given the values their parsers returned,
+ * are identical, errors included. The offset of an error is only compared
+ * if `off` is set, as parse_format() doesn't track it. */
+static int same_log_item(int ra, const GLogItem *a, int rb, const GLogItem *b,
+                         int off) {
+  return ra == rb && same_str(a->agent, b->agent) &&
+         same_str(a->date, b->date) && same_str(a->host, b->host) &&
+         same_str(a->keyphrase, b->keyphrase) &&
+         same_str(a->method, b->method) &&
+         same_str(a->protocol, b->protocol) && same_str(a->qstr, b->qstr) &&
+         same_str(a->ref, b->ref) && same_str(a->req, b->req) &&
+         same_str(a->time, b->time) && same_str(a->vhost, b->vhost) &&
+         same_str(a->userid, b->userid) &&
+         same_str(a->cache_status, b->cache_status) &&
+         same_str(a->mime_type, b->mime_type) &&
+         same_str(a->tls_type, b->tls_type) &&
+         same_str(a->tls_cypher, b->tls_cypher) &&
+         same_str(a->tls_type_cypher, b->tls_type_cypher) &&
+         same_str(a->errstr, b->errstr) && strcmp(a->site, b->site) == 0 &&
+         a->status == b->status && a->resp_size == b->resp_size &&
+         a->serve_time == b->serve_time && a->numdate == b->numdate &&
+         a->type_ip == b->type_ip &&
+         memcmp(a->addr, b->addr, sizeof(a->addr)) == 0 &&
+         a->err.code == b->err.code && a->err.spec == b->err.spec &&
+         (!off || a->err.off == b->err.off) && a->dt.tm_year == b->dt.tm_year &&
+         a->dt.tm_mon == b->dt.tm_mon && a->dt.tm_mday == b->dt.tm_mday &&
+         a->dt.tm_hour == b->dt.tm_hour && a->dt.tm_min == b->dt.tm_min &&
+         a->dt.tm_sec == b->dt.tm_sec;
+}
+
+/* Parsers of the current log format selftest_line() compares, see
+ * parse_line_with(). */
+enum {
+  SELFTEST_WALK,   /* parse_format(), walking the format string */
+  SELFTEST_PROG,   /* parse_format_prog() */
+  SELFTEST_PRESET, /* specialized parser of a preset */
+  SELFTEST_PDJSON, /* parse_json_prog(), reading through pdjson */
+  SELFTEST_INDEX,  /* parse_json_index() */
 };
 
-static const size_t app_metrics_len = ARRAY_SIZE(app_metrics);
+static int selftest_parse(GLogItem *logitem, const char *line, int how) {
+  switch (how) {
+  case SELFTEST_WALK:
+    return parse_format(logitem, line, log_parser.log_format);
+  case SELFTEST_PROG:
+    return parse_format_prog(logitem, line, log_parser.log_format_prog);
+  case SELFTEST_PRESET:
+    return log_parser.log_format_fn(logitem, line);
+  case SELFTEST_PDJSON:
+    return parse_json_prog(logitem, line, log_parser.json_format_prog);
+  }
+  return parse_json_index(logitem, line, log_parser.json_format_prog);
+}
+
+/* Parse the given line through two parsers of the current log format and
+ * count a mismatch if the items differ. */
+static void selftest_line(GSelftest *st, const char *line, const char *what,
+                          int x, int y) {
+  GLogItem *a = init_log_item(), *b = init_log_item();
+  int ra = selftest_parse(a, line, x), rb = selftest_parse(b, line, y);
+
+  st->checks++;
+  if (!same_log_item(ra, a, rb, b, x != SELFTEST_WALK))
+    selftest_fail(st, "%s, line [%s]", what, line);
+
+  free_glog(a);
+  free_glog(b);
+}
+
+/* Parse `lines` mutated lines of each benchmark corpus through every parser
+ * of its log format: the format walk, the compiled op program and the
+ * specialized preset parser, or pdjson and the structural index for JSON
+ * formats. */
+static uint64_t selftest_formats(uint32_t lines) {
+  GSelftest st = {"formats", 0, 0}, js = {"json", 0, 0};
+  const char *alpha = " \"[]:\t,.-\\x0\n{}\x01\xc3\x80" "e";
+  char line[LINE_BUFFER], *buf = NULL, *s = NULL, *nl = NULL;
+  uint32_t seed = 2463534242u;
+  size_t len = 0, n = 0, k;
+
+  for (k = 0; k < ARRAY_SIZE(bench_fmts); k++) {
+    set_bench_format(&bench_fmts[k]);
+    buf = gen_bench_corpus(bench_fmts[k].name, lines, &len);
+    for (s = buf; s < buf + len; s += n) {
+      nl = memchr(s, '\n', buf + len - s);
+      n = nl ? (size_t)(nl - s) + 1 : (size_t)(buf + len - s);
+      if (n >= sizeof(line))
+        continue;
+      memcpy(line, s, n);
+      line[n] = '\0';
+      mutate_str(line, sizeof(line), alpha, 3, &seed);
+
+      if (conf.is_json_log_format) {
+        selftest_line(&js, line, bench_fmts[k].name, SELFTEST_PDJSON,
+                      SELFTEST_INDEX);
+        continue;
+      }
+      selftest_line(&st, line, bench_fmts[k].name, SELFTEST_WALK,
+                    SELFTEST_PROG);
+      if (log_parser.log_format_fn)
+        selftest_line(&st, line, bench_fmts[k].name, SELFTEST_PROG,
+                      SELFTEST_PRESET);
+    }
+    free(buf);
+  }
 
-/* Initialize a global hash structure.
- *
- * On success, a pointer to that hash structure is returned. */
-static GKHashDB *init_gkhashdb(void) {
-  GKHashDB *storage = NULL;
+  selftest_report(&st);
+  selftest_report(&js);
 
-  int n = 0, i;
+  return st.bad + js.bad;
+}
 
-  storage = new_gkhdb();
-  n = app_metrics_len;
-  for (i = 0; i < n; i++) {
-    storage->metrics[i] = app_metrics[i];
-    storage->metrics[i].hash = app_metrics[i].alloc();
+/* Convert the given instant through tz_localtime() and localtime_r(3), the
+ * process TZ being set to the zone of the table. */
+static void selftest_tz_at(GSelftest *st, const GTzTable *table, time_t t) {
+  struct tm a, b;
+
+  memset(&a, 0, sizeof(a));
+  memset(&b, 0, sizeof(b));
+  tz_localtime(table, t, &a);
+  localtime_r(&t, &b);
+
+  st->checks++;
+  if (a.tm_year != b.tm_year || a.tm_mon != b.tm_mon ||
+      a.tm_mday != b.tm_mday || a.tm_hour != b.tm_hour ||
+      a.tm_min != b.tm_min || a.tm_sec != b.tm_sec ||
+      a.tm_wday != b.tm_wday || a.tm_yday != b.tm_yday ||
+      a.tm_isdst != b.tm_isdst || a.tm_gmtoff != b.tm_gmtoff)
+    selftest_fail(st, "%s at %lld", table->name, (long long)t);
+}
+
+/* Convert the instants around each transition of a few timezones, and
+ * `samples` random ones of each, through tz_localtime() and localtime_r(3).
+ * Random instants span 50 years past both ends of the table, see
+ * tz_localtime_libc(). */
+static uint64_t selftest_tz(uint32_t samples) {
+  static const char *const zones[] = {
+      "America/New_York",  "Europe/London",       "Europe/Dublin",
+      "America/St_Johns",  "Australia/Lord_Howe", "Pacific/Apia",
+      "Asia/Kolkata",      "Africa/Casablanca",   "America/Sao_Paulo",
+      "Pacific/Chatham",
+  };
+  const int64_t margin = 50 * 365 * 86400LL;
+  const uint64_t span = TZ_TABLE_END - TZ_TABLE_START + 2 * margin;
+  GSelftest st = {"timezones", 0, 0};
+  GTzTable *table = NULL;
+  uint64_t r = 0;
+  uint32_t seed = 88172645u, i;
+  char *env = NULL, *saved = NULL;
+  size_t k;
+  int j, d;
+
+  if ((env = getenv("TZ")))
+    saved = xstrdup(env);
+
+  for (k = 0; k < ARRAY_SIZE(zones); k++) {
+    table = new_tz_table(zones[k]);
+    pthread_mutex_lock(&tz_mutex);
+    set_tz(zones[k]);
+    pthread_mutex_unlock(&tz_mutex);
+
+    for (j = 1; j < table->size; j++)
+      for (d = -3; d <= 3; d++)
+        selftest_tz_at(&st, table, (time_t)(table->trans[j].at + d));
+    for (i = 0; i < samples; i++) {
+      r = (uint64_t)bench_rand(&seed) << 32 | bench_rand(&seed);
+      selftest_tz_at(&st, table,
+                     (time_t)(TZ_TABLE_START - margin + (int64_t)(r % span)));
+    }
+    free_tz_table(table);
   }
 
-  return storage;
+  pthread_mutex_lock(&tz_mutex);
+  set_tz(saved);
+  pthread_mutex_unlock(&tz_mutex);
+  free(saved);
+
+  selftest_report(&st);
+
+  return st.bad;
 }
 
-/* Create a new GKDB instance given a uint32_t key
- *
- * On error, -1 is returned.
- * On key found, 1 is returned.
- * On success 0 is returned */
-static GKDB *new_db(khash_t(igdb) * hash, uint32_t key) {
-  GKDB *db = NULL;
-  khint_t k;
-  int ret;
+/* Parse `samples` mutated dates and times of the fixed preset layouts
+ * through str_to_time() and strptime(3), and format those parsed through
+ * format_date_num() and format_time() as well as strftime(3). */
+#pragma GCC diagnostic ignored "-Wformat-nonliteral"
+static uint64_t selftest_dates(uint32_t samples) {
+  static const char *const fmts[] = {"%d/%b/%Y", "%Y-%m-%d", "%H:%M:%S", "%T",
+                                     "%s"};
+  GSelftest st = {"dates", 0, 0};
+  const char *alpha = "0123456789/-:JunjUNMayFebDecx 5";
+  char s[32], x[DATE_LEN], y[DATE_LEN];
+  struct tm a, b, g;
+  uint32_t seed = 521288629u, i, numdate = 0;
+  time_t t;
+  char *end = NULL;
+  int f, ra, rb;
+
+  for (i = 0; i < samples; i++) {
+    f = bench_rand(&seed) % ARRAY_SIZE(fmts);
+    t = (time_t)(bench_rand(&seed) % 2000000000u);
+    gmtime_r(&t, &g);
+    if (f == 4)
+      snprintf(s, sizeof(s), "%ld", (long)t);
+    else
+      strftime(s, sizeof(s), f == 3 ? "%H:%M:%S" : fmts[f], &g);
+    mutate_str(s, sizeof(s), alpha, 2, &seed);
+
+    memset(&a, 0, sizeof(a));
+    memset(&b, 0, sizeof(b));
+    a.tm_mday = b.tm_mday = 7;
+    a.tm_hour = b.tm_hour = 3;
+    end = strptime(s, fmts[f], &a);
+    ra = end == NULL || *end != '\0';
+    rb = str_to_time(s, fmts[f], &b, 0);
+
+    st.checks++;
+    if (ra != rb || (!ra && (memcmp(&a, &b, offsetof(struct tm, tm_isdst)) ||
+                             a.tm_gmtoff != b.tm_gmtoff))) {
+      selftest_fail(&st, "%s [%s]", fmts[f], s);
+      continue;
+    }
+    if (ra)
+      continue;
 
-  if (!hash)
-    return NULL;
+    st.checks++;
+    strftime(x, sizeof(x), "%Y%m%d", &a);
+    format_date_num(y, sizeof(y), &a, &numdate);
+    if (strcmp(x, y) || (uint32_t)atoi(x) != numdate)
+      selftest_fail(&st, "%%Y%%m%%d of [%s]: %s vs %s", s, x, y);
+    st.checks++;
+    strftime(x, sizeof(x), "%H:%M:%S", &a);
+    format_time(y, sizeof(y), &a);
+    if (strcmp(x, y))
+      selftest_fail(&st, "%%H:%%M:%%S of [%s]: %s vs %s", s, x, y);
+  }
 
-  k = kh_put(igdb, hash, key, &ret);
-  /* operation failed */
-  if (ret == -1)
+  selftest_report(&st);
+
+  return st.bad;
+}
+
+#pragma GCC diagnostic warning "-Wformat-nonliteral"
+
+/* Find the end of a token the way parse_string() did before scan_delim(),
+ * see find_token_end(). */
+static const char *find_token_end_bytes(const char *str, const char *delims,
+                                        int cnt) {
+  const char *pch = str, *p = NULL;
+  int idx = 0;
+  char end;
+
+  if ((*delims != 0x0) && (p = strpbrk(str, delims)) == NULL)
     return NULL;
-  /* the key is present in the hash table */
-  if (ret == 0)
-    return kh_val(hash, k);
 
-  db = new_gkdb();
-  db->hdb = init_gkhashdb();
-  db->cache = NULL;
-  db->store = NULL;
-  db->logs = NULL;
-  kh_val(hash, k) = db;
+  end = !*delims ? 0x0 : *p;
+  do {
+    if (*pch == end)
+      idx++;
+    if ((*pch == end && cnt == idx) || *pch == '\0')
+      return pch;
+    if (*pch == '\\')
+      pch++;
+  } while (*pch++);
 
-  return db;
+  return NULL;
 }
 
-static void init_pre_storage() {
-  ht_db = (khash_t(igdb) *)new_igdb_ht();
-  new_db(ht_db, DB_INSTANCE);
+/* Find the end of `samples` random tokens at random alignments through
+ * find_token_end() with every delimiter scanner the CPU supports, and
+ * through the byte loop it replaces. */
+static uint64_t selftest_scan(uint32_t samples) {
+  static const char *const delims[] = {"\"", " ", "", "]", "\\", " \"", ","};
+  GSelftest st = {"scan", 0, 0};
+  GScanDelimFn fns[4], saved = scan_delim_fn;
+  const char *alpha = "ab \"\\],x", *a = NULL, *b = NULL, *d = NULL;
+  char buf[96];
+  uint32_t seed = 362436069u, i;
+  int nfns = 0, f, len, off, cnt, j;
+
+  fns[nfns++] = scan_delim_scalar;
+#if defined(__SSE2__)
+  fns[nfns++] = scan_delim_sse2;
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    fns[nfns++] = scan_delim_avx2;
+#endif
+#if defined(__ARM_NEON) || defined(__aarch64__)
+  fns[nfns++] = scan_delim_neon;
+#endif
+
+  for (i = 0; i < samples; i++) {
+    len = bench_rand(&seed) % 80;
+    off = bench_rand(&seed) % 16;
+    for (j = 0; j < len; j++)
+      buf[off + j] = bench_rand(&seed) % 3 ? "abc"[bench_rand(&seed) % 3]
+                                           : alpha[bench_rand(&seed) % 8];
+    buf[off + len] = '\0';
+    d = delims[bench_rand(&seed) % ARRAY_SIZE(delims)];
+    cnt = 1 + bench_rand(&seed) % 3;
+
+    a = find_token_end_bytes(buf + off, d, cnt);
+    for (f = 0; f < nfns; f++) {
+      scan_delim_fn = fns[f];
+      b = find_token_end(buf + off, d, cnt);
+      st.checks++;
+      if (a != b)
+        selftest_fail(&st, "scanner %d, delims [%s] x%d in [%s]", f, d, cnt,
+                      buf + off);
+    }
+  }
+  scan_delim_fn = saved;
+
+  selftest_report(&st);
+
+  return st.bad;
 }
 
-/* Get the string value of a given string key.
- *
- * On error, NULL is returned.
- * On success the string value for the given key is returned */
-static char *get_ss32(khash_t(ss32) * hash, const char *key) {
-  khint_t k;
-  char *value = NULL;
+/* Validate `samples` mutated IPv4 and IPv6 addresses through parse_ipaddr()
+ * and inet_pton(3). */
+static uint64_t selftest_ipaddr(uint32_t samples) {
+  static const char *const seeds[] = {
+      "1.2.3.4", "::", "::1", "1::", "::ffff:1.2.3.4",
+      "2001:db8::8a2e:370:7334", "1:2:3:4:5:6:7:8", "1:2:3:4:5:6:1.2.3.4",
+      "255.255.255.255", "01.2.3.4", "1.2.3", "1.2.3.4.5", "::1.2.3.4",
+      "1:2:3:4:5:6:7::", "::2:3:4:5:6:7:8", "1:2:3:4:5:6:7:8:9", ":1::",
+      "1::2::3", "fe80::1%eth0", "0.0.0.0", "256.1.1.1", "1..2.3",
+      "a:b:c:d:e:f:1.2.3.4", "a::b:c:d:e:f:1.2.3.4", "1.2.3.04", "00ff::",
+      "12345::", "1:2:3:4:5:6:7:8::", "::1.2.3.4:5",
+  };
+  GSelftest st = {"ipaddr", 0, 0};
+  const char *alpha = "0123456789abcdefABCDEF:.:.:x%Z 0";
+  struct in_addr a4;
+  struct in6_addr a6;
+  uint8_t want[16], got[16];
+  char s[64];
+  uint32_t seed = 123456789u, i;
+  int wtype, gtype, wret, gret;
+
+  for (i = 0; i < samples; i++) {
+    snprintf(s, sizeof(s), "%s", seeds[i % ARRAY_SIZE(seeds)]);
+    if (i >= ARRAY_SIZE(seeds))
+      mutate_str(s, sizeof(s), alpha, 3, &seed);
+
+    memset(want, 0, sizeof(want));
+    wtype = TYPE_IPINV;
+    wret = 1;
+    if (*s && inet_pton(AF_INET, s, &a4) == 1) {
+      wtype = TYPE_IPV4;
+      want[10] = want[11] = 0xff;
+      memcpy(want + 12, &a4, 4);
+      wret = 0;
+    } else if (*s && inet_pton(AF_INET6, s, &a6) == 1) {
+      wtype = TYPE_IPV6;
+      memcpy(want, &a6, 16);
+      wret = 0;
+    }
 
-  if (!hash)
-    return NULL;
+    memset(got, 0, sizeof(got));
+    gret = parse_ipaddr(s, strlen(s), &gtype, got);
+    st.checks++;
+    if (wret != gret || wtype != gtype || (!wret && memcmp(want, got, 16)))
+      selftest_fail(&st, "[%s]", s);
+  }
 
-  k = kh_get(ss32, hash, key);
-  /* key found, return current value */
-  if (k != kh_end(hash) && (value = kh_val(hash, k)))
-    return xstrdup(value);
+  selftest_report(&st);
 
-  return NULL;
+  return st.bad;
 }
 
-/* Get the string value from ht_json_logfmt given a JSON specifier key.
- *
- * On error, NULL is returned.
- * On success the string value for the given key is returned */
-static char *ht_get_json_logfmt(const char *key) {
+/* Sum the hits and bandwidth of every module of the aggregated store, then
+ * empty it. */
+static void take_agg_totals(uint64_t *hits, uint64_t *bw) {
   GKDB *db = get_db_instance(DB_INSTANCE);
-  khash_t(ss32) *hash = get_hdb(db, MTRC_JSON_LOGFMT);
+  khash_t(igkh) *dates = db ? get_hdb(db, MTRC_DATES) : NULL;
+  khash_t(ii32) *hh = NULL;
+  khash_t(iu64) *bh = NULL;
+  GKHashModule *mod = NULL;
+  size_t idx = 0;
+  khint_t k, j;
 
-  if (!hash)
-    return NULL;
+  *hits = *bw = 0;
+  if (!dates)
+    return;
 
-  return get_ss32(hash, key);
+  pthread_mutex_lock(&agg_mutex);
+  for (k = kh_begin(dates); k != kh_end(dates); ++k) {
+    if (!kh_exist(dates, k))
+      continue;
+    idx = 0;
+    FOREACH_MODULE(idx, module_list) {
+      mod = &kh_val(dates, k)->mhash[module_list[idx]];
+      if (!(hh = mod->metrics[MTRC_HITS].hash) ||
+          !(bh = mod->metrics[MTRC_BW].hash))
+        continue;
+      for (j = kh_begin(hh); j != kh_end(hh); ++j)
+        if (kh_exist(hh, j))
+          *hits += kh_val(hh, j);
+      for (j = kh_begin(bh); j != kh_end(bh); ++j)
+        if (kh_exist(bh, j))
+          *bw += kh_val(bh, j);
+    }
+    free_date_store(kh_val(dates, k));
+  }
+  kh_clear(igkh, dates);
+  pthread_mutex_unlock(&agg_mutex);
 }
 
-void printlog(int ret, GLogItem *logitem) {
-  if (!logitem) {
-    printf("logitem returns as NULL\n");
-  } else {
-    if (ret != 0) {
-      printf("err: %s\n", logitem->errstr);
-    }
-    printf("URL: %s\n", logitem->req);
-    printf("Size: %ld\n", logitem->resp_size);
-    printf("From: %s\n", logitem->host);
+/* Aggregate a sampled corpus of `lines` lines while parsing it, then from
+ * a cache of it, and compare the hits and bandwidth of both. Sampling is
+ * either always on or only while half of the log is pending, so the cache
+ * holds rows of different rates.
+ *
+ * If the log or its cache can't be written, the program exits. */
+static uint64_t selftest_cache(uint32_t lines) {
+  GSelftest st = {"cache", 0, 0};
+  GLogCache cache;
+  GLog glog;
+  char path[] = "/tmp/goaccess-selftest-XXXXXX", cpath[sizeof(path) + 6];
+  char *buf = NULL;
+  uint64_t hits, bw, chits, cbw, backlog[2];
+  uint32_t sample_rate = conf.sample_rate, rows = 0;
+  uint64_t sample_backlog = conf.sample_backlog;
+  int aggregate = conf.aggregate, jobs = conf.jobs, fd, b;
+  size_t len = 0;
+
+  set_bench_format(&bench_fmts[0]);
+  buf = gen_bench_corpus(bench_fmts[0].name, lines, &len);
+  if ((fd = mkstemp(path)) == -1 || write(fd, buf, len) != (ssize_t)len)
+    FATAL("Unable to write %s: %s", path, strerror(errno));
+  close(fd);
+  free(buf);
+  snprintf(cpath, sizeof(cpath), "%s.cache", path);
+
+  take_agg_totals(&hits, &bw);
+  backlog[0] = 0;
+  backlog[1] = len / 2;
+  conf.sample_rate = 4;
+  conf.jobs = 2;
+  for (b = 0; b < 2; b++) {
+    conf.sample_backlog = backlog[b];
+    conf.aggregate = 1;
+    memset(&glog, 0, sizeof(glog));
+    mmap_lines(path, &glog, NULL, NULL);
+    take_agg_totals(&hits, &bw);
+
+    conf.aggregate = 0;
+    if (save_log_cache(cpath, path) != 0 ||
+        open_log_cache(&cache, cpath, path, NULL) != 0)
+      FATAL("Unable to write %s", cpath);
+    rows = aggregate_log_cache(&cache, 0, UINT32_MAX);
+    close_log_cache(&cache);
+    take_agg_totals(&chits, &cbw);
+
+    st.checks++;
+    if (rows != glog.processed || hits != chits || bw != cbw || !hits)
+      selftest_fail(&st, "backlog %" PRIu64 ": hits %" PRIu64 " vs %" PRIu64
+                    ", bandwidth %" PRIu64 " vs %" PRIu64, backlog[b], hits,
+                    chits, bw, cbw);
   }
+  unlink(cpath);
+  unlink(path);
+
+  conf.sample_rate = sample_rate;
+  conf.sample_backlog = sample_backlog;
+  conf.aggregate = aggregate;
+  conf.jobs = jobs;
+  selftest_report(&st);
+
+  return st.bad;
 }
 
-int main(void) {
+/* Check each fast path against the code or the libc functions it replaces
+ * on random and mutated inputs, scaled by `lines`, and report the
+ * mismatches of each. Checks are repeatable, as the inputs come from fixed
+ * seeds.
+ *
+ * If any check found a mismatch, 1 is returned.
+ * Otherwise, 0 is returned. */
+static int run_selftest(uint32_t lines) {
+  uint64_t bad = 0;
+
+  bad += selftest_formats(lines);
+  bad += selftest_tz(lines);
+  bad += selftest_dates(lines * 10);
+  bad += selftest_scan(lines * 10);
+  bad += selftest_ipaddr(lines * 10);
+  bad += selftest_cache(lines * 10);
+
+  return bad != 0;
+}
+
+int main(int argc, char **argv) {
+  /* ./a.out --selftest [lines] */
+  if (argc > 1 && strcmp(argv[1], "--selftest") == 0) {
+    init_pre_storage();
+    init_storage();
+    return run_selftest(argc > 2 ? strtoul(argv[2], NULL, 10) : 20000);
+  }
+
+  /* ./a.out --bench [lines [corpus dir]] */
+  if (argc > 1 && strcmp(argv[1], "--bench") == 0) {
+    init_pre_storage();
+    init_storage();
+    return bench_presets(argc > 3 ? argv[3] : NULL,
+                         argc > 2 ? strtoul(argv[2], NULL, 10) : 100000);
+  }
+
   init_pre_storage();
   init_storage();
   set_log_format_str("COMBINED");
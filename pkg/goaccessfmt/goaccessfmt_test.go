@@ -1,6 +1,9 @@
 package goaccessfmt_test
 
 import (
+	"bufio"
+	"os"
+	"path/filepath"
 	"testing"
 	"time"
 
@@ -201,3 +204,91 @@ func TestMirrorNginxJSONFormat(t *testing.T) {
 		t.Errorf("want (%v), get (%v)", expectedLogitem, logitem)
 	}
 }
+
+// benchFormats maps the corpus files written by `reference --bench <lines>
+// <dir>` (see assets/reference.c) to their log format. An empty format
+// means the name is a preset.
+var benchFormats = []struct {
+	name   string
+	logfmt string
+}{
+	{"combined", ""},
+	{"vcombined", ""},
+	{"common", ""},
+	{"vcommon", ""},
+	{"w3c", ""},
+	{"cloudfront", ""},
+	{"cloudstorage", ""},
+	{"awselb", ""},
+	{"squid", ""},
+	{"awss3", ""},
+	{"caddy", ""},
+	{"awsalb", ""},
+	{"traefikclf", ""},
+	{"xff", `%^ - - [%d:%t %^] "%r" %s %b "%R" "%u" "~h{, }"`},
+}
+
+func readBenchCorpus(b *testing.B, path string) ([]string, int) {
+	f, err := os.Open(path)
+	if err != nil {
+		b.Fatal(err)
+	}
+	defer f.Close()
+
+	var lines []string
+	size := 0
+	scanner := bufio.NewScanner(f)
+	scanner.Buffer(make([]byte, 0, 64*1024), 1024*1024)
+	for scanner.Scan() {
+		lines = append(lines, scanner.Text())
+		size += len(scanner.Text()) + 1
+	}
+	if err := scanner.Err(); err != nil {
+		b.Fatal(err)
+	}
+	if len(lines) == 0 {
+		b.Fatalf("empty corpus %s", path)
+	}
+	return lines, size
+}
+
+// BenchmarkPresets parses the same synthetic corpora as the C reference so
+// both implementations can be compared line for line. Set
+// GOACCESSFMT_BENCH_CORPUS to the directory the corpora were written to.
+func BenchmarkPresets(b *testing.B) {
+	dir := os.Getenv("GOACCESSFMT_BENCH_CORPUS")
+	if dir == "" {
+		b.Skip("GOACCESSFMT_BENCH_CORPUS not set")
+	}
+
+	for _, bf := range benchFormats {
+		bf := bf
+		b.Run(bf.name, func(b *testing.B) {
+			logfmt, datefmt, timefmt := bf.logfmt, goaccessfmt.Dates.Apache, goaccessfmt.Times.Fmt24
+			if logfmt == "" {
+				var err error
+				logfmt, datefmt, timefmt, err = goaccessfmt.GetFmtFromPreset(bf.name)
+				if err != nil {
+					b.Fatal(err)
+				}
+			}
+			conf, err := goaccessfmt.SetupConfig(logfmt, datefmt, timefmt, locationUTC)
+			if err != nil {
+				b.Fatal(err)
+			}
+			lines, size := readBenchCorpus(b, filepath.Join(dir, bf.name+".log"))
+
+			invalid := 0
+			b.SetBytes(int64(size / len(lines)))
+			b.ReportAllocs()
+			b.ResetTimer()
+			for i := 0; i < b.N; i++ {
+				if _, err := goaccessfmt.ParseLine(conf, lines[i%len(lines)]); err != nil {
+					invalid++
+				}
+			}
+			b.ReportMetric(float64(b.N)/b.Elapsed().Seconds(), "lines/s")
+			b.ReportMetric(float64(invalid)/float64(b.N), "invalid/op")
+		})
+	}
+}